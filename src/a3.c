@@ -9,144 +9,199 @@
  * 
  * Compilation: Use the provided Makefile, typically `make`
  * Execution: mpirun -np [number of processes] [path to compiled a3 executable]
- * [input file] [output file] [depth]
+ * [options] [input file] [output file] [depth]
+ *
+ * With --lean, each process convolves its slab in place through a rolling
+ * window of depth+1 rows instead of a second processed submatrix, and the
+ * master scatters from and gathers into its single copy of the matrix.
+ *
+ * With --collective-write, results are not gathered: every process writes
+ * its own rows to the output file with collective MPI-IO, and the master
+ * releases the full matrix as soon as it has been scattered.
+ *
+ * With --checkpoint DIR, finished rows are checkpointed to DIR by a
+ * background thread as they are computed; --restart resumes an interrupted
+ * run from those checkpoints, with any number of processes.
+ *
+ * The convolution kernel, tile size and thread count are taken from
+ * --kernel, from calibration with --autotune, or from the autotune profile
+ * recorded for the closest job shape on this host.
+ *
+ * With --dynamic, the fixed slabs are replaced by chunks of rows that the
+ * processes claim from the master through one-sided MPI, so that faster
+ * processes take on more of the work.
+ *
+ * With --pipelined, the master reads and sends one slab at a time instead
+ * of reading the whole matrix before scattering it.
+ *
+ * Matrix buffers are aligned and pooled for reuse; --huge-pages backs the
+ * large ones with huge pages, and --timing also reports buffer statistics.
+ *
+ * With --serve SOCKET, the program stays up and runs the jobs requested on
+ * a UNIX domain socket (see service.h and the a3client program), keeping
+ * frequently used inputs in memory.
+ *
+ * With --result-cache DIR, results are kept in DIR keyed on a hash of the
+ * input and the depth, and a job seen before is copied from there before
+ * the master reads the input.
+ *
+ * With --depths D1,D2,..., the [depth] argument is dropped and every listed
+ * depth is computed in one pass over slabs padded for the deepest, writing
+ * depth D to [output].D.
+ *
+ * With --previous-output FILE and either --previous-input or --dirty,
+ * FILE is updated for the changes in the input: only the cells within
+ * depth of a change are recomputed, split between the processes by area.
+ *
+ * With --hierarchical, slabs are scattered and results gathered through
+ * one leader process per node, so each node's band crosses the network
+ * once.
+ *
+ * With --sparse, slabs that are mostly zeros are sent as their nonzeros
+ * and convolved by scattering each nonzero into the cells around it (see
+ * sparse.h); denser slabs are scattered and convolved as usual.
+ *
+ * With --filter=NAME, each cell is replaced by the minimum, maximum or
+ * median of its neighbourhood instead of the weighted sum (see filter.h),
+ * over the same padded slabs.
+ *
+ * With --batch LIST, the [input] and [output] arguments are dropped and
+ * every INPUT OUTPUT pair in LIST is convolved instead, the jobs dealt out
+ * to the processes and those of the same size convolved together by
+ * convolve_batch (see batch.h).
+ *
+ * Jobs in the plain, sparse or filter modes on one process, or on a matrix
+ * of at most LOCAL_MAX_SIZE rows, are convolved by the master alone (see
+ * local.h); the a3local program runs the same path without MPI.
  */
 
 #include "headers.h"
+#include <limits.h>
+#include <string.h>
 
 /**
- * @brief Main function for the distributed matrix convolution application.
- * 
- * @param argc Argument count
- * @param argv Argument values
- * @return int Exit status
+ * @brief Convolve a slab, checkpointing finished rows as it goes.
+ *
+ * On restart, rows found in the checkpoint directory are restored instead
+ * of recomputed; otherwise stale checkpoints are removed first. The rows
+ * still to do are computed in bands of options->checkpoint_rows and each
+ * band is handed to the background writer as soon as it is finished.
+ * Collective over MPI_COMM_WORLD.
+ *
+ * @param options Parsed command line options.
+ * @param my_rank Rank of this process.
+ * @param padded Padded input submatrix.
+ * @param padded_rows Number of rows in the padded submatrix.
+ * @param matrix_size Number of columns (size of the full matrix).
+ * @param top_padding Number of padding rows above the working rows.
+ * @param rows Number of working rows.
+ * @param first_row Global index of the first working row.
+ * @param processed Output buffer of rows * matrix_size cells.
+ * @param config Kernel configuration to compute with.
+ * @return 0 on success, -1 on failure.
  */
-int main(int argc, char **argv)
+static int process_with_checkpoints(const options_t *options, int my_rank,
+                                    int *padded, int padded_rows,
+                                    int matrix_size, int top_padding,
+                                    int rows, int first_row, int *processed,
+                                    const kernel_config_t *config)
 {
-    int     my_rank,    // Rank of this process (node)
-            nproc,      // Number of processes (nodes)
-            depth,      // Number of neighbours to include in the convolution
-            mpi_err,    // Error codes returned from MPI functions 
-            matrix_size    = -1,    // Size of the master matrix
-            my_padded_rows = -1,    // Size of submatrix plus depth
-            rows_per_node  = -1,    // Size of processed submatrix
-            my_top_padding,
-            my_bottom_padding,
-            my_start_row,
-            my_end_row,
-            *cells_per_process      = NULL, // Number of rows per node
-            *starts_per_process     = NULL, // Starting element per node
-            *matrix                 = NULL, // Main matrix
-            *my_padded_submatrix    = NULL, // Padded working sub-matrix
-            *my_processed_submatrix = NULL; // Processed output sub-matrix
-
-    char    *input_filename,    // Filename of input matrix
-            *output_filename;   // Filename of output matrix
-
-
-    // Setup MPI (initialise, get rank and number of processes)
-    mpi_setup(&argc, &argv, &my_rank, &nproc);
-    LOG("Initialised P%d of %d\n", my_rank, nproc);
+    checkpoint_t *ckpt;
+    double busy_seconds = 0;
+    int result = 0;
+    char *restored = calloc(rows, sizeof(char));
+    if (!restored)
+        return -1;
 
-
-    // Parse args
-    if (argc != 4 || (depth = atoi(argv[3])) < 0) {
-        LOG("Usage: %s [input] [output] [depth]\n", argv[0]);
-        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    timing_start(PHASE_CHECKPOINT);
+    if (options->restart) {
+        result = checkpoint_restore(options->checkpoint_dir,
+                                    options->input_filename, matrix_size,
+                                    options->depth, first_row, rows,
+                                    processed, restored);
+        LOG("P%d restored %d of its %d rows from checkpoints\n",
+            my_rank, result, rows);
+    } else if (my_rank == MASTER) {
+        result = checkpoint_remove(options->checkpoint_dir);
     }
-
-
-    // Master process retrieves matrix from file
-    if (my_rank == MASTER) {
-        input_filename = argv[1];
-        output_filename = argv[2];
-        LOG("ARGS: %s, %s, %d\n",
-            input_filename, output_filename, depth);
-        matrix = read_matrix_from_file(input_filename, &matrix_size);
-        if (matrix_size <= 0 || !matrix) {
-            LOG("Failed to read matrix from file: %s\n", input_filename);
-            safe_free(&matrix);
-            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
-        }
-        LOG("Master process read a %dx%d matrix from file:\n%s",
-            matrix_size, matrix_size,
-            matrix_to_string(matrix, matrix_size, matrix_size));
-
-        // If zero depth, no work to do. Write input matrix to output file 
-        if (depth == 0) {
-            LOG("Zero depth set. No work to do\n");
-            int result = write_matrix_to_file(output_filename,
-                                                matrix, matrix_size);
-            if (result == -1) {
-                LOG("Failed to write matrix to output file %s.\n",
-                    output_filename);
-            } else if (result == -2) {
-                LOG("Failed to close the file after "
-                    "writing matrix to output file %s.\n",
-                    output_filename);
-            }
-            LOG("Master process wrote matrix to file\n");
-            safe_free(&matrix);
-            MPI_Finalize();
-            return EXIT_SUCCESS;
-        }
+    // Nobody may append to a checkpoint file until all have been read
+    if (MPI_Barrier(MPI_COMM_WORLD) != MPI_SUCCESS || result == -1) {
+        free(restored);
+        return -1;
     }
-
-
-    // Broadcast the master matrix's size from master to all processes
-    mpi_err = MPI_Bcast(&matrix_size, 1, MPI_INT, MASTER, MPI_COMM_WORLD);
-    if (mpi_err != MPI_SUCCESS) {
-        LOG("P%d experienced an error during broadcast of matrix size.\n",
-                my_rank);
-        if (my_rank == MASTER)
-            safe_free(&matrix);
-        MPI_Abort(MPI_COMM_WORLD, mpi_err);
+    ckpt = checkpoint_open(options->checkpoint_dir, my_rank,
+                           options->input_filename, matrix_size,
+                           options->depth);
+    timing_stop(PHASE_CHECKPOINT);
+    if (!ckpt) {
+        free(restored);
+        return -1;
     }
 
-    // All processes compute the size of their submatrix
-    rows_per_node = matrix_size / nproc;
-    my_top_padding   =  get_padding(my_rank, matrix_size,
-                                    depth, rows_per_node, UP);
-    my_bottom_padding = get_padding(my_rank, matrix_size,
-                                    depth, rows_per_node, DOWN);
-    my_padded_rows = my_top_padding + rows_per_node + my_bottom_padding;
-    my_start_row = (my_rank * rows_per_node) - my_top_padding;
-    my_end_row = my_start_row + my_padded_rows - 1;
+    result = 0;
+    for (int row = 0; row < rows && result == 0; ) {
+        if (restored[row]) {
+            row++;
+            continue;
+        }
+        // Compute up to the end of this band or the next restored row
+        int band_end = (row / options->checkpoint_rows + 1)
+                        * options->checkpoint_rows;
+        int end = row;
+        while (end < rows && end < band_end && !restored[end])
+            end++;
 
-    if (my_top_padding < 0 ||
-        my_bottom_padding < 0 ||
-        my_padded_rows <= 0 ||
-        my_start_row < 0 ||
-        my_end_row >= matrix_size) {
-        LOG("P%d experienced an error calculating padding\n",
-                my_rank);
-        if (my_rank == MASTER)
-            safe_free(&matrix);
-        MPI_Abort(MPI_COMM_WORLD, mpi_err);
+        timing_start(PHASE_COMPUTE);
+        result = convolve_rows_with(config, padded, padded_rows, matrix_size,
+                                    top_padding + row, end - row,
+                                    options->depth,
+                                    processed + row * matrix_size);
+        timing_stop(PHASE_COMPUTE);
+
+        timing_start(PHASE_CHECKPOINT);
+        if (result == 0)
+            result = checkpoint_submit(ckpt, first_row + row, end - row,
+                                       processed + row * matrix_size);
+        timing_stop(PHASE_CHECKPOINT);
+        row = end;
     }
-    LOG("P%d will handle %d rows starting at row %d and ending at row %d. "
-        "(%d upper padding, %d working rows, %d lower padding)\n",
-        my_rank, my_padded_rows, my_start_row, my_end_row,
-        my_top_padding, rows_per_node, my_bottom_padding);
 
+    // Wait for the writer to drain; this is the only blocking part
+    timing_start(PHASE_CHECKPOINT);
+    if (checkpoint_close(ckpt, &busy_seconds) == -1)
+        result = -1;
+    timing_stop(PHASE_CHECKPOINT);
+    timing_add(PHASE_CHECKPOINT_BG, busy_seconds);
 
-    // All processes allocate space for their padded submatrix
-    my_padded_submatrix = allocate_matrix(my_padded_rows, matrix_size);
-    if (!my_padded_submatrix) {
-        LOG("P%d experienced an error while allocating "
-            "memory for their padded submatrix\n",
-            my_rank);
-        if (my_rank == MASTER)
-            safe_free(&matrix);
-        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
-    }
-    LOG("P%d has allocated their %dx%d padded submatix=%p "
-        "(0,0=%d. %d,%d=%d)\n",
-        my_rank, my_padded_rows, matrix_size, (void*)my_padded_submatrix,
-        my_padded_submatrix[0],
-        my_padded_rows-1, matrix_size-1, 
-        my_padded_submatrix[my_padded_rows-1 * matrix_size + matrix_size-1]);
+    free(restored);
+    return result;
+}
 
+/**
+ * @brief Scatter each process's padded submatrix from the master's matrix.
+ *
+ * The master works out how many cells each process needs, and from where,
+ * and shares the counts before the Scatterv. Collective over
+ * MPI_COMM_WORLD.
+ *
+ * @param my_rank Rank of this process.
+ * @param nproc Number of processes.
+ * @param matrix Full matrix (master only).
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param my_padded_submatrix Receive buffer for this process's submatrix.
+ * @param my_padded_rows Rows in the padded submatrix.
+ * @param in_place The master's slab is already in place in the matrix.
+ * @return MPI_SUCCESS, or an error code (-1 if allocation fails).
+ */
+static int scatter_submatrices(int my_rank, int nproc, int *matrix,
+                               int matrix_size, int depth,
+                               int *my_padded_submatrix, int my_padded_rows,
+                               int in_place)
+{
+    int mpi_err,
+        *cells_per_process  = NULL, // Number of rows per node
+        *starts_per_process = NULL; // Starting element per node
 
     // Allocate space for cells_per_process and starts_per_process
     cells_per_process  = (int *) malloc(nproc * sizeof(int));
@@ -155,12 +210,9 @@ int main(int argc, char **argv)
         LOG("P%d experienced an error while allocating memory for "
             "cells_per_process or starts_per_process\n",
             my_rank);
-        if (my_rank == MASTER)
-            safe_free(&matrix);
-        safe_free(&my_padded_submatrix);
         safe_free(&cells_per_process);
         safe_free(&starts_per_process);
-        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        return -1;
     }
     LOG("P%d has allocated cells_per_process=%p and starts_per_process=%p\n",
         my_rank, (void*)cells_per_process, (void*)starts_per_process);
@@ -170,15 +222,14 @@ int main(int argc, char **argv)
     // to send to each process
     if (my_rank == MASTER) {
         for(int proc = 0; proc < nproc; proc++) {
-            int top_padding   =  get_padding(proc, matrix_size,
-                                            depth, rows_per_node, UP);
-            int bottom_padding = get_padding(proc, matrix_size,
-                                            depth, rows_per_node, DOWN);
-            int padded_portion = top_padding + rows_per_node + bottom_padding;
+            int top_padding   =  get_padding(proc, nproc, matrix_size,
+                                            depth, UP);
+            int padded_portion = get_padded_rows(proc, nproc, matrix_size,
+                                                 depth);
 
             cells_per_process[proc] = padded_portion * matrix_size;
-            starts_per_process[proc] = ((proc * rows_per_node) - top_padding)
-                                        * matrix_size;
+            starts_per_process[proc] = ((proc * (matrix_size / nproc)) -
+                                        top_padding) * matrix_size;
             LOG("P%d will be given %d cells (%d rows) "
                 "at starting position %d (in row %d)\n",
                 proc, cells_per_process[proc], padded_portion,
@@ -195,18 +246,18 @@ int main(int argc, char **argv)
     if (mpi_err != MPI_SUCCESS) {
         LOG("P%d experienced an error during broadcast of cells_per_process\n",
                 my_rank);
-        if (my_rank == MASTER)
-            safe_free(&matrix);
-        MPI_Abort(MPI_COMM_WORLD, mpi_err);
+        safe_free(&cells_per_process);
+        safe_free(&starts_per_process);
+        return mpi_err;
     }
     mpi_err = MPI_Bcast(starts_per_process, nproc,
                         MPI_INT, MASTER, MPI_COMM_WORLD);
     if (mpi_err != MPI_SUCCESS) {
         LOG("P%d experienced an error during broadcast of starts_per_process\n",
                 my_rank);
-        if (my_rank == MASTER)
-            safe_free(&matrix);
-        MPI_Abort(MPI_COMM_WORLD, mpi_err);
+        safe_free(&cells_per_process);
+        safe_free(&starts_per_process);
+        return mpi_err;
     }
     LOG("P%d has received cells_per_process[me]=%d "
         "and starts_per_process[me]=%d\n",
@@ -235,20 +286,20 @@ int main(int argc, char **argv)
     if (mpi_err != MPI_SUCCESS) {
         LOG("P%d experienced an error during mpi barrier.\n",
                 my_rank);
-        if (my_rank == MASTER)
-            safe_free(&matrix);
-        MPI_Abort(MPI_COMM_WORLD, mpi_err);
+        safe_free(&cells_per_process);
+        safe_free(&starts_per_process);
+        return mpi_err;
     }
 
 
-    // TODO: Check this is correct
-    // Distribute sub-matrices to processes
+    // Distribute sub-matrices to processes. A lean master keeps its own
+    // slab where it is rather than copying it.
     mpi_err = MPI_Scatterv(
         matrix,                      // send buffer
         cells_per_process,              // array of elements to each process
         starts_per_process,             // array of start element per process
         MPI_INT,                        // send data type
-        my_padded_submatrix,         // receive buffer 
+        in_place ? MPI_IN_PLACE : my_padded_submatrix, // receive buffer
         my_padded_rows * matrix_size,   // elements in receive buffer
         MPI_INT,                        // receive data type
         MASTER,                         // rank of source process
@@ -257,38 +308,625 @@ int main(int argc, char **argv)
     if (mpi_err != MPI_SUCCESS) {
         LOG("P%d experienced an error during Scatterv operation.\n",
                 my_rank);
-        if (my_rank == MASTER)
-            safe_free(&matrix);
-        safe_free(&my_padded_submatrix);
         safe_free(&cells_per_process);
         safe_free(&starts_per_process);
+        return mpi_err;
+    }
+
+
+    safe_free(&cells_per_process);
+    safe_free(&starts_per_process);
+    LOG("P%d has freed their cells_per_process and starts_per_process\n",
+        my_rank);
+    return MPI_SUCCESS;
+}
+
+/**
+ * @brief Read the input matrix on the master, aborting if it cannot.
+ *
+ * @param filename Name of the input file.
+ * @param [out] matrix_size Size of the matrix read.
+ * @return The matrix.
+ */
+static int* read_input(const char *filename, int *matrix_size)
+{
+    int *matrix;
+
+    timing_start(PHASE_READ);
+    matrix = read_matrix_from_file(filename, matrix_size);
+    timing_stop(PHASE_READ);
+    if (*matrix_size <= 0 || !matrix) {
+        LOG("Failed to read matrix from file: %s\n", filename);
+        safe_free(&matrix);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    LOG("Master process read a %dx%d matrix from file:\n%s",
+        *matrix_size, *matrix_size,
+        matrix_to_string(matrix, *matrix_size, *matrix_size));
+    return matrix;
+}
+
+/**
+ * @brief Add a finished job's output to the result cache, if enabled.
+ *
+ * @param options Options of the job.
+ * @param key Cache key of the job.
+ */
+static void cache_result(const options_t *options, const char *key)
+{
+    if (!options->result_cache_dir)
+        return;
+    timing_start(PHASE_WRITE);
+    if (result_cache_store(options->result_cache_dir, key,
+                           options->output_filename,
+                           (size_t) options->result_cache_mb << 20) == 0)
+        LOG("Master process cached the result as %s\n", key);
+    timing_stop(PHASE_WRITE);
+}
+
+/**
+ * @brief Name the output file of one depth of a multi-depth job.
+ *
+ * @param options Options of the job.
+ * @param depth Depth of the output.
+ * @param [out] name Buffer of PATH_MAX characters for the name.
+ */
+static void depth_output_name(const options_t *options, int depth,
+                              char *name)
+{
+    snprintf(name, PATH_MAX, "%s.%d", options->output_filename, depth);
+}
+
+/**
+ * @brief Write each depth of a multi-depth job to its own output file.
+ *
+ * With collective output every process writes its rows of each depth;
+ * otherwise each depth in turn is gathered into the master's matrix and
+ * written by the master. Collective over MPI_COMM_WORLD.
+ *
+ * @param options Options of the job.
+ * @param my_rank Rank of this process.
+ * @param outputs Rows of this process at each depth.
+ * @param rows_per_node Number of rows of each process but the last.
+ * @param my_rows Number of rows of this process.
+ * @param matrix_size Size of the matrix.
+ * @param matrix Matrix to gather into (master only, unless collective).
+ * @param hierarchy Hierarchy to gather through, or NULL to gather directly.
+ * @param [out] status Set to EXIT_FAILURE if the master fails to write.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+static int write_depths(const options_t *options, int my_rank, int **outputs,
+                        int rows_per_node, int my_rows, int matrix_size,
+                        int *matrix, const hierarchy_t *hierarchy,
+                        int *status)
+{
+    char name[PATH_MAX];
+    async_writer_t writer;
+    int writer_open, mpi_err;
+
+    for (int k = 0; k < options->num_depths; k++) {
+        depth_output_name(options, options->depths[k], name);
+        if (options->collective_write) {
+            timing_start(PHASE_COLLECT);
+            mpi_err = mpi_write_rows(name, outputs[k],
+                                     my_rank * rows_per_node, my_rows,
+                                     matrix_size, MPI_COMM_WORLD);
+            timing_stop(PHASE_COLLECT);
+            if (mpi_err != MPI_SUCCESS)
+                return mpi_err;
+            continue;
+        }
+
+        if (hierarchy) {
+            timing_start(PHASE_COLLECT);
+            mpi_err = hierarchy_gather(hierarchy, my_rank, outputs[k],
+                                       matrix_size, matrix, 0);
+            timing_stop(PHASE_COLLECT);
+            if (mpi_err != MPI_SUCCESS)
+                return mpi_err;
+            timing_start(PHASE_WRITE);
+            if (my_rank == MASTER &&
+                write_matrix_to_file(name, matrix, matrix_size) != 0) {
+                LOG("Failed to write matrix to output file %s.\n", name);
+                *status = EXIT_FAILURE;
+            }
+            timing_stop(PHASE_WRITE);
+            continue;
+        }
+
+        // The master writes each process's rows as they arrive
+        writer_open = my_rank == MASTER &&
+                      async_writer_open(&writer, name) == 0;
+        timing_start(PHASE_COLLECT);
+        mpi_err = mpi_gather_write(outputs[k], rows_per_node, matrix_size,
+                                   matrix, 0, writer_open ? &writer : NULL,
+                                   MASTER, MPI_COMM_WORLD);
+        timing_stop(PHASE_COLLECT);
+        if (mpi_err != MPI_SUCCESS)
+            return mpi_err;
+        timing_start(PHASE_WRITE);
+        if (my_rank == MASTER &&
+            (!writer_open || async_writer_close(&writer) != 0)) {
+            LOG("Failed to write matrix to output file %s.\n", name);
+            *status = EXIT_FAILURE;
+        }
+        timing_stop(PHASE_WRITE);
+    }
+    return MPI_SUCCESS;
+}
+
+/**
+ * @brief Run one convolution job with all processes.
+ *
+ * Collective over MPI_COMM_WORLD, except that with zero depth only the
+ * master takes part. The master may be handed the input matrix already in
+ * memory; it then owns and frees it.
+ *
+ * @param options Options of the job.
+ * @param my_rank Rank of this process.
+ * @param nproc Number of processes.
+ * @param matrix Input matrix, or NULL to read it from the input file
+ *               (master only).
+ * @param matrix_size Size of the given matrix (master only).
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the output could not be written.
+ */
+static int run_job(options_t options, int my_rank, int nproc,
+                   int *matrix, int matrix_size)
+{
+    int     depth,      // Number of neighbours to include in the convolution
+            mpi_err,    // Error codes returned from MPI functions 
+            result,     // Return codes from local (non-MPI) functions
+            status = EXIT_SUCCESS,  // Exit status of the job
+            my_padded_rows = -1,    // Size of submatrix plus depth
+            rows_per_node  = -1,    // Working rows of all but the last
+            my_rows        = -1,    // Size of processed submatrix
+            my_top_padding,
+            my_bottom_padding,
+            my_start_row,
+            my_end_row,
+            *my_padded_submatrix    = NULL, // Padded working sub-matrix
+            *my_processed_submatrix = NULL, // Processed output sub-matrix
+            *my_window              = NULL, // Rolling window (lean mode)
+            *my_result_rows         = NULL, // Start of this node's results
+            *output                 = NULL; // Output matrix (dynamic mode)
+
+    kernel_config_t kernel_config;  // Kernel chosen for this job
+    int     ranks_on_node,      // Processes sharing this node
+            max_threads;        // Threads each process may use
+
+    char    *input_filename,    // Filename of input matrix
+            *output_filename;   // Filename of output matrix
+
+    char    cache_key[RESULT_CACHE_KEY_LEN];    // Key in the result cache
+    int     cache_hit = 0;      // Result was found in the cache
+    long    cache_hits,         // Result cache statistics
+            cache_misses;
+
+    int     *my_depth_outputs[MAX_DEPTHS];  // Processed rows at each depth
+    hierarchy_t hierarchy;              // Node leaders (hierarchical mode)
+    int     use_hierarchy = 0;          // Scatter and gather through them
+    int     in_place;                   // Master's results are in place
+    char    depth_filename[PATH_MAX];       // Output file of a single depth
+    async_writer_t writer;              // Output file (master only)
+    int     writer_open = 0;            // The writer was opened
+    output_stats_t stats,               // Statistics of this process's rows
+            all_stats;                  // ... and of all of them (master)
+    sparse_slab_t my_sparse = {0};      // Slab received in sparse form
+
+    input_filename = options.input_filename;
+    output_filename = options.output_filename;
+    depth = options.depth;
+
+    // A service runs many jobs; each one's timings are reported alone
+    timing_reset();
+
+
+    // Master process retrieves matrix from file
+    if (my_rank == MASTER) {
+        LOG("ARGS: %s, %s, %d%s\n",
+            input_filename, output_filename, depth,
+            options.lean ? " (lean)" : "");
+
+        // The matrix may already be in memory. When pipelined, the slabs
+        // are read as they are distributed, and an update reads just the
+        // rows it needs. With a result cache, the matrix is only read once
+        // the job has missed the cache.
+        if (matrix) {
+            LOG("Master process was given a %dx%d matrix\n",
+                matrix_size, matrix_size);
+        } else if ((options.pipelined || options.previous_output ||
+                    options.result_cache_dir) && depth > 0) {
+            matrix_size = get_matrix_size_from_file(input_filename);
+            if (matrix_size <= 0) {
+                LOG("Failed get matrix size: %s\n", input_filename);
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
+            LOG("Master process will read a %dx%d matrix from file "
+                "as needed\n", matrix_size, matrix_size);
+        } else {
+            matrix = read_input(input_filename, &matrix_size);
+        }
+
+        // If zero depth, no work to do. Write input matrix to output file 
+        if (depth == 0) {
+            LOG("Zero depth set. No work to do\n");
+            if (options.num_depths > 0) {
+                depth_output_name(&options, 0, depth_filename);
+                output_filename = depth_filename;
+            }
+            result = write_matrix_to_file(output_filename,
+                                                matrix, matrix_size);
+            if (result == -1) {
+                LOG("Failed to write matrix to output file %s.\n",
+                    output_filename);
+            } else if (result == -2) {
+                LOG("Failed to close the file after "
+                    "writing matrix to output file %s.\n",
+                    output_filename);
+            }
+            LOG("Master process wrote matrix to file\n");
+            if (result == 0 && options.stats) {
+                stats_init(&stats);
+                stats_add_rows(&stats, matrix, matrix_size, matrix_size, 0);
+                result = stats_write(output_filename, &stats);
+            }
+            safe_free(&matrix);
+            return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+
+    // Broadcast the master matrix's size from master to all processes
+    timing_start(PHASE_DISTRIBUTE);
+    mpi_err = MPI_Bcast(&matrix_size, 1, MPI_INT, MASTER, MPI_COMM_WORLD);
+    if (mpi_err != MPI_SUCCESS) {
+        LOG("P%d experienced an error during broadcast of matrix size.\n",
+                my_rank);
+        if (my_rank == MASTER)
+            safe_free(&matrix);
+        MPI_Abort(MPI_COMM_WORLD, mpi_err);
+    }
+
+    // Small jobs, and any job on one process, are convolved by the master
+    // alone without distributing the matrix
+    if (local_eligible(&options, nproc, matrix_size)) {
+        timing_stop(PHASE_DISTRIBUTE);
+        if (my_rank == MASTER)
+            status = local_run(&options, matrix, matrix_size);
+        if (options.timing) {
+            timing_report(my_rank, MPI_COMM_WORLD);
+            allocator_report(my_rank, MPI_COMM_WORLD);
+        }
+        LOG("P%d has finished\n", my_rank);
+        return status;
+    }
+    timing_stop(PHASE_DISTRIBUTE);
+
+    // With a result cache, every process hashes its rows of the input and
+    // a job seen before is copied from the cache instead of read and
+    // recomputed
+    if (options.result_cache_dir) {
+        timing_start(PHASE_READ);
+        mpi_err = result_cache_key(input_filename, matrix_size, depth,
+                                   filter_name(options.filter),
+                                   MPI_COMM_WORLD,
+                                   cache_key);
+        timing_stop(PHASE_READ);
+        if (mpi_err == MPI_SUCCESS && my_rank == MASTER) {
+            timing_start(PHASE_WRITE);
+            cache_hit = result_cache_fetch(options.result_cache_dir,
+                                           cache_key, output_filename,
+                                           &cache_hits, &cache_misses) == 0;
+            timing_stop(PHASE_WRITE);
+            fprintf(stderr, "Result cache %s (%ld hits, %ld misses)\n",
+                    cache_hit ? "hit" : "miss", cache_hits, cache_misses);
+        }
+        if (mpi_err == MPI_SUCCESS)
+            mpi_err = MPI_Bcast(&cache_hit, 1, MPI_INT, MASTER,
+                                MPI_COMM_WORLD);
+        if (mpi_err != MPI_SUCCESS) {
+            LOG("P%d experienced an error looking up the result cache.\n",
+                my_rank);
+            if (my_rank == MASTER)
+                safe_free(&matrix);
+            MPI_Abort(MPI_COMM_WORLD, mpi_err == -1 ? EXIT_FAILURE : mpi_err);
+        }
+        if (cache_hit) {
+            if (my_rank == MASTER)
+                safe_free(&matrix);
+            if (options.timing) {
+                timing_report(my_rank, MPI_COMM_WORLD);
+                allocator_report(my_rank, MPI_COMM_WORLD);
+            }
+            LOG("P%d has finished\n", my_rank);
+            return EXIT_SUCCESS;
+        }
+    }
+
+    // The master reads the matrix it has not yet needed, unless its slabs
+    // are streamed or only the changes are read
+    if (my_rank == MASTER && !matrix && !options.pipelined &&
+        !options.previous_output)
+        matrix = read_input(input_filename, &matrix_size);
+    timing_start(PHASE_DISTRIBUTE);
+
+    // All processes compute the size of their submatrix; the last process
+    // also takes the rows left over
+    rows_per_node = matrix_size / nproc;
+    my_rows = get_working_rows(my_rank, nproc, matrix_size);
+    my_top_padding   =  get_padding(my_rank, nproc, matrix_size,
+                                    depth, UP);
+    my_bottom_padding = get_padding(my_rank, nproc, matrix_size,
+                                    depth, DOWN);
+    my_padded_rows = my_top_padding + my_rows + my_bottom_padding;
+    my_start_row = (my_rank * rows_per_node) - my_top_padding;
+    my_end_row = my_start_row + my_padded_rows - 1;
+
+    if (my_top_padding < 0 ||
+        my_bottom_padding < 0 ||
+        my_padded_rows <= 0 ||
+        my_start_row < 0 ||
+        my_end_row >= matrix_size) {
+        LOG("P%d experienced an error calculating padding\n",
+                my_rank);
+        if (my_rank == MASTER)
+            safe_free(&matrix);
+        MPI_Abort(MPI_COMM_WORLD, mpi_err);
+    }
+    LOG("P%d will handle %d rows starting at row %d and ending at row %d. "
+        "(%d upper padding, %d working rows, %d lower padding)\n",
+        my_rank, my_padded_rows, my_start_row, my_end_row,
+        my_top_padding, my_rows, my_bottom_padding);
+
+    // Master chooses the kernel configuration, leaving each process an
+    // equal share of this node's cores, and shares it with all processes
+    mpi_err = mpi_ranks_per_node(MPI_COMM_WORLD, &ranks_on_node);
+    if (mpi_err == MPI_SUCCESS) {
+        max_threads = sysconf(_SC_NPROCESSORS_ONLN) / ranks_on_node;
+        if (max_threads < 1)
+            max_threads = 1;
+        if (my_rank == MASTER &&
+            autotune_select(options.kernel, options.autotune,
+                            options.profile, matrix_size, depth, nproc,
+                            rows_per_node, max_threads,
+                            &kernel_config) == -1) {
+            safe_free(&matrix);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        mpi_err = MPI_Bcast(&kernel_config, sizeof(kernel_config), MPI_BYTE,
+                            MASTER, MPI_COMM_WORLD);
+    }
+    if (mpi_err != MPI_SUCCESS) {
+        LOG("P%d experienced an error choosing the kernel.\n", my_rank);
+        if (my_rank == MASTER)
+            safe_free(&matrix);
         MPI_Abort(MPI_COMM_WORLD, mpi_err);
     }
 
+
+    // An update recomputes only the regions near the changes
+    if (options.previous_output) {
+        long cells_done;
+        mpi_err = incremental_convolve(&options, my_rank, matrix_size, depth,
+                                       &kernel_config, MPI_COMM_WORLD,
+                                       &cells_done);
+        if (mpi_err != MPI_SUCCESS) {
+            LOG("P%d experienced an error updating %s.\n",
+                my_rank, output_filename);
+            MPI_Abort(MPI_COMM_WORLD, mpi_err == -1 ? EXIT_FAILURE : mpi_err);
+        }
+        LOG("P%d recomputed %ld cells\n", my_rank, cells_done);
+        if (my_rank == MASTER)
+            cache_result(&options, cache_key);
+        if (options.timing) {
+            timing_report(my_rank, MPI_COMM_WORLD);
+            allocator_report(my_rank, MPI_COMM_WORLD);
+        }
+        LOG("P%d has finished\n", my_rank);
+        return status;
+    }
+
+
+    // In dynamic mode, processes claim chunks of rows until none are left
+    if (options.dynamic) {
+        int chunks_done;
+        if (my_rank == MASTER) {
+            output = allocate_matrix_uninit(matrix_size, matrix_size);
+            if (!output) {
+                LOG("Master failed to allocate the output matrix\n");
+                safe_free(&matrix);
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
+        }
+        mpi_err = dynamic_convolve(my_rank, MASTER, matrix, output,
+                                   matrix_size, depth, options.chunk_rows,
+                                   &kernel_config, MPI_COMM_WORLD,
+                                   &chunks_done);
+        if (mpi_err != MPI_SUCCESS) {
+            LOG("P%d experienced an error processing dynamic chunks.\n",
+                my_rank);
+            safe_free(&matrix);
+            safe_free(&output);
+            MPI_Abort(MPI_COMM_WORLD, mpi_err == -1 ? EXIT_FAILURE : mpi_err);
+        }
+        LOG("P%d processed %d chunks of %d rows\n",
+            my_rank, chunks_done, options.chunk_rows);
+
+        if (my_rank == MASTER) {
+            timing_start(PHASE_WRITE);
+            result = write_matrix_to_file(output_filename, output,
+                                          matrix_size);
+            timing_stop(PHASE_WRITE);
+            if (result != 0) {
+                LOG("Failed to write matrix to output file %s.\n",
+                    output_filename);
+                status = EXIT_FAILURE;
+            } else {
+                cache_result(&options, cache_key);
+            }
+            safe_free(&matrix);
+            safe_free(&output);
+        }
+        if (options.timing) {
+            timing_report(my_rank, MPI_COMM_WORLD);
+            allocator_report(my_rank, MPI_COMM_WORLD);
+        }
+        LOG("P%d has finished\n", my_rank);
+        return status;
+    }
+
+
+    // With a progress thread, the slabs, halos and finished bands move
+    // while the processes compute
+    if (options.progress) {
+        mpi_err = progress_convolve(my_rank, matrix, matrix_size, depth,
+                                    &kernel_config, output_filename,
+                                    MPI_COMM_WORLD, &result);
+        if (mpi_err != MPI_SUCCESS) {
+            LOG("P%d experienced an error with the progress thread.\n",
+                my_rank);
+            safe_free(&matrix);
+            MPI_Abort(MPI_COMM_WORLD, mpi_err == -1 ? EXIT_FAILURE : mpi_err);
+        }
+        if (my_rank == MASTER) {
+            if (result != 0) {
+                LOG("Failed to write matrix to output file %s.\n",
+                    output_filename);
+                status = EXIT_FAILURE;
+            } else {
+                cache_result(&options, cache_key);
+            }
+            safe_free(&matrix);
+        }
+        if (options.timing) {
+            timing_report(my_rank, MPI_COMM_WORLD);
+            allocator_report(my_rank, MPI_COMM_WORLD);
+        }
+        LOG("P%d has finished\n", my_rank);
+        return status;
+    }
+
+
+    // All processes allocate space for their padded submatrix. In lean mode
+    // the master's slab is the top of the matrix it already holds.
+    if (options.lean && my_rank == MASTER && matrix)
+        my_padded_submatrix = matrix;
+    else
+        my_padded_submatrix = allocate_matrix_uninit(my_padded_rows,
+                                                     matrix_size);
+    if (!my_padded_submatrix) {
+        LOG("P%d experienced an error while allocating "
+            "memory for their padded submatrix\n",
+            my_rank);
+        if (my_rank == MASTER)
+            safe_free(&matrix);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    // The buffer is not yet filled, so only its address is logged
+    LOG("P%d has allocated their %dx%d padded submatix=%p\n",
+        my_rank, my_padded_rows, matrix_size, (void*)my_padded_submatrix);
+
+
+    // Set up the node leaders, unless the nodes' ranks are interleaved
+    if (options.hierarchical) {
+        mpi_err = hierarchy_create(MPI_COMM_WORLD, &hierarchy,
+                                   &use_hierarchy);
+        if (mpi_err != MPI_SUCCESS) {
+            LOG("P%d experienced an error finding the node leaders.\n",
+                my_rank);
+            if (my_rank == MASTER)
+                safe_free(&matrix);
+            MPI_Abort(MPI_COMM_WORLD, mpi_err);
+        }
+        if (!use_hierarchy && my_rank == MASTER)
+            fprintf(stderr, "Ranks are not placed in blocks per node; "
+                    "scattering from the master instead\n");
+    }
+
+
+    // Distribute sub-matrices to processes, streaming them from the file
+    // if pipelined
+    if (use_hierarchy)
+        mpi_err = hierarchy_scatter(&hierarchy, my_rank, matrix, matrix_size,
+                                    depth, my_padded_submatrix,
+                                    my_padded_rows,
+                                    options.lean && my_rank == MASTER);
+    else if (options.pipelined)
+        mpi_err = pipeline_distribute(my_rank, MASTER, input_filename,
+                                      matrix_size, depth,
+                                      my_padded_submatrix, MPI_COMM_WORLD);
+    else if (options.sparse > 0)
+        mpi_err = sparse_distribute(my_rank, nproc, matrix, matrix_size,
+                                    depth, options.sparse,
+                                    my_padded_submatrix, my_padded_rows,
+                                    &my_sparse, MPI_COMM_WORLD);
+    else
+        mpi_err = scatter_submatrices(my_rank, nproc, matrix, matrix_size,
+                                      depth, my_padded_submatrix,
+                                      my_padded_rows,
+                                      options.lean && my_rank == MASTER);
+    if (mpi_err != MPI_SUCCESS) {
+        LOG("P%d experienced an error distributing the submatrices.\n",
+                my_rank);
+        if (my_padded_submatrix != matrix)
+            safe_free(&my_padded_submatrix);
+        if (my_rank == MASTER)
+            safe_free(&matrix);
+        MPI_Abort(MPI_COMM_WORLD, mpi_err == -1 ? EXIT_FAILURE : mpi_err);
+    }
+
     LOG("P%d received data:\n%s", 
         my_rank,
         matrix_to_string(my_padded_submatrix, my_padded_rows, matrix_size));
 
+    timing_stop(PHASE_DISTRIBUTE);
 
-    safe_free(&cells_per_process);
-    safe_free(&starts_per_process);
-    LOG("P%d has freed their cells_per_process and starts_per_process\n",
-        my_rank);
+    // With collective output the master never needs the whole matrix again.
+    // A lean master's slab is the top of the matrix, so shrink it to that.
+    if (options.collective_write && my_rank == MASTER && matrix) {
+        int *slab = NULL;
+        if (options.lean) {
+            slab = allocate_matrix_uninit(my_padded_rows, matrix_size);
+            if (!slab) {
+                LOG("Master failed to allocate its slab\n");
+                safe_free(&matrix);
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
+            memcpy(slab, matrix,
+                   (size_t) my_padded_rows * matrix_size * sizeof(int));
+            my_padded_submatrix = slab;
+        }
+        safe_free(&matrix);
+        matrix = slab;
+        allocator_trim();   // Hand the full matrix back to the system
+        LOG("Master process has released the full matrix\n");
+    }
 
 
-    // All processes allocate space for their processed submatrix
-    my_processed_submatrix = allocate_matrix(rows_per_node, matrix_size);
-    if (!my_processed_submatrix) {
+    // All processes allocate space for their processed rows: a full
+    // processed submatrix (one per depth with several depths), or just the
+    // rolling window in lean mode
+    if (options.lean)
+        my_window = allocate_matrix_uninit(depth + 1, matrix_size);
+    else if (options.num_depths > 0)
+        my_processed_submatrix = allocate_matrix_uninit(
+            my_rows * options.num_depths, matrix_size);
+    else
+        my_processed_submatrix = allocate_matrix_uninit(my_rows,
+                                                        matrix_size);
+    if (!my_processed_submatrix && !my_window) {
         LOG("P%d experienced an error allocating memory for processed matrix",
                 my_rank);
+        if (my_padded_submatrix != matrix)
+            safe_free(&my_padded_submatrix);
         if (my_rank == MASTER)
             safe_free(&matrix);
-        safe_free(&my_padded_submatrix);
-        safe_free(&my_processed_submatrix);
         MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
     }
-    LOG("P%d has allocated their %d-row by %d-col processed submatix=%p\n",
-        my_rank, rows_per_node, matrix_size, (void*)my_processed_submatrix);
+    LOG("P%d has allocated their %d-row by %d-col processed %s=%p\n",
+        my_rank, options.lean ? depth + 1 : my_rows, matrix_size,
+        options.lean ? "window" : "submatrix",
+        options.lean ? (void*)my_window : (void*)my_processed_submatrix);
 
 
     mpi_err = MPI_Barrier(MPI_COMM_WORLD);
@@ -304,32 +942,196 @@ int main(int argc, char **argv)
     LOG("P%d will apply convolution on %d rows "
         "(%d upper padding, %d working rows, %d lower padding)\n",
         my_rank, my_padded_rows,
-        my_top_padding, rows_per_node, my_bottom_padding);
-        
-    for (int row=my_top_padding; row < (rows_per_node+my_top_padding); row++) {
-        for (int col = 0; col < matrix_size; col++) {
-            int sum = apply_convolution(row, col, my_padded_submatrix,
-                                        my_padded_rows, matrix_size, depth);
-            if (sum < 0) {
-                LOG("P%d experienced an error in apply_convolution at "
-                    "local row %d and col %d of their padded submatrix\n",
-                    my_rank, row, col);
-                if (my_rank == MASTER)
-                    safe_free(&matrix);
-                safe_free(&my_padded_submatrix);
-                safe_free(&my_processed_submatrix);
-                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
-            }
-            my_processed_submatrix[row * matrix_size + col] = sum;
+        my_top_padding, my_rows, my_bottom_padding);
+
+    if (options.lean) {
+        timing_start(PHASE_COMPUTE);
+        result = convolve_rows_in_place(my_padded_submatrix, my_padded_rows,
+                                        matrix_size, my_top_padding,
+                                        my_rows, depth, my_window,
+                                        &kernel_config);
+        timing_stop(PHASE_COMPUTE);
+        my_result_rows = my_padded_submatrix + my_top_padding * matrix_size;
+    } else if (options.num_depths > 0) {
+        for (int k = 0; k < options.num_depths; k++)
+            my_depth_outputs[k] = my_processed_submatrix +
+                                  (size_t) k * my_rows * matrix_size;
+        timing_start(PHASE_COMPUTE);
+        result = convolve_rows_multi(&kernel_config, my_padded_submatrix,
+                                     my_padded_rows, matrix_size,
+                                     my_top_padding, my_rows,
+                                     options.depths, options.num_depths,
+                                     my_depth_outputs);
+        timing_stop(PHASE_COMPUTE);
+        my_result_rows = my_processed_submatrix;
+    } else if (options.checkpoint_dir) {
+        result = process_with_checkpoints(&options, my_rank,
+                                          my_padded_submatrix, my_padded_rows,
+                                          matrix_size, my_top_padding,
+                                          my_rows, my_rank * rows_per_node,
+                                          my_processed_submatrix,
+                                          &kernel_config);
+        my_result_rows = my_processed_submatrix;
+    } else if (options.approximate > 0 && depth >= APPROXIMATE_MIN_DEPTH) {
+        timing_start(PHASE_COMPUTE);
+        result = approximate_rows(&kernel_config, options.approximate,
+                                  my_padded_submatrix, my_padded_rows,
+                                  matrix_size, my_top_padding, my_rows,
+                                  depth, my_processed_submatrix);
+        timing_stop(PHASE_COMPUTE);
+        if (result == 0) {
+            timing_start(PHASE_ERROR_CHECK);
+            mpi_err = approximate_check(my_rank, my_padded_submatrix,
+                                        my_padded_rows, matrix_size,
+                                        my_top_padding, my_rows, depth,
+                                        my_processed_submatrix,
+                                        MPI_COMM_WORLD);
+            timing_stop(PHASE_ERROR_CHECK);
+            if (mpi_err != MPI_SUCCESS)
+                result = -1;
         }
+        my_result_rows = my_processed_submatrix;
+    } else if (options.filter != FILTER_CONVOLUTION) {
+        stats_init(&stats);
+        timing_start(PHASE_COMPUTE);
+        result = filter_rows(&kernel_config, options.filter,
+                             my_padded_submatrix, my_padded_rows, matrix_size,
+                             my_top_padding, my_rows, depth,
+                             my_processed_submatrix, my_rank * rows_per_node,
+                             options.stats ? &stats : NULL);
+        timing_stop(PHASE_COMPUTE);
+        my_result_rows = my_processed_submatrix;
+    } else if (my_sparse.data) {
+        stats_init(&stats);
+        timing_start(PHASE_COMPUTE);
+        result = sparse_convolve_rows(&kernel_config, &my_sparse,
+                                      my_top_padding, my_rows, depth,
+                                      my_processed_submatrix,
+                                      my_rank * rows_per_node,
+                                      options.stats ? &stats : NULL);
+        timing_stop(PHASE_COMPUTE);
+        sparse_free(&my_sparse);
+        my_result_rows = my_processed_submatrix;
+    } else {
+        stats_init(&stats);
+        timing_start(PHASE_COMPUTE);
+        result = convolve_rows_stats(&kernel_config, my_padded_submatrix,
+                                     my_padded_rows, matrix_size,
+                                     my_top_padding, my_rows,
+                                     depth, my_processed_submatrix,
+                                     my_rank * rows_per_node,
+                                     options.stats ? &stats : NULL);
+        timing_stop(PHASE_COMPUTE);
+        my_result_rows = my_processed_submatrix;
+    }
+    if (result == -1) {
+        LOG("P%d experienced an error in apply_convolution\n", my_rank);
+        if (my_padded_submatrix != matrix)
+            safe_free(&my_padded_submatrix);
+        if (my_rank == MASTER)
+            safe_free(&matrix);
+        safe_free(&my_processed_submatrix);
+        safe_free(&my_window);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
     }
     LOG("P%d has finished processing their submatix\n", my_rank);
 
-    safe_free(&my_padded_submatrix);
-    LOG("P%d has freed their padded submatix. Waiting for gather call\n",
-        my_rank);
+    // The statistics of every process's rows are combined on the master and
+    // written beside the output
+    if (options.stats) {
+        timing_start(PHASE_COLLECT);
+        mpi_err = stats_reduce(&stats, &all_stats, MASTER, MPI_COMM_WORLD);
+        timing_stop(PHASE_COLLECT);
+        if (mpi_err != MPI_SUCCESS) {
+            LOG("P%d experienced an error combining the statistics.\n",
+                my_rank);
+            MPI_Abort(MPI_COMM_WORLD, mpi_err);
+        }
+        if (my_rank == MASTER &&
+            stats_write(output_filename, &all_stats) == -1) {
+            LOG("Failed to write the statistics of %s\n", output_filename);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    safe_free(&my_window);
+    if (!options.lean) {
+        safe_free(&my_padded_submatrix);
+        LOG("P%d has freed their padded submatix. Waiting for gather call\n",
+            my_rank);
+    }
+
+
+    // Each depth of a multi-depth job goes to its own output file
+    if (options.num_depths > 0) {
+        if (my_rank == MASTER && !matrix && !options.collective_write)
+            matrix = allocate_matrix_uninit(matrix_size, matrix_size);
+        if (my_rank == MASTER && !matrix && !options.collective_write) {
+            LOG("Master failed to allocate the gathered matrix\n");
+            safe_free(&my_processed_submatrix);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        mpi_err = write_depths(&options, my_rank, my_depth_outputs,
+                               rows_per_node, my_rows, matrix_size, matrix,
+                               use_hierarchy ? &hierarchy : NULL, &status);
+        safe_free(&my_processed_submatrix);
+        safe_free(&matrix);
+        if (use_hierarchy)
+            hierarchy_free(&hierarchy);
+        if (mpi_err != MPI_SUCCESS) {
+            LOG("P%d experienced an error writing the depths.\n", my_rank);
+            MPI_Abort(MPI_COMM_WORLD, mpi_err);
+        }
+        if (options.timing) {
+            timing_report(my_rank, MPI_COMM_WORLD);
+            allocator_report(my_rank, MPI_COMM_WORLD);
+        }
+        LOG("P%d has finished\n", my_rank);
+        return status;
+    }
+
+
+    // Each process writes its own rows straight to the output file
+    if (options.collective_write) {
+        timing_start(PHASE_COLLECT);
+        mpi_err = mpi_write_rows(output_filename, my_result_rows,
+                                 my_rank * rows_per_node, my_rows,
+                                 matrix_size, MPI_COMM_WORLD);
+        timing_stop(PHASE_COLLECT);
+        if (mpi_err != MPI_SUCCESS) {
+            LOG("P%d experienced an error during collective write to %s.\n",
+                my_rank, output_filename);
+            if (my_padded_submatrix != matrix)
+                safe_free(&my_padded_submatrix);
+            safe_free(&my_processed_submatrix);
+            safe_free(&matrix);
+            MPI_Abort(MPI_COMM_WORLD, mpi_err);
+        }
+        LOG("P%d wrote its rows to file\n", my_rank);
+        if (my_padded_submatrix != matrix)
+            safe_free(&my_padded_submatrix);
+        safe_free(&my_processed_submatrix);
+        safe_free(&matrix);
+        if (use_hierarchy)
+            hierarchy_free(&hierarchy);
+
+        // The output is complete, so its checkpoints are no longer needed
+        // and it can be cached
+        if (options.checkpoint_dir || options.result_cache_dir) {
+            MPI_Barrier(MPI_COMM_WORLD);
+            if (my_rank == MASTER && options.checkpoint_dir)
+                checkpoint_remove(options.checkpoint_dir);
+            if (my_rank == MASTER)
+                cache_result(&options, cache_key);
+        }
+        if (options.timing) {
+            timing_report(my_rank, MPI_COMM_WORLD);
+            allocator_report(my_rank, MPI_COMM_WORLD);
+        }
+        LOG("P%d has finished\n", my_rank);
+        return status;
+    }
 
-    
     LOG("Before Gather, P%d's data is:\n"
         " - sndbuf  = %p\n"
         " - sndcnt  = %d\n"
@@ -337,13 +1139,25 @@ int main(int argc, char **argv)
         " - recvcnt = %d\n"
         " - root    = %d\n",
         my_rank,                        // Process rank
-        (void*)my_processed_submatrix,  // send buffer address
-        rows_per_node * matrix_size,    // elements in send buffer
+        (void*)my_result_rows,          // send buffer address
+        my_rows * matrix_size,          // elements in send buffer
         (void*)matrix,                  // receive buffer address
-        matrix_size * matrix_size,      // elements in receive buffer
+        rows_per_node * matrix_size,    // elements received per process
         MASTER                          // rank of source process
     );
 
+    // A pipelined master has only held slabs so far, so it needs
+    // somewhere to gather the results
+    if (my_rank == MASTER && !matrix) {
+        matrix = allocate_matrix_uninit(matrix_size, matrix_size);
+        if (!matrix) {
+            LOG("Master failed to allocate the gathered matrix\n");
+            safe_free(&my_padded_submatrix);
+            safe_free(&my_processed_submatrix);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+
     mpi_err = MPI_Barrier(MPI_COMM_WORLD);
     if (mpi_err != MPI_SUCCESS) {
         LOG("P%d experienced an error during mpi barrier.\n",
@@ -354,26 +1168,44 @@ int main(int argc, char **argv)
     }
 
 
-    // Gather the processed sub-matrices at master process
-    mpi_err = MPI_Gather(
-        my_processed_submatrix,         // send buffer
-        rows_per_node * matrix_size,    // number of elements in send buffer
-        MPI_INT,                        // send data type
-        matrix,                         // receive buffer
-        matrix_size * matrix_size,    // number of elements in receive buffer
-        MPI_INT,                        // receive data type
-        MASTER,                         // rank of destination process
-        MPI_COMM_WORLD                  // communicator
-    );
+    // Gather the processed sub-matrices at master process. A lean master's
+    // results are already in place at the top of the matrix. Without the
+    // leaders, the master writes each process's rows as they arrive.
+    in_place = options.lean && my_padded_submatrix == matrix;
+    if (my_rank == MASTER && !use_hierarchy) {
+        writer_open = async_writer_open(&writer, output_filename) == 0;
+        if (writer_open)
+            LOG("Master process writes through %s\n",
+                async_writer_backend(&writer));
+        else
+            LOG("Failed to open output file %s.\n", output_filename);
+    }
+    timing_start(PHASE_COLLECT);
+    if (use_hierarchy) {
+        mpi_err = hierarchy_gather(&hierarchy, my_rank, my_result_rows,
+                                   matrix_size, matrix, in_place);
+        hierarchy_free(&hierarchy);
+    } else {
+        mpi_err = mpi_gather_write(my_result_rows, rows_per_node,
+                                   matrix_size, matrix, in_place,
+                                   writer_open ? &writer : NULL, MASTER,
+                                   MPI_COMM_WORLD);
+    }
     if (mpi_err != MPI_SUCCESS) {
         LOG("P%d experienced an error during Gather operation.\n", my_rank);
+        if (my_padded_submatrix != matrix)
+            safe_free(&my_padded_submatrix);
         if (my_rank == MASTER)
             safe_free(&matrix);
         safe_free(&my_processed_submatrix);
         MPI_Abort(MPI_COMM_WORLD, mpi_err);
     }
 
+    timing_stop(PHASE_COLLECT);
+
     safe_free(&my_processed_submatrix);
+    if (my_padded_submatrix != matrix)
+        safe_free(&my_padded_submatrix);
     LOG("P%d has freed their processed submatix\n", my_rank);
 
 
@@ -381,20 +1213,95 @@ int main(int argc, char **argv)
     if (my_rank == MASTER) {
         LOG("Master process has gathered the final matrix:\n%s",
             matrix_to_string(matrix, matrix_size, matrix_size));
-        int result = write_matrix_to_file(output_filename, matrix, matrix_size);
+        timing_start(PHASE_WRITE);
+        if (use_hierarchy)
+            result = write_matrix_to_file(output_filename, matrix,
+                                          matrix_size);
+        else
+            result = writer_open ? async_writer_close(&writer) : -1;
+        timing_stop(PHASE_WRITE);
         if (result == -1) {
             LOG("Failed to write matrix to output file %s.\n", output_filename);
+            status = EXIT_FAILURE;
         } else if (result == -2) {
             LOG("Failed to close the file after "
             "writing matrix to output file %s.\n",
             output_filename);
+            status = EXIT_FAILURE;
+        } else {
+            // The output is complete, so its checkpoints are no longer
+            // needed and it can be cached
+            if (options.checkpoint_dir)
+                checkpoint_remove(options.checkpoint_dir);
+            cache_result(&options, cache_key);
         }
         LOG("Master process wrote matrix to file\n");
         safe_free(&matrix);
     }
 
+    if (options.timing) {
+        timing_report(my_rank, MPI_COMM_WORLD);
+        allocator_report(my_rank, MPI_COMM_WORLD);
+    }
+
     
     LOG("P%d has finished\n", my_rank);
+    return status;
+}
+
+/**
+ * @brief Main function for the distributed matrix convolution application.
+ * 
+ * @param argc Argument count
+ * @param argv Argument values
+ * @return int Exit status
+ */
+int main(int argc, char **argv)
+{
+    int     my_rank,    // Rank of this process (node)
+            nproc,      // Number of processes (nodes)
+            parsed,     // Result of parsing the arguments
+            provided,   // Thread support provided by MPI
+            status;     // Exit status of the job(s)
+
+    options_t options;          // Parsed command line options
+
+
+    // Parse args first, as a progress thread needs full thread support
+    // from MPI; they are only reported once the ranks are known
+    parsed = parse_options(argc, argv, &options);
+
+    // Setup MPI (initialise, get rank and number of processes)
+    mpi_setup(&argc, &argv,
+              parsed == 0 && options.progress ? MPI_THREAD_MULTIPLE :
+                                                MPI_THREAD_FUNNELED,
+              &provided, &my_rank, &nproc);
+    LOG("Initialised P%d of %d\n", my_rank, nproc);
+
+    if (parsed == -1) {
+        if (my_rank == MASTER)
+            print_usage(argv[0]);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    if (options.progress && provided < MPI_THREAD_MULTIPLE) {
+        if (my_rank == MASTER)
+            fprintf(stderr, "MPI does not support MPI_THREAD_MULTIPLE; "
+                    "running without the progress thread\n");
+        options.progress = 0;
+    }
+    allocator_configure(options.huge_pages);
+    async_writer_configure(options.writer);
+
+
+    // Either serve jobs until told to stop, run a batch of small jobs, or
+    // run the one job given
+    if (options.socket_path)
+        status = service_run(&options, my_rank, nproc, run_job);
+    else if (options.batch_list)
+        status = batch_run(&options, my_rank, nproc, MPI_COMM_WORLD);
+    else
+        status = run_job(options, my_rank, nproc, NULL, -1);
+
     MPI_Finalize();
-    return EXIT_SUCCESS;
+    return status;
 }
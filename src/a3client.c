@@ -0,0 +1,80 @@
+/**
+ * @file    a3client.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Client for the persistent convolution service.
+ *
+ * Sends one request to an a3 started with --serve and prints the reply.
+ *
+ * Usage: a3client [socket] [input] [output] [depth] [kernel]
+ *        a3client [socket] shutdown
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_LINE 8192   /* Longest request or reply */
+
+/**
+ * @brief Send a request and print the service's reply.
+ *
+ * @param argc Argument count
+ * @param argv Argument values
+ * @return 0 if the service replied ok, 1 otherwise
+ */
+int main(int argc, char **argv)
+{
+    struct sockaddr_un address;
+    char line[MAX_LINE];
+    int length = 0;
+
+    if (argc != 3 && argc != 5 && argc != 6) {
+        fprintf(stderr, "Usage: %s [socket] [input] [output] [depth] "
+                "[kernel]\n       %s [socket] shutdown\n", argv[0], argv[0]);
+        return 1;
+    }
+    if (strlen(argv[1]) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", argv[1]);
+        return 1;
+    }
+
+    // The request is the remaining arguments on one line
+    for (int i = 2; i < argc && length < MAX_LINE; i++)
+        length += snprintf(line + length, MAX_LINE - length, "%s%s",
+                           argv[i], i + 1 < argc ? " " : "\n");
+    if (length >= MAX_LINE) {
+        fprintf(stderr, "Request too long\n");
+        return 1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, argv[1]);
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn == -1 ||
+        connect(conn, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        perror("Failed to connect to service");
+        return 1;
+    }
+    if (write(conn, line, length) != length) {
+        perror("Failed to send request");
+        close(conn);
+        return 1;
+    }
+    shutdown(conn, SHUT_WR);
+
+    // The reply is a single line
+    length = 0;
+    ssize_t got;
+    while (length < MAX_LINE - 1 &&
+           (got = read(conn, line + length, MAX_LINE - 1 - length)) > 0)
+        length += got;
+    close(conn);
+    line[length] = '\0';
+    fputs(line, stdout);
+    return strncmp(line, "ok", 2) == 0 ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+/**
+ * @file    a3local.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Matrix convolution in a single process, without MPI.
+ *
+ * Runs the path a3 takes for small jobs and jobs on one process (see
+ * local.h) but never initialises MPI, so it starts in a fraction of the
+ * time and needs no mpirun. It takes the same arguments as a3, with the
+ * options that only apply to distributed runs left out.
+ *
+ * Usage: a3local [options] [input] [output] [depth]
+ */
+
+#include "headers.h"
+
+/**
+ * @brief Print the usage message to stderr.
+ *
+ * @param program_name Name of the executable (argv[0]).
+ */
+static void print_local_usage(const char *program_name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [input] [output] [depth]\n"
+            "Options:\n"
+            "  -t, --timing  report the time spent in each phase\n"
+            "  --kernel=NAME[:TILE[:THREADS]]\n"
+            "                use this kernel (naive, clipped or blocked)\n"
+            "  --autotune    calibrate the kernels for this job and record\n"
+            "                the fastest in the profile\n"
+            "  --profile=FILE\n"
+            "                autotune profile (default %s)\n"
+            "  --huge-pages  back large matrix buffers with huge pages\n"
+            "  --writer=BACKEND\n"
+            "                issue output writes through io_uring, threads\n"
+            "                or auto (io_uring where available; default)\n"
+            "  --stats       gather the output's range, mean, histogram and\n"
+            "                checksum while computing it, and write them to\n"
+            "                output%s\n"
+            "  --sparse[=DENSITY]\n"
+            "                convolve matrices with at most DENSITY nonzeros\n"
+            "                (default %g) from their nonzeros\n"
+            "  --filter=NAME replace each cell by the min, max or median of\n"
+            "                its neighbourhood instead of the convolution\n",
+            program_name, AUTOTUNE_PROFILE, STATS_SUFFIX,
+            SPARSE_MAX_DENSITY);
+}
+
+int main(int argc, char **argv)
+{
+    options_t options;
+    int status;
+
+    // Everything else distributes the job or needs the processes of a3
+    if (parse_options(argc, argv, &options) == -1 || options.socket_path ||
+        !local_eligible(&options, 1, 0)) {
+        print_local_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    allocator_configure(options.huge_pages);
+    async_writer_configure(options.writer);
+
+    status = local_run(&options, NULL, -1);
+    if (options.timing)
+        timing_print();
+    return status;
+}
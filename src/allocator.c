@@ -0,0 +1,308 @@
+/**
+ * @file    allocator.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of the pooled matrix buffer allocator.
+ */
+
+#include "allocator.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define REPORT_ROOT 0   /* Rank that prints the allocation report */
+#define MIB (1024.0 * 1024.0)
+
+/**
+ * @brief A buffer handed out by, or pooled in, the allocator.
+ */
+typedef struct block {
+    void    *base;          /* Start of the buffer */
+    size_t  capacity;       /* Usable bytes */
+    int     mapped;         /* Mapped directly rather than from the heap */
+    int     huge;           /* Mapped with explicit huge pages */
+    int     clean;          /* Known to hold only zeros */
+    struct block *next;
+} block_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static block_t *live;           /* Buffers handed out */
+static block_t *pool;           /* Buffers kept for reuse, newest first */
+static int use_huge_pages;
+static alloc_stats_t stats;
+
+/**
+ * @brief Round a size up to a multiple of a power of two.
+ *
+ * @param bytes Size to round.
+ * @param multiple Power of two to round to.
+ * @return Rounded size.
+ */
+static size_t round_up(size_t bytes, size_t multiple)
+{
+    return (bytes + multiple - 1) & ~(multiple - 1);
+}
+
+/**
+ * @brief Give a block's memory back to the system and free the block.
+ *
+ * @param block Block to release.
+ */
+static void release_block(block_t *block)
+{
+    if (block->mapped)
+        munmap(block->base, block->capacity);
+    else
+        free(block->base);
+    free(block);
+}
+
+/**
+ * @brief Map a large buffer, with huge pages if configured.
+ *
+ * @param block Block to fill in; capacity must already be set.
+ * @return 0 on success, -1 if the mapping fails.
+ */
+static int map_block(block_t *block)
+{
+    void *base = MAP_FAILED;
+
+    block->mapped = 1;
+    block->clean = 1;   // Fresh anonymous mappings are zero filled
+#ifdef MAP_HUGETLB
+    if (use_huge_pages) {
+        base = mmap(NULL, block->capacity, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        block->huge = base != MAP_FAILED;
+    }
+#endif
+    if (base == MAP_FAILED) {
+        base = mmap(NULL, block->capacity, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return -1;
+#ifdef MADV_HUGEPAGE
+        // No reserved huge pages: ask for transparent ones instead
+        if (use_huge_pages)
+            madvise(base, block->capacity, MADV_HUGEPAGE);
+#endif
+    }
+    block->base = base;
+    return 0;
+}
+
+/**
+ * @brief Take the best fitting pooled block for a request, if any.
+ *
+ * A block is only reused if the request fills at least half of it.
+ *
+ * @param capacity Rounded size of the request.
+ * @return The block, unlinked from the pool, or NULL.
+ */
+static block_t *take_from_pool(size_t capacity)
+{
+    block_t **best = NULL;
+
+    for (block_t **link = &pool; *link; link = &(*link)->next) {
+        size_t size = (*link)->capacity;
+        if (size >= capacity && size / 2 <= capacity &&
+            (!best || size < (*best)->capacity))
+            best = link;
+    }
+    if (!best)
+        return NULL;
+
+    block_t *block = *best;
+    *best = block->next;
+    stats.pooled_bytes -= block->capacity;
+    return block;
+}
+
+/**
+ * @brief Allocate a new block from the system.
+ *
+ * @param capacity Rounded size of the block.
+ * @return The block, or NULL if out of memory.
+ */
+static block_t *new_block(size_t capacity)
+{
+    block_t *block = calloc(1, sizeof(*block));
+    if (!block)
+        return NULL;
+
+    block->capacity = capacity;
+    if (capacity >= ALLOC_MAP_THRESHOLD) {
+        if (map_block(block) == 0)
+            return block;
+    } else if (posix_memalign(&block->base, ALLOC_ALIGNMENT,
+                              capacity) == 0) {
+        return block;
+    }
+    free(block);
+    return NULL;
+}
+
+/**
+ * @brief Choose whether large buffers should use huge pages.
+ *
+ * @param huge_pages Non-zero to back large buffers with huge pages.
+ */
+void allocator_configure(int huge_pages)
+{
+    pthread_mutex_lock(&lock);
+    use_huge_pages = huge_pages;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Get an aligned buffer.
+ *
+ * @param bytes Size of the buffer.
+ * @param zero Non-zero if the buffer must be cleared.
+ * @return The buffer, or NULL if out of memory.
+ */
+void *allocator_get(size_t bytes, int zero)
+{
+    size_t capacity = round_up(bytes ? bytes : 1, ALLOC_ALIGNMENT);
+
+    pthread_mutex_lock(&lock);
+    if (capacity >= ALLOC_MAP_THRESHOLD)
+        capacity = round_up(capacity, use_huge_pages ? ALLOC_HUGE_PAGE :
+                                      (size_t) sysconf(_SC_PAGESIZE));
+    block_t *block = take_from_pool(capacity);
+    if (block) {
+        stats.pool_hits++;
+    } else {
+        block = new_block(capacity);
+        if (!block) {
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+        if (block->huge)
+            stats.huge_pages++;
+    }
+
+    if (zero && !block->clean) {
+        memset(block->base, 0, bytes);
+        stats.zeroed_bytes += bytes;
+    }
+    block->clean = 0;
+    block->next = live;
+    live = block;
+    stats.allocations++;
+    stats.live_bytes += block->capacity;
+    if (stats.live_bytes > stats.peak_bytes)
+        stats.peak_bytes = stats.live_bytes;
+    pthread_mutex_unlock(&lock);
+    return block->base;
+}
+
+/**
+ * @brief Return a buffer to the pool.
+ *
+ * @param buffer Buffer to return (may be NULL).
+ */
+void allocator_put(void *buffer)
+{
+    block_t **link;
+
+    if (!buffer)
+        return;
+
+    pthread_mutex_lock(&lock);
+    for (link = &live; *link && (*link)->base != buffer; link = &(*link)->next)
+        ;
+    if (!*link) {
+        pthread_mutex_unlock(&lock);
+        free(buffer);   // Not one of ours
+        return;
+    }
+    block_t *block = *link;
+    *link = block->next;
+    stats.live_bytes -= block->capacity;
+
+    // Make room by dropping the oldest pooled buffers
+    while (pool && stats.pooled_bytes + block->capacity > ALLOC_POOL_LIMIT) {
+        block_t **oldest = &pool;
+        while ((*oldest)->next)
+            oldest = &(*oldest)->next;
+        stats.pooled_bytes -= (*oldest)->capacity;
+        release_block(*oldest);
+        *oldest = NULL;
+    }
+    if (block->capacity > ALLOC_POOL_LIMIT) {
+        release_block(block);
+    } else {
+        block->next = pool;
+        pool = block;
+        stats.pooled_bytes += block->capacity;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Release every pooled buffer back to the system.
+ */
+void allocator_trim(void)
+{
+    pthread_mutex_lock(&lock);
+    while (pool) {
+        block_t *block = pool;
+        pool = block->next;
+        release_block(block);
+    }
+    stats.pooled_bytes = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Get this process's allocation statistics.
+ *
+ * @param [out] result Statistics so far.
+ */
+void allocator_stats(alloc_stats_t *result)
+{
+    pthread_mutex_lock(&lock);
+    *result = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Reduce the allocation statistics across processes and report them.
+ *
+ * @param rank Rank of the calling process in comm.
+ * @param comm Communicator of the processes to report on.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int allocator_report(int rank, MPI_Comm comm)
+{
+    alloc_stats_t mine;
+    double counts[4], sums[4], peak, max_peak;
+    int mpi_err;
+
+    allocator_stats(&mine);
+    counts[0] = mine.allocations;
+    counts[1] = mine.pool_hits;
+    counts[2] = mine.huge_pages;
+    counts[3] = mine.zeroed_bytes / MIB;
+    peak = mine.peak_bytes / MIB;
+
+    mpi_err = MPI_Reduce(counts, sums, 4, MPI_DOUBLE, MPI_SUM,
+                         REPORT_ROOT, comm);
+    if (mpi_err != MPI_SUCCESS)
+        return mpi_err;
+    mpi_err = MPI_Reduce(&peak, &max_peak, 1, MPI_DOUBLE, MPI_MAX,
+                         REPORT_ROOT, comm);
+    if (mpi_err != MPI_SUCCESS)
+        return mpi_err;
+
+    if (rank == REPORT_ROOT)
+        fprintf(stderr, "buffers: %.0f allocated, %.0f from pool, "
+                "%.0f on huge pages, %.1f MiB zeroed, "
+                "peak %.1f MiB per process\n",
+                sums[0], sums[1], sums[2], sums[3], max_peak);
+    return MPI_SUCCESS;
+}
@@ -0,0 +1,92 @@
+/**
+ * @file    allocator.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Aligned, pooled allocation of matrix buffers.
+ *
+ * All matrix buffers come from here (through allocate_matrix and
+ * safe_free). Buffers are aligned to at least ALLOC_ALIGNMENT bytes; large
+ * ones are mapped directly, page aligned, and can be backed by huge pages
+ * to cut TLB misses on big slabs. Released buffers are kept in a pool and
+ * handed out again to later requests of a similar size, so the phases of a
+ * run (and successive jobs in one process) do not keep going back to the
+ * kernel. Buffers are only zeroed when the caller asks for it and the
+ * memory is not already known to be zero.
+ */
+
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <stddef.h>
+#include <mpi.h>
+
+#define ALLOC_ALIGNMENT     64              /* Cache line and SIMD alignment */
+#define ALLOC_MAP_THRESHOLD (1L << 21)      /* Map buffers at least this big */
+#define ALLOC_HUGE_PAGE     (1L << 21)      /* Huge page size assumed */
+#define ALLOC_POOL_LIMIT    (256L << 20)    /* Most bytes kept for reuse */
+
+/**
+ * @brief Allocation statistics of this process.
+ */
+typedef struct {
+    long    allocations;    /* Buffers handed out */
+    long    pool_hits;      /* Buffers handed out again from the pool */
+    long    huge_pages;     /* Buffers mapped with explicit huge pages */
+    size_t  zeroed_bytes;   /* Bytes explicitly cleared */
+    size_t  live_bytes;     /* Bytes currently handed out */
+    size_t  peak_bytes;     /* Most bytes handed out at once */
+    size_t  pooled_bytes;   /* Bytes held in the pool */
+} alloc_stats_t;
+
+/**
+ * @brief Choose whether large buffers should use huge pages.
+ *
+ * Explicit huge pages (MAP_HUGETLB) are tried first, falling back to
+ * ordinary pages with a transparent huge page hint.
+ *
+ * @param huge_pages Non-zero to back large buffers with huge pages.
+ */
+void allocator_configure(int huge_pages);
+
+/**
+ * @brief Get an aligned buffer.
+ *
+ * @param bytes Size of the buffer.
+ * @param zero Non-zero if the buffer must be cleared.
+ * @return The buffer, or NULL if out of memory.
+ */
+void *allocator_get(size_t bytes, int zero);
+
+/**
+ * @brief Return a buffer to the pool.
+ *
+ * Buffers that did not come from allocator_get are passed to free().
+ *
+ * @param buffer Buffer to return (may be NULL).
+ */
+void allocator_put(void *buffer);
+
+/**
+ * @brief Release every pooled buffer back to the system.
+ */
+void allocator_trim(void);
+
+/**
+ * @brief Get this process's allocation statistics.
+ *
+ * @param [out] result Statistics so far.
+ */
+void allocator_stats(alloc_stats_t *result);
+
+/**
+ * @brief Reduce the allocation statistics across processes and report them.
+ *
+ * Collective over comm; the report is printed by rank 0.
+ *
+ * @param rank Rank of the calling process in comm.
+ * @param comm Communicator of the processes to report on.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int allocator_report(int rank, MPI_Comm comm);
+
+#endif /* ALLOCATOR_H */
@@ -0,0 +1,324 @@
+/**
+ * @file    approximate.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of the approximate convolution.
+ */
+
+#include "approximate.h"
+#include "headers.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * @brief What the exact kernel makes of one ring's cells.
+ */
+typedef struct {
+    double  weight;     /* Weight of the ring, 1 / (ring + 1) */
+    double  loss;       /* Mean fraction truncated from a weighted value */
+} ring_t;
+
+/**
+ * @brief One thread's share of the far rings of a band of rows.
+ */
+typedef struct {
+    const int64_t   *table;         /* Summed area table of the matrix */
+    const ring_t    *rings;         /* Each ring up to the depth */
+    const int       *outers;        /* Outermost ring of each band */
+    int             num_bands;
+    int             matrix_rows;
+    int             matrix_cols;
+    int             first_row;      /* First row of the share */
+    int             num_rows;       /* Rows in the share */
+    int             *output;        /* Results of the share's first row */
+} far_task_t;
+
+/**
+ * @brief Group the rings past the exact ones into bands.
+ *
+ * @param tolerance Largest relative spread of the weights in one band.
+ * @param depth Depth for convolution operation.
+ * @param [out] outers Outermost ring of each band, room for one per ring.
+ * @return Number of bands.
+ */
+static int plan_bands(double tolerance, int depth, int *outers)
+{
+    int num_bands = 0;
+
+    for (int inner = APPROXIMATE_NEAR_RINGS + 1; inner <= depth;) {
+        // 1 / (inner + 1) is within tolerance of 1 / (outer + 1)
+        int outer = (int) floor((inner + 1) * (1 + tolerance)) - 1;
+        if (outer < inner)
+            outer = inner;
+        if (outer > depth)
+            outer = depth;
+        outers[num_bands++] = outer;
+        inner = outer + 1;
+    }
+    return num_bands;
+}
+
+/**
+ * @brief Weigh each ring and measure what the exact kernel truncates.
+ *
+ * The loss of a ring is the mean fraction dropped from a sampled value
+ * times its weight, computed as the kernel does so that values a multiple
+ * of ring + 1 that round just below a whole number count too.
+ *
+ * @param matrix Matrix to sample values from.
+ * @param cells Number of cells in the matrix.
+ * @param depth Depth for convolution operation.
+ * @param [out] rings Weight and loss of each ring up to the depth.
+ */
+static void measure_rings(const int *matrix, size_t cells, int depth,
+                          ring_t *rings)
+{
+    size_t step = cells / APPROXIMATE_LOSS_SAMPLE;
+    if (step == 0)
+        step = 1;
+
+    for (int ring = 0; ring <= depth; ring++) {
+        double loss = 0;
+        size_t samples = 0;
+
+        rings[ring].weight = 1 / (double)(ring + 1);
+        for (size_t i = 0; i < cells; i += step, samples++) {
+            double value = matrix[i] * rings[ring].weight;
+            loss += value - floor(value);
+        }
+        rings[ring].loss = loss / samples;
+    }
+}
+
+/**
+ * @brief Sum a rectangle of the matrix from its summed area table.
+ *
+ * @param table Summed area table, (rows + 1) x (cols + 1).
+ * @param cols Number of columns in the matrix.
+ * @param first_row First row of the rectangle.
+ * @param last_row Last row of the rectangle.
+ * @param first_col First column of the rectangle.
+ * @param last_col Last column of the rectangle.
+ * @return Sum of the cells in the rectangle.
+ */
+static int64_t box_sum(const int64_t *table, int cols, int first_row,
+                       int last_row, int first_col, int last_col)
+{
+    size_t width = cols + 1;
+    const int64_t *top = table + first_row * width;
+    const int64_t *bottom = table + (last_row + 1) * width;
+    return bottom[last_col + 1] - bottom[first_col] -
+           top[last_col + 1] + top[first_col];
+}
+
+/**
+ * @brief Add the far rings of one thread's share of rows to its results.
+ *
+ * A band's sum is weighted by the mean weight of the cells it covers once
+ * clipped, which near the edges leans towards its inner rings.
+ *
+ * @param arg The far_task_t describing the share.
+ * @return NULL.
+ */
+static void* add_far_rings(void *arg)
+{
+    far_task_t *task = arg;
+    int rows = task->matrix_rows, cols = task->matrix_cols;
+
+    for (int row = task->first_row;
+         row < task->first_row + task->num_rows; row++) {
+        int *output_row = task->output +
+                          (size_t)(row - task->first_row) * cols;
+        for (int col = 0; col < cols; col++) {
+            int reach = APPROXIMATE_NEAR_RINGS;
+            int first_row = row - reach < 0 ? 0 : row - reach;
+            int last_row = row + reach >= rows ? rows - 1 : row + reach;
+            int first_col = col - reach < 0 ? 0 : col - reach;
+            int last_col = col + reach >= cols ? cols - 1 : col + reach;
+            int64_t inside = box_sum(task->table, cols, first_row, last_row,
+                                     first_col, last_col);
+            long count = (long)(last_row - first_row + 1) *
+                         (last_col - first_col + 1);
+            double far = 0;
+
+            for (int b = 0; b < task->num_bands; b++) {
+                long band_count = 0;
+                double weighted = 0, lost = 0;
+
+                // Count the cells of each ring left after clipping
+                for (reach++; reach <= task->outers[b]; reach++) {
+                    first_row = row - reach < 0 ? 0 : row - reach;
+                    last_row = row + reach >= rows ? rows - 1 : row + reach;
+                    first_col = col - reach < 0 ? 0 : col - reach;
+                    last_col = col + reach >= cols ? cols - 1 : col + reach;
+                    long ring_count = (long)(last_row - first_row + 1) *
+                                      (last_col - first_col + 1) -
+                                      count - band_count;
+                    weighted += ring_count * task->rings[reach].weight;
+                    lost += ring_count * task->rings[reach].loss;
+                    band_count += ring_count;
+                }
+                reach = task->outers[b];
+                if (band_count == 0)
+                    break;      // Clipped on every side; nothing further
+                int64_t total = box_sum(task->table, cols, first_row,
+                                        last_row, first_col, last_col);
+                far += (total - inside) * (weighted / band_count) - lost;
+                inside = total;
+                count += band_count;
+            }
+            output_row[col] += (int) lround(far);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Approximates the convolution of a band of rows.
+ *
+ * @param config Kernel configuration for the exact rings.
+ * @param tolerance Largest relative spread of the weights in one band.
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth for convolution operation.
+ * @param output Buffer of num_rows * matrix_cols cells for the results.
+ * @return 0 on success, -1 on failure.
+ */
+int approximate_rows(const kernel_config_t *config, double tolerance,
+                     int *matrix, int matrix_rows, int matrix_cols,
+                     int first_row, int num_rows, int depth, int *output)
+{
+    far_task_t tasks[MAX_KERNEL_THREADS];
+    pthread_t threads[MAX_KERNEL_THREADS];
+    size_t width = matrix_cols + 1;
+    int num_threads = config->threads, started;
+    int num_bands;
+
+    if (depth <= APPROXIMATE_NEAR_RINGS)
+        return convolve_rows_with(config, matrix, matrix_rows, matrix_cols,
+                                  first_row, num_rows, depth, output);
+
+    // The nearest rings exactly
+    if (convolve_rows_with(config, matrix, matrix_rows, matrix_cols,
+                           first_row, num_rows, APPROXIMATE_NEAR_RINGS,
+                           output) == -1)
+        return -1;
+
+    ring_t *rings = malloc((depth + 1) * sizeof(ring_t));
+    int *outers = malloc((depth + 1) * sizeof(int));
+    int64_t *table = allocator_get((matrix_rows + 1) * width *
+                                   sizeof(int64_t), 0);
+    if (!rings || !outers || !table) {
+        fprintf(stderr, "Failed to allocate the summed area table\n");
+        free(rings);
+        free(outers);
+        allocator_put(table);
+        return -1;
+    }
+    measure_rings(matrix, (size_t) matrix_rows * matrix_cols, depth, rings);
+    num_bands = plan_bands(tolerance, depth, outers);
+
+    // table[r][c] holds the sum of the cells above and left of (r, c)
+    for (int col = 0; col <= matrix_cols; col++)
+        table[col] = 0;
+    for (int row = 0; row < matrix_rows; row++) {
+        const int *line = matrix + (size_t) row * matrix_cols;
+        int64_t *above = table + row * width, *here = above + width;
+        int64_t across = 0;
+        here[0] = 0;
+        for (int col = 0; col < matrix_cols; col++) {
+            across += line[col];
+            here[col + 1] = above[col + 1] + across;
+        }
+    }
+
+    // The far rings, with the rows split between the threads
+    if (num_threads > num_rows)
+        num_threads = num_rows;
+    if (num_threads > MAX_KERNEL_THREADS)
+        num_threads = MAX_KERNEL_THREADS;
+    if (num_threads < 1)
+        num_threads = 1;
+    for (int t = 0; t < num_threads; t++) {
+        int start = num_rows * t / num_threads;
+        int end = num_rows * (t + 1) / num_threads;
+        tasks[t] = (far_task_t) {
+            table, rings, outers, num_bands, matrix_rows, matrix_cols,
+            first_row + start, end - start,
+            output + (size_t) start * matrix_cols
+        };
+    }
+    for (started = 1; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, add_far_rings,
+                           &tasks[started]) != 0) {
+            // The calling thread takes over the shares not started
+            for (int t = started; t < num_threads; t++)
+                add_far_rings(&tasks[t]);
+            break;
+        }
+    }
+    add_far_rings(&tasks[0]);
+    for (int t = 1; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    allocator_put(table);
+    free(rings);
+    free(outers);
+    return 0;
+}
+
+/**
+ * @brief Measure the error of approximate results against the exact kernel.
+ *
+ * @param my_rank Rank of the calling process in comm.
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the band that was processed.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth for convolution operation.
+ * @param output Approximate results of the band.
+ * @param comm Communicator of the processes; the master must be rank 0.
+ * @return MPI_SUCCESS, or an MPI error code.
+ */
+int approximate_check(int my_rank, int *matrix, int matrix_rows,
+                      int matrix_cols, int first_row, int num_rows, int depth,
+                      const int *output, MPI_Comm comm)
+{
+    double largest = 0, all_largest;
+    double totals[3] = {0, 0, 0};   // Cells, absolute error, exact values
+    double all_totals[3];
+    int mpi_err;
+
+    // Cells spread down the band, at scattered columns
+    for (int i = 0; num_rows > 0 && i < APPROXIMATE_CHECK_CELLS; i++) {
+        int row = first_row + (int)((long) i * num_rows /
+                                    APPROXIMATE_CHECK_CELLS);
+        int col = (int)((i * 2654435761u) % (unsigned) matrix_cols);
+        int exact = apply_convolution(row, col, matrix, matrix_rows,
+                                      matrix_cols, depth);
+        double error = fabs((double) output[(size_t)(row - first_row) *
+                                            matrix_cols + col] - exact);
+        if (error > largest)
+            largest = error;
+        totals[0]++;
+        totals[1] += error;
+        totals[2] += exact;
+    }
+
+    mpi_err = MPI_Reduce(&largest, &all_largest, 1, MPI_DOUBLE, MPI_MAX,
+                         MASTER, comm);
+    if (mpi_err == MPI_SUCCESS)
+        mpi_err = MPI_Reduce(totals, all_totals, 3, MPI_DOUBLE, MPI_SUM,
+                             MASTER, comm);
+    if (mpi_err == MPI_SUCCESS && my_rank == MASTER && all_totals[0] > 0)
+        fprintf(stderr, "Approximation error over %.0f sampled cells: "
+                "max %.0f, mean %.2f (mean value %.1f)\n",
+                all_totals[0], all_largest, all_totals[1] / all_totals[0],
+                all_totals[2] / all_totals[0]);
+    return mpi_err;
+}
@@ -0,0 +1,76 @@
+/**
+ * @file    approximate.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Approximate convolution for very large depths.
+ *
+ * Past the first few rings the 1/(ring + 1) weights change slowly, so the
+ * rings are grouped into bands over which the weight varies by at most the
+ * tolerance, and each band is taken as its sum times one weight. A summed
+ * area table of the slab gives any band's sum with four lookups whatever
+ * its size, so the cost of a cell grows with the number of bands, about
+ * log(depth) / tolerance, rather than with depth squared.
+ *
+ * The nearest APPROXIMATE_NEAR_RINGS rings are still computed exactly. The
+ * exact kernel truncates each neighbour's weighted value as it adds it, so
+ * each band is also reduced by the mean fraction lost, measured on a
+ * sample of the slab's values.
+ */
+
+#ifndef APPROXIMATE_H
+#define APPROXIMATE_H
+
+#include <mpi.h>
+#include "convolution.h"
+
+#define APPROXIMATE_TOLERANCE   0.05    /* Default spread of a band's weights */
+#define APPROXIMATE_MIN_DEPTH   256     /* Shallower depths are computed
+                                           exactly */
+#define APPROXIMATE_NEAR_RINGS  16      /* Rings always computed exactly */
+#define APPROXIMATE_LOSS_SAMPLE 4096    /* Values sampled for the truncation */
+#define APPROXIMATE_CHECK_CELLS 64      /* Cells per process checked exactly */
+
+/**
+ * @brief Approximates the convolution of a band of rows.
+ *
+ * Same contract as convolve_rows_with. The exact rings use the kernel
+ * configuration; the rest are split across config->threads threads.
+ *
+ * @param config Kernel configuration for the exact rings.
+ * @param tolerance Largest relative spread of the weights in one band.
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth for convolution operation.
+ * @param output Buffer of num_rows * matrix_cols cells for the results.
+ * @return 0 on success, -1 on failure.
+ */
+int approximate_rows(const kernel_config_t *config, double tolerance,
+                     int *matrix, int matrix_rows, int matrix_cols,
+                     int first_row, int num_rows, int depth, int *output);
+
+/**
+ * @brief Measure the error of approximate results against the exact kernel.
+ *
+ * Collective over comm. Each process recomputes APPROXIMATE_CHECK_CELLS of
+ * its cells exactly, and the master reports the largest and mean absolute
+ * error over all of them to stderr.
+ *
+ * @param my_rank Rank of the calling process in comm.
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the band that was processed.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth for convolution operation.
+ * @param output Approximate results of the band.
+ * @param comm Communicator of the processes; the master must be rank 0.
+ * @return MPI_SUCCESS, or an MPI error code.
+ */
+int approximate_check(int my_rank, int *matrix, int matrix_rows,
+                      int matrix_cols, int first_row, int num_rows, int depth,
+                      const int *output, MPI_Comm comm);
+
+#endif /* APPROXIMATE_H */
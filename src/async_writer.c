@@ -0,0 +1,427 @@
+/**
+ * @file    async_writer.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of the asynchronous file writer.
+ */
+
+#include "async_writer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int configured_backend = WRITER_AUTO;
+
+/**
+ * @brief Choose how later writers issue their writes.
+ *
+ * @param backend WRITER_AUTO, WRITER_IO_URING or WRITER_THREADS.
+ */
+void async_writer_configure(int backend)
+{
+    configured_backend = backend;
+}
+
+/**
+ * @brief Enter the ring, retrying when interrupted.
+ *
+ * @param writer Writer whose ring to enter.
+ * @param to_submit Number of new submissions.
+ * @param min_complete Number of completions to wait for.
+ * @return Number of submissions consumed, or -1 on failure.
+ */
+static int ring_enter(async_writer_t *writer, unsigned to_submit,
+                      unsigned min_complete)
+{
+    long result;
+
+    do {
+        result = syscall(__NR_io_uring_enter, writer->ring_fd, to_submit,
+                         min_complete,
+                         min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (result == -1 && errno == EINTR);
+    return (int) result;
+}
+
+/**
+ * @brief Submit the piece in a slot to the ring.
+ *
+ * @param writer Writer with an io_uring.
+ * @param slot Slot of the piece.
+ */
+static void ring_submit(async_writer_t *writer, int slot)
+{
+    const write_piece_t *piece = &writer->pieces[slot];
+    unsigned tail = *writer->sq_tail;
+    unsigned index = tail & *writer->sq_mask;
+    struct io_uring_sqe *sqe = &writer->sqes[index];
+
+    writer->iovecs[slot].iov_base = (void *) piece->data;
+    writer->iovecs[slot].iov_len = piece->bytes;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = writer->fd;
+    sqe->addr = (uintptr_t) &writer->iovecs[slot];
+    sqe->len = 1;
+    sqe->off = piece->offset;
+    sqe->user_data = slot;
+    writer->sq_array[index] = index;
+
+    // The kernel may read the entry once it sees the new tail
+    __atomic_store_n(writer->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (ring_enter(writer, 1, 0) != 1)
+        writer->failed = 1;
+}
+
+/**
+ * @brief Handle the ring's completed pieces, resubmitting the rest of any
+ *        short write.
+ *
+ * @param writer Writer with an io_uring.
+ * @param wait Whether to wait for at least one completion first.
+ */
+static void ring_reap(async_writer_t *writer, int wait)
+{
+    unsigned head, tail;
+
+    if (wait && ring_enter(writer, 0, 1) < 0) {
+        // Nothing more will complete, so give up on what is in flight
+        writer->failed = 1;
+        writer->in_flight = 0;
+        writer->num_free = ASYNC_QUEUE_DEPTH;
+        for (int s = 0; s < ASYNC_QUEUE_DEPTH; s++)
+            writer->free_slots[s] = s;
+        return;
+    }
+
+    head = *writer->cq_head;
+    tail = __atomic_load_n(writer->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe =
+            &writer->cqes[head & *writer->cq_mask];
+        int slot = (int) cqe->user_data;
+        write_piece_t *piece = &writer->pieces[slot];
+
+        if (cqe->res > 0 && (size_t) cqe->res < piece->bytes) {
+            piece->data += cqe->res;
+            piece->bytes -= cqe->res;
+            piece->offset += cqe->res;
+            ring_submit(writer, slot);
+            continue;
+        }
+        if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+            ring_submit(writer, slot);
+            continue;
+        }
+        if (cqe->res <= 0)
+            writer->failed = 1;
+        writer->free_slots[writer->num_free++] = slot;
+        writer->in_flight--;
+    }
+    __atomic_store_n(writer->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Unmap and close a writer's ring.
+ *
+ * @param writer Writer with an io_uring (possibly partly set up).
+ */
+static void ring_free(async_writer_t *writer)
+{
+    if (writer->sqes && writer->sqes != MAP_FAILED)
+        munmap(writer->sqes, writer->sqes_size);
+    if (writer->cq_map && writer->cq_map != MAP_FAILED &&
+        writer->cq_map != writer->sq_map)
+        munmap(writer->cq_map, writer->cq_map_size);
+    if (writer->sq_map && writer->sq_map != MAP_FAILED)
+        munmap(writer->sq_map, writer->sq_map_size);
+    if (writer->ring_fd != -1)
+        close(writer->ring_fd);
+    writer->ring_fd = -1;
+}
+
+/**
+ * @brief Set up an io_uring with the raw system calls.
+ *
+ * @param writer Writer to set the ring up for.
+ * @return 0 on success, -1 if io_uring is unavailable.
+ */
+static int ring_setup(async_writer_t *writer)
+{
+    struct io_uring_params params;
+    char *sq, *cq;
+
+    memset(&params, 0, sizeof(params));
+    writer->ring_fd = syscall(__NR_io_uring_setup, ASYNC_QUEUE_DEPTH,
+                              &params);
+    if (writer->ring_fd < 0) {
+        writer->ring_fd = -1;
+        return -1;
+    }
+
+    // Newer kernels map both rings together
+    writer->sq_map_size = params.sq_off.array +
+                          params.sq_entries * sizeof(unsigned);
+    writer->cq_map_size = params.cq_off.cqes +
+                          params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (writer->cq_map_size > writer->sq_map_size)
+            writer->sq_map_size = writer->cq_map_size;
+        writer->cq_map_size = writer->sq_map_size;
+    }
+    writer->sq_map = mmap(NULL, writer->sq_map_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, writer->ring_fd,
+                          IORING_OFF_SQ_RING);
+    if (writer->sq_map == MAP_FAILED) {
+        ring_free(writer);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        writer->cq_map = writer->sq_map;
+    else
+        writer->cq_map = mmap(NULL, writer->cq_map_size,
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, writer->ring_fd,
+                              IORING_OFF_CQ_RING);
+    writer->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    writer->sqes = mmap(NULL, writer->sqes_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, writer->ring_fd,
+                        IORING_OFF_SQES);
+    if (writer->cq_map == MAP_FAILED || writer->sqes == MAP_FAILED) {
+        ring_free(writer);
+        return -1;
+    }
+
+    sq = writer->sq_map;
+    cq = writer->cq_map;
+    writer->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    writer->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    writer->sq_array = (unsigned *) (sq + params.sq_off.array);
+    writer->cq_head = (unsigned *) (cq + params.cq_off.head);
+    writer->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    writer->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    writer->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    writer->num_free = ASYNC_QUEUE_DEPTH;
+    for (int s = 0; s < ASYNC_QUEUE_DEPTH; s++)
+        writer->free_slots[s] = s;
+    return 0;
+}
+
+/**
+ * @brief Write queued pieces with pwrite until the writer is closed.
+ *
+ * @param arg The writer.
+ * @return NULL.
+ */
+static void *write_thread(void *arg)
+{
+    async_writer_t *writer = arg;
+    write_piece_t piece;
+    ssize_t written;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (!writer->queued && !writer->stopping)
+            pthread_cond_wait(&writer->work, &writer->lock);
+        if (!writer->queued)
+            break;
+        piece = writer->pieces[writer->queue_head];
+        writer->queue_head = (writer->queue_head + 1) % ASYNC_QUEUE_DEPTH;
+        writer->queued--;
+        pthread_mutex_unlock(&writer->lock);
+
+        while (piece.bytes > 0) {
+            written = pwrite(writer->fd, piece.data, piece.bytes,
+                             piece.offset);
+            if (written == -1 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                break;
+            piece.data += written;
+            piece.bytes -= written;
+            piece.offset += written;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        if (piece.bytes > 0)
+            writer->failed = 1;
+        writer->in_flight--;
+        pthread_cond_signal(&writer->done);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+/**
+ * @brief Stop a writer's threads once their queue is empty.
+ *
+ * @param writer Writer with pwrite threads.
+ */
+static void threads_stop(async_writer_t *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = 1;
+    pthread_cond_broadcast(&writer->work);
+    pthread_mutex_unlock(&writer->lock);
+    for (int t = 0; t < writer->num_threads; t++)
+        pthread_join(writer->threads[t], NULL);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->work);
+    pthread_cond_destroy(&writer->done);
+}
+
+/**
+ * @brief Start the pwrite threads.
+ *
+ * @param writer Writer to start the threads for.
+ * @return 0 on success, -1 if no thread could be started.
+ */
+static int threads_start(async_writer_t *writer)
+{
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->work, NULL);
+    pthread_cond_init(&writer->done, NULL);
+    for (int t = 0; t < ASYNC_WRITE_THREADS; t++) {
+        if (pthread_create(&writer->threads[t], NULL, write_thread,
+                           writer) != 0)
+            break;
+        writer->num_threads++;
+    }
+    if (writer->num_threads == 0) {
+        threads_stop(writer);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Create or truncate a file for writing.
+ *
+ * @param [out] writer Writer to set up.
+ * @param filename Name of the file.
+ * @return 0 on success, -1 if the file or the chosen backend could not be
+ *         set up.
+ */
+int async_writer_open(async_writer_t *writer, const char *filename)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->ring_fd = -1;
+    writer->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC,
+                      S_IRUSR | S_IWUSR);
+    if (writer->fd == -1)
+        return -1;
+
+    if (configured_backend != WRITER_THREADS && ring_setup(writer) == 0) {
+        writer->backend = WRITER_IO_URING;
+        return 0;
+    }
+    if (configured_backend != WRITER_IO_URING && threads_start(writer) == 0) {
+        writer->backend = WRITER_THREADS;
+        return 0;
+    }
+    close(writer->fd);
+    return -1;
+}
+
+/**
+ * @brief Queue one piece, waiting while the queue is full.
+ *
+ * @param writer Open writer.
+ * @param data Bytes to write.
+ * @param bytes Number of bytes, at most ASYNC_WRITE_CHUNK.
+ * @param offset Offset in the file.
+ */
+static void queue_piece(async_writer_t *writer, const char *data,
+                        size_t bytes, off_t offset)
+{
+    write_piece_t piece = { data, bytes, offset };
+    int slot;
+
+    if (writer->backend == WRITER_IO_URING) {
+        while (writer->num_free == 0)
+            ring_reap(writer, 1);
+        slot = writer->free_slots[--writer->num_free];
+        writer->pieces[slot] = piece;
+        writer->in_flight++;
+        ring_submit(writer, slot);
+        ring_reap(writer, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->in_flight == ASYNC_QUEUE_DEPTH)
+        pthread_cond_wait(&writer->done, &writer->lock);
+    slot = (writer->queue_head + writer->queued) % ASYNC_QUEUE_DEPTH;
+    writer->pieces[slot] = piece;
+    writer->queued++;
+    writer->in_flight++;
+    pthread_cond_signal(&writer->work);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/**
+ * @brief Queue a block to be written.
+ *
+ * @param writer Open writer.
+ * @param data Bytes to write.
+ * @param bytes Number of bytes.
+ * @param offset Offset in the file.
+ * @return 0, or -1 if a write has already failed.
+ */
+int async_writer_submit(async_writer_t *writer, const void *data,
+                        size_t bytes, off_t offset)
+{
+    const char *next = data;
+
+    // Pieces end on chunk boundaries, so all but the ends are whole chunks
+    while (bytes > 0 && !writer->failed) {
+        size_t piece = ASYNC_WRITE_CHUNK - offset % ASYNC_WRITE_CHUNK;
+        if (piece > bytes)
+            piece = bytes;
+        queue_piece(writer, next, piece, offset);
+        next += piece;
+        bytes -= piece;
+        offset += piece;
+    }
+    return writer->failed ? -1 : 0;
+}
+
+/**
+ * @brief Wait for every queued write to finish, then close the file.
+ *
+ * @param writer Open writer.
+ * @return 0 on success,
+ *        -1 if a write failed,
+ *        -2 if the file could not be closed.
+ */
+int async_writer_close(async_writer_t *writer)
+{
+    if (writer->backend == WRITER_IO_URING) {
+        while (writer->in_flight > 0)
+            ring_reap(writer, 1);
+        ring_free(writer);
+    } else {
+        threads_stop(writer);
+    }
+    if (close(writer->fd) == -1)
+        return -2;
+    return writer->failed ? -1 : 0;
+}
+
+/**
+ * @brief Name the backend a writer uses.
+ *
+ * @param writer Open writer.
+ * @return "io_uring" or "threads".
+ */
+const char *async_writer_backend(const async_writer_t *writer)
+{
+    return writer->backend == WRITER_IO_URING ? "io_uring" : "threads";
+}
@@ -0,0 +1,136 @@
+/**
+ * @file    async_writer.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Asynchronous writer of large blocks to a file.
+ *
+ * Writes are queued and return at once; the caller goes on (for instance
+ * receiving the next slab) while earlier ones reach the file. Each write is
+ * split into pieces of at most ASYNC_WRITE_CHUNK bytes, cut at multiples of
+ * ASYNC_WRITE_CHUNK in the file, with up to ASYNC_QUEUE_DEPTH pieces in
+ * flight.
+ *
+ * Pieces are submitted through io_uring, set up with the raw system calls,
+ * where the kernel allows it. Otherwise a small pool of threads issues them
+ * with pwrite.
+ */
+
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define ASYNC_WRITE_CHUNK   (1L << 20)  /* Most bytes per write, and their
+                                           alignment in the file */
+#define ASYNC_QUEUE_DEPTH   32          /* Most writes in flight */
+#define ASYNC_WRITE_THREADS 4           /* Threads of the pwrite fallback */
+
+/**
+ * @brief Ways of issuing the writes.
+ */
+enum {
+    WRITER_AUTO,        /* io_uring where available, else threads */
+    WRITER_IO_URING,    /* io_uring only */
+    WRITER_THREADS      /* Threads calling pwrite */
+};
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * @brief One piece of a write.
+ */
+typedef struct {
+    const char  *data;      /* Bytes still to write */
+    size_t      bytes;      /* Number of bytes still to write */
+    off_t       offset;     /* Offset in the file */
+} write_piece_t;
+
+/**
+ * @brief An open file and the writes queued to it.
+ */
+typedef struct {
+    int         fd;             /* File written */
+    int         backend;        /* WRITER_IO_URING or WRITER_THREADS */
+    int         failed;         /* Some write has failed */
+    int         in_flight;      /* Pieces submitted and not yet done */
+    write_piece_t pieces[ASYNC_QUEUE_DEPTH];
+
+    // io_uring
+    int         ring_fd;        /* Ring, or -1 */
+    unsigned    *sq_tail, *sq_mask, *sq_array;
+    unsigned    *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void        *sq_map, *cq_map;
+    size_t      sq_map_size, cq_map_size, sqes_size;
+    struct iovec iovecs[ASYNC_QUEUE_DEPTH];
+    int         free_slots[ASYNC_QUEUE_DEPTH];
+    int         num_free;
+
+    // pwrite threads
+    pthread_t   threads[ASYNC_WRITE_THREADS];
+    int         num_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;       /* Signalled when a piece is queued */
+    pthread_cond_t  done;       /* Signalled when a piece is written */
+    int         queue_head;     /* Oldest queued piece */
+    int         queued;         /* Pieces queued and not yet taken */
+    int         stopping;       /* Threads should exit */
+} async_writer_t;
+
+/**
+ * @brief Choose how later writers issue their writes.
+ *
+ * @param backend WRITER_AUTO, WRITER_IO_URING or WRITER_THREADS.
+ */
+void async_writer_configure(int backend);
+
+/**
+ * @brief Create or truncate a file for writing.
+ *
+ * @param [out] writer Writer to set up.
+ * @param filename Name of the file.
+ * @return 0 on success, -1 if the file or the chosen backend could not be
+ *         set up.
+ */
+int async_writer_open(async_writer_t *writer, const char *filename);
+
+/**
+ * @brief Queue a block to be written.
+ *
+ * Returns once the block's pieces are all submitted, waiting only while
+ * ASYNC_QUEUE_DEPTH pieces are in flight. The data must not change or be
+ * freed until the writer is closed.
+ *
+ * @param writer Open writer.
+ * @param data Bytes to write.
+ * @param bytes Number of bytes.
+ * @param offset Offset in the file.
+ * @return 0, or -1 if a write has already failed.
+ */
+int async_writer_submit(async_writer_t *writer, const void *data,
+                        size_t bytes, off_t offset);
+
+/**
+ * @brief Wait for every queued write to finish, then close the file.
+ *
+ * @param writer Open writer.
+ * @return 0 on success,
+ *        -1 if a write failed,
+ *        -2 if the file could not be closed.
+ */
+int async_writer_close(async_writer_t *writer);
+
+/**
+ * @brief Name the backend a writer uses.
+ *
+ * @param writer Open writer.
+ * @return "io_uring" or "threads".
+ */
+const char *async_writer_backend(const async_writer_t *writer);
+
+#endif /* ASYNC_WRITER_H */
@@ -0,0 +1,327 @@
+/**
+ * @file    autotune.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of kernel calibration and profile handling.
+ */
+
+#include "autotune.h"
+#include "allocator.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_LINE        512     /* Longest profile line */
+#define MAX_HOSTNAME    256     /* Longest host name */
+#define MAX_SPEC        64      /* Longest kernel specification */
+#define RANDOM_RANGE    2147    /* Synthetic values span mkRandomMatrix's */
+
+static const int tile_candidates[] = {32, 64, 128, 256};
+
+/**
+ * @brief Get a monotonic timestamp in seconds.
+ *
+ * @return Current time in seconds.
+ */
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Round a job parameter up to the power of two bucket it falls in.
+ *
+ * @param value Parameter value.
+ * @return Smallest power of two not less than value (at least 1).
+ */
+static int bucket(int value)
+{
+    int result = 1;
+    while (result < value && result < INT_MAX / 2)
+        result *= 2;
+    return result;
+}
+
+/**
+ * @brief Distance between two buckets, in powers of two.
+ *
+ * @param a First bucket.
+ * @param b Second bucket.
+ * @return Number of doublings separating the buckets.
+ */
+static int bucket_distance(int a, int b)
+{
+    int distance = 0;
+    while (a < b) { a *= 2; distance++; }
+    while (b < a) { b *= 2; distance++; }
+    return distance;
+}
+
+/**
+ * @brief Time one configuration on the synthetic slab.
+ *
+ * @param config Configuration to time.
+ * @param slab Synthetic padded slab.
+ * @param slab_rows Rows in the slab.
+ * @param cols Columns in the slab.
+ * @param top Padding rows above the sample rows.
+ * @param rows Sample rows to compute.
+ * @param depth Depth of the convolution.
+ * @param output Output buffer for the sample rows.
+ * @return Best time in seconds over the trials, or -1 on failure.
+ */
+static double time_config(const kernel_config_t *config, int *slab,
+                          int slab_rows, int cols, int top, int rows,
+                          int depth, int *output)
+{
+    double best = -1;
+    for (int trial = 0; trial < AUTOTUNE_REPEATS; trial++) {
+        double started = now_seconds();
+        if (convolve_rows_with(config, slab, slab_rows, cols, top, rows,
+                               depth, output) == -1)
+            return -1;
+        double elapsed = now_seconds() - started;
+        if (best < 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+/**
+ * @brief Time every candidate configuration and return the fastest.
+ *
+ * @param matrix_size Number of columns of the slab.
+ * @param rows Number of working rows per process.
+ * @param depth Depth of the convolution.
+ * @param max_threads Most threads a process may use.
+ * @param [out] best Fastest configuration found.
+ * @param [out] ns_per_cell Time per output cell of the fastest configuration.
+ * @return 0 on success, -1 on failure.
+ */
+int autotune_calibrate(int matrix_size, int rows, int depth, int max_threads,
+                       kernel_config_t *best, double *ns_per_cell)
+{
+    long neighbours = (2L * depth + 1) * (2L * depth + 1);
+    long sample_rows = AUTOTUNE_CELL_BUDGET / (matrix_size * neighbours);
+    double best_time = -1;
+
+    // Trial on just enough rows to fill the budget, padded on both sides
+    if (sample_rows < 1)
+        sample_rows = 1;
+    if (sample_rows > rows)
+        sample_rows = rows;
+    int slab_rows = sample_rows + 2 * depth;
+    int *slab = allocator_get((size_t) slab_rows * matrix_size * sizeof(int),
+                              0);
+    int *output = allocator_get((size_t) sample_rows * matrix_size
+                                * sizeof(int), 0);
+    if (!slab || !output) {
+        fprintf(stderr, "Failed to allocate calibration slab\n");
+        allocator_put(slab);
+        allocator_put(output);
+        return -1;
+    }
+    for (long i = 0; i < (long) slab_rows * matrix_size; i++)
+        slab[i] = rand() % RANDOM_RANGE;
+
+    kernel_config_t candidate = {KERNEL_NAIVE, 0, 1};
+    for (int kernel = 0; kernel < NUM_KERNELS; kernel++) {
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            int num_tiles = kernel == KERNEL_BLOCKED ?
+                sizeof(tile_candidates) / sizeof(tile_candidates[0]) : 1;
+            for (int t = 0; t < num_tiles; t++) {
+                candidate.kernel = kernel;
+                candidate.threads = threads;
+                candidate.tile_cols = kernel == KERNEL_BLOCKED ?
+                                      tile_candidates[t] : 0;
+                if (candidate.tile_cols >= matrix_size)
+                    continue;   // Same as clipped
+
+                double elapsed = time_config(&candidate, slab, slab_rows,
+                                             matrix_size, depth, sample_rows,
+                                             depth, output);
+                if (elapsed < 0) {
+                    allocator_put(slab);
+                    allocator_put(output);
+                    return -1;
+                }
+                if (best_time < 0 || elapsed < best_time) {
+                    best_time = elapsed;
+                    *best = candidate;
+                }
+            }
+            if (kernel == KERNEL_NAIVE)
+                break;  // The naive kernel is the single-threaded baseline
+        }
+    }
+
+    *ns_per_cell = best_time * 1e9 / (sample_rows * matrix_size);
+    allocator_put(slab);
+    allocator_put(output);
+    return 0;
+}
+
+/**
+ * @brief Look up the configuration recorded for the closest job shape.
+ *
+ * @param path Profile file.
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param nproc Number of processes.
+ * @param [out] config Recorded configuration.
+ * @return 0 if found, -1 if the profile has no entry for this host.
+ */
+int autotune_load(const char *path, int matrix_size, int depth, int nproc,
+                  kernel_config_t *config)
+{
+    char line[MAX_LINE], host[MAX_HOSTNAME], line_host[MAX_HOSTNAME];
+    char spec[MAX_SPEC];
+    int size_bucket, depth_bucket, line_nproc, best_distance = -1;
+    double ns;
+
+    FILE *profile = fopen(path, "r");
+    if (!profile)
+        return -1;
+    if (gethostname(host, sizeof(host)) != 0)
+        host[0] = '\0';
+    host[sizeof(host) - 1] = '\0';
+
+    while (fgets(line, sizeof(line), profile)) {
+        kernel_config_t candidate;
+        if (line[0] == '#' ||
+            sscanf(line, "%255s %d %d %d %63s %lf", line_host, &size_bucket,
+                   &depth_bucket, &line_nproc, spec, &ns) != 6 ||
+            strcmp(line_host, host) != 0 ||
+            kernel_config_from_string(spec, &candidate) == -1)
+            continue;
+
+        int distance = bucket_distance(size_bucket, bucket(matrix_size)) +
+                       bucket_distance(depth_bucket, bucket(depth)) +
+                       bucket_distance(line_nproc, nproc);
+        if (best_distance < 0 || distance < best_distance) {
+            best_distance = distance;
+            *config = candidate;
+        }
+    }
+
+    fclose(profile);
+    return best_distance < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Record a configuration for a job shape, replacing any older one.
+ *
+ * @param path Profile file.
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param nproc Number of processes.
+ * @param config Configuration to record.
+ * @param ns_per_cell Measured time per output cell.
+ * @return 0 on success, -1 on failure.
+ */
+int autotune_save(const char *path, int matrix_size, int depth, int nproc,
+                  const kernel_config_t *config, double ns_per_cell)
+{
+    char line[MAX_LINE], host[MAX_HOSTNAME], line_host[MAX_HOSTNAME];
+    char spec[MAX_SPEC], temp_path[PATH_MAX];
+    int size_bucket, depth_bucket, line_nproc;
+
+    if (gethostname(host, sizeof(host)) != 0)
+        host[0] = '\0';
+    host[sizeof(host) - 1] = '\0';
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE *updated = fopen(temp_path, "w");
+    if (!updated) {
+        perror("Failed to write autotune profile");
+        return -1;
+    }
+    fprintf(updated, "# host size_bucket depth_bucket nproc "
+                     "kernel:tile:threads ns_per_cell\n");
+
+    // Copy every other entry across, dropping this shape's old entry
+    FILE *profile = fopen(path, "r");
+    if (profile) {
+        while (fgets(line, sizeof(line), profile)) {
+            if (line[0] == '#')
+                continue;
+            if (sscanf(line, "%255s %d %d %d", line_host, &size_bucket,
+                       &depth_bucket, &line_nproc) == 4 &&
+                strcmp(line_host, host) == 0 &&
+                size_bucket == bucket(matrix_size) &&
+                depth_bucket == bucket(depth) &&
+                line_nproc == nproc)
+                continue;
+            fputs(line, updated);
+        }
+        fclose(profile);
+    }
+
+    fprintf(updated, "%s %d %d %d %s %.3f\n", host, bucket(matrix_size),
+            bucket(depth), nproc,
+            kernel_config_to_string(config, spec, sizeof(spec)), ns_per_cell);
+    if (fclose(updated) != 0 || rename(temp_path, path) != 0) {
+        perror("Failed to update autotune profile");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Choose the kernel configuration for a job and report the choice.
+ *
+ * @param override Kernel specification given by the user, or NULL.
+ * @param tune Run calibration for this job.
+ * @param profile Profile file.
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param nproc Number of processes.
+ * @param rows Number of working rows per process.
+ * @param max_threads Most threads a process may use.
+ * @param [out] config Chosen configuration.
+ * @return 0 on success, -1 if the override is invalid or calibration fails.
+ */
+int autotune_select(const char *override, int tune, const char *profile,
+                    int matrix_size, int depth, int nproc, int rows,
+                    int max_threads, kernel_config_t *config)
+{
+    char spec[MAX_SPEC];
+    double ns_per_cell;
+
+    if (override) {
+        if (kernel_config_from_string(override, config) == -1) {
+            fprintf(stderr, "Invalid kernel specification: %s\n", override);
+            return -1;
+        }
+        fprintf(stderr, "Kernel %s (override)\n",
+                kernel_config_to_string(config, spec, sizeof(spec)));
+    } else if (tune) {
+        if (autotune_calibrate(matrix_size, rows, depth, max_threads,
+                               config, &ns_per_cell) == -1)
+            return -1;
+        fprintf(stderr, "Kernel %s (calibrated, %.3f ns/cell)\n",
+                kernel_config_to_string(config, spec, sizeof(spec)),
+                ns_per_cell);
+        if (autotune_save(profile, matrix_size, depth, nproc,
+                          config, ns_per_cell) == 0)
+            fprintf(stderr, "Recorded in profile %s\n", profile);
+    } else if (autotune_load(profile, matrix_size, depth, nproc,
+                             config) == 0) {
+        fprintf(stderr, "Kernel %s (from profile %s)\n",
+                kernel_config_to_string(config, spec, sizeof(spec)), profile);
+    } else {
+        *config = (kernel_config_t) {KERNEL_CLIPPED, 0, 1};
+        fprintf(stderr, "Kernel %s (default)\n",
+                kernel_config_to_string(config, spec, sizeof(spec)));
+    }
+
+    // A recorded thread count may not suit this job's process placement
+    if (config->threads > max_threads && !override)
+        config->threads = max_threads;
+    return 0;
+}
@@ -0,0 +1,89 @@
+/**
+ * @file    autotune.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Selection of the fastest convolution kernel configuration.
+ *
+ * The best kernel, tile size and thread count depend on the matrix size,
+ * the depth, the number of processes and the machine. Calibration runs
+ * each candidate configuration on a synthetic slab and records the winner
+ * in a plain text profile, one line per host and job shape:
+ *
+ *     host size_bucket depth_bucket nproc kernel:tile:threads ns_per_cell
+ *
+ * Later runs look up the closest recorded shape for their host.
+ */
+
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include "convolution.h"
+
+#define AUTOTUNE_PROFILE     "a3.profile"   /* Default profile file */
+#define AUTOTUNE_CELL_BUDGET 20000000       /* Neighbour visits per trial */
+#define AUTOTUNE_REPEATS     2              /* Trials per candidate */
+
+/**
+ * @brief Time every candidate configuration and return the fastest.
+ *
+ * @param matrix_size Number of columns of the slab.
+ * @param rows Number of working rows per process.
+ * @param depth Depth of the convolution.
+ * @param max_threads Most threads a process may use.
+ * @param [out] best Fastest configuration found.
+ * @param [out] ns_per_cell Time per output cell of the fastest configuration.
+ * @return 0 on success, -1 on failure.
+ */
+int autotune_calibrate(int matrix_size, int rows, int depth, int max_threads,
+                       kernel_config_t *best, double *ns_per_cell);
+
+/**
+ * @brief Look up the configuration recorded for the closest job shape.
+ *
+ * @param path Profile file.
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param nproc Number of processes.
+ * @param [out] config Recorded configuration.
+ * @return 0 if found, -1 if the profile has no entry for this host.
+ */
+int autotune_load(const char *path, int matrix_size, int depth, int nproc,
+                  kernel_config_t *config);
+
+/**
+ * @brief Record a configuration for a job shape, replacing any older one.
+ *
+ * @param path Profile file.
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param nproc Number of processes.
+ * @param config Configuration to record.
+ * @param ns_per_cell Measured time per output cell.
+ * @return 0 on success, -1 on failure.
+ */
+int autotune_save(const char *path, int matrix_size, int depth, int nproc,
+                  const kernel_config_t *config, double ns_per_cell);
+
+/**
+ * @brief Choose the kernel configuration for a job and report the choice.
+ *
+ * An explicit override wins; otherwise calibration is run (and recorded)
+ * if requested, else the profile is consulted, else the single-threaded
+ * clipped kernel is used.
+ *
+ * @param override Kernel specification given by the user, or NULL.
+ * @param tune Run calibration for this job.
+ * @param profile Profile file.
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param nproc Number of processes.
+ * @param rows Number of working rows per process.
+ * @param max_threads Most threads a process may use.
+ * @param [out] config Chosen configuration.
+ * @return 0 on success, -1 if the override is invalid or calibration fails.
+ */
+int autotune_select(const char *override, int tune, const char *profile,
+                    int matrix_size, int depth, int nproc, int rows,
+                    int max_threads, kernel_config_t *config);
+
+#endif /* AUTOTUNE_H */
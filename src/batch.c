@@ -0,0 +1,237 @@
+/**
+ * @file    batch.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of batches of small matrices.
+ */
+
+#include "batch.h"
+#include "headers.h"
+#include <limits.h>
+#include <string.h>
+
+#define MAX_NAME_FORMAT "%4095s %4095s"     /* A job's line, within PATH_MAX */
+
+/**
+ * @brief One job of a batch.
+ */
+typedef struct {
+    char    *input;     /* Filename of the input matrix */
+    char    *output;    /* Filename of the output matrix */
+    int     *matrix;    /* Input once read (or NULL) */
+    int     size;       /* Size of the input (0 until read) */
+} batch_job_t;
+
+/**
+ * @brief Read this process's jobs from a batch list.
+ *
+ * @param filename Name of the list.
+ * @param my_rank Rank of the calling process.
+ * @param nproc Number of processes.
+ * @param [out] jobs This process's jobs, allocated here.
+ * @param [out] num_jobs Number of this process's jobs.
+ * @param [out] total Number of jobs in the list.
+ * @return 0 on success, -1 if the list could not be read.
+ */
+static int read_list(const char *filename, int my_rank, int nproc,
+                     batch_job_t **jobs, int *num_jobs, int *total)
+{
+    char input[PATH_MAX], output[PATH_MAX];
+    FILE *file = fopen(filename, "r");
+    int capacity = 0, fields;
+
+    *jobs = NULL;
+    *num_jobs = *total = 0;
+    if (!file)
+        return -1;
+    while ((fields = fscanf(file, MAX_NAME_FORMAT, input, output)) == 2) {
+        // Jobs are dealt out in turn
+        if ((*total)++ % nproc != my_rank)
+            continue;
+        if (*num_jobs == capacity) {
+            batch_job_t *grown;
+            capacity = capacity ? 2 * capacity : BATCH_GROUP;
+            grown = realloc(*jobs, capacity * sizeof(batch_job_t));
+            if (!grown)
+                break;
+            *jobs = grown;
+        }
+        (*jobs)[*num_jobs] = (batch_job_t) {
+            strdup(input), strdup(output), NULL, 0
+        };
+        if (!(*jobs)[*num_jobs].input || !(*jobs)[*num_jobs].output) {
+            free((*jobs)[*num_jobs].input);
+            free((*jobs)[*num_jobs].output);
+            break;
+        }
+        (*num_jobs)++;
+    }
+    fclose(file);
+    return fields == EOF ? 0 : -1;
+}
+
+/**
+ * @brief Order jobs by the size of their input, failed reads first.
+ *
+ * @param a First job.
+ * @param b Second job.
+ * @return Negative, zero or positive as a's size is below, equal to or
+ *         above b's.
+ */
+static int compare_sizes(const void *a, const void *b)
+{
+    int x = ((const batch_job_t*) a)->size, y = ((const batch_job_t*) b)->size;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Convolve and write a run of jobs whose inputs are the same size.
+ *
+ * @param jobs The jobs, with their inputs read.
+ * @param count Number of jobs.
+ * @param depth Depth of the convolution.
+ * @param config Kernel configuration.
+ * @return Number of jobs that failed.
+ */
+static int run_same_size(batch_job_t *jobs, int count, int depth,
+                         const kernel_config_t *config)
+{
+    int size = jobs[0].size, failures = 0, result;
+    int **inputs = malloc(count * sizeof(int*));
+    int **outputs = calloc(count, sizeof(int*));
+
+    for (int m = 0; inputs && outputs && m < count; m++) {
+        inputs[m] = jobs[m].matrix;
+        outputs[m] = allocate_matrix_uninit(size, size);
+        if (!outputs[m])
+            break;
+    }
+    if (!inputs || !outputs || !outputs[count - 1]) {
+        LOG("Failed to allocate a batch of %d %dx%d matrices\n",
+            count, size, size);
+        failures = count;
+    } else {
+        timing_start(PHASE_COMPUTE);
+        result = convolve_batch(config, inputs, count, size, depth, outputs);
+        timing_stop(PHASE_COMPUTE);
+        if (result == -1)
+            failures = count;
+    }
+
+    for (int m = 0; outputs && m < count; m++) {
+        if (failures == 0) {
+            timing_start(PHASE_WRITE);
+            result = write_matrix_to_file(jobs[m].output, outputs[m], size);
+            timing_stop(PHASE_WRITE);
+            if (result != 0) {
+                LOG("Failed to write matrix to output file %s.\n",
+                    jobs[m].output);
+                failures++;
+            }
+        }
+        safe_free(&outputs[m]);
+    }
+    free(inputs);
+    free(outputs);
+    return failures;
+}
+
+/**
+ * @brief Read, convolve and write a group of jobs.
+ *
+ * @param jobs The jobs.
+ * @param count Number of jobs.
+ * @param depth Depth of the convolution.
+ * @param config Kernel configuration.
+ * @return Number of jobs that failed.
+ */
+static int run_group(batch_job_t *jobs, int count, int depth,
+                     const kernel_config_t *config)
+{
+    int failures = 0;
+
+    timing_start(PHASE_READ);
+    for (int k = 0; k < count; k++) {
+        jobs[k].matrix = read_matrix_from_file(jobs[k].input, &jobs[k].size);
+        if (!jobs[k].matrix) {
+            LOG("Failed to read matrix from file: %s\n", jobs[k].input);
+            jobs[k].size = 0;
+            failures++;
+        }
+    }
+    timing_stop(PHASE_READ);
+
+    // Each run of inputs of one size is convolved together
+    qsort(jobs, count, sizeof(batch_job_t), compare_sizes);
+    for (int start = failures, end; start < count; start = end) {
+        for (end = start; end < count && jobs[end].size == jobs[start].size;
+             end++)
+            ;
+        failures += run_same_size(jobs + start, end - start, depth, config);
+    }
+
+    for (int k = 0; k < count; k++)
+        safe_free(&jobs[k].matrix);
+    return failures;
+}
+
+/**
+ * @brief Run every job of a batch list.
+ *
+ * @param options Options of the run, with the list and the depth.
+ * @param my_rank Rank of the calling process in comm.
+ * @param nproc Number of processes.
+ * @param comm Communicator of the processes.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the list could not be read or
+ *         any job failed.
+ */
+int batch_run(const options_t *options, int my_rank, int nproc,
+              MPI_Comm comm)
+{
+    kernel_config_t config = {KERNEL_CLIPPED, 0, 1};
+    batch_job_t *jobs;
+    int num_jobs, total, failures = 0, all_failures;
+
+    if (options->kernel &&
+        kernel_config_from_string(options->kernel, &config) == -1) {
+        if (my_rank == MASTER)
+            fprintf(stderr, "Invalid kernel: %s\n", options->kernel);
+        return EXIT_FAILURE;
+    }
+
+    if (read_list(options->batch_list, my_rank, nproc, &jobs, &num_jobs,
+                  &total) == -1) {
+        LOG("P%d failed to read the batch list %s\n",
+            my_rank, options->batch_list);
+        failures = 1;
+    } else {
+        if (my_rank == MASTER)
+            fprintf(stderr, "Batch of %d matrices at depth %d over %d "
+                    "processes, %d to a vector\n",
+                    total, options->depth, nproc, BATCH_LANES);
+        for (int first = 0; first < num_jobs; first += BATCH_GROUP)
+            failures += run_group(jobs + first,
+                                  num_jobs - first < BATCH_GROUP ?
+                                      num_jobs - first : BATCH_GROUP,
+                                  options->depth, &config);
+    }
+    LOG("P%d finished %d jobs with %d failures\n",
+        my_rank, num_jobs, failures);
+
+    for (int k = 0; k < num_jobs; k++) {
+        free(jobs[k].input);
+        free(jobs[k].output);
+    }
+    free(jobs);
+
+    if (MPI_Allreduce(&failures, &all_failures, 1, MPI_INT, MPI_SUM,
+                      comm) != MPI_SUCCESS)
+        return EXIT_FAILURE;
+    if (my_rank == MASTER && all_failures > 0)
+        fprintf(stderr, "%d of the batch's jobs failed\n", all_failures);
+    if (options->timing) {
+        timing_report(my_rank, comm);
+        allocator_report(my_rank, comm);
+    }
+    return all_failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
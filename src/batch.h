@@ -0,0 +1,43 @@
+/**
+ * @file    batch.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Convolution of many small matrices in one run.
+ *
+ * A list file names one job per line as INPUT OUTPUT, all at the same
+ * depth. The jobs are dealt out to the processes in turn, and each process
+ * reads its own, convolves those of the same size together with
+ * convolve_batch and writes their results. No matrix is sent between
+ * processes: a small matrix costs less to read where it is convolved than
+ * to scatter.
+ *
+ * A process takes its jobs BATCH_GROUP at a time, so its memory does not
+ * grow with the length of the list.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <mpi.h>
+#include "options.h"
+
+#define BATCH_GROUP 256     /* Jobs a process reads, convolves and writes
+                               together */
+
+/**
+ * @brief Run every job of a batch list.
+ *
+ * Collective over comm. The kernel's thread count is taken from
+ * options->kernel if given, and is otherwise one.
+ *
+ * @param options Options of the run, with the list and the depth.
+ * @param my_rank Rank of the calling process in comm.
+ * @param nproc Number of processes.
+ * @param comm Communicator of the processes.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the list could not be read or
+ *         any job failed.
+ */
+int batch_run(const options_t *options, int my_rank, int nproc,
+              MPI_Comm comm);
+
+#endif /* BATCH_H */
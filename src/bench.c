@@ -0,0 +1,509 @@
+/**
+ * @file    bench.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Micro-benchmark of the convolution kernels.
+ *
+ * Runs each kernel on synthetic padded slabs across a range of depths and
+ * widths, outside MPI, and reports the time per cell, the achieved
+ * GFLOP/s and GB/s and, where perf_event_open is allowed, cycles,
+ * instructions, IPC and cache misses per cell.
+ *
+ * Every neighbour costs a multiply and an add, so a slab's flops are twice
+ * its neighbour count. Its bytes are the compulsory traffic: the padded
+ * slab read once and the output written once. Before the kernels run, the
+ * tool measures this machine's roofs: memory bandwidth (a STREAM-style
+ * triad), peak scalar multiply-add throughput, and the rate of the
+ * truncating dependent add every kernel performs per neighbour, which
+ * bounds a single accumulator no matter how fast the memory is. Each
+ * result is given as a percentage of the lowest of these roofs at its
+ * arithmetic intensity, together with which roof that is. Shallow depths
+ * can beat the accumulator roof, as out-of-order execution overlaps the
+ * short chains of neighbouring cells; deep ones cannot.
+ *
+ * Usage: bench [-k KERNEL,...] [-d DEPTH,...] [-w WIDTH,...] [-r ROWS]
+ *              [-s SECONDS]
+ */
+
+#include "convolution.h"
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_LIST        32          /* Most entries in a list option */
+#define DEFAULT_KERNELS "naive,clipped,blocked:256"
+#define DEFAULT_DEPTHS  "1,2,4,8,16"
+#define DEFAULT_WIDTHS  "256,1024,4096"
+#define DEFAULT_ROWS    32          /* Working rows per slab */
+#define DEFAULT_SECONDS 0.2         /* Least time spent on each measurement */
+#define STREAM_DOUBLES  (4 << 20)   /* Doubles per array of the triad */
+#define PEAK_CHAINS     8           /* Independent chains of the peak loop */
+#define ROOF_STEPS      (1 << 24)   /* Iterations of the compute roof loops */
+
+/**
+ * @brief Hardware events counted around each kernel.
+ */
+enum {
+    EVENT_CYCLES,
+    EVENT_INSTRUCTIONS,
+    EVENT_CACHE_MISSES,
+    NUM_EVENTS
+};
+
+static const uint64_t event_configs[NUM_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES
+};
+
+/**
+ * @brief Open hardware counters, one per event (-1 where unavailable).
+ */
+typedef struct {
+    int     fds[NUM_EVENTS];
+} counters_t;
+
+/**
+ * @brief Measured roofs of this machine.
+ */
+typedef struct {
+    double  bandwidth;      /* Triad bandwidth, GB/s */
+    double  peak;           /* Independent multiply-adds, GFLOP/s */
+    double  chain;          /* One truncating accumulator, GFLOP/s */
+} roofline_t;
+
+/**
+ * @brief Current time in seconds.
+ *
+ * @return Seconds on the monotonic clock.
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Open a counter for each event, counting this process's user time
+ *        and any threads it starts.
+ *
+ * @param [out] counters Counters to open.
+ * @return Number of counters opened.
+ */
+static int counters_open(counters_t *counters)
+{
+    struct perf_event_attr attr;
+    int opened = 0;
+
+    for (int e = 0; e < NUM_EVENTS; e++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = event_configs[e];
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters->fds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fds[e] != -1)
+            opened++;
+    }
+    return opened;
+}
+
+/**
+ * @brief Zero and start the open counters.
+ *
+ * @param counters Counters to start.
+ */
+static void counters_start(const counters_t *counters)
+{
+    for (int e = 0; e < NUM_EVENTS; e++)
+        if (counters->fds[e] != -1) {
+            ioctl(counters->fds[e], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+/**
+ * @brief Stop the open counters and read them.
+ *
+ * Counts are scaled up for any time the kernel multiplexed a counter out.
+ *
+ * @param counters Counters to stop.
+ * @param [out] counts Count of each event, or -1 where unavailable.
+ */
+static void counters_stop(const counters_t *counters, double *counts)
+{
+    uint64_t values[3];     // Count, time enabled, time running
+
+    for (int e = 0; e < NUM_EVENTS; e++) {
+        counts[e] = -1;
+        if (counters->fds[e] == -1)
+            continue;
+        ioctl(counters->fds[e], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counters->fds[e], values, sizeof(values)) ==
+                (ssize_t) sizeof(values) && values[2] > 0)
+            counts[e] = (double) values[0] * values[1] / values[2];
+    }
+}
+
+/**
+ * @brief Close the open counters.
+ *
+ * @param counters Counters to close.
+ */
+static void counters_close(counters_t *counters)
+{
+    for (int e = 0; e < NUM_EVENTS; e++)
+        if (counters->fds[e] != -1)
+            close(counters->fds[e]);
+}
+
+/**
+ * @brief Measure the memory bandwidth with a STREAM-style triad.
+ *
+ * @param min_seconds Least time to spend.
+ * @return Best bandwidth seen in GB/s, or 0 if out of memory.
+ */
+static double measure_bandwidth(double min_seconds)
+{
+    double *a = malloc(STREAM_DOUBLES * sizeof(double));
+    double *b = malloc(STREAM_DOUBLES * sizeof(double));
+    double *c = malloc(STREAM_DOUBLES * sizeof(double));
+    volatile double sink;
+    double best = 0, spent = 0;
+
+    if (!a || !b || !c) {
+        free(a);
+        free(b);
+        free(c);
+        return 0;
+    }
+    for (int i = 0; i < STREAM_DOUBLES; i++) {
+        b[i] = i;
+        c[i] = 1;
+    }
+    while (spent < min_seconds) {
+        double started = now();
+        for (int i = 0; i < STREAM_DOUBLES; i++)
+            a[i] = b[i] + 3.0 * c[i];
+        double elapsed = now() - started;
+        double rate = 3.0 * STREAM_DOUBLES * sizeof(double) / elapsed / 1e9;
+        if (rate > best)
+            best = rate;
+        spent += elapsed;
+        sink = a[STREAM_DOUBLES / 2];   // Keep the triad from being elided
+    }
+    (void) sink;
+    free(a);
+    free(b);
+    free(c);
+    return best;
+}
+
+/**
+ * @brief Measure scalar multiply-add throughput over independent chains.
+ *
+ * @return GFLOP/s.
+ */
+static double measure_peak(void)
+{
+    volatile double seed = 1e-9;
+    double sums[PEAK_CHAINS], total = 0;
+    double weight = seed;
+
+    for (int k = 0; k < PEAK_CHAINS; k++)
+        sums[k] = k;
+    double started = now();
+    for (int i = 0; i < ROOF_STEPS; i++)
+        for (int k = 0; k < PEAK_CHAINS; k++)
+            sums[k] += sums[k] * weight;
+    double elapsed = now() - started;
+    for (int k = 0; k < PEAK_CHAINS; k++)
+        total += sums[k];
+    seed = total;
+    return 2.0 * PEAK_CHAINS * ROOF_STEPS / elapsed / 1e9;
+}
+
+/**
+ * @brief Measure one truncating accumulator, the kernels' inner step.
+ *
+ * Each step waits for the previous one, as in the kernels, where the int
+ * sum is converted to double, added to and truncated for every neighbour.
+ *
+ * @return GFLOP/s.
+ */
+static double measure_chain(void)
+{
+    volatile int seed = 3;
+    volatile double weight_seed = 0.5;
+    int value = seed, sum = 0;
+    double weight = weight_seed;
+
+    double started = now();
+    for (int i = 0; i < ROOF_STEPS; i++)
+        sum += value * weight;
+    double elapsed = now() - started;
+    seed = sum;
+    return 2.0 * ROOF_STEPS / elapsed / 1e9;
+}
+
+/**
+ * @brief Parse a comma separated list of positive ints.
+ *
+ * @param text List to parse.
+ * @param [out] values Values of the list.
+ * @return Number of values, or -1 if the list is invalid.
+ */
+static int parse_list(const char *text, int *values)
+{
+    int count = 0;
+    char *end;
+
+    do {
+        long value = strtol(text, &end, 10);
+        if (end == text || value <= 0 || value > 1 << 20 ||
+            (*end && *end != ',') || count == MAX_LIST)
+            return -1;
+        values[count++] = value;
+        text = end + 1;
+    } while (*end);
+    return count;
+}
+
+/**
+ * @brief Count the neighbours the kernels visit in a padded slab.
+ *
+ * The slab is padded by the depth above and below, so only the columns
+ * are clipped at the edges.
+ *
+ * @param rows Working rows.
+ * @param width Columns.
+ * @param depth Depth of the convolution.
+ * @return Neighbours visited.
+ */
+static double count_neighbours(int rows, int width, int depth)
+{
+    double per_row = 0;
+
+    for (int col = 0; col < width; col++) {
+        int first = col - depth < 0 ? 0 : col - depth;
+        int last = col + depth >= width ? width - 1 : col + depth;
+        per_row += (2.0 * depth + 1) * (last - first + 1) - 1;
+    }
+    return per_row * rows;
+}
+
+/**
+ * @brief Time one kernel on one slab shape and print a result line.
+ *
+ * @param config Kernel to run.
+ * @param spec Kernel specification as given.
+ * @param rows Working rows.
+ * @param width Columns.
+ * @param depth Depth of the convolution.
+ * @param min_seconds Least time to spend.
+ * @param counters Hardware counters.
+ * @param roofs Measured roofs.
+ * @return 0 on success, -1 on failure.
+ */
+static int bench_kernel(const kernel_config_t *config, const char *spec,
+                        int rows, int width, int depth, double min_seconds,
+                        const counters_t *counters, const roofline_t *roofs)
+{
+    int padded_rows = rows + 2 * depth;
+    int *slab = malloc((size_t) padded_rows * width * sizeof(int));
+    int *output = malloc((size_t) rows * width * sizeof(int));
+    double best = 0, spent = 0, counts[NUM_EVENTS], best_counts[NUM_EVENTS];
+
+    if (!slab || !output) {
+        fprintf(stderr, "Failed to allocate a %dx%d slab\n",
+                padded_rows, width);
+        free(slab);
+        free(output);
+        return -1;
+    }
+    srand(depth * 7919 + width);
+    for (size_t i = 0; i < (size_t) padded_rows * width; i++)
+        slab[i] = rand() % 10;
+
+    // Keep the fastest run, and its counts (-1 until one is counted)
+    for (int e = 0; e < NUM_EVENTS; e++)
+        best_counts[e] = -1;
+    while (spent < min_seconds || best == 0) {
+        counters_start(counters);
+        double started = now();
+        if (convolve_rows_with(config, slab, padded_rows, width, depth, rows,
+                               depth, output) == -1) {
+            free(slab);
+            free(output);
+            return -1;
+        }
+        double elapsed = now() - started;
+        counters_stop(counters, counts);
+        if (best == 0 || elapsed < best) {
+            best = elapsed;
+            memcpy(best_counts, counts, sizeof(counts));
+        }
+        spent += elapsed;
+    }
+
+    double cells = (double) rows * width;
+    double flops = 2 * count_neighbours(rows, width, depth);
+    double bytes = ((double) padded_rows + rows) * width * sizeof(int);
+    double intensity = flops / bytes;
+    double gflops = flops / best / 1e9;
+    // The lowest roof at this intensity bounds the kernel
+    const char *bound = "memory";
+    double roof = intensity * roofs->bandwidth;
+    if (roofs->peak < roof) {
+        roof = roofs->peak;
+        bound = "peak";
+    }
+    if (roofs->chain < roof) {
+        roof = roofs->chain;
+        bound = "chain";
+    }
+
+    printf("%-14s %5d %6d %9.2f %8.3f %7.3f %7.1f %6.1f%% %-6s",
+           spec, depth, width, best / cells * 1e9, gflops,
+           bytes / best / 1e9, intensity, roof > 0 ? 100 * gflops / roof : 0,
+           bound);
+    if (best_counts[EVENT_CYCLES] >= 0)
+        printf(" %9.1f", best_counts[EVENT_CYCLES] / cells);
+    else
+        printf(" %9s", "n/a");
+    if (best_counts[EVENT_CYCLES] > 0 && best_counts[EVENT_INSTRUCTIONS] >= 0)
+        printf(" %5.2f", best_counts[EVENT_INSTRUCTIONS] /
+                         best_counts[EVENT_CYCLES]);
+    else
+        printf(" %5s", "n/a");
+    if (best_counts[EVENT_CACHE_MISSES] >= 0)
+        printf(" %10.3f\n", best_counts[EVENT_CACHE_MISSES] / cells);
+    else
+        printf(" %10s\n", "n/a");
+
+    free(slab);
+    free(output);
+    return 0;
+}
+
+/**
+ * @brief Print the usage message to stderr.
+ *
+ * @param program_name Name of the executable (argv[0]).
+ */
+static void print_usage(const char *program_name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "Options:\n"
+            "  -k KERNEL,... kernels to run, as NAME[:TILE[:THREADS]]\n"
+            "                (default %s)\n"
+            "  -d DEPTH,...  depths (default %s)\n"
+            "  -w WIDTH,...  slab widths (default %s)\n"
+            "  -r ROWS       working rows per slab (default %d)\n"
+            "  -s SECONDS    least time per measurement (default %.1f)\n",
+            program_name, DEFAULT_KERNELS, DEFAULT_DEPTHS, DEFAULT_WIDTHS,
+            DEFAULT_ROWS, DEFAULT_SECONDS);
+}
+
+/**
+ * @brief Run every kernel on every slab shape.
+ *
+ * @param argc Argument count
+ * @param argv Argument values
+ * @return 0 on success, 1 on failure
+ */
+int main(int argc, char **argv)
+{
+    char kernel_list[1024] = DEFAULT_KERNELS;
+    int depths[MAX_LIST], widths[MAX_LIST];
+    int num_depths = parse_list(DEFAULT_DEPTHS, depths);
+    int num_widths = parse_list(DEFAULT_WIDTHS, widths);
+    int rows = DEFAULT_ROWS, opt;
+    double min_seconds = DEFAULT_SECONDS;
+    kernel_config_t configs[MAX_LIST];
+    char *specs[MAX_LIST], *saved;
+    int num_kernels = 0;
+    counters_t counters;
+    roofline_t roofs;
+
+    while ((opt = getopt(argc, argv, "k:d:w:r:s:h")) != -1) {
+        switch (opt) {
+        case 'k':
+            snprintf(kernel_list, sizeof(kernel_list), "%s", optarg);
+            break;
+        case 'd':
+            num_depths = parse_list(optarg, depths);
+            break;
+        case 'w':
+            num_widths = parse_list(optarg, widths);
+            break;
+        case 'r':
+            rows = atoi(optarg);
+            break;
+        case 's':
+            min_seconds = atof(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    for (char *spec = strtok_r(kernel_list, ",", &saved);
+         spec && num_kernels < MAX_LIST; spec = strtok_r(NULL, ",", &saved)) {
+        if (kernel_config_from_string(spec, &configs[num_kernels]) == -1) {
+            fprintf(stderr, "Invalid kernel: %s\n", spec);
+            return 1;
+        }
+        specs[num_kernels++] = spec;
+    }
+    if (optind != argc || num_depths <= 0 || num_widths <= 0 ||
+        num_kernels == 0 || rows <= 0 || min_seconds < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // The roofs every kernel is compared against
+    roofs.bandwidth = measure_bandwidth(min_seconds);
+    roofs.peak = measure_peak();
+    roofs.chain = measure_chain();
+    printf("Roofline: memory %.2f GB/s, peak %.2f GFLOP/s (ridge at %.2f "
+           "flop/byte), one truncating accumulator %.2f GFLOP/s\n",
+           roofs.bandwidth, roofs.peak,
+           roofs.bandwidth > 0 ? roofs.peak / roofs.bandwidth : 0,
+           roofs.chain);
+
+    if (counters_open(&counters) == 0)
+        printf("Hardware counters unavailable (perf_event_open); "
+               "showing timings only\n");
+    printf("%-14s %5s %6s %9s %8s %7s %7s %7s %-6s %9s %5s %10s\n",
+           "kernel", "depth", "width", "ns/cell", "GFLOP/s", "GB/s",
+           "flop/B", "roof", "bound", "cyc/cell", "IPC", "miss/cell");
+
+    for (int k = 0; k < num_kernels; k++)
+        for (int d = 0; d < num_depths; d++)
+            for (int w = 0; w < num_widths; w++)
+                if (bench_kernel(&configs[k], specs[k], rows, widths[w],
+                                 depths[d], min_seconds, &counters,
+                                 &roofs) == -1) {
+                    counters_close(&counters);
+                    return 1;
+                }
+
+    counters_close(&counters);
+    return 0;
+}
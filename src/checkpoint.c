@@ -0,0 +1,541 @@
+/**
+ * @file    checkpoint.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of asynchronous row checkpointing.
+ *
+ * File layout: a checkpoint_header followed by fixed-size records, each a
+ * record_header followed by one row of matrix_size ints. Records are only
+ * ever appended, so a crash can at worst leave a torn record at the end,
+ * which is trimmed on reopen and ignored on restore.
+ */
+
+#include "checkpoint.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC    "A3CK"
+#define CHECKPOINT_VERSION  2
+#define FNV_OFFSET          2166136261u
+#define FNV_PRIME           16777619u
+
+/**
+ * @brief Header at the start of every checkpoint file.
+ */
+typedef struct {
+    char        magic[4];
+    int         version;
+    int         matrix_size;
+    int         depth;
+    long long   input_bytes;    /* Size of the input file */
+    long long   input_mtime;    /* Its modification time (ns) */
+} checkpoint_header;
+
+/**
+ * @brief Header in front of every checkpointed row.
+ */
+typedef struct {
+    int             row;        /* Global row index */
+    unsigned int    checksum;   /* Checksum of row index and data */
+} record_header;
+
+/**
+ * @brief A band of rows waiting to be written.
+ */
+typedef struct checkpoint_job {
+    int     first_row;
+    int     num_rows;
+    int     *rows;
+    struct checkpoint_job *next;
+} checkpoint_job;
+
+struct checkpoint {
+    int             fd;
+    int             matrix_size;
+    pthread_t       writer;
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;
+    checkpoint_job  *head, *tail;   /* Queue of pending jobs */
+    int             closing;        /* Set when no more jobs will come */
+    int             failed;         /* Set if any write failed */
+    double          busy_seconds;   /* Time spent writing */
+};
+
+/**
+ * @brief Compute the checksum of a row record.
+ *
+ * @param row Global row index.
+ * @param data Row data.
+ * @param cols Number of cells in the row.
+ * @return FNV-1a checksum of the row index and data.
+ */
+static unsigned int row_checksum(int row, const int *data, int cols)
+{
+    unsigned int hash = (FNV_OFFSET ^ (unsigned int) row) * FNV_PRIME;
+    const unsigned char *bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < cols * sizeof(int); i++)
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    return hash;
+}
+
+/**
+ * @brief Get a monotonic timestamp in seconds.
+ *
+ * @return Current time in seconds.
+ */
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Build the path of a rank's checkpoint file.
+ *
+ * @param dir Checkpoint directory.
+ * @param name File name within the directory.
+ * @return Newly allocated path, or NULL on failure.
+ */
+static char* checkpoint_path(const char *dir, const char *name)
+{
+    size_t length = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(length);
+    if (path)
+        snprintf(path, length, "%s/%s", dir, name);
+    return path;
+}
+
+/**
+ * @brief Fill in the header of a run's checkpoint files.
+ *
+ * The input is identified by its size and modification time, so that the
+ * checkpoints of a different input are not mixed into the results.
+ *
+ * @param input_filename Input matrix file of the run.
+ * @param matrix_size Size of the matrix being processed.
+ * @param depth Depth of the convolution.
+ * @param [out] header Header to fill in.
+ * @return 0 on success, -1 if the input file cannot be examined.
+ */
+static int run_header(const char *input_filename, int matrix_size, int depth,
+                      checkpoint_header *header)
+{
+    struct stat st;
+
+    if (stat(input_filename, &st) == -1) {
+        perror("Failed to stat input file");
+        return -1;
+    }
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+    header->version = CHECKPOINT_VERSION;
+    header->matrix_size = matrix_size;
+    header->depth = depth;
+    header->input_bytes = st.st_size;
+    header->input_mtime = st.st_mtim.tv_sec * 1000000000LL +
+                          st.st_mtim.tv_nsec;
+    return 0;
+}
+
+/**
+ * @brief Append one band of rows to the checkpoint file and sync it.
+ *
+ * @param ckpt Checkpoint to write to.
+ * @param job Band of rows to write.
+ * @return 0 on success, -1 on failure.
+ */
+static int write_job(checkpoint_t *ckpt, checkpoint_job *job)
+{
+    size_t row_bytes = ckpt->matrix_size * sizeof(int);
+
+    for (int i = 0; i < job->num_rows; i++) {
+        int *data = job->rows + i * ckpt->matrix_size;
+        record_header header;
+        struct iovec iov[2];
+
+        header.row = job->first_row + i;
+        header.checksum = row_checksum(header.row, data, ckpt->matrix_size);
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = data;
+        iov[1].iov_len = row_bytes;
+        if (writev(ckpt->fd, iov, 2) != (ssize_t)(sizeof(header) + row_bytes)) {
+            perror("Failed to write checkpoint record");
+            return -1;
+        }
+    }
+
+    // Only count the band as checkpointed once it is on stable storage
+    if (fdatasync(ckpt->fd) == -1) {
+        perror("Failed to sync checkpoint file");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Background writer: drains the job queue until closed.
+ *
+ * @param arg The checkpoint.
+ * @return NULL.
+ */
+static void* writer_thread(void *arg)
+{
+    checkpoint_t *ckpt = arg;
+
+    pthread_mutex_lock(&ckpt->lock);
+    for (;;) {
+        while (!ckpt->head && !ckpt->closing)
+            pthread_cond_wait(&ckpt->ready, &ckpt->lock);
+        if (!ckpt->head)
+            break;  // Closing and nothing left to write
+
+        checkpoint_job *job = ckpt->head;
+        ckpt->head = job->next;
+        if (!ckpt->head)
+            ckpt->tail = NULL;
+        pthread_mutex_unlock(&ckpt->lock);
+
+        double started = now_seconds();
+        int failed = write_job(ckpt, job) == -1;
+        double elapsed = now_seconds() - started;
+        free(job);
+
+        pthread_mutex_lock(&ckpt->lock);
+        ckpt->busy_seconds += elapsed;
+        ckpt->failed |= failed;
+    }
+    pthread_mutex_unlock(&ckpt->lock);
+    return NULL;
+}
+
+/**
+ * @brief Prepare a checkpoint file for appending.
+ *
+ * Writes the header to a new file, or validates the header of an existing
+ * one and trims any torn record from its end.
+ *
+ * @param fd Open checkpoint file.
+ * @param expected Header of this run.
+ * @return 0 on success, -1 on failure.
+ */
+static int prepare_file(int fd, const checkpoint_header *expected)
+{
+    checkpoint_header header;
+    struct stat st;
+    off_t record_bytes = sizeof(record_header) +
+                         expected->matrix_size * sizeof(int);
+
+    if (fstat(fd, &st) == -1) {
+        perror("Failed to stat checkpoint file");
+        return -1;
+    }
+
+    if (st.st_size == 0) {
+        if (write(fd, expected, sizeof(*expected)) != sizeof(*expected)) {
+            perror("Failed to write checkpoint header");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(&header, expected, sizeof(header)) != 0) {
+        fprintf(stderr, "Existing checkpoint file does not match this run\n");
+        return -1;
+    }
+
+    off_t records = (st.st_size - (off_t) sizeof(header)) / record_bytes;
+    if (ftruncate(fd, sizeof(header) + records * record_bytes) == -1) {
+        perror("Failed to trim checkpoint file");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Open this process's checkpoint file and start its writer thread.
+ *
+ * @param dir Checkpoint directory.
+ * @param rank Rank of the calling process.
+ * @param input_filename Input matrix file of the run.
+ * @param matrix_size Size of the matrix being processed.
+ * @param depth Depth of the convolution.
+ * @return Pointer to the checkpoint, or NULL on failure.
+ */
+checkpoint_t* checkpoint_open(const char *dir, int rank,
+                              const char *input_filename,
+                              int matrix_size, int depth)
+{
+    char name[64];
+    char *path;
+    checkpoint_t *ckpt;
+    checkpoint_header header;
+
+    if (run_header(input_filename, matrix_size, depth, &header) == -1)
+        return NULL;
+    if (mkdir(dir, S_IRWXU) == -1 && errno != EEXIST) {
+        perror("Failed to create checkpoint directory");
+        return NULL;
+    }
+
+    snprintf(name, sizeof(name), CHECKPOINT_PREFIX "%d", rank);
+    path = checkpoint_path(dir, name);
+    ckpt = calloc(1, sizeof(*ckpt));
+    if (!path || !ckpt) {
+        fprintf(stderr, "Failed to allocate checkpoint\n");
+        free(path);
+        free(ckpt);
+        return NULL;
+    }
+
+    ckpt->matrix_size = matrix_size;
+    ckpt->fd = open(path, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+    free(path);
+    if (ckpt->fd == -1) {
+        perror("Failed to open checkpoint file");
+        free(ckpt);
+        return NULL;
+    }
+    if (prepare_file(ckpt->fd, &header) == -1) {
+        close(ckpt->fd);
+        free(ckpt);
+        return NULL;
+    }
+
+    pthread_mutex_init(&ckpt->lock, NULL);
+    pthread_cond_init(&ckpt->ready, NULL);
+    if (pthread_create(&ckpt->writer, NULL, writer_thread, ckpt) != 0) {
+        fprintf(stderr, "Failed to start checkpoint writer thread\n");
+        pthread_mutex_destroy(&ckpt->lock);
+        pthread_cond_destroy(&ckpt->ready);
+        close(ckpt->fd);
+        free(ckpt);
+        return NULL;
+    }
+    return ckpt;
+}
+
+/**
+ * @brief Queue a band of finished rows to be written in the background.
+ *
+ * @param ckpt Checkpoint to write to.
+ * @param first_row Global index of the first row.
+ * @param num_rows Number of rows.
+ * @param rows Pointer to the row data.
+ * @return 0 on success, -1 if queueing failed or an earlier write failed.
+ */
+int checkpoint_submit(checkpoint_t *ckpt, int first_row, int num_rows,
+                      int *rows)
+{
+    checkpoint_job *job = malloc(sizeof(*job));
+    if (!job) {
+        fprintf(stderr, "Failed to allocate checkpoint job\n");
+        return -1;
+    }
+    job->first_row = first_row;
+    job->num_rows = num_rows;
+    job->rows = rows;
+    job->next = NULL;
+
+    pthread_mutex_lock(&ckpt->lock);
+    int failed = ckpt->failed;
+    if (ckpt->tail)
+        ckpt->tail->next = job;
+    else
+        ckpt->head = job;
+    ckpt->tail = job;
+    pthread_cond_signal(&ckpt->ready);
+    pthread_mutex_unlock(&ckpt->lock);
+
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Wait for all queued rows to be written and close the checkpoint.
+ *
+ * @param ckpt Checkpoint to close (freed by this call).
+ * @param [out] busy_seconds Time the writer thread spent writing.
+ * @return 0 on success, -1 if any write failed.
+ */
+int checkpoint_close(checkpoint_t *ckpt, double *busy_seconds)
+{
+    int failed;
+
+    pthread_mutex_lock(&ckpt->lock);
+    ckpt->closing = 1;
+    pthread_cond_signal(&ckpt->ready);
+    pthread_mutex_unlock(&ckpt->lock);
+    pthread_join(ckpt->writer, NULL);
+
+    failed = ckpt->failed;
+    *busy_seconds = ckpt->busy_seconds;
+    if (close(ckpt->fd) == -1) {
+        perror("Failed to close checkpoint file");
+        failed = 1;
+    }
+    pthread_mutex_destroy(&ckpt->lock);
+    pthread_cond_destroy(&ckpt->ready);
+    free(ckpt);
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Restore the rows of a band found in one checkpoint file.
+ *
+ * @param path Path of the checkpoint file.
+ * @param expected Header of this run.
+ * @param first_row Global index of the band's first row.
+ * @param num_rows Number of rows in the band.
+ * @param rows Buffer of num_rows * matrix_size cells for the band.
+ * @param [out] restored Flags set to 1 for each row of the band restored.
+ * @return Number of new rows restored, or -1 on failure.
+ */
+static int restore_file(const char *path, const checkpoint_header *expected,
+                        int first_row, int num_rows, int *rows,
+                        char *restored)
+{
+    checkpoint_header header;
+    record_header record;
+    int matrix_size = expected->matrix_size;
+    size_t row_bytes = matrix_size * sizeof(int);
+    off_t offset = sizeof(header);
+    int count = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("Failed to open checkpoint file");
+        return -1;
+    }
+    if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(&header, expected, sizeof(header)) != 0) {
+        fprintf(stderr, "Checkpoint %s was written for a different input, "
+                "matrix size or depth\n", path);
+        close(fd);
+        return -1;
+    }
+
+    // Records are read into a scratch row and only copied into the band
+    // once their checksum holds, so a torn or corrupt record never
+    // overwrites a row already restored
+    int *scratch = malloc(row_bytes);
+    if (!scratch) {
+        fprintf(stderr, "Failed to allocate checkpoint row\n");
+        close(fd);
+        return -1;
+    }
+
+    // Walk the records, reading only the rows that belong to this band
+    while (pread(fd, &record, sizeof(record), offset) == sizeof(record)) {
+        int local_row = record.row - first_row;
+        offset += sizeof(record);
+        if (local_row >= 0 && local_row < num_rows && !restored[local_row]) {
+            if (pread(fd, scratch, row_bytes, offset) != (ssize_t) row_bytes)
+                break;  // Torn final record
+            if (row_checksum(record.row, scratch, matrix_size) ==
+                    record.checksum) {
+                memcpy(rows + (size_t) local_row * matrix_size, scratch,
+                       row_bytes);
+                restored[local_row] = 1;
+                count++;
+            }
+        }
+        offset += row_bytes;
+    }
+
+    free(scratch);
+    close(fd);
+    return count;
+}
+
+/**
+ * @brief Restore previously checkpointed rows of a band.
+ *
+ * @param dir Checkpoint directory.
+ * @param input_filename Input matrix file of the run.
+ * @param matrix_size Size of the matrix being processed.
+ * @param depth Depth of the convolution.
+ * @param first_row Global index of the band's first row.
+ * @param num_rows Number of rows in the band.
+ * @param rows Buffer of num_rows * matrix_size cells for the band.
+ * @param [out] restored Flags set to 1 for each row of the band restored.
+ * @return Number of rows restored, or -1 on failure.
+ */
+int checkpoint_restore(const char *dir, const char *input_filename,
+                       int matrix_size, int depth, int first_row,
+                       int num_rows, int *rows, char *restored)
+{
+    struct dirent *entry;
+    checkpoint_header header;
+    int total = 0;
+
+    if (run_header(input_filename, matrix_size, depth, &header) == -1)
+        return -1;
+
+    DIR *directory = opendir(dir);
+    if (!directory) {
+        perror("Failed to open checkpoint directory");
+        return -1;
+    }
+
+    while ((entry = readdir(directory)) != NULL) {
+        if (strncmp(entry->d_name, CHECKPOINT_PREFIX,
+                    strlen(CHECKPOINT_PREFIX)) != 0)
+            continue;
+
+        char *path = checkpoint_path(dir, entry->d_name);
+        int count = path ? restore_file(path, &header, first_row, num_rows,
+                                        rows, restored) : -1;
+        free(path);
+        if (count == -1) {
+            closedir(directory);
+            return -1;
+        }
+        total += count;
+    }
+
+    closedir(directory);
+    return total;
+}
+
+/**
+ * @brief Remove all checkpoint files from a directory.
+ *
+ * @param dir Checkpoint directory.
+ * @return 0 on success (or if the directory does not exist), -1 on failure.
+ */
+int checkpoint_remove(const char *dir)
+{
+    struct dirent *entry;
+    int result = 0;
+
+    DIR *directory = opendir(dir);
+    if (!directory)
+        return errno == ENOENT ? 0 : -1;
+
+    while ((entry = readdir(directory)) != NULL) {
+        if (strncmp(entry->d_name, CHECKPOINT_PREFIX,
+                    strlen(CHECKPOINT_PREFIX)) != 0)
+            continue;
+
+        char *path = checkpoint_path(dir, entry->d_name);
+        if (!path || unlink(path) == -1) {
+            perror("Failed to remove checkpoint file");
+            result = -1;
+        }
+        free(path);
+    }
+
+    closedir(directory);
+    return result;
+}
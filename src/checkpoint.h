@@ -0,0 +1,99 @@
+/**
+ * @file    checkpoint.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Asynchronous checkpointing of processed rows for restartable runs.
+ *
+ * Each process appends its finished output rows to its own checkpoint file
+ * in a checkpoint directory. The writes are done by a background thread so
+ * that computing the next rows is not stalled. Every row is stored as a
+ * self-describing record (global row index, checksum, data), so a restarted
+ * run can pick up the completed rows of its own slab from any of the files,
+ * even when it runs with a different number of processes.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#define CHECKPOINT_PREFIX "ckpt."   /* Checkpoint file name prefix */
+#define CHECKPOINT_ROWS   64        /* Default rows per checkpoint */
+
+/**
+ * @brief An open checkpoint file and its background writer.
+ */
+typedef struct checkpoint checkpoint_t;
+
+/**
+ * @brief Open this process's checkpoint file and start its writer thread.
+ *
+ * Creates the directory if needed. An existing file for this rank is kept
+ * (minus any partially written trailing record) so that it can be appended
+ * to after a restart, provided it was written for the same input (by size
+ * and modification time), matrix size and depth.
+ *
+ * @param dir Checkpoint directory.
+ * @param rank Rank of the calling process.
+ * @param input_filename Input matrix file of the run.
+ * @param matrix_size Size of the matrix being processed.
+ * @param depth Depth of the convolution.
+ * @return Pointer to the checkpoint, or NULL on failure.
+ */
+checkpoint_t* checkpoint_open(const char *dir, int rank,
+                              const char *input_filename,
+                              int matrix_size, int depth);
+
+/**
+ * @brief Queue a band of finished rows to be written in the background.
+ *
+ * The rows are not copied: they must not change until checkpoint_close.
+ *
+ * @param ckpt Checkpoint to write to.
+ * @param first_row Global index of the first row.
+ * @param num_rows Number of rows.
+ * @param rows Pointer to the row data.
+ * @return 0 on success, -1 if queueing failed or an earlier write failed.
+ */
+int checkpoint_submit(checkpoint_t *ckpt, int first_row, int num_rows,
+                      int *rows);
+
+/**
+ * @brief Wait for all queued rows to be written and close the checkpoint.
+ *
+ * @param ckpt Checkpoint to close (freed by this call).
+ * @param [out] busy_seconds Time the writer thread spent writing.
+ * @return 0 on success, -1 if any write failed.
+ */
+int checkpoint_close(checkpoint_t *ckpt, double *busy_seconds);
+
+/**
+ * @brief Restore previously checkpointed rows of a band.
+ *
+ * Scans every checkpoint file in the directory and copies each valid record
+ * whose row lies in [first_row, first_row + num_rows) into rows. A row is
+ * taken from the first record of it whose checksum holds; later copies are
+ * skipped.
+ *
+ * @param dir Checkpoint directory.
+ * @param input_filename Input matrix file of the run.
+ * @param matrix_size Size of the matrix being processed.
+ * @param depth Depth of the convolution.
+ * @param first_row Global index of the band's first row.
+ * @param num_rows Number of rows in the band.
+ * @param rows Buffer of num_rows * matrix_size cells for the band.
+ * @param [out] restored Flags set to 1 for each row of the band restored.
+ * @return Number of rows restored, or -1 if a file is unreadable or was
+ *         written for a different input, matrix size or depth.
+ */
+int checkpoint_restore(const char *dir, const char *input_filename,
+                       int matrix_size, int depth, int first_row,
+                       int num_rows, int *rows, char *restored);
+
+/**
+ * @brief Remove all checkpoint files from a directory.
+ *
+ * @param dir Checkpoint directory.
+ * @return 0 on success (or if the directory does not exist), -1 on failure.
+ */
+int checkpoint_remove(const char *dir);
+
+#endif /* CHECKPOINT_H */
@@ -8,9 +8,12 @@
  */
 
 #include "convolution.h"
+#include "stats.h"
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 /**
@@ -131,3 +134,852 @@ int apply_convolution(  int row, int col, int *matrix,
     // Return the final weighted sum of neighbours.
     return sum;
 }
+
+/**
+ * @brief Applies convolution to a band of consecutive rows.
+ *
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth for convolution operation.
+ * @param output Buffer of num_rows * matrix_cols cells for the results.
+ * @return 0 on success, -1 if any cell fails to convolve.
+ */
+int convolve_rows(  int *matrix, int matrix_rows, int matrix_cols,
+                    int first_row, int num_rows, int depth, int *output)
+{
+    for (int row = first_row; row < first_row + num_rows; row++) {
+        int *output_row = output + (row - first_row) * matrix_cols;
+        for (int col = 0; col < matrix_cols; col++) {
+            int sum = apply_convolution(row, col, matrix,
+                                        matrix_rows, matrix_cols, depth);
+            if (sum < 0) {
+                fprintf(stderr, "Convolution failed at row %d, col %d\n",
+                        row, col);
+                return -1;
+            }
+            output_row[col] = sum;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Applies convolution to a band of rows, overwriting the input.
+ *
+ * Output row r needs input rows r - depth to r + depth, so once row r has
+ * been computed, input row r - depth - 1 is dead and can take the result
+ * that was computed depth + 1 rows earlier. That is the slot about to be
+ * reused in the window, so at most depth + 1 result rows are ever pending.
+ *
+ * @param matrix Pointer to the (padded) matrix, updated in place.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth for convolution operation.
+ * @param window Scratch buffer of (depth + 1) * matrix_cols cells.
+ * @param config Kernel configuration used to compute each row.
+ * @return 0 on success, -1 if any cell fails to convolve.
+ */
+int convolve_rows_in_place( int *matrix, int matrix_rows, int matrix_cols,
+                            int first_row, int num_rows, int depth,
+                            int *window, const kernel_config_t *config)
+{
+    int slots = depth + 1;
+    size_t row_bytes = matrix_cols * sizeof(int);
+
+    for (int done = 0; done < num_rows; done++) {
+        int *slot = window + (done % slots) * matrix_cols;
+
+        // Retire the oldest pending row over its (now unused) input row
+        if (done >= slots)
+            memcpy(matrix + (first_row + done - slots) * matrix_cols,
+                   slot, row_bytes);
+
+        if (convolve_rows_with(config, matrix, matrix_rows, matrix_cols,
+                               first_row + done, 1, depth, slot) == -1)
+            return -1;
+    }
+
+    // Flush the rows still pending in the window
+    int pending = num_rows < slots ? num_rows : slots;
+    for (int done = num_rows - pending; done < num_rows; done++) {
+        memcpy(matrix + (first_row + done) * matrix_cols,
+               window + (done % slots) * matrix_cols, row_bytes);
+    }
+    return 0;
+}
+
+static const char *kernel_names[NUM_KERNELS] = {
+    "naive",
+    "clipped",
+    "blocked"
+};
+
+/**
+ * @brief Arguments of one kernel thread's share of a band.
+ */
+typedef struct {
+    const kernel_config_t *config;
+    const double *weights;
+    int *matrix;
+    int matrix_rows;
+    int matrix_cols;
+    int first_row;
+    int num_rows;
+    int depth;
+    int *output;        /* Output row 0 corresponds to first_row */
+    int result;
+    const int *depths;  /* Depths of a multi-depth band, ascending */
+    int num_depths;
+    int **outputs;      /* Output of each depth (multi-depth only) */
+    int first_col;      /* Columns of a region (region only) */
+    int num_cols;
+    output_stats_t *stats;  /* Statistics of the finished rows (or NULL) */
+    int output_row;     /* Row of the whole output that first_row is */
+    int **inputs;       /* Matrices of a batch, whose groups of BATCH_LANES
+                           take the place of rows (batch only) */
+    int num_matrices;
+} kernel_task;
+
+/**
+ * @brief Accumulates one row segment whose cells all share a weight.
+ *
+ * @param sum Running sum of the cell.
+ * @param line Pointer to the start of the segment.
+ * @param count Number of cells in the segment.
+ * @param weight Weight of every cell in the segment.
+ * @return The updated sum.
+ */
+static int add_segment(int sum, const int *line, int count, double weight)
+{
+    for (int i = 0; i < count; i++)
+        sum += line[i] * weight;
+    return sum;
+}
+
+/**
+ * @brief Convolves one cell with its neighbourhood clipped up front.
+ *
+ * Visits the neighbours in the same order as apply_convolution. Within a
+ * neighbour row at distance dr, the columns within dr of the cell all lie
+ * on ring dr, so only the columns further out need their own weights.
+ *
+ * @param row Row coordinate of the cell.
+ * @param col Column coordinate of the cell.
+ * @param matrix Pointer to the matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param depth Depth for convolution operation.
+ * @param weights Weight of each ring, weights[ring] = 1 / (ring + 1).
+ * @return Weighted sum of the cell's neighbours.
+ */
+static int convolve_cell_clipped(int row, int col, const int *matrix,
+                                 int matrix_rows, int matrix_cols, int depth,
+                                 const double *weights)
+{
+    int first_row = row - depth < 0 ? 0 : row - depth;
+    int last_row = row + depth >= matrix_rows ? matrix_rows - 1 : row + depth;
+    int first_col = col - depth < 0 ? 0 : col - depth;
+    int last_col = col + depth >= matrix_cols ? matrix_cols - 1 : col + depth;
+    int sum = 0;
+
+    for (int r = first_row; r <= last_row; r++) {
+        const int *line = matrix + r * matrix_cols;
+        int ring = abs(r - row);
+        int inner_first = col - ring < first_col ? first_col : col - ring;
+        int inner_last = col + ring > last_col ? last_col : col + ring;
+
+        // Left of the inner segment: ring grows with column distance
+        for (int c = first_col; c < inner_first; c++)
+            sum += line[c] * weights[col - c];
+
+        if (ring == 0) {
+            // The cell itself is not its own neighbour
+            sum = add_segment(sum, line + inner_first, col - inner_first,
+                              weights[ring]);
+            sum = add_segment(sum, line + col + 1, inner_last - col,
+                              weights[ring]);
+        } else {
+            sum = add_segment(sum, line + inner_first,
+                              inner_last - inner_first + 1, weights[ring]);
+        }
+
+        // Right of the inner segment
+        for (int c = inner_last + 1; c <= last_col; c++)
+            sum += line[c] * weights[c - col];
+    }
+    return sum;
+}
+
+/**
+ * @brief Adds a run of weighted neighbours to the sums of several depths.
+ *
+ * @param sums Weighted sum at each depth.
+ * @param first First depth the run is within reach of.
+ * @param num_depths Number of depths.
+ * @param line Neighbours to add.
+ * @param count Number of neighbours.
+ * @param weight Weight of the neighbours' ring.
+ */
+static void add_to_depths(int *sums, int first, int num_depths,
+                          const int *line, int count, double weight)
+{
+    // Outer rings are usually reached by the deepest depth alone
+    if (first == num_depths - 1) {
+        sums[first] = add_segment(sums[first], line, count, weight);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        double weighted = line[i] * weight;
+        for (int k = first; k < num_depths; k++)
+            sums[k] += weighted;
+    }
+}
+
+/**
+ * @brief Convolves one cell at several depths in a single sweep.
+ *
+ * Visits the deepest depth's neighbours in the order apply_convolution
+ * does and adds each weighted neighbour to the sums of the depths that
+ * reach its ring, so each sum sees its own neighbours in the usual order.
+ *
+ * @param row Row coordinate of the cell.
+ * @param col Column coordinate of the cell.
+ * @param matrix Pointer to the matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param depths Depths to compute, in ascending order.
+ * @param num_depths Number of depths.
+ * @param weights Weight of each ring, weights[ring] = 1 / (ring + 1).
+ * @param nearest First index into depths reaching each ring.
+ * @param [out] sums Weighted sum at each depth.
+ */
+static void convolve_cell_multi(int row, int col, const int *matrix,
+                                int matrix_rows, int matrix_cols,
+                                const int *depths, int num_depths,
+                                const double *weights, const int *nearest,
+                                int *sums)
+{
+    int depth = depths[num_depths - 1];
+    int first_row = row - depth < 0 ? 0 : row - depth;
+    int last_row = row + depth >= matrix_rows ? matrix_rows - 1 : row + depth;
+    int first_col = col - depth < 0 ? 0 : col - depth;
+    int last_col = col + depth >= matrix_cols ? matrix_cols - 1 : col + depth;
+
+    for (int k = 0; k < num_depths; k++)
+        sums[k] = 0;
+
+    for (int r = first_row; r <= last_row; r++) {
+        const int *line = matrix + r * matrix_cols;
+        int ring = abs(r - row);
+        int inner_first = col - ring < first_col ? first_col : col - ring;
+        int inner_last = col + ring > last_col ? last_col : col + ring;
+
+        // Left of the inner segment: ring grows with column distance
+        for (int c = first_col; c < inner_first; c++)
+            add_to_depths(sums, nearest[col - c], num_depths, line + c, 1,
+                          weights[col - c]);
+
+        // Inner segment: one ring, skipping the cell itself on its own row
+        if (ring == 0) {
+            add_to_depths(sums, nearest[1], num_depths, line + inner_first,
+                          col - inner_first, weights[1]);
+            add_to_depths(sums, nearest[1], num_depths, line + col + 1,
+                          inner_last - col, weights[1]);
+        } else {
+            add_to_depths(sums, nearest[ring], num_depths, line + inner_first,
+                          inner_last - inner_first + 1, weights[ring]);
+        }
+
+        // Right of the inner segment
+        for (int c = inner_last + 1; c <= last_col; c++)
+            add_to_depths(sums, nearest[c - col], num_depths, line + c, 1,
+                          weights[c - col]);
+    }
+
+    // Depth zero leaves the cell as it is
+    if (depths[0] == 0)
+        sums[0] = matrix[row * matrix_cols + col];
+}
+
+/**
+ * @brief Runs the multi-depth kernel over one thread's share of a band.
+ *
+ * @param arg The kernel_task describing the share.
+ * @return NULL; the outcome is stored in the task's result.
+ */
+static void* run_multi_task(void *arg)
+{
+    kernel_task *task = arg;
+    int cols = task->matrix_cols;
+    int depth = task->depths[task->num_depths - 1];
+    int *nearest = malloc((depth + 2) * sizeof(int));
+    int *sums = malloc(task->num_depths * sizeof(int));
+
+    task->result = 0;
+    if (!nearest || !sums) {
+        fprintf(stderr, "Failed to allocate multi-depth sums\n");
+        free(nearest);
+        free(sums);
+        task->result = -1;
+        return NULL;
+    }
+    // Ring 1 is looked up even at zero depth, where it is out of reach
+    for (int ring = 0, k = 0; ring <= depth + 1; ring++) {
+        while (k < task->num_depths && task->depths[k] < ring)
+            k++;
+        nearest[ring] = k;
+    }
+
+    for (int row = task->first_row; row < task->first_row + task->num_rows;
+         row++) {
+        size_t offset = (size_t)(row - task->first_row) * cols;
+        for (int col = 0; col < cols; col++) {
+            convolve_cell_multi(row, col, task->matrix, task->matrix_rows,
+                                cols, task->depths, task->num_depths,
+                                task->weights, nearest, sums);
+            for (int k = 0; k < task->num_depths; k++)
+                task->outputs[k][offset + col] = sums[k];
+        }
+    }
+    free(nearest);
+    free(sums);
+    return NULL;
+}
+
+/**
+ * @brief Runs a kernel over one thread's share of a band.
+ *
+ * @param arg The kernel_task describing the share.
+ * @return NULL; the outcome is stored in the task's result.
+ */
+static void* run_kernel_task(void *arg)
+{
+    kernel_task *task = arg;
+    int cols = task->matrix_cols;
+    int last_row = task->first_row + task->num_rows;
+    int tile = task->config->tile_cols;
+
+    task->result = 0;
+    if (task->config->kernel == KERNEL_NAIVE) {
+        task->result = convolve_rows(task->matrix, task->matrix_rows, cols,
+                                     task->first_row, task->num_rows,
+                                     task->depth, task->output);
+        for (int i = 0; task->stats && i < task->num_rows; i++)
+            stats_add_row(task->stats, task->output + i * cols, cols,
+                          task->output_row + i);
+        return NULL;
+    }
+
+    // The clipped kernel is the blocked kernel with one full-width tile
+    if (task->config->kernel != KERNEL_BLOCKED || tile <= 0)
+        tile = cols;
+
+    for (int tile_start = 0; tile_start < cols; tile_start += tile) {
+        int tile_end = tile_start + tile > cols ? cols : tile_start + tile;
+        for (int row = task->first_row; row < last_row; row++) {
+            int *output_row = task->output + (row - task->first_row) * cols;
+            for (int col = tile_start; col < tile_end; col++) {
+                output_row[col] = task->depth == 0 ?
+                    task->matrix[row * cols + col] :
+                    convolve_cell_clipped(row, col, task->matrix,
+                                          task->matrix_rows, cols,
+                                          task->depth, task->weights);
+            }
+
+            // The row is finished with its last tile, and still in cache
+            if (task->stats && tile_end == cols)
+                stats_add_row(task->stats, output_row, cols,
+                              task->output_row + row - task->first_row);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs the clipped kernel over one thread's share of a region.
+ *
+ * @param arg The kernel_task describing the share.
+ * @return NULL; the outcome is stored in the task's result.
+ */
+static void* run_region_task(void *arg)
+{
+    kernel_task *task = arg;
+    int cols = task->matrix_cols;
+
+    task->result = 0;
+    for (int row = task->first_row; row < task->first_row + task->num_rows;
+         row++) {
+        int *output_row = task->output +
+                          (size_t)(row - task->first_row) * task->num_cols;
+        for (int i = 0; i < task->num_cols; i++) {
+            int col = task->first_col + i;
+            output_row[i] = task->depth == 0 ?
+                task->matrix[row * cols + col] :
+                convolve_cell_clipped(row, col, task->matrix,
+                                      task->matrix_rows, cols,
+                                      task->depth, task->weights);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Decide how many threads share a band.
+ *
+ * @param threads Threads requested.
+ * @param num_rows Rows in the band.
+ * @return Threads to use, at least one and at most one per row.
+ */
+static int split_threads(int threads, int num_rows)
+{
+    if (threads > num_rows)
+        threads = num_rows;
+    if (threads > MAX_KERNEL_THREADS)
+        threads = MAX_KERNEL_THREADS;
+    return threads < 1 ? 1 : threads;
+}
+
+/**
+ * @brief Run each task on its own thread and wait for them all.
+ *
+ * @param tasks Shares of the band, one per thread.
+ * @param num_threads Number of tasks.
+ * @param body Function that runs a task.
+ * @return 0 on success, -1 if a thread fails to start or a task fails.
+ */
+static int run_tasks(kernel_task *tasks, int num_threads,
+                     void *(*body)(void *))
+{
+    pthread_t threads[MAX_KERNEL_THREADS];
+    int result = 0;
+
+    // The calling thread runs the first share itself
+    int started = 1;
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL,
+                           body, &tasks[started]) != 0) {
+            fprintf(stderr, "Failed to start kernel thread\n");
+            result = -1;
+            break;
+        }
+    }
+    body(&tasks[0]);
+    for (int t = 1; t < started; t++)
+        pthread_join(threads[t], NULL);
+    for (int t = 0; t < started; t++)
+        if (tasks[t].result == -1)
+            result = -1;
+    return result;
+}
+
+/**
+ * @brief Applies convolution to a band of rows with a chosen kernel.
+ *
+ * @param config Kernel configuration to run.
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth for convolution operation.
+ * @param output Buffer of num_rows * matrix_cols cells for the results.
+ * @return 0 on success, -1 on failure.
+ */
+int convolve_rows_with( const kernel_config_t *config,
+                        int *matrix, int matrix_rows, int matrix_cols,
+                        int first_row, int num_rows, int depth, int *output)
+{
+    return convolve_rows_stats(config, matrix, matrix_rows, matrix_cols,
+                               first_row, num_rows, depth, output, 0, NULL);
+}
+
+/**
+ * @brief Applies convolution to a band of rows with a chosen kernel,
+ *        gathering statistics of the results.
+ *
+ * @param config Kernel configuration to run.
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth for convolution operation.
+ * @param output Buffer of num_rows * matrix_cols cells for the results.
+ * @param output_row Row of the whole output that the band's first row is.
+ * @param stats Statistics to add the results to (may be NULL).
+ * @return 0 on success, -1 on failure.
+ */
+int convolve_rows_stats(const kernel_config_t *config,
+                        int *matrix, int matrix_rows, int matrix_cols,
+                        int first_row, int num_rows, int depth, int *output,
+                        int output_row, output_stats_t *stats)
+{
+    kernel_task tasks[MAX_KERNEL_THREADS];
+    output_stats_t *thread_stats = NULL;
+    int num_threads = split_threads(config->threads, num_rows);
+    int result;
+
+    if (!matrix || !output || matrix_rows <= 0 || matrix_cols <= 0 ||
+        depth < 0 || first_row < 0 || num_rows < 0 ||
+        first_row + num_rows > matrix_rows) {
+        fprintf(stderr, "Invalid input parameters for convolve_rows_with\n");
+        return -1;
+    }
+
+    double *weights = malloc((depth + 1) * sizeof(double));
+    if (stats)
+        thread_stats = malloc(num_threads * sizeof(output_stats_t));
+    if (!weights || (stats && !thread_stats)) {
+        fprintf(stderr, "Failed to allocate convolution weights\n");
+        free(weights);
+        free(thread_stats);
+        return -1;
+    }
+    for (int ring = 0; ring <= depth; ring++)
+        weights[ring] = 1 / (double)(ring + 1);
+
+    // Split the band's rows as evenly as possible between the threads,
+    // each gathering its own statistics
+    for (int t = 0; t < num_threads; t++) {
+        int start = num_rows * t / num_threads;
+        int end = num_rows * (t + 1) / num_threads;
+        tasks[t] = (kernel_task) {
+            config, weights, matrix, matrix_rows, matrix_cols,
+            first_row + start, end - start, depth,
+            output + start * matrix_cols, 0, NULL, 0, NULL, 0, 0,
+            stats ? &thread_stats[t] : NULL, output_row + start
+        };
+        if (stats)
+            stats_init(&thread_stats[t]);
+    }
+
+    result = run_tasks(tasks, num_threads, run_kernel_task);
+    for (int t = 0; stats && t < num_threads; t++)
+        stats_merge(stats, &thread_stats[t]);
+    free(thread_stats);
+    free(weights);
+    return result;
+}
+
+/**
+ * @brief Applies convolution to a rectangular region of a matrix.
+ *
+ * @param config Kernel configuration (only the thread count is used).
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the region.
+ * @param num_rows Number of rows in the region.
+ * @param first_col First column of the region.
+ * @param num_cols Number of columns in the region.
+ * @param depth Depth for convolution operation.
+ * @param output Output buffer of num_rows * num_cols cells.
+ * @return 0 on success, -1 on failure.
+ */
+int convolve_region(const kernel_config_t *config,
+                    int *matrix, int matrix_rows, int matrix_cols,
+                    int first_row, int num_rows, int first_col, int num_cols,
+                    int depth, int *output)
+{
+    kernel_task tasks[MAX_KERNEL_THREADS];
+    int num_threads = split_threads(config->threads, num_rows);
+    int result;
+
+    if (!matrix || !output || matrix_rows <= 0 || matrix_cols <= 0 ||
+        depth < 0 || first_row < 0 || num_rows < 0 ||
+        first_row + num_rows > matrix_rows || first_col < 0 ||
+        num_cols < 0 || first_col + num_cols > matrix_cols) {
+        fprintf(stderr, "Invalid input parameters for convolve_region\n");
+        return -1;
+    }
+
+    double *weights = malloc((depth + 1) * sizeof(double));
+    if (!weights) {
+        fprintf(stderr, "Failed to allocate convolution weights\n");
+        return -1;
+    }
+    for (int ring = 0; ring <= depth; ring++)
+        weights[ring] = 1 / (double)(ring + 1);
+
+    for (int t = 0; t < num_threads; t++) {
+        int start = num_rows * t / num_threads;
+        int end = num_rows * (t + 1) / num_threads;
+        tasks[t] = (kernel_task) {
+            config, weights, matrix, matrix_rows, matrix_cols,
+            first_row + start, end - start, depth,
+            output + (size_t) start * num_cols, 0, NULL, 0, NULL,
+            first_col, num_cols
+        };
+    }
+
+    result = run_tasks(tasks, num_threads, run_region_task);
+    free(weights);
+    return result;
+}
+
+/**
+ * @brief Applies convolution at several depths to a band of rows at once.
+ *
+ * @param config Kernel configuration (only the thread count is used).
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depths Depths to compute, in ascending order.
+ * @param num_depths Number of depths.
+ * @param outputs One buffer of num_rows * matrix_cols cells per depth.
+ * @return 0 on success, -1 on failure.
+ */
+int convolve_rows_multi(const kernel_config_t *config,
+                        int *matrix, int matrix_rows, int matrix_cols,
+                        int first_row, int num_rows,
+                        const int *depths, int num_depths, int **outputs)
+{
+    kernel_task tasks[MAX_KERNEL_THREADS];
+    int num_threads = split_threads(config->threads, num_rows);
+    int result;
+
+    if (!matrix || !outputs || !depths || num_depths <= 0 ||
+        matrix_rows <= 0 || matrix_cols <= 0 || depths[0] < 0 ||
+        first_row < 0 || num_rows < 0 || first_row + num_rows > matrix_rows) {
+        fprintf(stderr, "Invalid input parameters for convolve_rows_multi\n");
+        return -1;
+    }
+
+    int depth = depths[num_depths - 1];
+    double *weights = malloc((depth + 1) * sizeof(double));
+    int **shares = malloc((size_t) num_threads * num_depths * sizeof(int *));
+    if (!weights || !shares) {
+        fprintf(stderr, "Failed to allocate convolution weights\n");
+        free(weights);
+        free(shares);
+        return -1;
+    }
+    for (int ring = 0; ring <= depth; ring++)
+        weights[ring] = 1 / (double)(ring + 1);
+
+    // Split the band's rows as evenly as possible between the threads
+    for (int t = 0; t < num_threads; t++) {
+        int start = num_rows * t / num_threads;
+        int end = num_rows * (t + 1) / num_threads;
+        int **share = shares + t * num_depths;
+        for (int k = 0; k < num_depths; k++)
+            share[k] = outputs[k] + (size_t) start * matrix_cols;
+        tasks[t] = (kernel_task) {
+            config, weights, matrix, matrix_rows, matrix_cols,
+            first_row + start, end - start, depth, NULL, 0,
+            depths, num_depths, share, 0, 0
+        };
+    }
+
+    result = run_tasks(tasks, num_threads, run_multi_task);
+    free(weights);
+    free(shares);
+    return result;
+}
+
+/**
+ * @brief Convolves the same cell of a group of interleaved matrices.
+ *
+ * Visits the neighbours in the same order as apply_convolution, adding
+ * each one to the sums of all BATCH_LANES matrices at once.
+ *
+ * @param row Row coordinate of the cell.
+ * @param col Column coordinate of the cell.
+ * @param lanes The group's matrices, interleaved cell by cell.
+ * @param matrix_size Size of the matrices.
+ * @param depth Depth for convolution operation.
+ * @param weights Weight of each ring, weights[ring] = 1 / (ring + 1).
+ * @param [out] sums Weighted sum of the cell in each matrix.
+ */
+static void convolve_cell_batch(int row, int col, const int *lanes,
+                                int matrix_size, int depth,
+                                const double *weights, int *sums)
+{
+    int first_row = row - depth < 0 ? 0 : row - depth;
+    int last_row = row + depth >= matrix_size ? matrix_size - 1 : row + depth;
+    int first_col = col - depth < 0 ? 0 : col - depth;
+    int last_col = col + depth >= matrix_size ? matrix_size - 1 : col + depth;
+
+    for (int lane = 0; lane < BATCH_LANES; lane++)
+        sums[lane] = 0;
+
+    for (int r = first_row; r <= last_row; r++) {
+        const int *line = lanes + (size_t) r * matrix_size * BATCH_LANES;
+        int row_ring = abs(r - row);
+
+        for (int c = first_col; c <= last_col; c++) {
+            int ring = abs(c - col) > row_ring ? abs(c - col) : row_ring;
+            const int *values = line + (size_t) c * BATCH_LANES;
+            double weight = weights[ring];
+
+            // The cell itself is not its own neighbour
+            if (ring == 0)
+                continue;
+            for (int lane = 0; lane < BATCH_LANES; lane++)
+                sums[lane] += values[lane] * weight;
+        }
+    }
+}
+
+/**
+ * @brief Runs the batch kernel over one thread's share of the groups.
+ *
+ * @param arg The kernel_task describing the share.
+ * @return NULL; the outcome is stored in the task's result.
+ */
+static void* run_batch_task(void *arg)
+{
+    kernel_task *task = arg;
+    int size = task->matrix_cols;
+    size_t cells = (size_t) size * size;
+    int *lanes = malloc(cells * BATCH_LANES * sizeof(int));
+    int *sums = malloc(cells * BATCH_LANES * sizeof(int));
+
+    task->result = lanes && sums ? 0 : -1;
+    for (int group = task->first_row;
+         task->result == 0 && group < task->first_row + task->num_rows;
+         group++) {
+        int first = group * BATCH_LANES;
+        int count = task->num_matrices - first < BATCH_LANES ?
+                    task->num_matrices - first : BATCH_LANES;
+
+        // Interleave the group, padding a short one with empty lanes
+        for (size_t i = 0; i < cells; i++) {
+            for (int lane = 0; lane < BATCH_LANES; lane++)
+                lanes[i * BATCH_LANES + lane] =
+                    lane < count ? task->inputs[first + lane][i] : 0;
+        }
+
+        for (int row = 0; row < size; row++)
+            for (int col = 0; col < size; col++)
+                convolve_cell_batch(row, col, lanes, size, task->depth,
+                                    task->weights,
+                                    sums + ((size_t) row * size + col) *
+                                           BATCH_LANES);
+
+        for (int lane = 0; lane < count; lane++) {
+            int *output = task->outputs[first + lane];
+            for (size_t i = 0; i < cells; i++)
+                output[i] = sums[i * BATCH_LANES + lane];
+        }
+    }
+    free(lanes);
+    free(sums);
+    return NULL;
+}
+
+/**
+ * @brief Applies convolution to a batch of same-sized matrices.
+ *
+ * @param config Kernel configuration (only the thread count is used).
+ * @param matrices The input matrices.
+ * @param num_matrices Number of matrices.
+ * @param matrix_size Size of every matrix.
+ * @param depth Depth for convolution operation.
+ * @param outputs One buffer of matrix_size * matrix_size cells per matrix.
+ * @return 0 on success, -1 on failure.
+ */
+int convolve_batch(const kernel_config_t *config, int **matrices,
+                   int num_matrices, int matrix_size, int depth,
+                   int **outputs)
+{
+    kernel_task tasks[MAX_KERNEL_THREADS];
+    int num_groups = (num_matrices + BATCH_LANES - 1) / BATCH_LANES;
+    int num_threads = split_threads(config->threads, num_groups);
+    int result;
+
+    if (!matrices || !outputs || num_matrices < 0 || matrix_size <= 0 ||
+        depth < 0) {
+        fprintf(stderr, "Invalid input parameters for convolve_batch\n");
+        return -1;
+    }
+
+    // Depth zero leaves the matrices as they are
+    if (depth == 0) {
+        for (int m = 0; m < num_matrices; m++)
+            memcpy(outputs[m], matrices[m],
+                   (size_t) matrix_size * matrix_size * sizeof(int));
+        return 0;
+    }
+
+    double *weights = malloc((depth + 1) * sizeof(double));
+    if (!weights) {
+        fprintf(stderr, "Failed to allocate convolution weights\n");
+        return -1;
+    }
+    for (int ring = 0; ring <= depth; ring++)
+        weights[ring] = 1 / (double)(ring + 1);
+
+    // Split the groups as evenly as possible between the threads
+    for (int t = 0; t < num_threads; t++) {
+        int start = num_groups * t / num_threads;
+        int end = num_groups * (t + 1) / num_threads;
+        tasks[t] = (kernel_task) {
+            config, weights, NULL, matrix_size, matrix_size, start,
+            end - start, depth, NULL, 0, NULL, 0, outputs, 0, 0, NULL, 0,
+            matrices, num_matrices
+        };
+    }
+
+    result = run_tasks(tasks, num_threads, run_batch_task);
+    free(weights);
+    return result;
+}
+
+/**
+ * @brief Parse a kernel configuration of the form NAME[:TILE[:THREADS]].
+ *
+ * @param spec Text to parse, e.g. "blocked:64:4".
+ * @param [out] config Parsed configuration.
+ * @return 0 on success, -1 if the text is not a valid configuration.
+ */
+int kernel_config_from_string(const char *spec, kernel_config_t *config)
+{
+    size_t name_length = strcspn(spec, ":");
+    const char *rest = spec + name_length;
+
+    config->kernel = NUM_KERNELS;
+    config->tile_cols = 0;
+    config->threads = 1;
+    for (int kernel = 0; kernel < NUM_KERNELS; kernel++) {
+        if (strlen(kernel_names[kernel]) == name_length &&
+            strncmp(spec, kernel_names[kernel], name_length) == 0)
+            config->kernel = kernel;
+    }
+    if (config->kernel == NUM_KERNELS)
+        return -1;
+
+    if (*rest == ':')
+        config->tile_cols = atoi(++rest);
+    rest += strcspn(rest, ":");
+    if (*rest == ':')
+        config->threads = atoi(++rest);
+
+    if (config->tile_cols < 0 ||
+        config->threads < 1 || config->threads > MAX_KERNEL_THREADS)
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief Format a kernel configuration as NAME:TILE:THREADS.
+ *
+ * @param config Configuration to format.
+ * @param buffer Buffer for the text.
+ * @param size Size of the buffer.
+ * @return buffer.
+ */
+char* kernel_config_to_string(const kernel_config_t *config,
+                              char *buffer, int size)
+{
+    snprintf(buffer, size, "%s:%d:%d", kernel_names[config->kernel],
+             config->tile_cols, config->threads);
+    return buffer;
+}
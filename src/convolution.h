@@ -9,6 +9,33 @@
 #ifndef CONVOLUTION_H
 #define CONVOLUTION_H
 
+#include "stats.h"
+
+#define MAX_KERNEL_THREADS 256  /* Upper limit on threads per process */
+#define BATCH_LANES         16   /* Matrices interleaved by convolve_batch */
+
+/**
+ * @brief Implementations of the convolution of a band of rows.
+ *
+ * All kernels accumulate each cell's neighbours in the same order with the
+ * same arithmetic as apply_convolution, so they give identical results.
+ */
+typedef enum {
+    KERNEL_NAIVE,       /* apply_convolution on every cell */
+    KERNEL_CLIPPED,     /* Neighbourhood clipped once per cell, table weights */
+    KERNEL_BLOCKED,     /* Clipped, visiting the band in column tiles */
+    NUM_KERNELS
+} kernel_t;
+
+/**
+ * @brief A kernel together with its tuning parameters.
+ */
+typedef struct {
+    kernel_t    kernel;     /* Kernel implementation */
+    int         tile_cols;  /* Columns per tile (blocked kernel only) */
+    int         threads;    /* Threads splitting the band's rows */
+} kernel_config_t;
+
 /**
  * @brief Applies convolution operation on the specified cell of the matrix.
  * 
@@ -29,4 +56,180 @@
 int apply_convolution(  int row, int col, int *matrix, 
                         int matrix_rows, int matrix_cols, int depth);
 
+/**
+ * @brief Applies convolution to a band of consecutive rows.
+ *
+ * Each row in [first_row, first_row + num_rows) of the matrix is convolved
+ * and written to the output buffer, whose row 0 corresponds to first_row.
+ *
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth for convolution operation.
+ * @param output Buffer of num_rows * matrix_cols cells for the results.
+ * @return 0 on success, -1 if any cell fails to convolve.
+ */
+int convolve_rows(  int *matrix, int matrix_rows, int matrix_cols,
+                    int first_row, int num_rows, int depth, int *output);
+
+/**
+ * @brief Applies convolution to a band of rows, overwriting the input.
+ *
+ * Results are held in a rolling window of depth + 1 rows and each result
+ * row is written back over its input row once no later row of the band
+ * needs that input any more. The rows outside the band are left untouched.
+ *
+ * @param matrix Pointer to the (padded) matrix, updated in place.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth for convolution operation.
+ * @param window Scratch buffer of (depth + 1) * matrix_cols cells.
+ * @return 0 on success, -1 if any cell fails to convolve.
+ */
+int convolve_rows_in_place( int *matrix, int matrix_rows, int matrix_cols,
+                            int first_row, int num_rows, int depth,
+                            int *window, const kernel_config_t *config);
+
+/**
+ * @brief Applies convolution to a band of rows with a chosen kernel.
+ *
+ * Same contract as convolve_rows, but runs the given kernel configuration,
+ * splitting the band's rows across config->threads threads.
+ *
+ * @param config Kernel configuration to run.
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth for convolution operation.
+ * @param output Buffer of num_rows * matrix_cols cells for the results.
+ * @return 0 on success, -1 on failure.
+ */
+int convolve_rows_with( const kernel_config_t *config,
+                        int *matrix, int matrix_rows, int matrix_cols,
+                        int first_row, int num_rows, int depth, int *output);
+
+/**
+ * @brief Applies convolution to a band of rows with a chosen kernel,
+ *        gathering statistics of the results.
+ *
+ * Same as convolve_rows_with, except that each output row is also added
+ * to the statistics as soon as it is finished.
+ *
+ * @param config Kernel configuration to run.
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth for convolution operation.
+ * @param output Buffer of num_rows * matrix_cols cells for the results.
+ * @param output_row Row of the whole output that the band's first row is.
+ * @param stats Statistics to add the results to (may be NULL).
+ * @return 0 on success, -1 on failure.
+ */
+int convolve_rows_stats(const kernel_config_t *config,
+                        int *matrix, int matrix_rows, int matrix_cols,
+                        int first_row, int num_rows, int depth, int *output,
+                        int output_row, output_stats_t *stats);
+
+/**
+ * @brief Applies convolution to a rectangular region of a matrix.
+ *
+ * Uses the clipped kernel, which gives the same results as
+ * apply_convolution, on just the columns of the region. The matrix must
+ * be padded for the depth above and below the region's rows; it always
+ * has full-width rows. Rows are split across config->threads threads.
+ *
+ * @param config Kernel configuration (only the thread count is used).
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the region.
+ * @param num_rows Number of rows in the region.
+ * @param first_col First column of the region.
+ * @param num_cols Number of columns in the region.
+ * @param depth Depth for convolution operation.
+ * @param output Output buffer of num_rows * num_cols cells.
+ * @return 0 on success, -1 on failure.
+ */
+int convolve_region(const kernel_config_t *config,
+                    int *matrix, int matrix_rows, int matrix_cols,
+                    int first_row, int num_rows, int first_col, int num_cols,
+                    int depth, int *output);
+
+/**
+ * @brief Applies convolution at several depths to a band of rows at once.
+ *
+ * The result at depth d is the weighted sum over rings 1 to d, so one sweep
+ * over the neighbourhood of the deepest depth serves every depth: each
+ * neighbour is loaded and weighted once and added to the sum of every
+ * depth that reaches its ring. Each depth's sum still sees its neighbours
+ * in the order apply_convolution uses, so every output is identical to a
+ * separate run at that depth. The matrix must be padded for the deepest
+ * depth. Rows are split across config->threads threads.
+ *
+ * @param config Kernel configuration (only the thread count is used).
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the matrix.
+ * @param matrix_cols Number of columns in the matrix.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depths Depths to compute, in ascending order.
+ * @param num_depths Number of depths.
+ * @param outputs One buffer of num_rows * matrix_cols cells per depth.
+ * @return 0 on success, -1 on failure.
+ */
+int convolve_rows_multi(const kernel_config_t *config,
+                        int *matrix, int matrix_rows, int matrix_cols,
+                        int first_row, int num_rows,
+                        const int *depths, int num_depths, int **outputs);
+
+/**
+ * @brief Applies convolution to a batch of same-sized matrices.
+ *
+ * Matrices too small to keep the vector units busy on their own are
+ * interleaved cell by cell in groups of BATCH_LANES, so each cell's
+ * neighbours are weighted and added for the whole group at once, one
+ * matrix per vector lane. Each matrix is convolved whole, with the
+ * neighbours in the order apply_convolution uses, so the results are
+ * identical. The groups are split across config->threads threads.
+ *
+ * @param config Kernel configuration (only the thread count is used).
+ * @param matrices The input matrices.
+ * @param num_matrices Number of matrices.
+ * @param matrix_size Size of every matrix.
+ * @param depth Depth for convolution operation.
+ * @param outputs One buffer of matrix_size * matrix_size cells per matrix.
+ * @return 0 on success, -1 on failure.
+ */
+int convolve_batch(const kernel_config_t *config, int **matrices,
+                   int num_matrices, int matrix_size, int depth,
+                   int **outputs);
+
+/**
+ * @brief Parse a kernel configuration of the form NAME[:TILE[:THREADS]].
+ *
+ * @param spec Text to parse, e.g. "blocked:64:4".
+ * @param [out] config Parsed configuration.
+ * @return 0 on success, -1 if the text is not a valid configuration.
+ */
+int kernel_config_from_string(const char *spec, kernel_config_t *config);
+
+/**
+ * @brief Format a kernel configuration as NAME:TILE:THREADS.
+ *
+ * @param config Configuration to format.
+ * @param buffer Buffer for the text.
+ * @param size Size of the buffer.
+ * @return buffer.
+ */
+char* kernel_config_to_string(const kernel_config_t *config,
+                              char *buffer, int size);
+
 #endif /* CONVOLUTION_H */
@@ -0,0 +1,205 @@
+/**
+ * @file    dynamic.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of dynamically balanced convolution over RMA windows.
+ */
+
+#include "dynamic.h"
+#include "allocator.h"
+#include "timing.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * @brief The RMA windows shared by all processes.
+ */
+typedef struct {
+    MPI_Win counter;    /* Next unclaimed chunk */
+    MPI_Win input;      /* Master's input matrix */
+    MPI_Win output;     /* Master's output matrix */
+} dynamic_windows;
+
+/**
+ * @brief Create one window, exposing memory only on the master.
+ *
+ * @param is_master Whether the caller is the master.
+ * @param base Memory to expose (master only).
+ * @param count Number of ints to expose (master only).
+ * @param comm Communicator of the processes.
+ * @param [out] win Created window.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+static int create_window(int is_master, int *base, MPI_Aint count,
+                         MPI_Comm comm, MPI_Win *win)
+{
+    int mpi_err = MPI_Win_create(is_master ? base : NULL,
+                                 is_master ? count * sizeof(int) : 0,
+                                 sizeof(int), MPI_INFO_NULL, comm, win);
+    if (mpi_err == MPI_SUCCESS)
+        MPI_Win_set_errhandler(*win, MPI_ERRORS_RETURN);
+    return mpi_err;
+}
+
+/**
+ * @brief Claim and process chunks until none are left.
+ *
+ * @param windows Shared windows, locked for access by the caller.
+ * @param master Rank holding the windows' memory.
+ * @param matrix_size Size of the (square) matrix.
+ * @param depth Depth of the convolution.
+ * @param chunk_rows Rows per chunk.
+ * @param config Kernel configuration to compute with.
+ * @param padded Buffer for a chunk's padded input rows.
+ * @param processed Buffer for a chunk's output rows.
+ * @param [out] chunks_done Number of chunks processed.
+ * @return MPI_SUCCESS, or an error code (-1 if a chunk fails to convolve).
+ */
+static int process_chunks(dynamic_windows *windows, int master,
+                          int matrix_size, int depth, int chunk_rows,
+                          const kernel_config_t *config,
+                          int *padded, int *processed, int *chunks_done)
+{
+    int num_chunks = (matrix_size + chunk_rows - 1) / chunk_rows;
+    int one = 1, chunk, mpi_err;
+
+    for (;;) {
+        // Claim the next chunk
+        timing_start(PHASE_DISTRIBUTE);
+        mpi_err = MPI_Fetch_and_op(&one, &chunk, MPI_INT, master, 0,
+                                   MPI_SUM, windows->counter);
+        if (mpi_err == MPI_SUCCESS)
+            mpi_err = MPI_Win_flush(master, windows->counter);
+        if (mpi_err != MPI_SUCCESS || chunk >= num_chunks) {
+            timing_stop(PHASE_DISTRIBUTE);
+            return mpi_err;
+        }
+
+        int first_row = chunk * chunk_rows;
+        int rows = first_row + chunk_rows > matrix_size ?
+                   matrix_size - first_row : chunk_rows;
+        int top = first_row < depth ? first_row : depth;
+        int bottom = matrix_size - (first_row + rows) < depth ?
+                     matrix_size - (first_row + rows) : depth;
+        int padded_rows = top + rows + bottom;
+
+        // Fetch its rows together with the neighbouring rows it needs
+        mpi_err = MPI_Get(padded, padded_rows * matrix_size, MPI_INT, master,
+                          (MPI_Aint)(first_row - top) * matrix_size,
+                          padded_rows * matrix_size, MPI_INT, windows->input);
+        if (mpi_err == MPI_SUCCESS)
+            mpi_err = MPI_Win_flush(master, windows->input);
+        timing_stop(PHASE_DISTRIBUTE);
+        if (mpi_err != MPI_SUCCESS)
+            return mpi_err;
+
+        timing_start(PHASE_COMPUTE);
+        int result = convolve_rows_with(config, padded, padded_rows,
+                                        matrix_size, top, rows, depth,
+                                        processed);
+        timing_stop(PHASE_COMPUTE);
+        if (result == -1)
+            return -1;
+
+        // Put the results in place; the flush lets the buffer be reused
+        timing_start(PHASE_COLLECT);
+        mpi_err = MPI_Put(processed, rows * matrix_size, MPI_INT, master,
+                          (MPI_Aint) first_row * matrix_size,
+                          rows * matrix_size, MPI_INT, windows->output);
+        if (mpi_err == MPI_SUCCESS)
+            mpi_err = MPI_Win_flush(master, windows->output);
+        timing_stop(PHASE_COLLECT);
+        if (mpi_err != MPI_SUCCESS)
+            return mpi_err;
+        (*chunks_done)++;
+    }
+}
+
+/**
+ * @brief Convolve the master's matrix with dynamically claimed chunks.
+ *
+ * @param my_rank Rank of the calling process in comm.
+ * @param master Rank holding the matrix and output.
+ * @param matrix Input matrix (master only).
+ * @param output Output matrix of the same size (master only).
+ * @param matrix_size Size of the (square) matrix.
+ * @param depth Depth of the convolution.
+ * @param chunk_rows Rows per chunk.
+ * @param config Kernel configuration to compute with.
+ * @param comm Communicator of the processes.
+ * @param [out] chunks_done Number of chunks this process processed.
+ * @return MPI_SUCCESS, or an error code (-1 if a chunk fails to convolve).
+ */
+int dynamic_convolve(int my_rank, int master, int *matrix, int *output,
+                     int matrix_size, int depth, int chunk_rows,
+                     const kernel_config_t *config, MPI_Comm comm,
+                     int *chunks_done)
+{
+    dynamic_windows windows;
+    MPI_Aint cells = (MPI_Aint) matrix_size * matrix_size;
+    int is_master = my_rank == master;
+    int next_chunk = 0, nproc, mpi_err, result;
+
+    *chunks_done = 0;
+
+    // Alone there is nothing to balance (and RMA windows may not even be
+    // available without a transport between processes)
+    MPI_Comm_size(comm, &nproc);
+    if (nproc == 1) {
+        *chunks_done = (matrix_size + chunk_rows - 1) / chunk_rows;
+        timing_start(PHASE_COMPUTE);
+        result = convolve_rows_with(config, matrix, matrix_size, matrix_size,
+                                    0, matrix_size, depth, output);
+        timing_stop(PHASE_COMPUTE);
+        return result == -1 ? -1 : MPI_SUCCESS;
+    }
+
+    int *padded = allocator_get((size_t)(chunk_rows + 2 * depth)
+                                * matrix_size * sizeof(int), 0);
+    int *processed = allocator_get((size_t) chunk_rows * matrix_size
+                                   * sizeof(int), 0);
+    if (!padded || !processed) {
+        fprintf(stderr, "P%d failed to allocate chunk buffers\n", my_rank);
+        allocator_put(padded);
+        allocator_put(processed);
+        return -1;
+    }
+
+    windows.counter = windows.input = windows.output = MPI_WIN_NULL;
+    mpi_err = create_window(is_master, &next_chunk, 1, comm,
+                            &windows.counter);
+    if (mpi_err == MPI_SUCCESS)
+        mpi_err = create_window(is_master, matrix, cells, comm,
+                                &windows.input);
+    if (mpi_err == MPI_SUCCESS)
+        mpi_err = create_window(is_master, output, cells, comm,
+                                &windows.output);
+
+    if (mpi_err == MPI_SUCCESS) {
+        // Passive target epochs: the master works on chunks like the rest
+        MPI_Win_lock_all(0, windows.counter);
+        MPI_Win_lock_all(0, windows.input);
+        MPI_Win_lock_all(0, windows.output);
+        result = process_chunks(&windows, master, matrix_size, depth,
+                                chunk_rows, config, padded, processed,
+                                chunks_done);
+        MPI_Win_unlock_all(windows.output);
+        MPI_Win_unlock_all(windows.input);
+        MPI_Win_unlock_all(windows.counter);
+
+        // Every put must have landed before the master uses the output
+        mpi_err = MPI_Barrier(comm);
+        if (result != MPI_SUCCESS)
+            mpi_err = result;
+    }
+
+    if (windows.output != MPI_WIN_NULL)
+        MPI_Win_free(&windows.output);
+    if (windows.input != MPI_WIN_NULL)
+        MPI_Win_free(&windows.input);
+    if (windows.counter != MPI_WIN_NULL)
+        MPI_Win_free(&windows.counter);
+    allocator_put(padded);
+    allocator_put(processed);
+    return mpi_err;
+}
@@ -0,0 +1,46 @@
+/**
+ * @file    dynamic.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Dynamic load balancing of the convolution with MPI one-sided calls.
+ *
+ * Instead of a fixed slab per process, the output is split into chunks of
+ * rows. Processes claim the next chunk from a shared counter on the master
+ * with MPI_Fetch_and_op, fetch the chunk's padded input rows from the
+ * master's matrix with MPI_Get, and put the processed rows into the
+ * master's output matrix with MPI_Put. Faster processes simply claim more
+ * chunks, so a slow node no longer holds up the whole job.
+ */
+
+#ifndef DYNAMIC_H
+#define DYNAMIC_H
+
+#include <mpi.h>
+#include "convolution.h"
+
+#define DYNAMIC_CHUNK_ROWS 16   /* Default rows per chunk */
+
+/**
+ * @brief Convolve the master's matrix with dynamically claimed chunks.
+ *
+ * Collective over comm. The master's matrix and output are only accessed
+ * on the master; other processes may pass NULL for both.
+ *
+ * @param my_rank Rank of the calling process in comm.
+ * @param master Rank holding the matrix and output.
+ * @param matrix Input matrix (master only).
+ * @param output Output matrix of the same size (master only).
+ * @param matrix_size Size of the (square) matrix.
+ * @param depth Depth of the convolution.
+ * @param chunk_rows Rows per chunk.
+ * @param config Kernel configuration to compute with.
+ * @param comm Communicator of the processes.
+ * @param [out] chunks_done Number of chunks this process processed.
+ * @return MPI_SUCCESS, or an error code (-1 if a chunk fails to convolve).
+ */
+int dynamic_convolve(int my_rank, int master, int *matrix, int *output,
+                     int matrix_size, int depth, int chunk_rows,
+                     const kernel_config_t *config, MPI_Comm comm,
+                     int *chunks_done);
+
+#endif /* DYNAMIC_H */
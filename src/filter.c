@@ -0,0 +1,564 @@
+/**
+ * @file    filter.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of the neighbourhood filters.
+ */
+
+#include "filter.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *filter_names[NUM_FILTERS] = {
+    "convolution",
+    "min",
+    "max",
+    "median"
+};
+
+/**
+ * @brief Arguments of one filter thread's share of a band.
+ */
+typedef struct {
+    int         filter;
+    const int   *matrix;        /* Padded input (minimum and maximum) */
+    const int   *bins;          /* Bin of each cell from row lo (median) */
+    const int   *values;        /* Value of each bin (median) */
+    int         num_bins;       /* Bins of the histogram (median) */
+    int         lo;             /* First row that bins covers (median) */
+    int         matrix_rows;
+    int         matrix_cols;
+    int         first_row;      /* First row of the share */
+    int         num_rows;       /* Rows in the share */
+    int         depth;
+    int         *output;        /* Results of the share's first row */
+    int         result;         /* 0 on success, -1 on failure */
+    output_stats_t *stats;      /* Statistics of the finished rows (or
+                                   NULL) */
+    int         output_row;     /* Row of the whole output of the share's
+                                   first row */
+} filter_task_t;
+
+/**
+ * @brief Sliding histogram of a median window.
+ */
+typedef struct {
+    int     *counts;    /* Cells in each bin */
+    int     *coarse;    /* Cells in each run of 2^FILTER_COARSE_BITS bins */
+    int     cells;      /* Cells in the window */
+    int     median;     /* Bin of the median */
+    int     below;      /* Cells in bins below the median's */
+} histogram_t;
+
+/**
+ * @brief Name of a filter, as given on the command line.
+ *
+ * @param filter Filter to name.
+ * @return The filter's name.
+ */
+const char* filter_name(int filter)
+{
+    return filter >= 0 && filter < NUM_FILTERS ?
+           filter_names[filter] : "unknown";
+}
+
+/**
+ * @brief Look up a filter by name.
+ *
+ * @param name Name of the filter.
+ * @return The filter, or -1 if there is none of that name.
+ */
+int filter_from_name(const char *name)
+{
+    for (int filter = 0; filter < NUM_FILTERS; filter++) {
+        if (strcmp(name, filter_names[filter]) == 0)
+            return filter;
+    }
+    return -1;
+}
+
+/**
+ * @brief Minimum of each window of a row, by van Herk/Gil-Werman.
+ *
+ * Cells beyond either end of the row are left out of the windows.
+ *
+ * @param values The row.
+ * @param length Length of the row.
+ * @param depth Cells either side of the centre of a window.
+ * @param forward Scratch of length + 2 * depth cells.
+ * @param backward Scratch of length + 2 * depth cells.
+ * @param [out] minima Minimum of the window centred on each value.
+ */
+static void window_minima(const int *values, int length, int depth,
+                          int *forward, int *backward, int *minima)
+{
+    int width = 2 * depth + 1, padded = length + 2 * depth;
+
+    // Running minima forwards and backwards within blocks of width cells,
+    // over the row padded with depth cells of INT_MAX at either end
+    for (int i = 0; i < padded; i++) {
+        int value = i >= depth && i < depth + length ?
+                    values[i - depth] : INT_MAX;
+        forward[i] = i % width == 0 || value < forward[i - 1] ?
+                     value : forward[i - 1];
+    }
+    for (int i = padded - 1; i >= 0; i--) {
+        int value = i >= depth && i < depth + length ?
+                    values[i - depth] : INT_MAX;
+        backward[i] = i % width == width - 1 || i == padded - 1 ||
+                      value < backward[i + 1] ? value : backward[i + 1];
+    }
+
+    // The window starting at i ends at i + width - 1, in the same block or
+    // the next
+    for (int i = 0; i < length; i++)
+        minima[i] = backward[i] < forward[i + width - 1] ?
+                    backward[i] : forward[i + width - 1];
+}
+
+/**
+ * @brief Fold a row of the input into a running minimum.
+ *
+ * @param task The share the row is read for.
+ * @param row Row of the input; rows outside it are left out.
+ * @param flip Mask complementing the values for the maximum.
+ * @param previous Running minimum so far, or NULL to start one.
+ * @param [out] running Running minimum including the row.
+ */
+static void fold_row(const filter_task_t *task, int row, int flip,
+                     const int *previous, int *running)
+{
+    int cols = task->matrix_cols;
+    const int *line = task->matrix + (size_t) row * cols;
+
+    if (row < 0 || row >= task->matrix_rows) {
+        for (int col = 0; col < cols; col++)
+            running[col] = previous ? previous[col] : INT_MAX;
+    } else if (!previous) {
+        for (int col = 0; col < cols; col++)
+            running[col] = line[col] ^ flip;
+    } else {
+        for (int col = 0; col < cols; col++) {
+            int value = line[col] ^ flip;
+            running[col] = value < previous[col] ? value : previous[col];
+        }
+    }
+}
+
+/**
+ * @brief Minimum or maximum filter of one thread's share of a band.
+ *
+ * Down the columns, van Herk/Gil-Werman runs a whole row at a time: the
+ * share's windows are taken a block of 2 * depth + 1 at a time, from the
+ * backward running minima of the block's rows and the forward ones of the
+ * next block's. Along the rows it runs on each row of column minima.
+ *
+ * The maximum is the minimum of the bitwise complements, complemented:
+ * complementing reverses the order of ints without overflowing.
+ *
+ * @param task The share, with its filter.
+ */
+static void extreme_rows(filter_task_t *task)
+{
+    int cols = task->matrix_cols, depth = task->depth;
+    int width = 2 * depth + 1, top = task->first_row - depth;
+    int flip = task->filter == FILTER_MAX ? ~0 : 0;
+    int *backward = malloc((size_t) width * cols * sizeof(int));
+    int *forward = malloc((size_t) width * cols * sizeof(int));
+    int *column_minima = malloc(cols * sizeof(int));
+    int *scratch = malloc(2 * ((size_t) cols + 2 * depth) * sizeof(int));
+
+    task->result = backward && forward && column_minima && scratch ? 0 : -1;
+
+    // Window k of a block spans rows top + start + k to that + 2 * depth
+    for (int start = 0; task->result == 0 && start < task->num_rows;
+         start += width) {
+        for (int k = width - 1; k >= 0; k--)
+            fold_row(task, top + start + k, flip,
+                     k == width - 1 ? NULL : backward + (size_t)(k + 1) * cols,
+                     backward + (size_t) k * cols);
+        for (int k = 1; k < width; k++)
+            fold_row(task, top + start + width + k - 1, flip,
+                     k == 1 ? NULL : forward + (size_t)(k - 1) * cols,
+                     forward + (size_t) k * cols);
+
+        // The first window is the whole block; the others end in the next
+        for (int k = 0; k < width && start + k < task->num_rows; k++) {
+            const int *back = backward + (size_t) k * cols;
+            const int *fore = forward + (size_t) k * cols;
+            int *line = task->output + (size_t)(start + k) * cols;
+
+            for (int col = 0; col < cols; col++)
+                column_minima[col] = k == 0 || back[col] < fore[col] ?
+                                     back[col] : fore[col];
+            window_minima(column_minima, cols, depth, scratch,
+                          scratch + cols + 2 * depth, line);
+            for (int col = 0; col < cols; col++)
+                line[col] ^= flip;
+            if (task->stats)
+                stats_add_row(task->stats, line, cols,
+                              task->output_row + start + k);
+        }
+    }
+    free(backward);
+    free(forward);
+    free(column_minima);
+    free(scratch);
+}
+
+/**
+ * @brief Count a cell into or out of a median window.
+ *
+ * @param histogram Histogram of the window.
+ * @param bin Bin of the cell.
+ * @param change 1 to count the cell in, -1 to count it out.
+ */
+static void count_cell(histogram_t *histogram, int bin, int change)
+{
+    histogram->counts[bin] += change;
+    histogram->coarse[bin >> FILTER_COARSE_BITS] += change;
+    histogram->cells += change;
+    if (bin < histogram->median)
+        histogram->below += change;
+}
+
+/**
+ * @brief Count a rectangle of cells into or out of a median window.
+ *
+ * The rectangle is clipped to the rows that bins covers, which are those
+ * of the matrix within reach of the band, and to its columns.
+ *
+ * @param task The share whose window it is.
+ * @param histogram Histogram of the window.
+ * @param first_row First row of the rectangle.
+ * @param last_row Last row of the rectangle.
+ * @param first_col First column of the rectangle.
+ * @param last_col Last column of the rectangle.
+ * @param change 1 to count the cells in, -1 to count them out.
+ */
+static void count_cells(const filter_task_t *task, histogram_t *histogram,
+                        int first_row, int last_row, int first_col,
+                        int last_col, int change)
+{
+    if (first_row < task->lo)
+        first_row = task->lo;
+    if (last_row >= task->matrix_rows)
+        last_row = task->matrix_rows - 1;
+    if (first_col < 0)
+        first_col = 0;
+    if (last_col >= task->matrix_cols)
+        last_col = task->matrix_cols - 1;
+    for (int row = first_row; row <= last_row; row++) {
+        const int *line = task->bins +
+                          (size_t)(row - task->lo) * task->matrix_cols;
+        for (int col = first_col; col <= last_col; col++)
+            count_cell(histogram, line[col], change);
+    }
+}
+
+/**
+ * @brief Move the median of a window to its new place after counting.
+ *
+ * The median is the bin holding the window's lower middle cell. Runs of
+ * empty bins are skipped a coarse bin at a time.
+ *
+ * @param histogram Histogram of the window.
+ * @return Bin of the median.
+ */
+static int find_median(histogram_t *histogram)
+{
+    int middle = (histogram->cells - 1) / 2;    // Cells below the median
+    int run = 1 << FILTER_COARSE_BITS;
+
+    while (histogram->below > middle) {
+        int bin = histogram->median;
+        if (bin % run == 0 && histogram->coarse[bin / run - 1] == 0) {
+            histogram->median -= run;
+        } else {
+            histogram->median--;
+            histogram->below -= histogram->counts[histogram->median];
+        }
+    }
+    while (histogram->below + histogram->counts[histogram->median] <=
+           middle) {
+        int bin = histogram->median;
+        if (bin % run == 0 && histogram->coarse[bin / run] == 0) {
+            histogram->median += run;
+        } else {
+            histogram->below += histogram->counts[histogram->median];
+            histogram->median++;
+        }
+    }
+    return histogram->median;
+}
+
+/**
+ * @brief Median filter of one thread's share of a band.
+ *
+ * The window snakes through the share: right along one row, down, left
+ * along the next. Each step counts in the column or row of cells that
+ * enters the window and counts out the one that leaves it.
+ *
+ * @param task The share, with the bins of its rows.
+ */
+static void median_rows(filter_task_t *task)
+{
+    int cols = task->matrix_cols, depth = task->depth;
+    int coarse_bins = (task->num_bins >> FILTER_COARSE_BITS) + 1;
+    histogram_t histogram = {
+        calloc(task->num_bins, sizeof(int)),
+        calloc(coarse_bins, sizeof(int)),
+        0, 0, 0
+    };
+
+    if (!histogram.counts || !histogram.coarse) {
+        free(histogram.counts);
+        free(histogram.coarse);
+        task->result = -1;
+        return;
+    }
+
+    count_cells(task, &histogram, task->first_row - depth,
+                task->first_row + depth, 0, depth, 1);
+    for (int i = 0; i < task->num_rows; i++) {
+        int row = task->first_row + i, rightwards = i % 2 == 0;
+        int *line = task->output + (size_t) i * cols;
+
+        for (int step = 0; step < cols; step++) {
+            int col = rightwards ? step : cols - 1 - step;
+            if (step > 0 && rightwards) {
+                count_cells(task, &histogram, row - depth, row + depth,
+                            col - depth - 1, col - depth - 1, -1);
+                count_cells(task, &histogram, row - depth, row + depth,
+                            col + depth, col + depth, 1);
+            } else if (step > 0) {
+                count_cells(task, &histogram, row - depth, row + depth,
+                            col + depth + 1, col + depth + 1, -1);
+                count_cells(task, &histogram, row - depth, row + depth,
+                            col - depth, col - depth, 1);
+            }
+            line[col] = task->values[find_median(&histogram)];
+        }
+        if (task->stats)
+            stats_add_row(task->stats, line, cols, task->output_row + i);
+
+        // Down a row, at the column the row ended on
+        if (i + 1 < task->num_rows) {
+            int col = rightwards ? cols - 1 : 0;
+            count_cells(task, &histogram, row - depth, row - depth,
+                        col - depth, col + depth, -1);
+            count_cells(task, &histogram, row + depth + 1, row + depth + 1,
+                        col - depth, col + depth, 1);
+        }
+    }
+    free(histogram.counts);
+    free(histogram.coarse);
+    task->result = 0;
+}
+
+/**
+ * @brief Thread entry for one share of a band.
+ *
+ * @param arg The filter_task_t of the share.
+ * @return NULL.
+ */
+static void* run_filter_task(void *arg)
+{
+    filter_task_t *task = arg;
+
+    if (task->num_rows == 0)
+        task->result = 0;
+    else if (task->filter == FILTER_MEDIAN)
+        median_rows(task);
+    else
+        extreme_rows(task);
+    return NULL;
+}
+
+/**
+ * @brief Compare two ints for qsort.
+ *
+ * @param a First int.
+ * @param b Second int.
+ * @return Negative, zero or positive as a is below, equal to or above b.
+ */
+static int compare_ints(const void *a, const void *b)
+{
+    int x = *(const int*) a, y = *(const int*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Bin the cells of consecutive rows for the median.
+ *
+ * Values are binned by their offset from the smallest, or by rank among
+ * the distinct values if they span more than FILTER_MAX_BINS.
+ *
+ * @param matrix First of the rows.
+ * @param cells Number of cells in the rows.
+ * @param [out] bins Bin of each cell.
+ * @param [out] values Value of each bin, allocated here.
+ * @return Number of bins, or -1 if out of memory.
+ */
+static int bin_cells(const int *matrix, size_t cells, int *bins,
+                     int **values)
+{
+    int smallest = INT_MAX, largest = INT_MIN, num_bins;
+
+    for (size_t i = 0; i < cells; i++) {
+        if (matrix[i] < smallest)
+            smallest = matrix[i];
+        if (matrix[i] > largest)
+            largest = matrix[i];
+    }
+
+    if ((long) largest - smallest < FILTER_MAX_BINS) {
+        num_bins = largest - smallest + 1;
+        *values = malloc(num_bins * sizeof(int));
+        if (!*values)
+            return -1;
+        for (int bin = 0; bin < num_bins; bin++)
+            (*values)[bin] = smallest + bin;
+        for (size_t i = 0; i < cells; i++)
+            bins[i] = matrix[i] - smallest;
+        return num_bins;
+    }
+
+    // Too wide to bin by offset: rank among the sorted distinct values
+    *values = malloc(cells * sizeof(int));
+    if (!*values)
+        return -1;
+    memcpy(*values, matrix, cells * sizeof(int));
+    qsort(*values, cells, sizeof(int), compare_ints);
+    num_bins = 1;
+    for (size_t i = 1; i < cells; i++) {
+        if ((*values)[i] != (*values)[num_bins - 1])
+            (*values)[num_bins++] = (*values)[i];
+    }
+    for (size_t i = 0; i < cells; i++) {
+        const int *found = bsearch(&matrix[i], *values, num_bins,
+                                   sizeof(int), compare_ints);
+        bins[i] = found - *values;
+    }
+    return num_bins;
+}
+
+/**
+ * @brief Applies a filter to a band of consecutive rows.
+ *
+ * @param config Kernel configuration (only the thread count is used by
+ *               the filters other than the convolution).
+ * @param filter Filter to apply.
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the input matrix.
+ * @param matrix_cols Number of columns in the input matrix.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth of the neighbourhood.
+ * @param output Buffer of num_rows * matrix_cols cells for the results.
+ * @param output_row Row of the whole output that the band's first row is.
+ * @param stats Statistics to add the results to (may be NULL).
+ * @return 0 on success, -1 on failure.
+ */
+int filter_rows(const kernel_config_t *config, int filter, int *matrix,
+                int matrix_rows, int matrix_cols, int first_row,
+                int num_rows, int depth, int *output, int output_row,
+                output_stats_t *stats)
+{
+    filter_task_t tasks[MAX_KERNEL_THREADS];
+    pthread_t threads[MAX_KERNEL_THREADS];
+    output_stats_t *thread_stats = NULL;
+    int num_threads = config->threads, started, result = 0;
+    int *bins = NULL, *values = NULL, num_bins = 0, lo = 0;
+
+    if (filter == FILTER_CONVOLUTION)
+        return convolve_rows_stats(config, matrix, matrix_rows, matrix_cols,
+                                   first_row, num_rows, depth, output,
+                                   output_row, stats);
+    if (filter < 0 || filter >= NUM_FILTERS || !matrix || !output ||
+        depth < 0 || first_row < 0 || num_rows < 0 ||
+        first_row + num_rows > matrix_rows) {
+        fprintf(stderr, "Invalid input parameters for filter_rows\n");
+        return -1;
+    }
+
+    // The median bins the rows within depth of the band once, for every
+    // thread
+    if (filter == FILTER_MEDIAN && num_rows > 0) {
+        int hi = first_row + num_rows - 1 + depth;
+        size_t cells;
+
+        lo = first_row - depth < 0 ? 0 : first_row - depth;
+        if (hi >= matrix_rows)
+            hi = matrix_rows - 1;
+        cells = (size_t)(hi - lo + 1) * matrix_cols;
+        bins = malloc(cells * sizeof(int));
+        if (bins)
+            num_bins = bin_cells(matrix + (size_t) lo * matrix_cols, cells,
+                                 bins, &values);
+        if (!bins || num_bins == -1) {
+            fprintf(stderr, "Failed to allocate the median's bins\n");
+            free(bins);
+            return -1;
+        }
+        matrix_rows = hi + 1;   // Rows past the band's reach are not binned
+    }
+
+    if (num_threads > num_rows)
+        num_threads = num_rows;
+    if (num_threads > MAX_KERNEL_THREADS)
+        num_threads = MAX_KERNEL_THREADS;
+    if (num_threads < 1)
+        num_threads = 1;
+    if (stats)
+        thread_stats = malloc(num_threads * sizeof(output_stats_t));
+    if (stats && !thread_stats) {
+        fprintf(stderr, "Failed to allocate the filter's statistics\n");
+        free(bins);
+        free(values);
+        return -1;
+    }
+
+    // Each thread gathers the statistics of its own share
+    for (int t = 0; t < num_threads; t++) {
+        int start = num_rows * t / num_threads;
+        int end = num_rows * (t + 1) / num_threads;
+        tasks[t] = (filter_task_t) {
+            filter, matrix, bins, values, num_bins, lo, matrix_rows,
+            matrix_cols, first_row + start, end - start, depth,
+            output + (size_t) start * matrix_cols, 0,
+            stats ? &thread_stats[t] : NULL, output_row + start
+        };
+        if (stats)
+            stats_init(&thread_stats[t]);
+    }
+    for (started = 1; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, run_filter_task,
+                           &tasks[started]) != 0) {
+            // The calling thread takes over the shares not started
+            for (int t = started; t < num_threads; t++)
+                run_filter_task(&tasks[t]);
+            break;
+        }
+    }
+    run_filter_task(&tasks[0]);
+    for (int t = 1; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    for (int t = 0; t < num_threads; t++) {
+        if (tasks[t].result == -1)
+            result = -1;
+    }
+    for (int t = 0; stats && t < num_threads; t++)
+        stats_merge(stats, &thread_stats[t]);
+    free(thread_stats);
+    if (result == -1)
+        fprintf(stderr, "Failed to allocate the %s filter's buffers\n",
+                filter_names[filter]);
+    free(bins);
+    free(values);
+    return result;
+}
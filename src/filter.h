@@ -0,0 +1,92 @@
+/**
+ * @file    filter.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Neighbourhood filters applied in place of the convolution.
+ *
+ * Besides the weighted sum of apply_convolution, a cell can be replaced by
+ * the minimum (erosion), maximum (dilation) or median of the square of
+ * cells within depth of it. Like the convolution, the square is clipped to
+ * the matrix as by is_valid_cell, but unlike it the square includes the
+ * cell itself; a clipped square with an even number of cells takes the
+ * lower of its two middle values as the median.
+ *
+ * The minimum and maximum are separable and computed by the van Herk/
+ * Gil-Werman algorithm, down the columns and then along the rows. Each pass
+ * takes a running extreme forwards and backwards within blocks of
+ * 2 * depth + 1 cells, and every window spans at most two blocks, so a cell
+ * costs three comparisons per pass whatever the depth.
+ *
+ * The median is taken by sliding a histogram of the window's values over
+ * the band, a row to the right or left and a row down at a time, so only
+ * the cells that enter and leave the window are counted. The median is
+ * tracked from one window to the next by the count of cells below it.
+ * Values are binned by their offset from the band's smallest value, or by
+ * rank among its distinct values when they span too wide a range.
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "convolution.h"
+
+#define FILTER_MAX_BINS     (1 << 20)   /* Widest range binned by offset */
+#define FILTER_COARSE_BITS  8           /* Histogram bins per coarse bin
+                                           (log2) */
+
+/**
+ * @brief Filters applied to the neighbourhood of each cell.
+ */
+typedef enum {
+    FILTER_CONVOLUTION, /* Weighted sum of apply_convolution */
+    FILTER_MIN,         /* Smallest value (erosion) */
+    FILTER_MAX,         /* Largest value (dilation) */
+    FILTER_MEDIAN,      /* Median value */
+    NUM_FILTERS
+} filter_t;
+
+/**
+ * @brief Name of a filter, as given on the command line.
+ *
+ * The name also keys the filter's results in the result cache.
+ *
+ * @param filter Filter to name.
+ * @return The filter's name.
+ */
+const char* filter_name(int filter);
+
+/**
+ * @brief Look up a filter by name.
+ *
+ * @param name Name of the filter.
+ * @return The filter, or -1 if there is none of that name.
+ */
+int filter_from_name(const char *name);
+
+/**
+ * @brief Applies a filter to a band of consecutive rows.
+ *
+ * The convolution is passed on to convolve_rows_stats. The other filters
+ * split the band's rows across config->threads threads, which add each
+ * output row to the statistics as soon as it is finished.
+ *
+ * @param config Kernel configuration (only the thread count is used by
+ *               the filters other than the convolution).
+ * @param filter Filter to apply.
+ * @param matrix Pointer to the (padded) input matrix.
+ * @param matrix_rows Number of rows in the input matrix.
+ * @param matrix_cols Number of columns in the input matrix.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth of the neighbourhood.
+ * @param output Buffer of num_rows * matrix_cols cells for the results.
+ * @param output_row Row of the whole output that the band's first row is.
+ * @param stats Statistics to add the results to (may be NULL).
+ * @return 0 on success, -1 on failure.
+ */
+int filter_rows(const kernel_config_t *config, int filter, int *matrix,
+                int matrix_rows, int matrix_cols, int first_row,
+                int num_rows, int depth, int *output, int output_row,
+                output_stats_t *stats);
+
+#endif /* FILTER_H */
@@ -17,11 +17,30 @@
 #include <stdlib.h>
 
 // Specific library and module headers
+#include "allocator.h"
+#include "approximate.h"
+#include "async_writer.h"
+#include "batch.h"
+#include "autotune.h"
+#include "checkpoint.h"
 #include "convolution.h"
+#include "dynamic.h"
+#include "filter.h"
+#include "hierarchy.h"
+#include "incremental.h"
+#include "local.h"
 #include "mpi.h"
 #include "mpi_utils.h"
 #include "matrix.h"
 #include "matrix_utils.h"
+#include "options.h"
+#include "pipeline.h"
+#include "progress.h"
+#include "result_cache.h"
+#include "service.h"
+#include "sparse.h"
+#include "stats.h"
+#include "timing.h"
 
 // Preprocessor definitions
 #define MASTER 0   /* Master rank identifier in MPI context. */
@@ -30,7 +49,9 @@
 #define FALSE  0   /* Represents a boolean FALSE value. */
 #define UP -1      /* Represents upward direction for padding calculations. */
 #define DOWN 1     /* Represents downward direction for padding calculations. */
+#ifndef VERBOSE
 #define VERBOSE 1  /* If set, enables verbose logging. */
+#endif
 
 /**
  * @brief Macro to log formatted messages.
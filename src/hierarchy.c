@@ -0,0 +1,295 @@
+/**
+ * @file    hierarchy.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of the two-level scatter and gather.
+ */
+
+#include "hierarchy.h"
+#include "headers.h"
+
+/**
+ * @brief Count the working rows of a range of processes.
+ *
+ * @param first_rank First rank of the range.
+ * @param num_ranks Number of ranks in the range.
+ * @param nproc Number of processes in all.
+ * @param matrix_size Size of the matrix.
+ * @return Number of working rows of the range.
+ */
+static int working_rows(int first_rank, int num_ranks, int nproc,
+                        int matrix_size)
+{
+    int last_rank = first_rank + num_ranks - 1;
+
+    return (num_ranks - 1) * (matrix_size / nproc) +
+           get_working_rows(last_rank, nproc, matrix_size);
+}
+
+/**
+ * @brief Find the rows of the matrix a range of processes needs, padding
+ *        included.
+ *
+ * The slabs of consecutive processes overlap in their halos, so the rows
+ * the range needs are one band from the first slab's top to the last
+ * slab's bottom.
+ *
+ * @param first_rank First rank of the range.
+ * @param num_ranks Number of ranks in the range.
+ * @param nproc Number of processes in all.
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param [out] first_row First padded row of the range.
+ * @param [out] num_rows Number of padded rows of the range.
+ */
+static void padded_band(int first_rank, int num_ranks, int nproc,
+                        int matrix_size, int depth, int *first_row,
+                        int *num_rows)
+{
+    int last_rank = first_rank + num_ranks - 1;
+    int top = get_padding(first_rank, nproc, matrix_size, depth, UP);
+    int bottom = get_padding(last_rank, nproc, matrix_size, depth, DOWN);
+
+    *first_row = first_rank * (matrix_size / nproc) - top;
+    *num_rows = top + working_rows(first_rank, num_ranks, nproc, matrix_size)
+                + bottom;
+}
+
+/**
+ * @brief Build the node and leader communicators.
+ *
+ * @param comm Communicator of the processes.
+ * @param [out] hierarchy Hierarchy to fill in.
+ * @param [out] usable Whether every node holds a contiguous range of
+ *                     ranks; if not, the hierarchy has been freed again.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int hierarchy_create(MPI_Comm comm, hierarchy_t *hierarchy, int *usable)
+{
+    int rank, node_rank, last_rank, contiguous, mpi_err;
+    int layout[2];      // First rank and number of ranks on a node
+
+    *usable = 0;
+    hierarchy->node_comm = MPI_COMM_NULL;
+    hierarchy->leader_comm = MPI_COMM_NULL;
+    hierarchy->num_nodes = 0;
+    MPI_Comm_size(comm, &hierarchy->nproc);
+    hierarchy->node_first = NULL;
+    hierarchy->node_ranks = NULL;
+
+    MPI_Comm_rank(comm, &rank);
+    mpi_err = MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank,
+                                  MPI_INFO_NULL, &hierarchy->node_comm);
+    if (mpi_err != MPI_SUCCESS)
+        return mpi_err;
+    MPI_Comm_rank(hierarchy->node_comm, &node_rank);
+    MPI_Comm_size(hierarchy->node_comm, &hierarchy->num_ranks);
+
+    // The node's lowest rank leads it
+    mpi_err = MPI_Comm_split(comm, node_rank == 0 ? 0 : MPI_UNDEFINED, rank,
+                             &hierarchy->leader_comm);
+    if (mpi_err == MPI_SUCCESS) {
+        hierarchy->first_rank = rank;
+        mpi_err = MPI_Bcast(&hierarchy->first_rank, 1, MPI_INT, 0,
+                            hierarchy->node_comm);
+    }
+    if (mpi_err == MPI_SUCCESS)
+        mpi_err = MPI_Allreduce(&rank, &last_rank, 1, MPI_INT, MPI_MAX,
+                                hierarchy->node_comm);
+
+    // Every node must hold a contiguous range of ranks
+    contiguous = last_rank - hierarchy->first_rank + 1 ==
+                 hierarchy->num_ranks;
+    if (mpi_err == MPI_SUCCESS)
+        mpi_err = MPI_Allreduce(&contiguous, usable, 1, MPI_INT, MPI_LAND,
+                                comm);
+    if (mpi_err != MPI_SUCCESS || !*usable) {
+        hierarchy_free(hierarchy);
+        return mpi_err;
+    }
+
+    // The master keeps the layout of every node
+    if (hierarchy->leader_comm != MPI_COMM_NULL) {
+        int *layouts = NULL;
+        MPI_Comm_size(hierarchy->leader_comm, &hierarchy->num_nodes);
+        if (rank == MASTER) {
+            layouts = malloc(2 * hierarchy->num_nodes * sizeof(int));
+            hierarchy->node_first = malloc(2 * hierarchy->num_nodes *
+                                           sizeof(int));
+            if (!layouts || !hierarchy->node_first) {
+                fprintf(stderr, "Failed to allocate the node layout\n");
+                MPI_Abort(comm, EXIT_FAILURE);
+            }
+            hierarchy->node_ranks = hierarchy->node_first +
+                                    hierarchy->num_nodes;
+        }
+        layout[0] = hierarchy->first_rank;
+        layout[1] = hierarchy->num_ranks;
+        mpi_err = MPI_Gather(layout, 2, MPI_INT, layouts, 2, MPI_INT, 0,
+                             hierarchy->leader_comm);
+        for (int n = 0; rank == MASTER && n < hierarchy->num_nodes; n++) {
+            hierarchy->node_first[n] = layouts[2 * n];
+            hierarchy->node_ranks[n] = layouts[2 * n + 1];
+        }
+        free(layouts);
+    }
+    if (mpi_err != MPI_SUCCESS)
+        hierarchy_free(hierarchy);
+    return mpi_err;
+}
+
+/**
+ * @brief Free a hierarchy's communicators and tables.
+ *
+ * @param hierarchy Hierarchy to free.
+ */
+void hierarchy_free(hierarchy_t *hierarchy)
+{
+    if (hierarchy->node_comm != MPI_COMM_NULL)
+        MPI_Comm_free(&hierarchy->node_comm);
+    if (hierarchy->leader_comm != MPI_COMM_NULL)
+        MPI_Comm_free(&hierarchy->leader_comm);
+    free(hierarchy->node_first);    // node_ranks shares its allocation
+    hierarchy->node_first = NULL;
+    hierarchy->node_ranks = NULL;
+}
+
+/**
+ * @brief Scatter the padded slabs of the master's matrix through the leaders.
+ *
+ * @param hierarchy Hierarchy to scatter through.
+ * @param my_rank Rank of the calling process.
+ * @param matrix Full matrix (master only).
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param padded Buffer for this process's padded slab.
+ * @param padded_rows Number of rows in the padded slab.
+ * @param in_place Whether the master's slab is already in place at the
+ *                 top of the matrix.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int hierarchy_scatter(const hierarchy_t *hierarchy, int my_rank, int *matrix,
+                      int matrix_size, int depth, int *padded,
+                      int padded_rows, int in_place)
+{
+    int *counts = NULL, *starts = NULL, *band = NULL;
+    int band_first, band_rows, first_row, num_rows, mpi_err = MPI_SUCCESS;
+
+    padded_band(hierarchy->first_rank, hierarchy->num_ranks, hierarchy->nproc,
+                matrix_size, depth, &band_first, &band_rows);
+
+    // The master sends each leader its node's band. The master's own band
+    // starts at the top of the matrix, so it stays where it is.
+    if (hierarchy->leader_comm != MPI_COMM_NULL) {
+        int entries = hierarchy->num_nodes > hierarchy->num_ranks ?
+                      hierarchy->num_nodes : hierarchy->num_ranks;
+        counts = malloc(entries * sizeof(int));
+        starts = malloc(entries * sizeof(int));
+        band = my_rank == MASTER ? matrix :
+               allocate_matrix_uninit(band_rows, matrix_size);
+        if (!counts || !starts || !band) {
+            fprintf(stderr, "Failed to allocate the node band\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        for (int n = 0; my_rank == MASTER && n < hierarchy->num_nodes; n++) {
+            padded_band(hierarchy->node_first[n], hierarchy->node_ranks[n],
+                        hierarchy->nproc, matrix_size, depth,
+                        &first_row, &num_rows);
+            counts[n] = num_rows * matrix_size;
+            starts[n] = first_row * matrix_size;
+        }
+        mpi_err = MPI_Scatterv(matrix, counts, starts, MPI_INT,
+                               my_rank == MASTER ? MPI_IN_PLACE : band,
+                               band_rows * matrix_size, MPI_INT, 0,
+                               hierarchy->leader_comm);
+
+        // Then hands out its node's slabs from the band
+        for (int r = 0; r < hierarchy->num_ranks; r++) {
+            padded_band(hierarchy->first_rank + r, 1, hierarchy->nproc,
+                        matrix_size, depth, &first_row, &num_rows);
+            counts[r] = num_rows * matrix_size;
+            starts[r] = (first_row - band_first) * matrix_size;
+        }
+    }
+    if (mpi_err == MPI_SUCCESS)
+        mpi_err = MPI_Scatterv(band, counts, starts, MPI_INT,
+                               in_place ? MPI_IN_PLACE : padded,
+                               padded_rows * matrix_size, MPI_INT, 0,
+                               hierarchy->node_comm);
+
+    free(counts);
+    free(starts);
+    if (band != matrix)
+        safe_free(&band);
+    return mpi_err;
+}
+
+/**
+ * @brief Gather every process's result rows at the master through the
+ *        leaders.
+ *
+ * @param hierarchy Hierarchy to gather through.
+ * @param my_rank Rank of the calling process.
+ * @param rows This process's working rows of results.
+ * @param matrix_size Size of the matrix.
+ * @param matrix Matrix to gather into (master only).
+ * @param in_place Whether the master's rows are already in place at the
+ *                 top of the matrix.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int hierarchy_gather(const hierarchy_t *hierarchy, int my_rank, int *rows,
+                     int matrix_size, int *matrix, int in_place)
+{
+    int *counts = NULL, *starts = NULL, *band = NULL;
+    int nproc = hierarchy->nproc;
+    int row_cells = (matrix_size / nproc) * matrix_size;
+    int band_rows = working_rows(hierarchy->first_rank, hierarchy->num_ranks,
+                                 nproc, matrix_size);
+    int is_leader = hierarchy->leader_comm != MPI_COMM_NULL;
+    int mpi_err;
+
+    // Each leader collects its node's rows into one band. The master's
+    // band is the top of the matrix.
+    if (is_leader) {
+        int entries = hierarchy->num_nodes > hierarchy->num_ranks ?
+                      hierarchy->num_nodes : hierarchy->num_ranks;
+        counts = malloc(entries * sizeof(int));
+        starts = malloc(entries * sizeof(int));
+        band = my_rank == MASTER ? matrix :
+               allocate_matrix_uninit(band_rows, matrix_size);
+        if (!counts || !starts || !band) {
+            fprintf(stderr, "Failed to allocate the node band\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        for (int r = 0; r < hierarchy->num_ranks; r++) {
+            counts[r] = get_working_rows(hierarchy->first_rank + r, nproc,
+                                         matrix_size) * matrix_size;
+            starts[r] = r * row_cells;
+        }
+    }
+    mpi_err = MPI_Gatherv(in_place ? MPI_IN_PLACE : rows,
+                          get_working_rows(my_rank, nproc, matrix_size) *
+                              matrix_size,
+                          MPI_INT, band, counts, starts, MPI_INT, 0,
+                          hierarchy->node_comm);
+
+    // The leaders send their bands on to the master
+    if (is_leader && mpi_err == MPI_SUCCESS) {
+        for (int n = 0; my_rank == MASTER && n < hierarchy->num_nodes; n++) {
+            counts[n] = working_rows(hierarchy->node_first[n],
+                                     hierarchy->node_ranks[n], nproc,
+                                     matrix_size) * matrix_size;
+            starts[n] = hierarchy->node_first[n] * row_cells;
+        }
+        mpi_err = MPI_Gatherv(my_rank == MASTER ? MPI_IN_PLACE : band,
+                              band_rows * matrix_size, MPI_INT,
+                              matrix, counts, starts, MPI_INT, 0,
+                              hierarchy->leader_comm);
+    }
+
+    free(counts);
+    free(starts);
+    if (band != matrix)
+        safe_free(&band);
+    return mpi_err;
+}
@@ -0,0 +1,98 @@
+/**
+ * @file    hierarchy.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Two-level scatter and gather through one leader per node.
+ *
+ * A flat MPI_Scatterv or MPI_Gather from the master exchanges one message
+ * with every process, even when many of them share a remote node. Here the
+ * processes on each node (from MPI_Comm_split_type) pick their lowest rank
+ * as leader, and the leaders form a communicator of their own. The master
+ * sends each leader one contiguous band covering all of its node's padded
+ * slabs, so halo rows shared by neighbouring slabs on a node cross the
+ * network once, and the leader hands the slabs out within the node.
+ * Results are gathered the same way in reverse.
+ *
+ * This relies on each node holding a contiguous range of ranks, as block
+ * placement gives; otherwise the flat collectives should be used.
+ */
+
+#ifndef HIERARCHY_H
+#define HIERARCHY_H
+
+#include <mpi.h>
+
+/**
+ * @brief Communicators and layout of a two-level hierarchy.
+ */
+typedef struct {
+    MPI_Comm    node_comm;      /* Processes on this node */
+    MPI_Comm    leader_comm;    /* Node leaders (MPI_COMM_NULL elsewhere) */
+    int         first_rank;     /* First rank on this node */
+    int         num_ranks;      /* Number of ranks on this node */
+    int         num_nodes;      /* Number of nodes */
+    int         nproc;          /* Number of processes in all */
+    int         *node_first;    /* First rank of each node (master only) */
+    int         *node_ranks;    /* Ranks on each node (master only) */
+} hierarchy_t;
+
+/**
+ * @brief Build the node and leader communicators.
+ *
+ * Collective over comm. The master must be rank 0, which leads its node
+ * and has rank 0 among the leaders.
+ *
+ * @param comm Communicator of the processes.
+ * @param [out] hierarchy Hierarchy to fill in.
+ * @param [out] usable Whether every node holds a contiguous range of
+ *                     ranks; if not, the hierarchy has been freed again.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int hierarchy_create(MPI_Comm comm, hierarchy_t *hierarchy, int *usable);
+
+/**
+ * @brief Free a hierarchy's communicators and tables.
+ *
+ * @param hierarchy Hierarchy to free.
+ */
+void hierarchy_free(hierarchy_t *hierarchy);
+
+/**
+ * @brief Scatter the padded slabs of the master's matrix through the leaders.
+ *
+ * Collective over the hierarchy's processes.
+ *
+ * @param hierarchy Hierarchy to scatter through.
+ * @param my_rank Rank of the calling process.
+ * @param matrix Full matrix (master only).
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param padded Buffer for this process's padded slab.
+ * @param padded_rows Number of rows in the padded slab.
+ * @param in_place Whether the master's slab is already in place at the
+ *                 top of the matrix.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int hierarchy_scatter(const hierarchy_t *hierarchy, int my_rank, int *matrix,
+                      int matrix_size, int depth, int *padded,
+                      int padded_rows, int in_place);
+
+/**
+ * @brief Gather every process's result rows at the master through the
+ *        leaders.
+ *
+ * Collective over the hierarchy's processes.
+ *
+ * @param hierarchy Hierarchy to gather through.
+ * @param my_rank Rank of the calling process.
+ * @param rows This process's working rows of results.
+ * @param matrix_size Size of the matrix.
+ * @param matrix Matrix to gather into (master only).
+ * @param in_place Whether the master's rows are already in place at the
+ *                 top of the matrix.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int hierarchy_gather(const hierarchy_t *hierarchy, int my_rank, int *rows,
+                     int matrix_size, int *matrix, int in_place);
+
+#endif /* HIERARCHY_H */
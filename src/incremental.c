@@ -0,0 +1,622 @@
+/**
+ * @file    incremental.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of incremental recomputation.
+ */
+
+#include "incremental.h"
+#include "headers.h"
+#include <string.h>
+
+#define DIFF_BATCH_BYTES (4 << 20)  /* Rows of each input read when diffing */
+#define MAX_DIRTY_LINE   256        /* Longest line of a dirty rectangle file */
+
+/**
+ * @brief Order ints from smallest to largest.
+ *
+ * @param a First int.
+ * @param b Second int.
+ * @return Negative, zero or positive as a is less than, equal to or more
+ *         than b.
+ */
+static int by_value(const void *a, const void *b)
+{
+    int value_a = *(const int *) a, value_b = *(const int *) b;
+    return (value_a > value_b) - (value_a < value_b);
+}
+
+/**
+ * @brief Order regions by their columns, then by their first row.
+ *
+ * @param a First region.
+ * @param b Second region.
+ * @return Negative, zero or positive as a comes before, with or after b.
+ */
+static int by_columns(const void *a, const void *b)
+{
+    const region_t *region_a = a, *region_b = b;
+
+    if (region_a->col != region_b->col)
+        return region_a->col < region_b->col ? -1 : 1;
+    if (region_a->cols != region_b->cols)
+        return region_a->cols < region_b->cols ? -1 : 1;
+    return (region_a->row > region_b->row) - (region_a->row < region_b->row);
+}
+
+/**
+ * @brief Order regions by their first row, then by their first column.
+ *
+ * @param a First region.
+ * @param b Second region.
+ * @return Negative, zero or positive as a comes before, with or after b.
+ */
+static int by_position(const void *a, const void *b)
+{
+    const region_t *region_a = a, *region_b = b;
+
+    if (region_a->row != region_b->row)
+        return region_a->row < region_b->row ? -1 : 1;
+    return (region_a->col > region_b->col) - (region_a->col < region_b->col);
+}
+
+/**
+ * @brief Append a region to a growing list.
+ *
+ * @param regions List to append to.
+ * @param count Number of regions in the list.
+ * @param capacity Number of regions the list has room for.
+ * @param region Region to append.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int append_region(region_t **regions, int *count, int *capacity,
+                         region_t region)
+{
+    if (*count == *capacity) {
+        int grown_capacity = *capacity ? 2 * *capacity : 16;
+        region_t *grown = realloc(*regions, grown_capacity * sizeof(region_t));
+        if (!grown)
+            return -1;
+        *regions = grown;
+        *capacity = grown_capacity;
+    }
+    (*regions)[(*count)++] = region;
+    return 0;
+}
+
+/**
+ * @brief Check the previous files and start the output from the previous
+ *        output.
+ *
+ * @param options Options of the job.
+ * @param matrix_size Size of the matrix.
+ * @return 0 on success, -1 on failure.
+ */
+static int prepare_output(const options_t *options, int matrix_size)
+{
+    struct stat previous, output;
+
+    if (get_matrix_size_from_file(options->previous_output) != matrix_size ||
+        (options->previous_input &&
+         get_matrix_size_from_file(options->previous_input) != matrix_size)) {
+        fprintf(stderr, "The previous input and output must be %dx%d "
+                "matrices like the input\n", matrix_size, matrix_size);
+        return -1;
+    }
+
+    // Updating the previous output in place needs no copy
+    if (stat(options->previous_output, &previous) == 0 &&
+        stat(options->output_filename, &output) == 0 &&
+        previous.st_dev == output.st_dev && previous.st_ino == output.st_ino)
+        return 0;
+    if (copy_matrix_file(options->previous_output,
+                         options->output_filename) != 0) {
+        fprintf(stderr, "Failed to copy %s to %s\n",
+                options->previous_output, options->output_filename);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read a dirty rectangle file.
+ *
+ * Each line holds ROW COL ROWS COLS of one changed rectangle, counted
+ * from zero; blank lines and lines starting with '#' are skipped.
+ * Rectangles are clipped to the matrix.
+ *
+ * @param path Dirty rectangle file.
+ * @param matrix_size Size of the matrix.
+ * @param [out] regions Changed rectangles, to be freed by the caller.
+ * @param [out] count Number of rectangles.
+ * @return 0 on success, -1 if the file cannot be read or is malformed.
+ */
+static int read_dirty_file(const char *path, int matrix_size,
+                           region_t **regions, int *count)
+{
+    char line[MAX_DIRTY_LINE];
+    int capacity = 0, number = 0;
+    region_t region;
+
+    *regions = NULL;
+    *count = 0;
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        char *text = line + strspn(line, " \t");
+        number++;
+        if (*text == '#' || *text == '\n' || *text == '\r' || *text == '\0')
+            continue;
+        if (sscanf(text, "%d %d %d %d", &region.row, &region.col,
+                   &region.rows, &region.cols) != 4 ||
+            region.row < 0 || region.col < 0 ||
+            region.rows < 0 || region.cols < 0) {
+            fprintf(stderr, "%s:%d: expected ROW COL ROWS COLS\n",
+                    path, number);
+            break;
+        }
+        if (region.row >= matrix_size || region.col >= matrix_size)
+            continue;
+        if (region.rows > matrix_size - region.row)
+            region.rows = matrix_size - region.row;
+        if (region.cols > matrix_size - region.col)
+            region.cols = matrix_size - region.col;
+        if (region.rows > 0 && region.cols > 0 &&
+            append_region(regions, count, &capacity, region) == -1)
+            break;
+    }
+
+    int complete = feof(file);
+    fclose(file);
+    if (!complete) {
+        free(*regions);
+        *regions = NULL;
+        *count = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Find the span of changed columns in each of a band of rows.
+ *
+ * @param previous Previous input matrix file.
+ * @param current Current input matrix file.
+ * @param matrix_size Size of the matrix.
+ * @param first_row First row to compare.
+ * @param num_rows Number of rows to compare.
+ * @param [out] spans First and last changed column of each row, or -1 and
+ *                    -1 for an unchanged row.
+ * @return 0 on success, -1 if the rows could not be read.
+ */
+static int diff_rows(const char *previous, const char *current,
+                     int matrix_size, int first_row, int num_rows, int *spans)
+{
+    int batch = DIFF_BATCH_BYTES / (matrix_size * (int) sizeof(int));
+    int result = 0;
+
+    if (batch < 1)
+        batch = 1;
+    if (batch > num_rows)
+        batch = num_rows;
+    if (num_rows <= 0)
+        return 0;
+
+    int old_fd = open(previous, O_RDONLY);
+    int new_fd = open(current, O_RDONLY);
+    int *old_rows = allocate_matrix_uninit(batch, matrix_size);
+    int *new_rows = allocate_matrix_uninit(batch, matrix_size);
+    if (old_fd == -1 || new_fd == -1 || !old_rows || !new_rows)
+        result = -1;
+
+    for (int row = first_row;
+         result == 0 && row < first_row + num_rows; row += batch) {
+        int count = first_row + num_rows - row < batch ?
+                    first_row + num_rows - row : batch;
+        if (read_matrix_rows(old_fd, matrix_size, row, count, old_rows) ||
+            read_matrix_rows(new_fd, matrix_size, row, count, new_rows)) {
+            result = -1;
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            const int *old_row = old_rows + (size_t) i * matrix_size;
+            const int *new_row = new_rows + (size_t) i * matrix_size;
+            int *span = spans + 2 * (row - first_row + i);
+            span[0] = span[1] = -1;
+            if (memcmp(old_row, new_row, matrix_size * sizeof(int)) == 0)
+                continue;
+            for (int col = 0; col < matrix_size; col++) {
+                if (old_row[col] == new_row[col])
+                    continue;
+                if (span[0] == -1)
+                    span[0] = col;
+                span[1] = col;
+            }
+        }
+    }
+
+    if (old_fd != -1)
+        close(old_fd);
+    if (new_fd != -1)
+        close(new_fd);
+    safe_free(&old_rows);
+    safe_free(&new_rows);
+    return result;
+}
+
+/**
+ * @brief Find the changed regions by comparing the previous input.
+ *
+ * Every process compares its share of the rows; the spans of changed
+ * columns are then shared and grouped into rectangles of consecutive rows
+ * whose spans overlap. Collective over comm.
+ *
+ * @param options Options of the job.
+ * @param matrix_size Size of the matrix.
+ * @param comm Communicator of the processes.
+ * @param [out] regions Changed rectangles, to be freed by the caller.
+ * @param [out] count Number of rectangles.
+ * @return MPI_SUCCESS, or an error code (-1 if any process failed).
+ */
+static int find_changes(const options_t *options, int matrix_size,
+                        MPI_Comm comm, region_t **regions, int *count)
+{
+    int rank, nproc, failed, any_failed, capacity = 0, open_region = 0;
+    region_t region = {0, 0, 0, 0};
+
+    *regions = NULL;
+    *count = 0;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nproc);
+
+    // Each process compares its own rows; the last also takes any remainder
+    int rows_per_node = matrix_size / nproc;
+    int *spans = malloc(2 * (size_t) matrix_size * sizeof(int));
+    int *counts = malloc(nproc * sizeof(int));
+    int *starts = malloc(nproc * sizeof(int));
+    failed = !spans || !counts || !starts;
+    if (!failed) {
+        for (int p = 0; p < nproc; p++) {
+            starts[p] = 2 * p * rows_per_node;
+            counts[p] = 2 * (p == nproc - 1 ?
+                             matrix_size - p * rows_per_node : rows_per_node);
+        }
+        failed = diff_rows(options->previous_input, options->input_filename,
+                           matrix_size, starts[rank] / 2, counts[rank] / 2,
+                           spans + starts[rank]) == -1;
+    }
+
+    int mpi_err = MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX,
+                                comm);
+    if (mpi_err == MPI_SUCCESS && !any_failed)
+        mpi_err = MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL,
+                                 spans, counts, starts, MPI_INT, comm);
+    free(counts);
+    free(starts);
+    if (mpi_err != MPI_SUCCESS || any_failed) {
+        free(spans);
+        return mpi_err != MPI_SUCCESS ? mpi_err : -1;
+    }
+
+    // Consecutive changed rows whose spans overlap form one rectangle
+    for (int row = 0; row < matrix_size && !failed; row++) {
+        int first = spans[2 * row], last = spans[2 * row + 1];
+        if (open_region && first != -1 &&
+            first <= region.col + region.cols && last + 1 >= region.col) {
+            int end = region.col + region.cols > last + 1 ?
+                      region.col + region.cols : last + 1;
+            if (first < region.col)
+                region.col = first;
+            region.cols = end - region.col;
+            region.rows++;
+            continue;
+        }
+        if (open_region)
+            failed = append_region(regions, count, &capacity, region) == -1;
+        open_region = first != -1;
+        region = (region_t) {row, first, 1, last - first + 1};
+    }
+    if (open_region && !failed)
+        failed = append_region(regions, count, &capacity, region) == -1;
+    free(spans);
+    return failed ? -1 : MPI_SUCCESS;
+}
+
+/**
+ * @brief Dilate the changed regions by the depth and make them disjoint.
+ *
+ * The dilated regions are cut into bands at every region's top and bottom
+ * edge, the column spans covered in each band are merged, and bands with
+ * the same columns are joined back up, so no cell is recomputed twice.
+ *
+ * @param changes Changed regions; dilated in place.
+ * @param count Number of changed regions.
+ * @param depth Depth of the convolution.
+ * @param matrix_size Size of the matrix.
+ * @param [out] regions Disjoint regions to recompute, to be freed by the
+ *                      caller.
+ * @param [out] num_regions Number of regions to recompute.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int dilate_regions(region_t *changes, int count, int depth,
+                          int matrix_size, region_t **regions,
+                          int *num_regions)
+{
+    int capacity = 0, num_bounds = 0, failed = 0;
+    int *bounds = malloc(2 * (size_t) count * sizeof(int) + 1);
+    region_t *band = malloc(count * sizeof(region_t) + 1);
+
+    *regions = NULL;
+    *num_regions = 0;
+    if (!bounds || !band) {
+        free(bounds);
+        free(band);
+        return -1;
+    }
+
+    // Every cell within depth of a change may differ
+    for (int i = 0; i < count; i++) {
+        region_t *change = &changes[i];
+        int bottom = change->row + change->rows;
+        int right = change->col + change->cols;
+        change->row = change->row < depth ? 0 : change->row - depth;
+        change->col = change->col < depth ? 0 : change->col - depth;
+        bottom = matrix_size - bottom < depth ? matrix_size : bottom + depth;
+        right = matrix_size - right < depth ? matrix_size : right + depth;
+        change->rows = bottom - change->row;
+        change->cols = right - change->col;
+        bounds[num_bounds++] = change->row;
+        bounds[num_bounds++] = bottom;
+    }
+    qsort(bounds, num_bounds, sizeof(int), by_value);
+
+    for (int b = 0; b + 1 < num_bounds && !failed; b++) {
+        int top = bounds[b], bottom = bounds[b + 1], covering = 0;
+        if (top == bottom)
+            continue;
+        for (int i = 0; i < count; i++)
+            if (changes[i].row <= top &&
+                changes[i].row + changes[i].rows >= bottom)
+                band[covering++] = changes[i];
+        qsort(band, covering, sizeof(region_t), by_columns);
+
+        // Merge overlapping or touching column spans
+        for (int i = 0; i < covering && !failed;) {
+            int col = band[i].col, end = band[i].col + band[i].cols;
+            for (i++; i < covering && band[i].col <= end; i++)
+                if (band[i].col + band[i].cols > end)
+                    end = band[i].col + band[i].cols;
+            failed = append_region(regions, num_regions, &capacity,
+                                   (region_t) {top, col, bottom - top,
+                                               end - col}) == -1;
+        }
+    }
+    free(bounds);
+    free(band);
+    if (failed) {
+        free(*regions);
+        *regions = NULL;
+        *num_regions = 0;
+        return -1;
+    }
+
+    // Join bands that continue each other with the same columns
+    qsort(*regions, *num_regions, sizeof(region_t), by_columns);
+    int joined = 0;
+    for (int i = 0; i < *num_regions; i++) {
+        region_t *last = joined ? &(*regions)[joined - 1] : NULL;
+        region_t *next = &(*regions)[i];
+        if (last && last->col == next->col && last->cols == next->cols &&
+            last->row + last->rows == next->row)
+            last->rows += next->rows;
+        else
+            (*regions)[joined++] = *next;
+    }
+    *num_regions = joined;
+    qsort(*regions, *num_regions, sizeof(region_t), by_position);
+    return 0;
+}
+
+/**
+ * @brief Recompute this process's share of the regions and write it.
+ *
+ * Rows of the regions, taken in order, go to the process whose equal
+ * share of the total area they start in. Each run of rows is convolved
+ * from its padded input rows, read straight from the input file, in
+ * batches of at most INCREMENTAL_BATCH_ROWS rows.
+ *
+ * @param options Options of the job.
+ * @param regions Disjoint regions to recompute.
+ * @param num_regions Number of regions.
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param config Kernel configuration.
+ * @param my_rank Rank of the calling process.
+ * @param nproc Number of processes.
+ * @param fh Output file.
+ * @param [out] cells_done Number of cells recomputed.
+ * @return 0 on success, -1 or an MPI error code on failure.
+ */
+static int update_cells(const options_t *options, const region_t *regions,
+                        int num_regions, int matrix_size, int depth,
+                        const kernel_config_t *config, int my_rank,
+                        int nproc, MPI_File fh, long *cells_done)
+{
+    long long total = 0, before = 0;
+    int batch_rows = INCREMENTAL_BATCH_ROWS, result = 0;
+
+    for (int i = 0; i < num_regions; i++)
+        total += (long long) regions[i].rows * regions[i].cols;
+    if (total == 0)
+        return 0;
+
+    if (batch_rows > matrix_size)
+        batch_rows = matrix_size;
+    long long padded_rows = batch_rows + 2LL * depth;
+    if (padded_rows > matrix_size)
+        padded_rows = matrix_size;
+    int *padded = allocate_matrix_uninit(padded_rows, matrix_size);
+    int *cells = allocate_matrix_uninit(batch_rows, matrix_size);
+    int fd = open(options->input_filename, O_RDONLY);
+    if (!padded || !cells || fd == -1)
+        result = -1;
+
+    for (int i = 0; i < num_regions && result == 0; i++) {
+        const region_t *region = &regions[i];
+        int r = 0;
+        while (r < region->rows && result == 0) {
+            // Rows go to the process whose share of the area they start in
+            if ((before + (long long) r * region->cols) * nproc / total !=
+                my_rank) {
+                r++;
+                continue;
+            }
+            int n = 1;
+            while (r + n < region->rows && n < batch_rows &&
+                   (before + (long long)(r + n) * region->cols) * nproc /
+                       total == my_rank)
+                n++;
+
+            int first = region->row + r;
+            int top = first < depth ? 0 : first - depth;
+            int bottom = matrix_size - (first + n) < depth ?
+                         matrix_size : first + n + depth;
+            timing_start(PHASE_READ);
+            result = read_matrix_rows(fd, matrix_size, top, bottom - top,
+                                      padded);
+            timing_stop(PHASE_READ);
+            if (result != 0)
+                break;
+
+            timing_start(PHASE_COMPUTE);
+            result = convolve_region(config, padded, bottom - top,
+                                     matrix_size, first - top, n,
+                                     region->col, region->cols, depth,
+                                     cells);
+            timing_stop(PHASE_COMPUTE);
+
+            timing_start(PHASE_WRITE);
+            for (int j = 0; j < n && result == 0; j++) {
+                MPI_Offset offset = ((MPI_Offset)(first + j) * matrix_size +
+                                     region->col) * sizeof(int);
+                result = MPI_File_write_at(fh, offset,
+                                           cells + (size_t) j * region->cols,
+                                           region->cols, MPI_INT,
+                                           MPI_STATUS_IGNORE);
+            }
+            timing_stop(PHASE_WRITE);
+            *cells_done += (long) n * region->cols;
+            r += n;
+        }
+        before += (long long) region->rows * region->cols;
+    }
+
+    if (fd != -1)
+        close(fd);
+    safe_free(&padded);
+    safe_free(&cells);
+    return result;
+}
+
+/**
+ * @brief Update a previous output for the changes in the input.
+ *
+ * @param options Options of the job, with the previous output and either
+ *                the previous input or the dirty rectangle file set.
+ * @param my_rank Rank of the calling process in comm.
+ * @param matrix_size Size of the (square) matrix.
+ * @param depth Depth of the convolution.
+ * @param config Kernel configuration (only the thread count is used).
+ * @param comm Communicator of the processes.
+ * @param [out] cells_done Number of cells this process recomputed.
+ * @return MPI_SUCCESS, or an error code (-1 if any process failed).
+ */
+int incremental_convolve(const options_t *options, int my_rank,
+                         int matrix_size, int depth,
+                         const kernel_config_t *config, MPI_Comm comm,
+                         long *cells_done)
+{
+    region_t *changes = NULL, *regions = NULL;
+    int header[2] = {0, 0};     // Output ready, and rectangles in the file
+    int num_changes = 0, num_regions = 0, failed, any_failed, mpi_err;
+    int nproc;
+    MPI_File fh;
+
+    *cells_done = 0;
+    MPI_Comm_size(comm, &nproc);
+
+    // The master starts the output from the previous output and reads any
+    // dirty rectangle file
+    timing_start(PHASE_READ);
+    if (my_rank == MASTER) {
+        header[0] = prepare_output(options, matrix_size) == 0 &&
+                    (!options->dirty_file ||
+                     read_dirty_file(options->dirty_file, matrix_size,
+                                     &changes, &num_changes) == 0);
+        header[1] = num_changes;
+    }
+    mpi_err = MPI_Bcast(header, 2, MPI_INT, MASTER, comm);
+    if (mpi_err != MPI_SUCCESS || !header[0]) {
+        free(changes);
+        timing_stop(PHASE_READ);
+        return mpi_err != MPI_SUCCESS ? mpi_err : -1;
+    }
+
+    if (options->dirty_file) {
+        num_changes = header[1];
+        if (my_rank != MASTER)
+            changes = malloc(num_changes * sizeof(region_t) + 1);
+        if (!changes) {
+            fprintf(stderr, "Failed to allocate the dirty rectangles\n");
+            MPI_Abort(comm, EXIT_FAILURE);
+        }
+        mpi_err = MPI_Bcast(changes, num_changes * sizeof(region_t),
+                            MPI_BYTE, MASTER, comm);
+    } else {
+        mpi_err = find_changes(options, matrix_size, comm, &changes,
+                               &num_changes);
+    }
+    timing_stop(PHASE_READ);
+    if (mpi_err != MPI_SUCCESS) {
+        free(changes);
+        return mpi_err;
+    }
+
+    // Every process works out the same regions, so only its share is
+    // ever communicated
+    failed = dilate_regions(changes, num_changes, depth, matrix_size,
+                            &regions, &num_regions) == -1;
+    free(changes);
+    if (my_rank == MASTER && !failed) {
+        long long area = 0;
+        for (int i = 0; i < num_regions; i++)
+            area += (long long) regions[i].rows * regions[i].cols;
+        LOG("Recomputing %lld cells in %d regions (%.2f%% of the matrix)\n",
+            area, num_regions,
+            100.0 * area / ((double) matrix_size * matrix_size));
+    }
+
+    mpi_err = MPI_File_open(comm, options->output_filename, MPI_MODE_WRONLY,
+                            MPI_INFO_NULL, &fh);
+    if (mpi_err != MPI_SUCCESS) {
+        fprintf(stderr, "Error opening %s for update.\n",
+                options->output_filename);
+        free(regions);
+        return mpi_err;
+    }
+    if (!failed)
+        failed = update_cells(options, regions, num_regions, matrix_size,
+                              depth, config, my_rank, nproc, fh,
+                              cells_done) != 0;
+    free(regions);
+    if (MPI_File_close(&fh) != MPI_SUCCESS)
+        failed = 1;
+
+    mpi_err = MPI_Allreduce(&failed, &any_failed, 1, MPI_INT, MPI_MAX, comm);
+    if (mpi_err != MPI_SUCCESS)
+        return mpi_err;
+    return any_failed ? -1 : MPI_SUCCESS;
+}
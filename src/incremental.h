@@ -0,0 +1,61 @@
+/**
+ * @file    incremental.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Incremental recomputation of the cells near changed input.
+ *
+ * When only parts of the input have changed since a previous run, only
+ * the output cells within depth of a change can differ. Given the previous
+ * output and either the previous input (to find the changed cells) or an
+ * explicit list of dirty rectangles, the changed regions are dilated by
+ * the depth and made disjoint, and just those cells are recomputed from
+ * the new input and written over a copy of the previous output.
+ *
+ * The work is split between processes by dirty area rather than by matrix
+ * size. Each process reads the padded input rows of its share straight
+ * from the input file and writes its cells with MPI-IO.
+ */
+
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include <mpi.h>
+#include "convolution.h"
+#include "options.h"
+
+#define INCREMENTAL_BATCH_ROWS 256  /* Most dirty rows convolved at once */
+
+/**
+ * @brief A rectangle of cells.
+ */
+typedef struct {
+    int row;        /* First row */
+    int col;        /* First column */
+    int rows;       /* Number of rows */
+    int cols;       /* Number of columns */
+} region_t;
+
+/**
+ * @brief Update a previous output for the changes in the input.
+ *
+ * Collective over comm. The previous output must be the result of the
+ * same depth on the previous input; cells away from the changes are taken
+ * from it unchecked. The output may be the previous output itself, which
+ * is then updated in place.
+ *
+ * @param options Options of the job, with the previous output and either
+ *                the previous input or the dirty rectangle file set.
+ * @param my_rank Rank of the calling process in comm.
+ * @param matrix_size Size of the (square) matrix.
+ * @param depth Depth of the convolution.
+ * @param config Kernel configuration (only the thread count is used).
+ * @param comm Communicator of the processes.
+ * @param [out] cells_done Number of cells this process recomputed.
+ * @return MPI_SUCCESS, or an error code (-1 if any process failed).
+ */
+int incremental_convolve(const options_t *options, int my_rank,
+                         int matrix_size, int depth,
+                         const kernel_config_t *config, MPI_Comm comm,
+                         long *cells_done);
+
+#endif /* INCREMENTAL_H */
@@ -0,0 +1,187 @@
+/**
+ * @file    input_cache.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of the input matrix cache.
+ */
+
+#include "input_cache.h"
+#include "headers.h"
+#include <string.h>
+#include <sys/stat.h>
+
+/**
+ * @brief A cached matrix and the file state it was read from.
+ */
+typedef struct entry {
+    char    *path;          /* Matrix file */
+    struct stat st;         /* File state when read */
+    int     *matrix;        /* Cached matrix */
+    int     matrix_size;    /* Size of the matrix */
+    size_t  bytes;          /* Bytes held by the matrix */
+    long    last_used;      /* Fetch count when last used */
+    struct entry *next;
+} entry_t;
+
+struct input_cache {
+    entry_t *entries;
+    size_t  budget;         /* Most bytes to hold */
+    size_t  bytes;          /* Bytes held */
+    long    hits;
+    long    misses;
+};
+
+/**
+ * @brief Unlink an entry and free it.
+ *
+ * @param cache Cache holding the entry.
+ * @param link Link pointing at the entry.
+ */
+static void drop_entry(input_cache_t *cache, entry_t **link)
+{
+    entry_t *entry = *link;
+
+    *link = entry->next;
+    cache->bytes -= entry->bytes;
+    safe_free(&entry->matrix);
+    free(entry->path);
+    free(entry);
+}
+
+/**
+ * @brief Evict least recently used entries until some bytes fit.
+ *
+ * @param cache Cache to evict from.
+ * @param bytes Bytes that must fit within the budget.
+ */
+static void make_room(input_cache_t *cache, size_t bytes)
+{
+    while (cache->entries && cache->bytes + bytes > cache->budget) {
+        entry_t **oldest = &cache->entries;
+        for (entry_t **link = &cache->entries; *link; link = &(*link)->next)
+            if ((*link)->last_used < (*oldest)->last_used)
+                oldest = link;
+        LOG("Evicting %s from the input cache\n", (*oldest)->path);
+        drop_entry(cache, oldest);
+    }
+}
+
+/**
+ * @brief Copy a matrix into a new buffer.
+ *
+ * @param matrix Matrix to copy.
+ * @param matrix_size Size of the matrix.
+ * @return The copy, or NULL if out of memory.
+ */
+static int *copy_matrix(const int *matrix, int matrix_size)
+{
+    int *copy = allocate_matrix_uninit(matrix_size, matrix_size);
+    if (copy)
+        memcpy(copy, matrix, (size_t) matrix_size * matrix_size * sizeof(int));
+    return copy;
+}
+
+/**
+ * @brief Create an empty cache.
+ *
+ * @param budget Most bytes of matrices to keep.
+ * @return The cache, or NULL if out of memory.
+ */
+input_cache_t *input_cache_create(size_t budget)
+{
+    input_cache_t *cache = calloc(1, sizeof(*cache));
+    if (cache)
+        cache->budget = budget;
+    return cache;
+}
+
+/**
+ * @brief Get a private copy of an input matrix, reading it on a miss.
+ *
+ * @param cache Cache to look in.
+ * @param path Matrix file.
+ * @param [out] matrix_size Size of the matrix.
+ * @return The matrix, owned by the caller, or NULL if it cannot be read.
+ */
+int *input_cache_fetch(input_cache_t *cache, const char *path,
+                       int *matrix_size)
+{
+    struct stat st;
+    entry_t **link;
+
+    if (stat(path, &st) != 0)
+        return NULL;
+
+    for (link = &cache->entries; *link; link = &(*link)->next)
+        if (strcmp((*link)->path, path) == 0)
+            break;
+
+    // A hit only counts if the file is unchanged since it was read
+    if (*link) {
+        entry_t *entry = *link;
+        if (entry->st.st_ino == st.st_ino &&
+            entry->st.st_size == st.st_size &&
+            entry->st.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+            entry->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+            cache->hits++;
+            entry->last_used = cache->hits + cache->misses;
+            *matrix_size = entry->matrix_size;
+            return copy_matrix(entry->matrix, entry->matrix_size);
+        }
+        drop_entry(cache, link);
+    }
+
+    cache->misses++;
+    int *matrix = read_matrix_from_file(path, matrix_size);
+    if (!matrix)
+        return NULL;
+
+    size_t bytes = (size_t) *matrix_size * *matrix_size * sizeof(int);
+    if (bytes > cache->budget)
+        return matrix;      // Too big to keep
+
+    entry_t *entry = calloc(1, sizeof(*entry));
+    int *copy = copy_matrix(matrix, *matrix_size);
+    if (!entry || !copy || !(entry->path = strdup(path))) {
+        free(entry);
+        safe_free(&copy);
+        return matrix;      // Still usable, just not cached
+    }
+    make_room(cache, bytes);
+    entry->st = st;
+    entry->matrix = matrix;
+    entry->matrix_size = *matrix_size;
+    entry->bytes = bytes;
+    entry->last_used = cache->hits + cache->misses;
+    entry->next = cache->entries;
+    cache->entries = entry;
+    cache->bytes += bytes;
+    return copy;
+}
+
+/**
+ * @brief Get the cache's hit and miss counts.
+ *
+ * @param cache Cache to query.
+ * @param [out] hits Fetches served from memory.
+ * @param [out] misses Fetches that read the file.
+ */
+void input_cache_stats(const input_cache_t *cache, long *hits, long *misses)
+{
+    *hits = cache->hits;
+    *misses = cache->misses;
+}
+
+/**
+ * @brief Free a cache and every matrix in it.
+ *
+ * @param cache Cache to free (may be NULL).
+ */
+void input_cache_destroy(input_cache_t *cache)
+{
+    if (!cache)
+        return;
+    while (cache->entries)
+        drop_entry(cache, &cache->entries);
+    free(cache);
+}
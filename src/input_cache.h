@@ -0,0 +1,57 @@
+/**
+ * @file    input_cache.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Bounded in-memory cache of input matrices.
+ *
+ * Used by the service so that inputs convolved again and again are read
+ * from disk only once. Entries are keyed by path and dropped when the file
+ * changes (size, inode or modification time); when the byte budget is
+ * exceeded the least recently used entries are evicted.
+ */
+
+#ifndef INPUT_CACHE_H
+#define INPUT_CACHE_H
+
+#include <stddef.h>
+
+#define INPUT_CACHE_MB 256      /* Default cache budget in MiB */
+
+typedef struct input_cache input_cache_t;
+
+/**
+ * @brief Create an empty cache.
+ *
+ * @param budget Most bytes of matrices to keep.
+ * @return The cache, or NULL if out of memory.
+ */
+input_cache_t *input_cache_create(size_t budget);
+
+/**
+ * @brief Get a private copy of an input matrix, reading it on a miss.
+ *
+ * @param cache Cache to look in.
+ * @param path Matrix file.
+ * @param [out] matrix_size Size of the matrix.
+ * @return The matrix, owned by the caller, or NULL if it cannot be read.
+ */
+int *input_cache_fetch(input_cache_t *cache, const char *path,
+                       int *matrix_size);
+
+/**
+ * @brief Get the cache's hit and miss counts.
+ *
+ * @param cache Cache to query.
+ * @param [out] hits Fetches served from memory.
+ * @param [out] misses Fetches that read the file.
+ */
+void input_cache_stats(const input_cache_t *cache, long *hits, long *misses);
+
+/**
+ * @brief Free a cache and every matrix in it.
+ *
+ * @param cache Cache to free (may be NULL).
+ */
+void input_cache_destroy(input_cache_t *cache);
+
+#endif /* INPUT_CACHE_H */
@@ -0,0 +1,192 @@
+/**
+ * @file    local.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of the single-process convolution.
+ */
+
+#include "local.h"
+#include "headers.h"
+
+#define MAX_SPEC 64     /* Longest kernel specification */
+
+/**
+ * @brief Decide whether a job is convolved by the master alone.
+ *
+ * @param options Options of the job.
+ * @param nproc Number of processes.
+ * @param matrix_size Size of the matrix.
+ * @return Non-zero to convolve locally.
+ */
+int local_eligible(const options_t *options, int nproc, int matrix_size)
+{
+    if (options->lean || options->collective_write ||
+        options->checkpoint_dir || options->dynamic || options->pipelined ||
+        options->num_depths > 0 || options->previous_output ||
+        options->hierarchical || options->progress ||
+        options->approximate > 0 || options->result_cache_dir)
+        return 0;
+    return nproc == 1 || matrix_size <= LOCAL_MAX_SIZE;
+}
+
+/**
+ * @brief Choose the kernel for a job on one process.
+ *
+ * @param options Options of the job.
+ * @param matrix_size Size of the matrix.
+ * @param [out] config Kernel configuration to compute with.
+ * @return 0 on success, -1 if the kernel could not be chosen.
+ */
+static int select_kernel(const options_t *options, int matrix_size,
+                         kernel_config_t *config)
+{
+    char spec[MAX_SPEC];
+    int cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cores < 1)
+        cores = 1;
+    if (options->kernel || options->autotune ||
+        autotune_load(options->profile, matrix_size, options->depth, 1,
+                      config) == 0)
+        return autotune_select(options->kernel, options->autotune,
+                               options->profile, matrix_size, options->depth,
+                               1, matrix_size, cores, config);
+
+    // The default of one thread leaves cores to other processes; a lone
+    // process has them all
+    *config = (kernel_config_t) {KERNEL_CLIPPED, 0, cores};
+    fprintf(stderr, "Kernel %s (default, local)\n",
+            kernel_config_to_string(config, spec, sizeof(spec)));
+    return 0;
+}
+
+/**
+ * @brief Convolve a matrix from its nonzeros if it is sparse enough.
+ *
+ * @param options Options of the job.
+ * @param config Kernel configuration (only the thread count is used).
+ * @param matrix Input matrix.
+ * @param matrix_size Size of the matrix.
+ * @param output Buffer for the results.
+ * @param stats Statistics to add the results to, or NULL.
+ * @return 0 once convolved, 1 if the matrix is to be convolved densely, or
+ *         -1 on failure.
+ */
+static int convolve_sparse_if_sparse(const options_t *options,
+                                     const kernel_config_t *config,
+                                     const int *matrix, int matrix_size,
+                                     int *output, output_stats_t *stats)
+{
+    sparse_slab_t slab;
+    double cells;
+    long nnz;
+    int result;
+
+    if (options->sparse <= 0)
+        return 1;
+    cells = (double) matrix_size * matrix_size;
+    nnz = sparse_count(matrix, matrix_size, matrix_size);
+    fprintf(stderr, "Matrix is %.2f%% nonzero; convolving it %s\n",
+            100.0 * nnz / cells,
+            nnz <= options->sparse * cells ? "sparsely" : "densely");
+    if (nnz > options->sparse * cells)
+        return 1;
+    if (sparse_build(matrix, matrix_size, matrix_size, &slab) == -1) {
+        LOG("Failed to allocate the sparse matrix\n");
+        return -1;
+    }
+    result = sparse_convolve_rows(config, &slab, 0, matrix_size,
+                                  options->depth, output, 0, stats);
+    sparse_free(&slab);
+    return result;
+}
+
+/**
+ * @brief Convolve a matrix in this process and write the result.
+ *
+ * @param options Options of the job.
+ * @param matrix Input matrix, or NULL to read it from the input file.
+ *               Freed here.
+ * @param matrix_size Size of the given matrix.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the input could not be read, the
+ *         kernel chosen or the output written.
+ */
+int local_run(const options_t *options, int *matrix, int matrix_size)
+{
+    kernel_config_t config;
+    output_stats_t stats;
+    int *output = NULL, result;
+
+    if (!matrix) {
+        timing_start(PHASE_READ);
+        matrix = read_matrix_from_file(options->input_filename, &matrix_size);
+        timing_stop(PHASE_READ);
+        if (!matrix) {
+            LOG("Failed to read matrix from file: %s\n",
+                options->input_filename);
+            return EXIT_FAILURE;
+        }
+    }
+    LOG("Convolving a %dx%d matrix locally at depth %d\n",
+        matrix_size, matrix_size, options->depth);
+
+    // Zero depth leaves the matrix as it is
+    stats_init(&stats);
+    if (options->depth == 0 && options->stats) {
+        stats_add_rows(&stats, matrix, matrix_size, matrix_size, 0);
+    } else if (options->depth > 0) {
+        if (select_kernel(options, matrix_size, &config) == -1) {
+            safe_free(&matrix);
+            return EXIT_FAILURE;
+        }
+        output = allocate_matrix_uninit(matrix_size, matrix_size);
+        if (!output) {
+            LOG("Failed to allocate the output matrix\n");
+            safe_free(&matrix);
+            return EXIT_FAILURE;
+        }
+        timing_start(PHASE_COMPUTE);
+        if (options->filter != FILTER_CONVOLUTION) {
+            result = filter_rows(&config, options->filter, matrix,
+                                 matrix_size, matrix_size, 0, matrix_size,
+                                 options->depth, output, 0,
+                                 options->stats ? &stats : NULL);
+        } else {
+            result = convolve_sparse_if_sparse(options, &config, matrix,
+                                               matrix_size, output,
+                                               options->stats ? &stats : NULL);
+        }
+        if (result == 1)
+            result = convolve_rows_stats(&config, matrix, matrix_size,
+                                         matrix_size, 0, matrix_size,
+                                         options->depth, output, 0,
+                                         options->stats ? &stats : NULL);
+        timing_stop(PHASE_COMPUTE);
+        safe_free(&matrix);
+        if (result == -1) {
+            LOG("Failed to convolve the matrix\n");
+            safe_free(&output);
+            return EXIT_FAILURE;
+        }
+        matrix = output;
+    }
+
+    timing_start(PHASE_WRITE);
+    result = write_matrix_to_file(options->output_filename, matrix,
+                                  matrix_size);
+    timing_stop(PHASE_WRITE);
+    safe_free(&matrix);
+    if (result != 0) {
+        LOG("Failed to write matrix to output file %s.\n",
+            options->output_filename);
+        return EXIT_FAILURE;
+    }
+    LOG("Wrote the local result to %s\n", options->output_filename);
+    if (options->stats &&
+        stats_write(options->output_filename, &stats) == -1) {
+        LOG("Failed to write the statistics of %s\n",
+            options->output_filename);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
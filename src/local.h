@@ -0,0 +1,51 @@
+/**
+ * @file    local.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Convolution of a whole matrix by a single process.
+ *
+ * For small matrices, and for any job on one process, distributing the
+ * matrix costs more than it saves: the slabs are copied through
+ * MPI_Scatterv into padded buffers and the results gathered back. Here the
+ * loaded matrix is convolved directly, with the rows split between the
+ * kernel's threads. None of it needs MPI to be initialised, so the a3local
+ * program runs the same path without mpirun.
+ */
+
+#ifndef LOCAL_H
+#define LOCAL_H
+
+#include "options.h"
+
+#define LOCAL_MAX_SIZE 1024     /* Largest matrix convolved on the master
+                                   alone with several processes */
+
+/**
+ * @brief Decide whether a job is convolved by the master alone.
+ *
+ * Only the plain mode qualifies: the others replace how slabs are
+ * distributed, computed or written.
+ *
+ * @param options Options of the job.
+ * @param nproc Number of processes.
+ * @param matrix_size Size of the matrix.
+ * @return Non-zero to convolve locally.
+ */
+int local_eligible(const options_t *options, int nproc, int matrix_size);
+
+/**
+ * @brief Convolve a matrix in this process and write the result.
+ *
+ * The kernel is chosen as by autotune_select for one process, except that
+ * without a recorded or requested configuration every core is used.
+ *
+ * @param options Options of the job.
+ * @param matrix Input matrix, or NULL to read it from the input file.
+ *               Freed here.
+ * @param matrix_size Size of the given matrix.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the input could not be read, the
+ *         kernel chosen or the output written.
+ */
+int local_run(const options_t *options, int *matrix, int matrix_size);
+
+#endif /* LOCAL_H */
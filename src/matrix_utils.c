@@ -1,4 +1,6 @@
 #include "matrix_utils.h"
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 /**
  * @brief Convert 2D matrix indices to 1D index for arrays.
@@ -21,13 +23,13 @@ int get_i(int row, int col, int matrix_cols)
 void safe_free(int **int_array)
 {
     if (*int_array) {
-        free(*int_array);
+        allocator_put(*int_array);
         *int_array = NULL;
     }
 }
 
 /**
- * @brief Allocate space for a matrix.
+ * @brief Allocate space for a matrix, cleared to zero.
  * 
  * @param rows Number of rows.
  * @param cols Number of columns.
@@ -35,7 +37,8 @@ void safe_free(int **int_array)
  */
 int* allocate_matrix(int rows, int cols)
 {
-    int *int_array = (int*) calloc(rows * cols, sizeof(int));
+    int *int_array = (int*) allocator_get((size_t) rows * cols * sizeof(int),
+                                          TRUE);
     if (!int_array) {
         LOG("Failed to allocate space");
         return NULL;
@@ -43,24 +46,60 @@ int* allocate_matrix(int rows, int cols)
     return int_array;
 }
 
+/**
+ * @brief Allocate space for a matrix the caller will completely overwrite.
+ *
+ * @param rows Number of rows.
+ * @param cols Number of columns.
+ * @return int* Pointer to the allocated matrix. NULL if allocation failed.
+ */
+int* allocate_matrix_uninit(int rows, int cols)
+{
+    int *int_array = (int*) allocator_get((size_t) rows * cols * sizeof(int),
+                                          FALSE);
+    if (!int_array) {
+        LOG("Failed to allocate space");
+        return NULL;
+    }
+    return int_array;
+}
+
+/**
+ * @brief Get the number of working rows of a process.
+ *
+ * @param proc_rank Rank of the process.
+ * @param nproc Number of processes.
+ * @param matrix_size Size of the matrix (number of rows or columns).
+ * @return Number of working rows of the process.
+ */
+int get_working_rows(int proc_rank, int nproc, int matrix_size)
+{
+    int rows_per_node = matrix_size / nproc;
+
+    if (proc_rank == nproc - 1)
+        return matrix_size - proc_rank * rows_per_node;
+    return rows_per_node;
+}
+
 /**
  * @brief Get the amount of padding required for a process.
  * 
  * @param proc_rank Rank of the process.
+ * @param nproc Number of processes.
  * @param matrix_size Size of the matrix (number of rows or columns).
  * @param depth Depth of the convolution.
- * @param rows_per_node Rows assigned to each process.
  * @param direction Direction to check padding (UP = -1, DOWN = 1).
  * @return Number of rows of padding required.
  */
-int get_padding(int proc_rank, int matrix_rows, int depth,
-                int rows_per_node, int direction)
+int get_padding(int proc_rank, int nproc, int matrix_rows, int depth,
+                int direction)
 {
     if (depth == 0)
         return 0;
 
-    int start_row = proc_rank * rows_per_node;
-    int end_row = start_row + rows_per_node - 1;
+    int start_row = proc_rank * (matrix_rows / nproc);
+    int end_row = start_row + get_working_rows(proc_rank, nproc,
+                                               matrix_rows) - 1;
 
     int rows_from_edge;  // Distance from the respective edge (top or bottom)
 
@@ -85,17 +124,18 @@ int get_padding(int proc_rank, int matrix_rows, int depth,
  *        after considering padding.
  * 
  * @param proc_rank Rank of the process.
+ * @param nproc Number of processes.
  * @param matrix_size Size of the matrix (number of rows or columns).
  * @param depth Depth of the convolution.
- * @param rows_per_node Rows assigned to each process.
  * @return Total number of rows for the process after adding padding.
  */
-int get_padded_rows(int proc_rank, int matrix_size, int depth,
-                    int rows_per_node)
+int get_padded_rows(int proc_rank, int nproc, int matrix_size, int depth)
 {
-    int top_padding = get_padding(proc_rank, matrix_size, depth, rows_per_node, -1);
-    int bottom_padding = get_padding(proc_rank, matrix_size, depth, rows_per_node, 1);
-    return top_padding + rows_per_node + bottom_padding;
+    int top_padding = get_padding(proc_rank, nproc, matrix_size, depth, UP);
+    int bottom_padding = get_padding(proc_rank, nproc, matrix_size, depth,
+                                     DOWN);
+    return top_padding + get_working_rows(proc_rank, nproc, matrix_size) +
+           bottom_padding;
 }
 
 /**
@@ -124,6 +164,41 @@ int get_matrix_size_from_file(const char *filename)
     return matrix_size;
 }
 
+/**
+ * @brief Read a band of consecutive rows of a matrix file.
+ *
+ * @param fd Open matrix file.
+ * @param matrix_size Size of the matrix in the file.
+ * @param first_row First row to read.
+ * @param num_rows Number of rows to read.
+ * @param rows Buffer of num_rows x matrix_size ints to read into.
+ * @return 0 on success, -1 if the rows could not be read.
+ */
+int read_matrix_rows(int fd, int matrix_size, int first_row, int num_rows,
+                     int *rows)
+{
+    char *buffer = (char *) rows;
+    size_t remaining = (size_t) num_rows * matrix_size * sizeof(int);
+    off_t offset = (off_t) first_row * matrix_size * sizeof(int);
+
+    // The rows are contiguous in the file, so read them in one go
+    while (remaining > 0) {
+        ssize_t got = pread(fd, buffer, remaining, offset);
+        if (got < 0) {
+            perror("read failed");
+            return -1;
+        }
+        if (got == 0) {
+            fprintf(stderr, "Unexpected end of matrix file\n");
+            return -1;
+        }
+        buffer += got;
+        offset += got;
+        remaining -= got;
+    }
+    return 0;
+}
+
 /**
  * @brief Read a matrix from a file.
  * 
@@ -145,24 +220,18 @@ int* read_matrix_from_file(const char *filename, int *size) {
         return NULL;
     }
 
-    int* matrix = allocate_matrix(*size, *size);
+    int* matrix = allocate_matrix_uninit(*size, *size);
     if (!matrix) {
         LOG("Failed to allocate space for main matrix.\n");
         close(fd);
         return NULL;
     }
 
-    for (int row = 0; row < *size; row++) {
-        for (int col = 0; col < *size; col++) {
-            int cell_value;
-            if (get_slot(fd, *size, row+1, col+1, &cell_value) == -1) {
-                LOG("Failed to get slot %d,%d.\n", row, col);
-                free(matrix);
-                close(fd);
-                return NULL;
-            }
-            matrix[row * *size + col] = cell_value;
-        }
+    if (read_matrix_rows(fd, *size, 0, *size, matrix) == -1) {
+        LOG("Failed to read matrix rows.\n");
+        safe_free(&matrix);
+        close(fd);
+        return NULL;
     }
 
     close(fd);
@@ -180,28 +249,60 @@ int* read_matrix_from_file(const char *filename, int *size) {
  *        -2 if failed to close the file.
  */
 int write_matrix_to_file(const char *filename, int *matrix, int size) {
-    int fd = open(filename, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-    if (fd == -1) {
+    async_writer_t writer;
+    int result;
+
+    if (async_writer_open(&writer, filename) == -1) {
         LOG("Failed to open/create file.\n");
         return -1;
     }
 
-    for (int row = 0; row < size; row++) {
-        for (int col = 0; col < size; col++) {
-            int cell_value = matrix[row * size + col];
-            if (set_slot(fd, size, row+1, col+1, cell_value) == -1) {
-                LOG("Failed to set slot %d,%d.\n", row, col);
-                free(matrix);
-                close(fd);
-                return -1;
-            }
-        }
+    async_writer_submit(&writer, matrix, (size_t) size * size * sizeof(int),
+                        0);
+    result = async_writer_close(&writer);
+    if (result == -1)
+        LOG("Failed to write matrix.\n");
+    else if (result == -2)
+        LOG("Failed to close file");
+    return result;
+}
+
+/**
+ * @brief Copy a matrix file, sharing its blocks where the file system allows.
+ *
+ * @param source File to copy.
+ * @param target File to create or replace.
+ * @return 0 on success, -1 on failure.
+ */
+int copy_matrix_file(const char *source, const char *target)
+{
+    char buffer[MATRIX_COPY_BUFFER];
+    ssize_t got = 0;
+
+    int in = open(source, O_RDONLY);
+    if (in == -1)
+        return -1;
+    int out = open(target, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (out == -1) {
+        close(in);
+        return -1;
     }
 
-    if (close(fd) == -1) {
-        LOG("Failed to close file");
-        return -2;
+    // A reflink costs no data copying at all
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) {
+        close(in);
+        return close(out) == 0 ? 0 : -1;
     }
+#endif
+    while ((got = read(in, buffer, sizeof(buffer))) > 0)
+        if (write(out, buffer, got) != got) {
+            got = -1;
+            break;
+        }
+    close(in);
+    if (close(out) != 0 || got < 0)
+        return -1;
     return 0;
 }
 
@@ -215,8 +316,8 @@ int write_matrix_to_file(const char *filename, int *matrix, int size) {
  */
 char* matrix_to_string(int* matrix, int rows, int cols) {
     // Calculate the needed buffer size. 
-    // Assuming each number can be 10 chars long + 1 space + 1 for '\n'
-    int buffer_size = rows * (cols * 5 + 1) + 1;
+    // An int needs up to 11 chars + 1 space; the last space becomes '\n'
+    int buffer_size = rows * cols * 12 + 1;
     char* buffer = (char*)malloc(buffer_size);
 
     if (buffer == NULL) {
@@ -18,6 +18,8 @@
 #include <unistd.h>
 #include "headers.h"
 
+#define MATRIX_COPY_BUFFER (64 << 10)   /* Bytes per read when copying */
+
 /**
  * @brief Convert 2D matrix indices to 1D index for arrays.
  * 
@@ -30,13 +32,15 @@ int get_i(int row, int col, int matrix_cols);
 
 /**
  * @brief Safely free allocated memory and set pointer to NULL.
+ *
+ * Matrix buffers go back to the allocator's pool for reuse.
  * 
  * @param int_array Pointer to the int array to be freed.
  */
 void safe_free(int **int_array);
 
 /**
- * @brief Allocate space for a matrix.
+ * @brief Allocate space for a matrix, cleared to zero.
  * 
  * @param rows Number of rows.
  * @param cols Number of columns.
@@ -44,31 +48,77 @@ void safe_free(int **int_array);
  */
 int* allocate_matrix(int rows, int cols);
 
+/**
+ * @brief Allocate space for a matrix the caller will completely overwrite.
+ *
+ * Unlike allocate_matrix, the contents are left undefined, which saves
+ * clearing buffers that are about to be received or computed into.
+ *
+ * @param rows Number of rows.
+ * @param cols Number of columns.
+ * @return int* Pointer to the allocated matrix. NULL if allocation failed.
+ */
+int* allocate_matrix_uninit(int rows, int cols);
+
+/**
+ * @brief Get the number of working rows of a process.
+ *
+ * Every process has matrix_size / nproc rows, except the last, which also
+ * takes the rows left over.
+ *
+ * @param proc_rank Rank of the process.
+ * @param nproc Number of processes.
+ * @param matrix_size Size of the matrix (number of rows or columns).
+ * @return Number of working rows of the process.
+ */
+int get_working_rows(int proc_rank, int nproc, int matrix_size);
+
 /**
  * @brief Get the amount of padding required for a process.
  * 
  * @param proc_rank Rank of the process.
+ * @param nproc Number of processes.
  * @param matrix_size Size of the matrix (number of rows or columns).
  * @param depth Depth of the convolution.
- * @param rows_per_node Rows assigned to each process.
  * @param direction Direction to check padding (UP = -1, DOWN = 1).
  * @return Number of rows of padding required.
  */
-int get_padding(int proc_rank, int matrix_size, int depth,
-                int rows_per_node, int direction);
+int get_padding(int proc_rank, int nproc, int matrix_size, int depth,
+                int direction);
 
 /**
  * @brief Calculate the number of rows a process needs to handle 
  *        after considering padding.
  * 
  * @param proc_rank Rank of the process.
+ * @param nproc Number of processes.
  * @param matrix_size Size of the matrix (number of rows or columns).
  * @param depth Depth of the convolution.
- * @param rows_per_node Rows assigned to each process.
  * @return Total number of rows for the process after adding padding.
  */
-int get_padded_rows(int proc_rank, int matrix_size, int depth,
-                    int rows_per_node);
+int get_padded_rows(int proc_rank, int nproc, int matrix_size, int depth);
+
+/**
+ * @brief Get the size of a matrix from a file.
+ *
+ * @param filename Name of the file to read from.
+ * @return Size of the matrix if successful,
+ *         -1 if there's an error reading the file.
+ */
+int get_matrix_size_from_file(const char *filename);
+
+/**
+ * @brief Read a band of consecutive rows of a matrix file.
+ *
+ * @param fd Open matrix file.
+ * @param matrix_size Size of the matrix in the file.
+ * @param first_row First row to read.
+ * @param num_rows Number of rows to read.
+ * @param rows Buffer of num_rows x matrix_size ints to read into.
+ * @return 0 on success, -1 if the rows could not be read.
+ */
+int read_matrix_rows(int fd, int matrix_size, int first_row, int num_rows,
+                     int *rows);
 
 /**
  * @brief Read a matrix from a file.
@@ -81,6 +131,9 @@ int* read_matrix_from_file(const char *filename, int *matrix_size);
 
 /**
  * @brief Write a matrix to a file.
+ *
+ * The matrix goes out in large chunks through an asynchronous writer,
+ * which this waits for. It stays the caller's to free, even on failure.
  * 
  * @param filename Name of the file to write to.
  * @param matrix Pointer to the matrix to write.
@@ -91,6 +144,18 @@ int* read_matrix_from_file(const char *filename, int *matrix_size);
  */
 int write_matrix_to_file(const char *filename, int *matrix, int matrix_size);
 
+/**
+ * @brief Copy a matrix file, sharing its blocks where the file system allows.
+ *
+ * A reflink (FICLONE) costs no data copying and later writes to either
+ * file only unshare the blocks written; otherwise the data is copied.
+ *
+ * @param source File to copy.
+ * @param target File to create or replace.
+ * @return 0 on success, -1 on failure.
+ */
+int copy_matrix_file(const char *source, const char *target);
+
 /**
  * @brief Convert a matrix to a string for display.
  * 
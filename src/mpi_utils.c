@@ -11,6 +11,8 @@
 #include "mpi.h"
 #include "mpi_utils.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 /**
  * @brief Sets up the MPI environment.
@@ -20,14 +22,19 @@
  * 
  * @param [in,out] argc The number of arguments from the main function.
  * @param [in,out] argv The arguments from the main function.
+ * @param required Thread support to ask for.
+ * @param [out] provided Thread support MPI provides.
  * @param [out] rank The rank of the current process.
  * @param [out] nproc The total number of processes.
  */
-void mpi_setup(int *argc, char ***argv, int *rank, int *nproc)
+void mpi_setup(int *argc, char ***argv, int required, int *provided,
+               int *rank, int *nproc)
 {
     int mpi_err;
 
-    mpi_err = MPI_Init(argc, argv);
+    // Helper threads (e.g. the checkpoint writer) never call MPI themselves,
+    // except for a progress thread, which needs MPI_THREAD_MULTIPLE
+    mpi_err = MPI_Init_thread(argc, argv, required, provided);
     if (mpi_err != MPI_SUCCESS) {
         fprintf(stderr, "Error initializing MPI.\n");
         MPI_Abort(MPI_COMM_WORLD, mpi_err);
@@ -49,3 +56,148 @@ void mpi_setup(int *argc, char ***argv, int *rank, int *nproc)
         MPI_Abort(MPI_COMM_WORLD, mpi_err);
     }
 }
+
+/**
+ * @brief Collectively writes each process's band of rows to a matrix file.
+ *
+ * @param filename Name of the file to write to.
+ * @param rows Pointer to this process's rows (may be NULL if num_rows is 0).
+ * @param first_row Index of this process's first row in the full matrix.
+ * @param num_rows Number of rows this process writes.
+ * @param matrix_size Size of the full (square) matrix.
+ * @param comm Communicator of the writing processes.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int mpi_write_rows(const char *filename, int *rows, int first_row,
+                   int num_rows, int matrix_size, MPI_Comm comm)
+{
+    MPI_File fh;
+    MPI_Info info;
+    MPI_Offset file_bytes, my_offset;
+    int mpi_err, close_err;
+
+    // Ask for two-phase collective buffering: a few aggregators gather
+    // the row slabs into large contiguous writes to the file system
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "romio_cb_write", "enable");
+    MPI_Info_set(info, "romio_ds_write", "disable");
+    MPI_Info_set(info, "cb_buffer_size", CB_BUFFER_SIZE);
+
+    mpi_err = MPI_File_open(comm, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                            info, &fh);
+    MPI_Info_free(&info);
+    if (mpi_err != MPI_SUCCESS) {
+        fprintf(stderr, "Error opening %s for collective write.\n", filename);
+        return mpi_err;
+    }
+
+    // Size the file up front; this also truncates any older, larger output
+    file_bytes = (MPI_Offset) matrix_size * matrix_size * sizeof(int);
+    mpi_err = MPI_File_set_size(fh, file_bytes);
+    if (mpi_err != MPI_SUCCESS) {
+        fprintf(stderr, "Error setting size of %s.\n", filename);
+        MPI_File_close(&fh);
+        return mpi_err;
+    }
+
+    my_offset = (MPI_Offset) first_row * matrix_size * sizeof(int);
+    mpi_err = MPI_File_write_at_all(fh, my_offset, rows,
+                                    num_rows * matrix_size, MPI_INT,
+                                    MPI_STATUS_IGNORE);
+    if (mpi_err != MPI_SUCCESS)
+        fprintf(stderr, "Error writing rows %d-%d to %s.\n",
+                first_row, first_row + num_rows - 1, filename);
+
+    close_err = MPI_File_close(&fh);
+    if (close_err != MPI_SUCCESS) {
+        fprintf(stderr, "Error closing %s.\n", filename);
+        if (mpi_err == MPI_SUCCESS)
+            mpi_err = close_err;
+    }
+    return mpi_err;
+}
+
+/**
+ * @brief Gathers every process's band of rows at the root, queueing each
+ *        band on a writer as soon as it arrives.
+ *
+ * @param rows This process's rows (unused on the root if in_place).
+ * @param num_rows Number of rows of each process but the last, which has
+ *                 the rest of the matrix.
+ * @param matrix_size Size of the full (square) matrix.
+ * @param matrix Matrix to gather into (root only). It must stay unchanged
+ *               until the writer is closed.
+ * @param in_place Whether the root's rows are already in place in matrix.
+ * @param writer Writer of the output file (root only), or NULL to gather
+ *               without writing.
+ * @param root Rank that gathers.
+ * @param comm Communicator of the processes.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int mpi_gather_write(int *rows, int num_rows, int matrix_size, int *matrix,
+                     int in_place, async_writer_t *writer, int root,
+                     MPI_Comm comm)
+{
+    size_t band = (size_t) num_rows * matrix_size;   // Cells per process
+    size_t last_band, cells;                        // ... for the last one
+    MPI_Request *requests;
+    int rank, size, index, mpi_err = MPI_SUCCESS;
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    last_band = (size_t) matrix_size * matrix_size - (size - 1) * band;
+    if (rank != root)
+        return MPI_Send(rows, rank == size - 1 ? last_band : band, MPI_INT,
+                        root, GATHER_TAG, comm);
+
+    requests = malloc(size * sizeof(MPI_Request));
+    if (!requests)
+        return MPI_ERR_NO_MEM;
+    for (int r = 0; r < size; r++) {
+        requests[r] = MPI_REQUEST_NULL;
+        if (r != root && mpi_err == MPI_SUCCESS)
+            mpi_err = MPI_Irecv(matrix + r * band,
+                                r == size - 1 ? last_band : band, MPI_INT,
+                                r, GATHER_TAG, comm, &requests[r]);
+    }
+
+    // The root's own rows can be written while the others arrive
+    cells = root == size - 1 ? last_band : band;
+    if (!in_place)
+        memcpy(matrix + root * band, rows, cells * sizeof(int));
+    if (writer)
+        async_writer_submit(writer, matrix + root * band,
+                            cells * sizeof(int), root * band * sizeof(int));
+
+    for (int left = size - 1; left > 0 && mpi_err == MPI_SUCCESS; left--) {
+        mpi_err = MPI_Waitany(size, requests, &index, MPI_STATUS_IGNORE);
+        if (mpi_err == MPI_SUCCESS && writer)
+            async_writer_submit(writer, matrix + index * band,
+                                (index == size - 1 ? last_band : band) *
+                                    sizeof(int),
+                                index * band * sizeof(int));
+    }
+    free(requests);
+    return mpi_err;
+}
+
+/**
+ * @brief Counts the processes that share this process's node.
+ *
+ * @param comm Communicator of the processes.
+ * @param [out] ranks Number of processes in comm on this node.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int mpi_ranks_per_node(MPI_Comm comm, int *ranks)
+{
+    MPI_Comm node_comm;
+    int mpi_err;
+
+    mpi_err = MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0,
+                                  MPI_INFO_NULL, &node_comm);
+    if (mpi_err != MPI_SUCCESS)
+        return mpi_err;
+    mpi_err = MPI_Comm_size(node_comm, ranks);
+    MPI_Comm_free(&node_comm);
+    return mpi_err;
+}
@@ -9,6 +9,10 @@
 #define MPI_UTILS_H
 
 #include <mpi.h>
+#include "async_writer.h"
+
+#define CB_BUFFER_SIZE "16777216"   /* Collective buffer per aggregator */
+#define GATHER_TAG     32           /* Message tag of gathered rows */
 
 /**
  * @brief Sets up the MPI environment.
@@ -18,9 +22,71 @@
  * 
  * @param [in,out] argc The number of arguments from the main function.
  * @param [in,out] argv The arguments from the main function.
+ * @param required Thread support to ask for.
+ * @param [out] provided Thread support MPI provides.
  * @param [out] rank The rank of the current process.
  * @param [out] nproc The total number of processes.
  */
-void mpi_setup(int *argc, char ***argv, int *rank, int *nproc);
+void mpi_setup(int *argc, char ***argv, int required, int *provided,
+               int *rank, int *nproc);
+
+/**
+ * @brief Collectively writes each process's band of rows to a matrix file.
+ *
+ * Every process in the communicator must call this function. Each writes
+ * its rows at their offset in the file with MPI_File_write_at_all, using
+ * collective buffering hints so the MPI-IO layer can aggregate the
+ * requests. The file is sized to hold the full matrix_size x matrix_size
+ * matrix in the same layout as the matrix.h utilities.
+ *
+ * @param filename Name of the file to write to.
+ * @param rows Pointer to this process's rows (may be NULL if num_rows is 0).
+ * @param first_row Index of this process's first row in the full matrix.
+ * @param num_rows Number of rows this process writes.
+ * @param matrix_size Size of the full (square) matrix.
+ * @param comm Communicator of the writing processes.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int mpi_write_rows(const char *filename, int *rows, int first_row,
+                   int num_rows, int matrix_size, MPI_Comm comm);
+
+/**
+ * @brief Gathers every process's band of rows at the root, queueing each
+ *        band on a writer as soon as it arrives.
+ *
+ * Every process in the communicator must call this function. The root
+ * posts a receive for every band and queues the bands in the order they
+ * complete, so the output is written while the rest are still arriving,
+ * and only the last band's write is left once the gather is done. Bands
+ * are placed in the matrix in rank order, as MPI_Gatherv would; the last
+ * process's band runs to the bottom of the matrix.
+ *
+ * @param rows This process's rows (unused on the root if in_place).
+ * @param num_rows Number of rows of each process but the last, which has
+ *                 the rest of the matrix.
+ * @param matrix_size Size of the full (square) matrix.
+ * @param matrix Matrix to gather into (root only). It must stay unchanged
+ *               until the writer is closed.
+ * @param in_place Whether the root's rows are already in place in matrix.
+ * @param writer Writer of the output file (root only), or NULL to gather
+ *               without writing.
+ * @param root Rank that gathers.
+ * @param comm Communicator of the processes.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int mpi_gather_write(int *rows, int num_rows, int matrix_size, int *matrix,
+                     int in_place, async_writer_t *writer, int root,
+                     MPI_Comm comm);
+
+/**
+ * @brief Counts the processes that share this process's node.
+ *
+ * Collective over comm.
+ *
+ * @param comm Communicator of the processes.
+ * @param [out] ranks Number of processes in comm on this node.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int mpi_ranks_per_node(MPI_Comm comm, int *ranks);
 
 #endif // MPI_UTILS_H
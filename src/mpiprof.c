@@ -0,0 +1,837 @@
+/**
+ * @file    mpiprof.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   PMPI profiler of MPI communication, linked in with `make MPIPROF=1`.
+ *
+ * Defines MPI_Bcast, MPI_Barrier, MPI_Scatterv, MPI_Gather, MPI_Gatherv and
+ * MPI_Allreduce over their PMPI_ entry points, so a program linked against
+ * libmpiprof.a has every call recorded without changes to its source. The
+ * point-to-point calls of a3's gather, MPI_Send, MPI_Irecv and MPI_Waitany,
+ * are recorded too. Each
+ * call site (the return address of the call, made relative to the module
+ * it lies in so that ranks agree on it) keeps its count, bytes and time.
+ *
+ * Every call is also logged with its entry and exit times. At MPI_Finalize
+ * each rank writes its own summary, PREFIX.RANK.txt, then rank 0 aligns the
+ * ranks' clocks by ping-pong, matches each call with the same call on the
+ * other members of its communicator, and writes the merged report,
+ * PREFIX.txt. A call's wait is its time before the last member arrived, and
+ * its transfer is the rest; the imbalance of a site is its slowest rank's
+ * time over the mean rank's. Sites are named with addr2line where it is
+ * available. PREFIX is "mpiprof" unless MPIPROF_PREFIX is set.
+ *
+ * Calls on one communicator happen in the same order on all its members,
+ * so a call is matched by its communicator's membership and its number
+ * among the calls on communicators of that membership. Programs that run
+ * collectives on duplicates of a communicator in differing orders would be
+ * mismatched; a3 does not.
+ *
+ * Point-to-point calls have no partners to match, so each is logged as if on
+ * MPI_COMM_SELF: it has no wait and all its time is transfer. Their bytes
+ * are counted where the message is sent or the receive posted, so waits
+ * count none.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <elf.h>
+#include <mpi.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SITES       128         /* Most call sites kept per rank */
+#define MAX_KEYS        256         /* Most communicator memberships seen */
+#define MAX_RECORDS     (1 << 15)   /* Most calls logged per rank */
+#define SYNC_ROUNDS     8           /* Ping-pongs per rank to align clocks */
+#define SITE_LABEL      128         /* Longest site label */
+#define DEFAULT_PREFIX  "mpiprof"
+
+/**
+ * @brief Operations intercepted.
+ */
+enum {
+    OP_BCAST,
+    OP_BARRIER,
+    OP_SCATTERV,
+    OP_GATHER,
+    OP_GATHERV,
+    OP_ALLREDUCE,
+    OP_SEND,
+    OP_IRECV,
+    OP_WAITANY,
+    NUM_OPS
+};
+
+static const char *op_names[NUM_OPS] = {
+    "MPI_Bcast", "MPI_Barrier", "MPI_Scatterv", "MPI_Gather", "MPI_Gatherv",
+    "MPI_Allreduce", "MPI_Send", "MPI_Irecv", "MPI_Waitany"
+};
+
+/**
+ * @brief Totals of one operation at one call site on this rank.
+ */
+typedef struct {
+    int         op;         /* Operation */
+    void        *address;   /* Return address of the call */
+    uint64_t    offset;     /* Return address within its module */
+    long        calls;      /* Number of calls */
+    long long   bytes;      /* Bytes sent or received */
+    double      time;       /* Seconds in the calls */
+} site_t;
+
+/**
+ * @brief One logged call, as sent to rank 0.
+ */
+typedef struct {
+    int         op;         /* Operation */
+    int         rank;       /* World rank of the caller */
+    int         is_root;    /* Whether the caller was the root */
+    int         comm_size;  /* Size of the communicator */
+    long        seq;        /* Number among calls of this membership */
+    uint64_t    offset;     /* Call site within its module */
+    uint64_t    comm;       /* Hash of the communicator's membership */
+    long long   bytes;      /* Bytes sent or received */
+    double      entry;      /* Time the call started */
+    double      exit;       /* Time the call returned */
+} call_record_t;
+
+/**
+ * @brief Merged totals of one operation at one call site.
+ */
+typedef struct {
+    int         op;         /* Operation */
+    uint64_t    offset;     /* Call site within its module */
+    long        calls;      /* Number of calls over all ranks */
+    long        unmatched;  /* Calls whose partners were not all logged */
+    long long   bytes;      /* Bytes over all ranks */
+    double      time;       /* Seconds over all ranks */
+    double      wait;       /* Seconds waiting for the last member */
+    double      root;       /* Seconds on the root */
+    double      *per_rank;  /* Seconds on each rank */
+    char        label[SITE_LABEL];
+} merged_site_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static site_t sites[MAX_SITES];
+static int num_sites;
+static struct {
+    uint64_t    comm;
+    long        calls;
+} keys[MAX_KEYS];
+static int num_keys;
+static call_record_t *records;
+static long num_records, dropped;
+static char *module_base;       /* Load address of the callers' module */
+static char module_name[256];   /* Path of the callers' module */
+
+/**
+ * @brief Hash the membership of a communicator, which every member computes
+ *        alike without communicating.
+ *
+ * @param comm Communicator.
+ * @param size Size of the communicator.
+ * @return FNV-1a hash of the world ranks of its members in order.
+ */
+static uint64_t membership(MPI_Comm comm, int size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    MPI_Group group, world;
+    int *ranks = malloc(2 * size * sizeof(int));
+
+    if (!ranks)
+        return 0;
+    PMPI_Comm_group(comm, &group);
+    PMPI_Comm_group(MPI_COMM_WORLD, &world);
+    for (int r = 0; r < size; r++)
+        ranks[r] = r;
+    PMPI_Group_translate_ranks(group, size, ranks, world, ranks + size);
+    PMPI_Group_free(&group);
+    PMPI_Group_free(&world);
+    for (int r = 0; r < size; r++) {
+        hash ^= (uint64_t) ranks[size + r];
+        hash *= 1099511628211ULL;
+    }
+    free(ranks);
+    return hash;
+}
+
+/**
+ * @brief Find or add the totals of a call site.
+ *
+ * Sites past MAX_SITES share the last entry.
+ *
+ * @param op Operation.
+ * @param address Return address of the call.
+ * @return Totals of the site.
+ */
+static site_t *find_site(int op, void *address)
+{
+    Dl_info info;
+    site_t *site;
+
+    for (int s = 0; s < num_sites; s++)
+        if (sites[s].op == op && sites[s].address == address)
+            return &sites[s];
+    if (num_sites == MAX_SITES)
+        return &sites[MAX_SITES - 1];
+
+    site = &sites[num_sites++];
+    memset(site, 0, sizeof(*site));
+    site->op = op;
+    site->address = address;
+    site->offset = (uintptr_t) address;
+    if (dladdr(address, &info) && info.dli_fbase) {
+        site->offset -= (uintptr_t) info.dli_fbase;
+        if (!module_base) {
+            module_base = info.dli_fbase;
+            snprintf(module_name, sizeof(module_name), "%s", info.dli_fname);
+        }
+    }
+    return site;
+}
+
+/**
+ * @brief Record a finished call.
+ *
+ * @param op Operation.
+ * @param address Return address of the call.
+ * @param comm Communicator of the call.
+ * @param root Rank of the root in comm, or -1 for rootless operations.
+ * @param bytes Bytes the caller sent or received.
+ * @param entry Time the call started.
+ * @param exit Time the call returned.
+ */
+static void record(int op, void *address, MPI_Comm comm, int root,
+                   long long bytes, double entry, double exit)
+{
+    int comm_rank, comm_size, world_rank, k;
+    uint64_t hash;
+    site_t *site;
+
+    PMPI_Comm_rank(comm, &comm_rank);
+    PMPI_Comm_size(comm, &comm_size);
+    PMPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    hash = membership(comm, comm_size);
+
+    pthread_mutex_lock(&lock);
+    site = find_site(op, address);
+    site->calls++;
+    site->bytes += bytes;
+    site->time += exit - entry;
+
+    for (k = 0; k < num_keys && keys[k].comm != hash; k++)
+        ;
+    if (k == num_keys && num_keys < MAX_KEYS) {
+        keys[k].comm = hash;
+        keys[k].calls = 0;
+        num_keys++;
+    }
+    if (!records)
+        records = malloc(MAX_RECORDS * sizeof(call_record_t));
+    if (k < num_keys && records && num_records < MAX_RECORDS) {
+        call_record_t *call = &records[num_records++];
+        call->op = op;
+        call->rank = world_rank;
+        call->is_root = comm_rank == root;
+        call->comm_size = comm_size;
+        call->seq = keys[k].calls;
+        call->offset = site->offset;
+        call->comm = hash;
+        call->bytes = bytes;
+        call->entry = entry;
+        call->exit = exit;
+    } else {
+        dropped++;
+    }
+    if (k < num_keys)
+        keys[k].calls++;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Sum the counts of every rank but one.
+ *
+ * @param counts Count of each rank.
+ * @param size Number of ranks.
+ * @param skip Rank to leave out.
+ * @return Sum of the counts.
+ */
+static long long sum_counts(const int *counts, int size, int skip)
+{
+    long long sum = 0;
+
+    for (int r = 0; r < size; r++)
+        if (r != skip)
+            sum += counts[r];
+    return sum;
+}
+
+/**
+ * @brief Broadcast through PMPI_Bcast, recording the call.
+ *
+ * @return The error code of PMPI_Bcast.
+ */
+int MPI_Bcast(void *buffer, int count, MPI_Datatype datatype, int root,
+              MPI_Comm comm)
+{
+    double entry = PMPI_Wtime();
+    int type_size, mpi_err;
+
+    mpi_err = PMPI_Bcast(buffer, count, datatype, root, comm);
+    PMPI_Type_size(datatype, &type_size);
+    record(OP_BCAST, __builtin_return_address(0), comm, root,
+           (long long) count * type_size, entry, PMPI_Wtime());
+    return mpi_err;
+}
+
+/**
+ * @brief Synchronise through PMPI_Barrier, recording the call.
+ *
+ * @return The error code of PMPI_Barrier.
+ */
+int MPI_Barrier(MPI_Comm comm)
+{
+    double entry = PMPI_Wtime();
+    int mpi_err;
+
+    mpi_err = PMPI_Barrier(comm);
+    record(OP_BARRIER, __builtin_return_address(0), comm, -1, 0, entry,
+           PMPI_Wtime());
+    return mpi_err;
+}
+
+/**
+ * @brief Scatter through PMPI_Scatterv, recording the call. The root's
+ *        bytes leave out its own part.
+ *
+ * @return The error code of PMPI_Scatterv.
+ */
+int MPI_Scatterv(const void *sendbuf, const int sendcounts[],
+                 const int displs[], MPI_Datatype sendtype, void *recvbuf,
+                 int recvcount, MPI_Datatype recvtype, int root,
+                 MPI_Comm comm)
+{
+    double entry = PMPI_Wtime();
+    int rank, size, type_size, mpi_err;
+    long long bytes;
+
+    mpi_err = PMPI_Scatterv(sendbuf, sendcounts, displs, sendtype, recvbuf,
+                            recvcount, recvtype, root, comm);
+    PMPI_Comm_rank(comm, &rank);
+    PMPI_Comm_size(comm, &size);
+    if (rank == root) {
+        PMPI_Type_size(sendtype, &type_size);
+        bytes = sum_counts(sendcounts, size, root) * type_size;
+    } else {
+        PMPI_Type_size(recvtype, &type_size);
+        bytes = (long long) recvcount * type_size;
+    }
+    record(OP_SCATTERV, __builtin_return_address(0), comm, root, bytes,
+           entry, PMPI_Wtime());
+    return mpi_err;
+}
+
+/**
+ * @brief Gather through PMPI_Gather, recording the call. The root's bytes
+ *        leave out its own part.
+ *
+ * @return The error code of PMPI_Gather.
+ */
+int MPI_Gather(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+               void *recvbuf, int recvcount, MPI_Datatype recvtype, int root,
+               MPI_Comm comm)
+{
+    double entry = PMPI_Wtime();
+    int rank, size, type_size, mpi_err;
+    long long bytes;
+
+    mpi_err = PMPI_Gather(sendbuf, sendcount, sendtype, recvbuf, recvcount,
+                          recvtype, root, comm);
+    PMPI_Comm_rank(comm, &rank);
+    PMPI_Comm_size(comm, &size);
+    if (rank == root) {
+        PMPI_Type_size(recvtype, &type_size);
+        bytes = (long long) recvcount * type_size * (size - 1);
+    } else {
+        PMPI_Type_size(sendtype, &type_size);
+        bytes = (long long) sendcount * type_size;
+    }
+    record(OP_GATHER, __builtin_return_address(0), comm, root, bytes,
+           entry, PMPI_Wtime());
+    return mpi_err;
+}
+
+/**
+ * @brief Gather through PMPI_Gatherv, recording the call. The root's bytes
+ *        leave out its own part.
+ *
+ * @return The error code of PMPI_Gatherv.
+ */
+int MPI_Gatherv(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                void *recvbuf, const int recvcounts[], const int displs[],
+                MPI_Datatype recvtype, int root, MPI_Comm comm)
+{
+    double entry = PMPI_Wtime();
+    int rank, size, type_size, mpi_err;
+    long long bytes;
+
+    mpi_err = PMPI_Gatherv(sendbuf, sendcount, sendtype, recvbuf, recvcounts,
+                           displs, recvtype, root, comm);
+    PMPI_Comm_rank(comm, &rank);
+    PMPI_Comm_size(comm, &size);
+    if (rank == root) {
+        PMPI_Type_size(recvtype, &type_size);
+        bytes = sum_counts(recvcounts, size, root) * type_size;
+    } else {
+        PMPI_Type_size(sendtype, &type_size);
+        bytes = (long long) sendcount * type_size;
+    }
+    record(OP_GATHERV, __builtin_return_address(0), comm, root, bytes,
+           entry, PMPI_Wtime());
+    return mpi_err;
+}
+
+/**
+ * @brief Reduce through PMPI_Allreduce, recording the call.
+ *
+ * @return The error code of PMPI_Allreduce.
+ */
+int MPI_Allreduce(const void *sendbuf, void *recvbuf, int count,
+                  MPI_Datatype datatype, MPI_Op op, MPI_Comm comm)
+{
+    double entry = PMPI_Wtime();
+    int type_size, mpi_err;
+
+    mpi_err = PMPI_Allreduce(sendbuf, recvbuf, count, datatype, op, comm);
+    PMPI_Type_size(datatype, &type_size);
+    record(OP_ALLREDUCE, __builtin_return_address(0), comm, -1,
+           (long long) count * type_size, entry, PMPI_Wtime());
+    return mpi_err;
+}
+
+/**
+ * @brief Send through PMPI_Send, recording the call.
+ *
+ * @return The error code of PMPI_Send.
+ */
+int MPI_Send(const void *buf, int count, MPI_Datatype datatype, int dest,
+             int tag, MPI_Comm comm)
+{
+    double entry = PMPI_Wtime();
+    int type_size, mpi_err;
+
+    mpi_err = PMPI_Send(buf, count, datatype, dest, tag, comm);
+    PMPI_Type_size(datatype, &type_size);
+    record(OP_SEND, __builtin_return_address(0), MPI_COMM_SELF, -1,
+           (long long) count * type_size, entry, PMPI_Wtime());
+    return mpi_err;
+}
+
+/**
+ * @brief Post a receive through PMPI_Irecv, recording the call with the
+ *        bytes it may receive.
+ *
+ * @return The error code of PMPI_Irecv.
+ */
+int MPI_Irecv(void *buf, int count, MPI_Datatype datatype, int source,
+              int tag, MPI_Comm comm, MPI_Request *request)
+{
+    double entry = PMPI_Wtime();
+    int type_size, mpi_err;
+
+    mpi_err = PMPI_Irecv(buf, count, datatype, source, tag, comm, request);
+    PMPI_Type_size(datatype, &type_size);
+    record(OP_IRECV, __builtin_return_address(0), MPI_COMM_SELF, -1,
+           (long long) count * type_size, entry, PMPI_Wtime());
+    return mpi_err;
+}
+
+/**
+ * @brief Wait for a request through PMPI_Waitany, recording the call.
+ *
+ * @return The error code of PMPI_Waitany.
+ */
+int MPI_Waitany(int count, MPI_Request requests[], int *index,
+                MPI_Status *status)
+{
+    double entry = PMPI_Wtime();
+    int mpi_err;
+
+    mpi_err = PMPI_Waitany(count, requests, index, status);
+    record(OP_WAITANY, __builtin_return_address(0), MPI_COMM_SELF, -1, 0,
+           entry, PMPI_Wtime());
+    return mpi_err;
+}
+
+/**
+ * @brief Open a report file named from the prefix.
+ *
+ * @param rank Rank whose summary it is, or -1 for the merged report.
+ * @param [out] name Buffer of FILENAME_MAX for the file name.
+ * @return The open file, or NULL on failure.
+ */
+static FILE *open_report(int rank, char *name)
+{
+    const char *prefix = getenv("MPIPROF_PREFIX");
+
+    if (!prefix || !*prefix)
+        prefix = DEFAULT_PREFIX;
+    if (rank < 0)
+        snprintf(name, FILENAME_MAX, "%s.txt", prefix);
+    else
+        snprintf(name, FILENAME_MAX, "%s.%d.txt", prefix, rank);
+    return fopen(name, "w");
+}
+
+/**
+ * @brief Write this rank's own totals per call site.
+ *
+ * @param rank World rank of this process.
+ */
+static void write_rank_summary(int rank)
+{
+    char name[FILENAME_MAX];
+    FILE *file = open_report(rank, name);
+
+    if (!file) {
+        fprintf(stderr, "mpiprof: cannot write %s\n", name);
+        return;
+    }
+    fprintf(file, "# mpiprof summary of rank %d\n", rank);
+    if (module_base)
+        fprintf(file, "# Sites are return addresses within %s\n",
+                module_name);
+    fprintf(file, "%-14s %18s %8s %14s %12s\n", "operation", "site",
+            "calls", "bytes", "seconds");
+    for (int s = 0; s < num_sites; s++)
+        fprintf(file, "%-14s %#18llx %8ld %14lld %12.6f\n",
+                op_names[sites[s].op], (unsigned long long) sites[s].offset,
+                sites[s].calls, sites[s].bytes, sites[s].time);
+    if (dropped)
+        fprintf(file, "# %ld calls not logged for the merged report\n",
+                dropped);
+    fclose(file);
+}
+
+/**
+ * @brief Measure every rank's clock against rank 0's.
+ *
+ * Rank 0 exchanges SYNC_ROUNDS ping-pongs with each rank in turn and keeps
+ * the estimate from the fastest round, taking the remote time as read
+ * halfway through it.
+ *
+ * @param rank World rank of this process.
+ * @param size Number of processes.
+ * @param offsets Seconds to add to each rank's times (rank 0 only).
+ */
+static void align_clocks(int rank, int size, double *offsets)
+{
+    double sent, remote, best;
+
+    for (int r = 1; r < size; r++) {
+        if (rank == 0) {
+            best = -1;
+            for (int round = 0; round < SYNC_ROUNDS; round++) {
+                sent = PMPI_Wtime();
+                PMPI_Send(&sent, 1, MPI_DOUBLE, r, 0, MPI_COMM_WORLD);
+                PMPI_Recv(&remote, 1, MPI_DOUBLE, r, 0, MPI_COMM_WORLD,
+                          MPI_STATUS_IGNORE);
+                double rtt = PMPI_Wtime() - sent;
+                if (best < 0 || rtt < best) {
+                    best = rtt;
+                    offsets[r] = sent + rtt / 2 - remote;
+                }
+            }
+        } else if (rank == r) {
+            for (int round = 0; round < SYNC_ROUNDS; round++) {
+                PMPI_Recv(&sent, 1, MPI_DOUBLE, 0, 0, MPI_COMM_WORLD,
+                          MPI_STATUS_IGNORE);
+                remote = PMPI_Wtime();
+                PMPI_Send(&remote, 1, MPI_DOUBLE, 0, 0, MPI_COMM_WORLD);
+            }
+        }
+    }
+    if (rank == 0)
+        offsets[0] = 0;
+}
+
+/**
+ * @brief Order calls by communicator, then call number, then rank.
+ *
+ * @param a First call.
+ * @param b Second call.
+ * @return Negative, zero or positive as a sorts before, with or after b.
+ */
+static int by_call(const void *a, const void *b)
+{
+    const call_record_t *x = a, *y = b;
+
+    if (x->comm != y->comm)
+        return x->comm < y->comm ? -1 : 1;
+    if (x->seq != y->seq)
+        return x->seq < y->seq ? -1 : 1;
+    return x->rank - y->rank;
+}
+
+/**
+ * @brief Find or add the merged totals of a call site.
+ *
+ * @param merged Merged sites.
+ * @param num_merged Number of merged sites, updated on adding one.
+ * @param call Call made at the site.
+ * @param size Number of processes.
+ * @return Totals of the site, or NULL if out of room or memory.
+ */
+static merged_site_t *find_merged(merged_site_t *merged, int *num_merged,
+                                  const call_record_t *call, int size)
+{
+    merged_site_t *site;
+
+    for (int s = 0; s < *num_merged; s++)
+        if (merged[s].op == call->op && merged[s].offset == call->offset)
+            return &merged[s];
+    if (*num_merged == MAX_SITES)
+        return NULL;
+    site = &merged[*num_merged];
+    memset(site, 0, sizeof(*site));
+    site->per_rank = calloc(size, sizeof(double));
+    if (!site->per_rank)
+        return NULL;
+    site->op = call->op;
+    site->offset = call->offset;
+    (*num_merged)++;
+    return site;
+}
+
+/**
+ * @brief Name the merged sites, with addr2line where it works and the
+ *        nearest exported symbol or the bare offset otherwise.
+ *
+ * @param merged Merged sites.
+ * @param num_merged Number of merged sites.
+ */
+static void label_sites(merged_site_t *merged, int num_merged)
+{
+    char command[FILENAME_MAX + 64 + MAX_SITES * 20];
+    char function[SITE_LABEL], line[SITE_LABEL];
+    uint64_t bias = 0;
+    FILE *pipe = NULL;
+    Dl_info info;
+    int length;
+
+    for (int s = 0; s < num_merged; s++) {
+        snprintf(merged[s].label, SITE_LABEL, "%#llx",
+                 (unsigned long long) merged[s].offset);
+        if (module_base &&
+            dladdr(module_base + merged[s].offset, &info) && info.dli_sname)
+            snprintf(merged[s].label, SITE_LABEL, "%s+%#lx", info.dli_sname,
+                     (unsigned long) (module_base + merged[s].offset -
+                                      (char *) info.dli_saddr));
+    }
+    if (!module_base || !num_merged)
+        return;
+
+    // addr2line takes addresses as linked: offsets for position-independent
+    // modules, load addresses otherwise. The call is the byte before the
+    // return address.
+    if (((const Elf64_Ehdr *) module_base)->e_type == ET_EXEC)
+        bias = (uintptr_t) module_base;
+    length = snprintf(command, sizeof(command), "addr2line -f -s -e '%s'",
+                      module_name);
+    for (int s = 0; s < num_merged; s++)
+        length += snprintf(command + length, sizeof(command) - length,
+                           " %#llx", (unsigned long long)
+                           (merged[s].offset + bias - 1));
+    if (length < (int) sizeof(command))
+        pipe = popen(command, "r");
+    for (int s = 0; pipe && s < num_merged; s++) {
+        if (!fgets(function, sizeof(function), pipe) ||
+            !fgets(line, sizeof(line), pipe))
+            break;
+        // Keep FILE:LINE, dropping any " (discriminator N)" after it
+        function[strcspn(function, "\n")] = '\0';
+        line[strcspn(line, " \n")] = '\0';
+        if (strcmp(function, "??") != 0)
+            snprintf(merged[s].label, SITE_LABEL, "%.60s (%.60s)", function,
+                     line);
+    }
+    if (pipe)
+        pclose(pipe);
+}
+
+/**
+ * @brief Match the calls of every rank and write the merged report.
+ *
+ * @param calls Calls of every rank, clocks aligned.
+ * @param num_calls Number of calls.
+ * @param size Number of processes.
+ * @param offsets Clock offset of each rank.
+ */
+static void write_merged_report(call_record_t *calls, long num_calls,
+                                int size, const double *offsets)
+{
+    merged_site_t merged[MAX_SITES];
+    double *rank_time = calloc(2 * size, sizeof(double));
+    double *rank_wait = rank_time + size;
+    double max_offset = 0;
+    int num_merged = 0;
+    char name[FILENAME_MAX];
+    FILE *file;
+
+    if (!rank_time)
+        return;
+    qsort(calls, num_calls, sizeof(call_record_t), by_call);
+
+    // Each run of one communicator's call number is one collective; its
+    // members wait until the last of them arrives
+    for (long first = 0, last; first < num_calls; first = last) {
+        double arrival = calls[first].entry;
+        for (last = first + 1; last < num_calls &&
+             calls[last].comm == calls[first].comm &&
+             calls[last].seq == calls[first].seq; last++)
+            if (calls[last].entry > arrival)
+                arrival = calls[last].entry;
+        int matched = last - first == calls[first].comm_size;
+
+        for (long c = first; c < last; c++) {
+            merged_site_t *site = find_merged(merged, &num_merged, &calls[c],
+                                              size);
+            double time = calls[c].exit - calls[c].entry;
+            double wait = arrival - calls[c].entry;
+
+            if (!site)
+                continue;
+            wait = !matched || wait < 0 ? 0 : wait > time ? time : wait;
+            site->calls++;
+            site->unmatched += !matched;
+            site->bytes += calls[c].bytes;
+            site->time += time;
+            site->wait += wait;
+            if (calls[c].is_root)
+                site->root += time;
+            site->per_rank[calls[c].rank] += time;
+            rank_time[calls[c].rank] += time;
+            rank_wait[calls[c].rank] += wait;
+        }
+    }
+    label_sites(merged, num_merged);
+    for (int r = 0; r < size; r++)
+        if (offsets[r] > max_offset || -offsets[r] > max_offset)
+            max_offset = offsets[r] < 0 ? -offsets[r] : offsets[r];
+
+    file = open_report(-1, name);
+    if (!file) {
+        fprintf(stderr, "mpiprof: cannot write %s\n", name);
+    } else {
+        fprintf(file, "# mpiprof report of %d ranks, %ld calls; clocks "
+                "aligned to rank 0 (largest offset %.3g s)\n", size,
+                num_calls, max_offset);
+        fprintf(file, "# Seconds are summed over ranks. Wait is the time "
+                "before the last member\n# arrived and transfer the rest; "
+                "imbalance is the slowest rank over the mean.\n");
+        fprintf(file, "%-14s %-40s %7s %13s %10s %10s %10s %10s %6s\n",
+                "operation", "site", "calls", "bytes", "seconds", "wait",
+                "transfer", "root", "imbal");
+        for (int s = 0; s < num_merged; s++) {
+            double slowest = 0;
+            for (int r = 0; r < size; r++)
+                if (merged[s].per_rank[r] > slowest)
+                    slowest = merged[s].per_rank[r];
+            fprintf(file, "%-14s %-40s %7ld %13lld %10.6f %10.6f %10.6f "
+                    "%10.6f %6.2f\n", op_names[merged[s].op],
+                    merged[s].label, merged[s].calls, merged[s].bytes,
+                    merged[s].time, merged[s].wait,
+                    merged[s].time - merged[s].wait, merged[s].root,
+                    merged[s].time > 0 ? slowest * size / merged[s].time : 0);
+            if (merged[s].unmatched)
+                fprintf(file, "%-14s %ld calls unmatched, counted as "
+                        "transfer\n", "", merged[s].unmatched);
+        }
+        fprintf(file, "\n%-6s %10s %10s %10s\n", "rank", "seconds", "wait",
+                "transfer");
+        for (int r = 0; r < size; r++)
+            fprintf(file, "%-6d %10.6f %10.6f %10.6f\n", r, rank_time[r],
+                    rank_wait[r], rank_time[r] - rank_wait[r]);
+        fclose(file);
+        fprintf(stderr, "mpiprof: report written to %s\n", name);
+    }
+    for (int s = 0; s < num_merged; s++)
+        free(merged[s].per_rank);
+    free(rank_time);
+}
+
+/**
+ * @brief Gather every rank's calls at rank 0 and write the merged report.
+ *
+ * @param rank World rank of this process.
+ * @param size Number of processes.
+ */
+static void merge_reports(int rank, int size)
+{
+    int *counts = NULL, *starts = NULL, bytes, total = 0;
+    double *offsets = NULL;
+    call_record_t *calls = NULL;
+
+    if (rank == 0) {
+        counts = malloc(2 * size * sizeof(int));
+        offsets = malloc(size * sizeof(double));
+        if (!counts || !offsets) {
+            fprintf(stderr, "mpiprof: failed to allocate the merge\n");
+            PMPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+    align_clocks(rank, size, offsets);
+
+    bytes = num_records * sizeof(call_record_t);
+    PMPI_Gather(&bytes, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+        starts = counts + size;
+        for (int r = 0; r < size; r++) {
+            starts[r] = total;
+            total += counts[r];
+        }
+        calls = malloc(total ? total : 1);
+        if (!calls) {
+            fprintf(stderr, "mpiprof: failed to allocate the merge\n");
+            PMPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+    PMPI_Gatherv(records, bytes, MPI_BYTE, calls, counts, starts, MPI_BYTE,
+                 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+        long num_calls = total / sizeof(call_record_t);
+        for (long c = 0; c < num_calls; c++) {
+            calls[c].entry += offsets[calls[c].rank];
+            calls[c].exit += offsets[calls[c].rank];
+        }
+        write_merged_report(calls, num_calls, size, offsets);
+    }
+    free(counts);
+    free(offsets);
+    free(calls);
+}
+
+/**
+ * @brief Write the summaries and the merged report, then finalise through
+ *        PMPI_Finalize.
+ *
+ * Collective over MPI_COMM_WORLD, like MPI_Finalize itself.
+ *
+ * @return The error code of PMPI_Finalize.
+ */
+int MPI_Finalize(void)
+{
+    int rank, size;
+
+    PMPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    PMPI_Comm_size(MPI_COMM_WORLD, &size);
+    write_rank_summary(rank);
+    merge_reports(rank, size);
+    free(records);
+    records = NULL;
+    return PMPI_Finalize();
+}
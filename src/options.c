@@ -0,0 +1,468 @@
+/**
+ * @file    options.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of command line option parsing.
+ */
+
+#include "options.h"
+#include "approximate.h"
+#include "async_writer.h"
+#include "autotune.h"
+#include "checkpoint.h"
+#include "dynamic.h"
+#include "filter.h"
+#include "input_cache.h"
+#include "result_cache.h"
+#include "sparse.h"
+#include "stats.h"
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define POSITIONAL_ARGS 3   /* [input] [output] [depth] */
+
+/* Values for options that only have a long form */
+enum {
+    OPT_KERNEL = 256,
+    OPT_AUTOTUNE,
+    OPT_PROFILE,
+    OPT_CHUNK_ROWS,
+    OPT_HUGE_PAGES,
+    OPT_SERVE,
+    OPT_CACHE_MB,
+    OPT_RESULT_CACHE,
+    OPT_RESULT_CACHE_MB,
+    OPT_DEPTHS,
+    OPT_PREVIOUS_INPUT,
+    OPT_PREVIOUS_OUTPUT,
+    OPT_DIRTY,
+    OPT_HIERARCHICAL,
+    OPT_WRITER,
+    OPT_PROGRESS,
+    OPT_APPROXIMATE,
+    OPT_STATS,
+    OPT_SPARSE,
+    OPT_FILTER,
+    OPT_BATCH
+};
+
+/**
+ * @brief Print the usage message to stderr.
+ *
+ * @param program_name Name of the executable (argv[0]).
+ */
+void print_usage(const char *program_name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [input] [output] [depth]\n"
+            "Options:\n"
+            "  -l, --lean    process each slab in place using a rolling\n"
+            "                window of depth+1 rows (reduced memory)\n"
+            "  -c, --collective-write\n"
+            "                every process writes its own rows with\n"
+            "                collective MPI-IO instead of gathering\n"
+            "  -k, --checkpoint=DIR\n"
+            "                checkpoint finished rows to DIR in the\n"
+            "                background (not with --lean)\n"
+            "  -K, --checkpoint-rows=N\n"
+            "                rows computed between checkpoints (default %d)\n"
+            "  -r, --restart resume from the checkpoints in DIR, with any\n"
+            "                number of processes\n"
+            "  -t, --timing  report the time spent in each phase\n"
+            "  --kernel=NAME[:TILE[:THREADS]]\n"
+            "                use this kernel (naive, clipped or blocked)\n"
+            "  --autotune    calibrate the kernels for this job and record\n"
+            "                the fastest in the profile\n"
+            "  --profile=FILE\n"
+            "                autotune profile (default %s)\n"
+            "  -d, --dynamic claim chunks of rows from the master through\n"
+            "                one-sided MPI (balances uneven nodes)\n"
+            "  --chunk-rows=N\n"
+            "                rows per dynamic chunk (default %d)\n"
+            "  -p, --pipelined\n"
+            "                send each process its slab as soon as it is\n"
+            "                read, without loading the whole matrix\n"
+            "  --huge-pages  back large matrix buffers with huge pages\n"
+            "  --serve=SOCKET\n"
+            "                stay up and run the jobs requested on the UNIX\n"
+            "                socket SOCKET (no positional arguments)\n"
+            "  --cache-mb=N  MiB of inputs the service keeps in memory\n"
+            "                (default %d)\n"
+            "  --result-cache=DIR\n"
+            "                reuse results of identical jobs cached in DIR\n"
+            "  --result-cache-mb=N\n"
+            "                MiB of results kept in DIR (default %d)\n"
+            "  --depths=D1,D2,...\n"
+            "                compute every listed depth in one pass and\n"
+            "                write each to output.DEPTH (replaces [depth];\n"
+            "                at most %d depths)\n"
+            "  --previous-output=FILE\n"
+            "                update FILE, the output of a previous run at the\n"
+            "                same depth, recomputing only the cells near the\n"
+            "                changes given by one of:\n"
+            "  --previous-input=FILE\n"
+            "                the input of that run, compared with the input\n"
+            "  --dirty=FILE  lines of ROW COL ROWS COLS, the rectangles\n"
+            "                changed since that run\n"
+            "  --hierarchical\n"
+            "                scatter and gather through one leader process\n"
+            "                per node\n"
+            "  --writer=BACKEND\n"
+            "                issue output writes through io_uring, threads\n"
+            "                or auto (io_uring where available; default)\n"
+            "  --progress    move slabs, halos and results from a progress\n"
+            "                thread while computing (MPI_THREAD_MULTIPLE)\n"
+            "  --approximate[=TOLERANCE]\n"
+            "                at depths of %d or more, take the far rings in\n"
+            "                bands whose weights differ by at most TOLERANCE\n"
+            "                (default %g) and report the error on a sample\n"
+            "  --stats       gather the output's range, mean, histogram and\n"
+            "                checksum while computing it, and write them to\n"
+            "                output%s\n"
+            "  --sparse[=DENSITY]\n"
+            "                send slabs with at most DENSITY nonzeros\n"
+            "                (default %g) in sparse form and convolve them\n"
+            "                from their nonzeros\n"
+            "  --filter=NAME replace each cell by the min, max or median of\n"
+            "                its neighbourhood instead of the convolution\n"
+            "  --batch=LIST  convolve every INPUT OUTPUT pair listed in LIST,\n"
+            "                together where their sizes match (only the\n"
+            "                [depth] argument)\n",
+            program_name, CHECKPOINT_ROWS, AUTOTUNE_PROFILE,
+            DYNAMIC_CHUNK_ROWS, INPUT_CACHE_MB, RESULT_CACHE_MB,
+            MAX_DEPTHS, APPROXIMATE_MIN_DEPTH, APPROXIMATE_TOLERANCE,
+            STATS_SUFFIX, SPARSE_MAX_DENSITY);
+}
+
+/**
+ * @brief Order depths from shallowest to deepest.
+ *
+ * @param a First depth.
+ * @param b Second depth.
+ * @return Negative, zero or positive as a is less than, equal to or more
+ *         than b.
+ */
+static int by_depth(const void *a, const void *b)
+{
+    int depth_a = *(const int *) a, depth_b = *(const int *) b;
+    return (depth_a > depth_b) - (depth_a < depth_b);
+}
+
+/**
+ * @brief Parse a comma separated list of depths.
+ *
+ * @param list List to parse.
+ * @param [out] opts Options to store the sorted, distinct depths in.
+ * @return 0 on success, -1 if the list is invalid.
+ */
+static int parse_depths(const char *list, options_t *opts)
+{
+    char *end;
+
+    opts->num_depths = 0;
+    do {
+        long depth = strtol(list, &end, 10);
+        if (end == list || depth < 0 || depth > INT_MAX ||
+            (*end && *end != ',') || opts->num_depths == MAX_DEPTHS)
+            return -1;
+        opts->depths[opts->num_depths++] = depth;
+        list = end + 1;
+    } while (*end);
+
+    // Duplicates would only write the same file twice
+    qsort(opts->depths, opts->num_depths, sizeof(int), by_depth);
+    int distinct = 1;
+    for (int i = 1; i < opts->num_depths; i++)
+        if (opts->depths[i] != opts->depths[distinct - 1])
+            opts->depths[distinct++] = opts->depths[i];
+    opts->num_depths = distinct;
+    return 0;
+}
+
+/**
+ * @brief Parse the command line into an options structure.
+ *
+ * @param argc Argument count.
+ * @param argv Argument values.
+ * @param [out] opts Options structure to fill in.
+ * @return 0 on success, -1 if the arguments are invalid.
+ */
+int parse_options(int argc, char **argv, options_t *opts)
+{
+    static struct option long_options[] = {
+        {"lean",             no_argument,       NULL, 'l'},
+        {"collective-write", no_argument,       NULL, 'c'},
+        {"checkpoint",       required_argument, NULL, 'k'},
+        {"checkpoint-rows",  required_argument, NULL, 'K'},
+        {"restart",          no_argument,       NULL, 'r'},
+        {"timing",           no_argument,       NULL, 't'},
+        {"kernel",           required_argument, NULL, OPT_KERNEL},
+        {"autotune",         no_argument,       NULL, OPT_AUTOTUNE},
+        {"profile",          required_argument, NULL, OPT_PROFILE},
+        {"dynamic",          no_argument,       NULL, 'd'},
+        {"chunk-rows",       required_argument, NULL, OPT_CHUNK_ROWS},
+        {"pipelined",        no_argument,       NULL, 'p'},
+        {"huge-pages",       no_argument,       NULL, OPT_HUGE_PAGES},
+        {"serve",            required_argument, NULL, OPT_SERVE},
+        {"cache-mb",         required_argument, NULL, OPT_CACHE_MB},
+        {"result-cache",     required_argument, NULL, OPT_RESULT_CACHE},
+        {"result-cache-mb",  required_argument, NULL, OPT_RESULT_CACHE_MB},
+        {"depths",           required_argument, NULL, OPT_DEPTHS},
+        {"previous-input",   required_argument, NULL, OPT_PREVIOUS_INPUT},
+        {"previous-output",  required_argument, NULL, OPT_PREVIOUS_OUTPUT},
+        {"dirty",            required_argument, NULL, OPT_DIRTY},
+        {"hierarchical",     no_argument,       NULL, OPT_HIERARCHICAL},
+        {"writer",           required_argument, NULL, OPT_WRITER},
+        {"progress",         no_argument,       NULL, OPT_PROGRESS},
+        {"approximate",      optional_argument, NULL, OPT_APPROXIMATE},
+        {"stats",            no_argument,       NULL, OPT_STATS},
+        {"sparse",           optional_argument, NULL, OPT_SPARSE},
+        {"filter",           required_argument, NULL, OPT_FILTER},
+        {"batch",            required_argument, NULL, OPT_BATCH},
+        {NULL,               0,                 NULL,  0 }
+    };
+    int opt;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->depth = -1;
+    opts->checkpoint_rows = CHECKPOINT_ROWS;
+    opts->profile = AUTOTUNE_PROFILE;
+    opts->chunk_rows = DYNAMIC_CHUNK_ROWS;
+    opts->cache_mb = INPUT_CACHE_MB;
+    opts->result_cache_mb = RESULT_CACHE_MB;
+
+    opterr = 0;     // Usage is reported by the caller
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, "lck:K:rtdp", long_options,
+                              NULL)) != -1) {
+        switch (opt) {
+        case 'l':
+            opts->lean = 1;
+            break;
+        case 'c':
+            opts->collective_write = 1;
+            break;
+        case 'k':
+            opts->checkpoint_dir = optarg;
+            break;
+        case 'K':
+            opts->checkpoint_rows = atoi(optarg);
+            break;
+        case 'r':
+            opts->restart = 1;
+            break;
+        case 't':
+            opts->timing = 1;
+            break;
+        case OPT_KERNEL:
+            opts->kernel = optarg;
+            break;
+        case OPT_AUTOTUNE:
+            opts->autotune = 1;
+            break;
+        case OPT_PROFILE:
+            opts->profile = optarg;
+            break;
+        case 'd':
+            opts->dynamic = 1;
+            break;
+        case OPT_CHUNK_ROWS:
+            opts->chunk_rows = atoi(optarg);
+            break;
+        case 'p':
+            opts->pipelined = 1;
+            break;
+        case OPT_HUGE_PAGES:
+            opts->huge_pages = 1;
+            break;
+        case OPT_SERVE:
+            opts->socket_path = optarg;
+            break;
+        case OPT_CACHE_MB:
+            opts->cache_mb = atoi(optarg);
+            break;
+        case OPT_RESULT_CACHE:
+            opts->result_cache_dir = optarg;
+            break;
+        case OPT_RESULT_CACHE_MB:
+            opts->result_cache_mb = atoi(optarg);
+            break;
+        case OPT_DEPTHS:
+            if (parse_depths(optarg, opts) == -1)
+                return -1;
+            break;
+        case OPT_PREVIOUS_INPUT:
+            opts->previous_input = optarg;
+            break;
+        case OPT_PREVIOUS_OUTPUT:
+            opts->previous_output = optarg;
+            break;
+        case OPT_DIRTY:
+            opts->dirty_file = optarg;
+            break;
+        case OPT_HIERARCHICAL:
+            opts->hierarchical = 1;
+            break;
+        case OPT_WRITER:
+            if (strcmp(optarg, "auto") == 0)
+                opts->writer = WRITER_AUTO;
+            else if (strcmp(optarg, "io_uring") == 0)
+                opts->writer = WRITER_IO_URING;
+            else if (strcmp(optarg, "threads") == 0)
+                opts->writer = WRITER_THREADS;
+            else
+                return -1;
+            break;
+        case OPT_PROGRESS:
+            opts->progress = 1;
+            break;
+        case OPT_APPROXIMATE:
+            opts->approximate = optarg ? atof(optarg) : APPROXIMATE_TOLERANCE;
+            if (opts->approximate <= 0 || opts->approximate > 1)
+                return -1;
+            break;
+        case OPT_STATS:
+            opts->stats = 1;
+            break;
+        case OPT_SPARSE:
+            opts->sparse = optarg ? atof(optarg) : SPARSE_MAX_DENSITY;
+            if (opts->sparse <= 0 || opts->sparse > 1)
+                return -1;
+            break;
+        case OPT_FILTER:
+            opts->filter = filter_from_name(optarg);
+            if (opts->filter == -1)
+                return -1;
+            break;
+        case OPT_BATCH:
+            opts->batch_list = optarg;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    // A service takes its files and depth from each request instead, and
+    // its checkpoints would mix different jobs
+    if (opts->socket_path) {
+        if (argc != optind || opts->cache_mb < 0 || opts->checkpoint_dir)
+            return -1;
+    } else if (opts->batch_list) {
+        if (argc - optind != 1)
+            return -1;
+
+        opts->depth = atoi(argv[optind]);
+        if (opts->depth < 0)
+            return -1;
+    } else if (opts->num_depths > 0) {
+        if (argc - optind != POSITIONAL_ARGS - 1)
+            return -1;
+
+        opts->input_filename  = argv[optind];
+        opts->output_filename = argv[optind + 1];
+        opts->depth = opts->depths[opts->num_depths - 1];
+    } else {
+        if (argc - optind != POSITIONAL_ARGS)
+            return -1;
+
+        opts->input_filename  = argv[optind];
+        opts->output_filename = argv[optind + 1];
+        opts->depth = atoi(argv[optind + 2]);
+        if (opts->depth < 0)
+            return -1;
+    }
+
+    if (opts->result_cache_mb < 0)
+        return -1;
+
+    // Checkpoints record finished rows in place, which lean mode overwrites
+    if (opts->checkpoint_rows <= 0 ||
+        (opts->restart && !opts->checkpoint_dir) ||
+        (opts->checkpoint_dir && opts->lean))
+        return -1;
+
+    // Dynamic chunks replace the fixed slabs the other modes work on
+    if (opts->chunk_rows <= 0 ||
+        (opts->dynamic && (opts->lean || opts->collective_write ||
+                           opts->checkpoint_dir || opts->pipelined)))
+        return -1;
+
+    // Several depths share one fixed slab per process and one pass
+    if (opts->num_depths > 0 &&
+        (opts->lean || opts->dynamic || opts->checkpoint_dir ||
+         opts->socket_path || opts->result_cache_dir))
+        return -1;
+
+    // An update needs the previous output and exactly one way of finding
+    // the changes, and works on regions rather than slabs
+    if ((opts->previous_input || opts->dirty_file || opts->previous_output) &&
+        (!opts->previous_output ||
+         !opts->previous_input == !opts->dirty_file ||
+         opts->lean || opts->dynamic || opts->checkpoint_dir ||
+         opts->num_depths > 0 || opts->socket_path))
+        return -1;
+
+    // The leaders replace the master's scatter and gather, which the
+    // streaming, dynamic and update modes do without
+    if (opts->hierarchical &&
+        (opts->pipelined || opts->dynamic || opts->previous_output))
+        return -1;
+
+    // The progress thread moves fixed slabs between the master and the
+    // others, which the other distribution and output modes replace
+    if (opts->progress &&
+        (opts->lean || opts->collective_write || opts->checkpoint_dir ||
+         opts->dynamic || opts->pipelined || opts->num_depths > 0 ||
+         opts->previous_output || opts->hierarchical))
+        return -1;
+
+    // Approximate results replace the exact kernel of a single fixed slab,
+    // and must not be cached or checkpointed as exact ones
+    if (opts->approximate > 0 &&
+        (opts->lean || opts->checkpoint_dir || opts->dynamic ||
+         opts->num_depths > 0 || opts->previous_output || opts->progress ||
+         opts->result_cache_dir))
+        return -1;
+
+    // Statistics are gathered by the kernel that computes whole rows of
+    // fixed slabs, so not from results restored, cached or updated
+    if (opts->stats &&
+        (opts->lean || opts->checkpoint_dir || opts->dynamic ||
+         opts->num_depths > 0 || opts->previous_output || opts->progress ||
+         opts->approximate > 0 || opts->result_cache_dir))
+        return -1;
+
+    // Sparse slabs replace the master's scatter of fixed slabs and the
+    // dense kernel, which the streaming, in-place and restartable modes
+    // need
+    if (opts->sparse > 0 &&
+        (opts->lean || opts->checkpoint_dir || opts->dynamic ||
+         opts->pipelined || opts->num_depths > 0 || opts->previous_output ||
+         opts->hierarchical || opts->progress || opts->approximate > 0))
+        return -1;
+
+    // The other filters replace the kernel of a single fixed slab; the
+    // in-place, restartable, incremental and service modes run the
+    // convolution's
+    if (opts->filter != FILTER_CONVOLUTION &&
+        (opts->socket_path || opts->lean || opts->checkpoint_dir ||
+         opts->dynamic || opts->num_depths > 0 || opts->previous_output ||
+         opts->progress || opts->approximate > 0 || opts->sparse > 0))
+        return -1;
+
+    // A batch runs whole small matrices on the processes that read them,
+    // with none of the slab modes
+    if (opts->batch_list &&
+        (opts->socket_path || opts->lean || opts->collective_write ||
+         opts->checkpoint_dir || opts->autotune || opts->dynamic ||
+         opts->pipelined || opts->result_cache_dir || opts->num_depths > 0 ||
+         opts->previous_output || opts->hierarchical || opts->progress ||
+         opts->approximate > 0 || opts->stats || opts->sparse > 0 ||
+         opts->filter != FILTER_CONVOLUTION))
+        return -1;
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+/**
+ * @file    options.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Command line option parsing for the convolution program.
+ *
+ * Holds the positional arguments ([input] [output] [depth]) together with
+ * the optional flags that select alternative processing modes.
+ */
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#define MAX_DEPTHS 32       /* Most depths computed in one pass */
+
+/**
+ * @brief Parsed command line options.
+ */
+typedef struct {
+    char    *input_filename;    /* Filename of input matrix */
+    char    *output_filename;   /* Filename of output matrix */
+    int     depth;              /* Neighbourhood depth of the convolution */
+    int     lean;               /* Process slabs in place (memory-lean mode) */
+    int     collective_write;   /* Each process writes its own rows */
+    char    *checkpoint_dir;    /* Directory for checkpoints (or NULL) */
+    int     checkpoint_rows;    /* Rows computed between checkpoints */
+    int     restart;            /* Resume from the checkpoint directory */
+    int     timing;             /* Report per-phase timings */
+    char    *kernel;            /* Kernel specification override (or NULL) */
+    int     autotune;           /* Calibrate kernels for this job */
+    char    *profile;           /* Autotune profile file */
+    int     dynamic;            /* Balance chunks dynamically over RMA */
+    int     chunk_rows;         /* Rows per dynamically claimed chunk */
+    int     pipelined;          /* Stream slabs from file as they are read */
+    int     huge_pages;         /* Back large buffers with huge pages */
+    char    *socket_path;       /* Serve jobs on this socket (or NULL) */
+    int     cache_mb;           /* MiB of inputs the service caches */
+    char    *result_cache_dir;  /* Directory of cached results (or NULL) */
+    int     result_cache_mb;    /* MiB of results kept in the cache */
+    int     depths[MAX_DEPTHS]; /* Depths computed in one pass, ascending */
+    int     num_depths;         /* Number of depths (0 for a single depth) */
+    char    *previous_input;    /* Input of the previous run (or NULL) */
+    char    *previous_output;   /* Output of the previous run (or NULL) */
+    char    *dirty_file;        /* Rectangles changed since then (or NULL) */
+    int     hierarchical;       /* Scatter and gather through node leaders */
+    int     writer;             /* Backend of the output writer */
+    int     progress;           /* Drive transfers from a progress thread */
+    double  approximate;        /* Band tolerance (0 for exact results) */
+    int     stats;              /* Write statistics of the output beside it */
+    double  sparse;             /* Densest slab convolved sparsely (0 never) */
+    int     filter;             /* Filter applied to each neighbourhood */
+    char    *batch_list;        /* List of INPUT OUTPUT jobs (or NULL) */
+} options_t;
+
+/**
+ * @brief Parse the command line into an options structure.
+ *
+ * Optional flags may appear anywhere; the remaining arguments must be
+ * exactly [input] [output] [depth] with a non-negative depth, [input]
+ * [output] when a list of depths is given, or none at all when serving
+ * jobs on a socket.
+ *
+ * @param argc Argument count.
+ * @param argv Argument values.
+ * @param [out] opts Options structure to fill in.
+ * @return 0 on success, -1 if the arguments are invalid.
+ */
+int parse_options(int argc, char **argv, options_t *opts);
+
+/**
+ * @brief Print the usage message to stderr.
+ *
+ * @param program_name Name of the executable (argv[0]).
+ */
+void print_usage(const char *program_name);
+
+#endif /* OPTIONS_H */
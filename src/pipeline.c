@@ -0,0 +1,147 @@
+/**
+ * @file    pipeline.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of pipelined reading and distribution.
+ */
+
+#include "pipeline.h"
+#include "headers.h"
+
+/**
+ * @brief Find the rows of the matrix a process needs, padding included.
+ *
+ * @param rank Rank of the process.
+ * @param nproc Number of processes.
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param [out] first_row First padded row of the process.
+ * @param [out] num_rows Number of padded rows of the process.
+ */
+static void padded_slab(int rank, int nproc, int matrix_size, int depth,
+                        int *first_row, int *num_rows)
+{
+    int top = get_padding(rank, nproc, matrix_size, depth, UP);
+
+    *first_row = rank * (matrix_size / nproc) - top;
+    *num_rows = get_padded_rows(rank, nproc, matrix_size, depth);
+}
+
+/**
+ * @brief Read the workers' slabs in turn, sending each as soon as it is read.
+ *
+ * @param fd Open matrix file.
+ * @param master Rank of the caller.
+ * @param nproc Number of processes.
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param buffers Ring of PIPELINE_BUFFERS slab buffers.
+ * @param requests Send request of each buffer.
+ * @param comm Communicator of the processes.
+ * @return MPI_SUCCESS, or an error code (-1 if reading fails).
+ */
+static int send_slabs(int fd, int master, int nproc, int matrix_size,
+                      int depth, int **buffers, MPI_Request *requests,
+                      MPI_Comm comm)
+{
+    int next = 0, mpi_err, first_row, num_rows;
+
+    for (int rank = 0; rank < nproc; rank++) {
+        if (rank == master)
+            continue;
+        padded_slab(rank, nproc, matrix_size, depth, &first_row, &num_rows);
+
+        // Reuse the oldest buffer once its slab has left
+        mpi_err = MPI_Wait(&requests[next], MPI_STATUS_IGNORE);
+        if (mpi_err != MPI_SUCCESS)
+            return mpi_err;
+
+        timing_start(PHASE_READ);
+        int result = read_matrix_rows(fd, matrix_size, first_row, num_rows,
+                                      buffers[next]);
+        timing_stop(PHASE_READ);
+        if (result == -1)
+            return -1;
+
+        mpi_err = MPI_Isend(buffers[next], num_rows * matrix_size, MPI_INT,
+                            rank, PIPELINE_TAG, comm, &requests[next]);
+        if (mpi_err != MPI_SUCCESS)
+            return mpi_err;
+        LOG("Master sent P%d rows %d to %d\n",
+            rank, first_row, first_row + num_rows - 1);
+        next = (next + 1) % PIPELINE_BUFFERS;
+    }
+    return MPI_SUCCESS;
+}
+
+/**
+ * @brief Read the matrix slab by slab and send each process its slab.
+ *
+ * @param my_rank Rank of the calling process in comm.
+ * @param master Rank that reads the file.
+ * @param filename Matrix file (master only).
+ * @param matrix_size Size of the (square) matrix.
+ * @param depth Depth of the convolution.
+ * @param padded Receive buffer for this process's padded submatrix.
+ * @param comm Communicator of the processes.
+ * @return MPI_SUCCESS, or an error code (-1 if reading fails).
+ */
+int pipeline_distribute(int my_rank, int master, const char *filename,
+                        int matrix_size, int depth, int *padded,
+                        MPI_Comm comm)
+{
+    int *buffers[PIPELINE_BUFFERS] = {NULL};
+    MPI_Request requests[PIPELINE_BUFFERS];
+    int nproc, first_row, num_rows, mpi_err, result;
+
+    MPI_Comm_size(comm, &nproc);
+    padded_slab(my_rank, nproc, matrix_size, depth, &first_row, &num_rows);
+    if (my_rank != master)
+        return MPI_Recv(padded, num_rows * matrix_size, MPI_INT, master,
+                        PIPELINE_TAG, comm, MPI_STATUS_IGNORE);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("Failed to open matrix file");
+        return -1;
+    }
+
+    // Every buffer fits the tallest slab: the last process's working rows,
+    // which take the remainder, padded both ways
+    int buffer_rows = get_working_rows(nproc - 1, nproc, matrix_size) +
+                      2 * depth;
+    if (buffer_rows > matrix_size)
+        buffer_rows = matrix_size;
+    for (int i = 0; i < PIPELINE_BUFFERS; i++) {
+        requests[i] = MPI_REQUEST_NULL;
+        if (nproc > 1)
+            buffers[i] = allocate_matrix_uninit(buffer_rows, matrix_size);
+        if (nproc > 1 && !buffers[i]) {
+            for (int j = 0; j < i; j++)
+                safe_free(&buffers[j]);
+            close(fd);
+            return -1;
+        }
+    }
+
+    mpi_err = send_slabs(fd, master, nproc, matrix_size, depth, buffers,
+                         requests, comm);
+
+    // The master's own slab is read while the last sends drain
+    if (mpi_err == MPI_SUCCESS) {
+        timing_start(PHASE_READ);
+        result = read_matrix_rows(fd, matrix_size, first_row, num_rows,
+                                  padded);
+        timing_stop(PHASE_READ);
+        if (result == -1)
+            mpi_err = -1;
+    }
+    if (mpi_err == MPI_SUCCESS)
+        mpi_err = MPI_Waitall(PIPELINE_BUFFERS, requests,
+                              MPI_STATUSES_IGNORE);
+
+    for (int i = 0; i < PIPELINE_BUFFERS; i++)
+        safe_free(&buffers[i]);
+    close(fd);
+    return mpi_err;
+}
@@ -0,0 +1,44 @@
+/**
+ * @file    pipeline.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Pipelined reading and distribution of the input matrix.
+ *
+ * Rather than reading the whole matrix before scattering it, the master
+ * reads one padded slab at a time, in rank order, and sends each slab with
+ * MPI_Isend as soon as it is in memory while it reads the next. Workers can
+ * start computing while the master is still reading, and the master only
+ * ever holds a few slabs instead of the whole matrix.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <mpi.h>
+
+#define PIPELINE_BUFFERS 3      /* Slabs in flight on the master */
+#define PIPELINE_TAG     31     /* Message tag of pipelined slabs */
+
+/**
+ * @brief Read the matrix slab by slab and send each process its slab.
+ *
+ * Collective over comm. The master reads the other processes' slabs first
+ * so they can start early, and its own slab last, straight into its
+ * padded submatrix. The file is only opened on the master. Every process
+ * has matrix_size / nproc working rows, and the last process also the rows
+ * left over, so the slabs cover the whole file.
+ *
+ * @param my_rank Rank of the calling process in comm.
+ * @param master Rank that reads the file.
+ * @param filename Matrix file (master only).
+ * @param matrix_size Size of the (square) matrix.
+ * @param depth Depth of the convolution.
+ * @param padded Receive buffer for this process's padded submatrix.
+ * @param comm Communicator of the processes.
+ * @return MPI_SUCCESS, or an error code (-1 if reading fails).
+ */
+int pipeline_distribute(int my_rank, int master, const char *filename,
+                        int matrix_size, int depth, int *padded,
+                        MPI_Comm comm);
+
+#endif /* PIPELINE_H */
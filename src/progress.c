@@ -0,0 +1,567 @@
+/**
+ * @file    progress.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of the progress thread and its convolution.
+ */
+
+#include "progress.h"
+#include "headers.h"
+#include <string.h>
+#include <time.h>
+
+/**
+ * @brief A finished band to hand to the output writer.
+ */
+typedef struct {
+    async_writer_t  *writer;    /* Output writer, or NULL if not open */
+    const int       *data;      /* Rows of the band */
+    size_t          bytes;      /* Size of the band */
+    off_t           offset;     /* Offset of the band in the file */
+} band_write_t;
+
+/**
+ * @brief Test the outstanding requests and complete those that are done.
+ *
+ * Called with the lock held. If testing fails, every request is treated
+ * as complete so that no caller waits for ever.
+ *
+ * @param engine Progress thread.
+ * @param indices Scratch space for the capacity's indices.
+ * @return Number of requests completed.
+ */
+static int poll_requests(progress_t *engine, int *indices)
+{
+    int outcount, kept = 0, completed = 0, mpi_err;
+
+    mpi_err = MPI_Testsome(engine->num_items, engine->requests, &outcount,
+                           indices, MPI_STATUSES_IGNORE);
+    if (mpi_err != MPI_SUCCESS && engine->mpi_err == MPI_SUCCESS)
+        engine->mpi_err = mpi_err;
+
+    for (int i = 0; i < engine->num_items; i++) {
+        if (engine->requests[i] != MPI_REQUEST_NULL &&
+            engine->mpi_err == MPI_SUCCESS) {
+            engine->requests[kept] = engine->requests[i];
+            engine->items[kept++] = engine->items[i];
+            continue;
+        }
+        if (engine->items[i].flag)
+            *engine->items[i].flag = 1;
+        if (engine->items[i].callback)
+            engine->items[i].callback(engine->items[i].arg);
+        completed++;
+    }
+    engine->num_items = kept;
+    if (completed) {
+        if (kept == 0)
+            engine->active += MPI_Wtime() - engine->active_since;
+        pthread_cond_broadcast(&engine->changed);
+    }
+    return completed;
+}
+
+/**
+ * @brief Keep testing the outstanding requests until stopped.
+ *
+ * @param arg The progress thread.
+ * @return NULL.
+ */
+static void *progress_thread(void *arg)
+{
+    progress_t *engine = arg;
+    struct timespec pause = { 0, PROGRESS_POLL_US * 1000L };
+    int *indices = NULL, capacity = 0, completed;
+    double started;
+
+    pthread_mutex_lock(&engine->lock);
+    for (;;) {
+        while (engine->num_items == 0 && !engine->stopping)
+            pthread_cond_wait(&engine->changed, &engine->lock);
+        if (engine->num_items == 0)
+            break;
+        if (capacity < engine->capacity) {
+            free(indices);
+            capacity = engine->capacity;
+            indices = malloc(capacity * sizeof(int));
+            if (!indices) {
+                fprintf(stderr, "Failed to allocate the progress indices\n");
+                MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            }
+        }
+
+        started = MPI_Wtime();
+        completed = poll_requests(engine, indices);
+        engine->busy += MPI_Wtime() - started;
+
+        // Let the compute threads have the core while nothing is moving
+        if (!completed) {
+            pthread_mutex_unlock(&engine->lock);
+            nanosleep(&pause, NULL);
+            pthread_mutex_lock(&engine->lock);
+        }
+    }
+    pthread_mutex_unlock(&engine->lock);
+    free(indices);
+    return NULL;
+}
+
+/**
+ * @brief Start a progress thread.
+ *
+ * @param [out] engine Progress thread to start.
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+int progress_start(progress_t *engine)
+{
+    memset(engine, 0, sizeof(*engine));
+    engine->mpi_err = MPI_SUCCESS;
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->changed, NULL);
+    if (pthread_create(&engine->thread, NULL, progress_thread, engine) != 0) {
+        pthread_mutex_destroy(&engine->lock);
+        pthread_cond_destroy(&engine->changed);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Hand a request to the progress thread.
+ *
+ * @param engine Running progress thread.
+ * @param request Request started by the caller, or MPI_REQUEST_NULL.
+ * @param flag Set to 1 on completion (may be NULL).
+ * @param callback Called on completion (may be NULL).
+ * @param arg Argument of the callback.
+ */
+void progress_add(progress_t *engine, MPI_Request request, int *flag,
+                  progress_callback_t callback, void *arg)
+{
+    pthread_mutex_lock(&engine->lock);
+    if (engine->num_items == engine->capacity) {
+        int capacity = engine->capacity ? 2 * engine->capacity : 64;
+        MPI_Request *requests = realloc(engine->requests,
+                                        capacity * sizeof(MPI_Request));
+        if (requests)
+            engine->requests = requests;
+        progress_item_t *items = realloc(engine->items,
+                                         capacity * sizeof(progress_item_t));
+        if (items)
+            engine->items = items;
+        if (!requests || !items) {
+            fprintf(stderr, "Failed to allocate the progress requests\n");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        engine->capacity = capacity;
+    }
+    if (engine->num_items == 0)
+        engine->active_since = MPI_Wtime();
+    engine->requests[engine->num_items] = request;
+    engine->items[engine->num_items].flag = flag;
+    engine->items[engine->num_items].callback = callback;
+    engine->items[engine->num_items].arg = arg;
+    engine->num_items++;
+    pthread_cond_broadcast(&engine->changed);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+/**
+ * @brief Wait for a request's flag to be set.
+ *
+ * @param engine Running progress thread.
+ * @param flag Flag given with the request.
+ * @return MPI_SUCCESS, or the error code of a failed test.
+ */
+int progress_wait(progress_t *engine, const int *flag)
+{
+    double started = MPI_Wtime();
+    int mpi_err;
+
+    pthread_mutex_lock(&engine->lock);
+    while (!*flag && engine->mpi_err == MPI_SUCCESS)
+        pthread_cond_wait(&engine->changed, &engine->lock);
+    mpi_err = engine->mpi_err;
+    engine->waited += MPI_Wtime() - started;
+    pthread_mutex_unlock(&engine->lock);
+    return mpi_err;
+}
+
+/**
+ * @brief Wait for every outstanding request to complete.
+ *
+ * @param engine Running progress thread.
+ * @return MPI_SUCCESS, or the error code of a failed test.
+ */
+int progress_wait_all(progress_t *engine)
+{
+    double started = MPI_Wtime();
+    int mpi_err;
+
+    pthread_mutex_lock(&engine->lock);
+    while (engine->num_items > 0 && engine->mpi_err == MPI_SUCCESS)
+        pthread_cond_wait(&engine->changed, &engine->lock);
+    mpi_err = engine->mpi_err;
+    engine->waited += MPI_Wtime() - started;
+    pthread_mutex_unlock(&engine->lock);
+    return mpi_err;
+}
+
+/**
+ * @brief Stop the progress thread and add its costs to the timings.
+ *
+ * @param engine Running progress thread.
+ */
+void progress_stop(progress_t *engine)
+{
+    progress_wait_all(engine);
+    pthread_mutex_lock(&engine->lock);
+    engine->stopping = 1;
+    pthread_cond_broadcast(&engine->changed);
+    pthread_mutex_unlock(&engine->lock);
+    pthread_join(engine->thread, NULL);
+
+    timing_add(PHASE_PROGRESS_BG, engine->busy);
+    if (engine->active > engine->waited)
+        timing_add(PHASE_OVERLAP, engine->active - engine->waited);
+    free(engine->requests);
+    free(engine->items);
+    pthread_mutex_destroy(&engine->lock);
+    pthread_cond_destroy(&engine->changed);
+}
+
+/**
+ * @brief Queue a received or computed band on the output writer.
+ *
+ * @param arg The band to write.
+ */
+static void write_band(void *arg)
+{
+    const band_write_t *band = arg;
+
+    if (band->writer)
+        async_writer_submit(band->writer, band->data, band->bytes,
+                            band->offset);
+}
+
+/**
+ * @brief Split a slab's working rows into bands, those away from the edges
+ *        first.
+ *
+ * A band is an edge band if some row in it is within depth of a halo; the
+ * others only need the slab's own rows.
+ *
+ * @param rows_per_node Working rows of the slab.
+ * @param depth Depth of the convolution.
+ * @param top Halo rows above the slab.
+ * @param bottom Halo rows below the slab.
+ * @param [out] firsts First working row of each band.
+ * @param [out] counts Rows of each band.
+ * @param [out] edges Whether each band needs the halos.
+ * @return Number of bands, at most rows_per_node / PROGRESS_BAND_ROWS + 3.
+ */
+static int plan_bands(int rows_per_node, int depth, int top, int bottom,
+                      int *firsts, int *counts, int *edges)
+{
+    int low = top > 0 ? depth : 0;
+    int high = bottom > 0 ? rows_per_node - depth : rows_per_node;
+    int num_bands = 0;
+
+    if (low > rows_per_node)
+        low = rows_per_node;
+    if (high < low)
+        high = low;
+    for (int row = low; row < high; row += PROGRESS_BAND_ROWS) {
+        firsts[num_bands] = row;
+        counts[num_bands] = high - row < PROGRESS_BAND_ROWS ?
+                            high - row : PROGRESS_BAND_ROWS;
+        edges[num_bands++] = 0;
+    }
+    if (low > 0) {
+        firsts[num_bands] = 0;
+        counts[num_bands] = low;
+        edges[num_bands++] = 1;
+    }
+    if (high < rows_per_node) {
+        firsts[num_bands] = high;
+        counts[num_bands] = rows_per_node - high;
+        edges[num_bands++] = 1;
+    }
+    return num_bands;
+}
+
+/**
+ * @brief Send the other processes their rows and halos, receive their
+ *        bands, and compute the master's own, writing each band as it is
+ *        ready.
+ *
+ * @param engine Running progress thread.
+ * @param nproc Number of processes.
+ * @param matrix Input matrix.
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param config Kernel configuration to compute with.
+ * @param output_filename Output file.
+ * @param comm Communicator of the processes.
+ * @param [out] write_result Result of writing the output.
+ * @return MPI_SUCCESS, or an error code (-1 if a band fails to convolve).
+ */
+static int master_convolve(progress_t *engine, int nproc, int *matrix,
+                           int matrix_size, int depth,
+                           const kernel_config_t *config,
+                           const char *output_filename, MPI_Comm comm,
+                           int *write_result)
+{
+    size_t cols = matrix_size;
+    int rows_per_node = matrix_size / nproc;
+    int max_rows = get_working_rows(nproc - 1, nproc, matrix_size);
+    int max_bands = max_rows / PROGRESS_BAND_ROWS + 3;
+    int *firsts = malloc(3 * max_bands * sizeof(int));
+    int *counts = firsts + max_bands, *edges = counts + max_bands;
+    band_write_t *writes = malloc((size_t) nproc * max_bands *
+                                  sizeof(band_write_t));
+    int *output = allocate_matrix_uninit(matrix_size, matrix_size);
+    int top, bottom, rows, num_bands, num_writes = 0;
+    int mpi_err = MPI_SUCCESS, result = 0;
+    async_writer_t writer, *open_writer = NULL;
+    MPI_Request request;
+    band_write_t *band;
+
+    if (!firsts || !writes || !output) {
+        fprintf(stderr, "Failed to allocate the master's bands\n");
+        MPI_Abort(comm, EXIT_FAILURE);
+    }
+    if (async_writer_open(&writer, output_filename) == 0)
+        open_writer = &writer;
+    else
+        LOG("Failed to open output file %s.\n", output_filename);
+
+    // Send every other process its rows, then its halos, and post the
+    // receives of its bands in the order it will send them
+    timing_start(PHASE_DISTRIBUTE);
+    for (int r = 1; r < nproc && mpi_err == MPI_SUCCESS; r++) {
+        size_t first = (size_t) r * rows_per_node;
+        rows = get_working_rows(r, nproc, matrix_size);
+        top = get_padding(r, nproc, matrix_size, depth, UP);
+        bottom = get_padding(r, nproc, matrix_size, depth, DOWN);
+
+        mpi_err = MPI_Isend(matrix + first * cols, rows * cols,
+                            MPI_INT, r, PROGRESS_ROWS_TAG, comm, &request);
+        if (mpi_err == MPI_SUCCESS) {
+            progress_add(engine, request, NULL, NULL, NULL);
+            if (top > 0)
+                mpi_err = MPI_Isend(matrix + (first - top) * cols,
+                                    top * cols, MPI_INT, r,
+                                    PROGRESS_HALO_TAG, comm, &request);
+        }
+        if (mpi_err == MPI_SUCCESS && top > 0)
+            progress_add(engine, request, NULL, NULL, NULL);
+        if (mpi_err == MPI_SUCCESS && bottom > 0) {
+            mpi_err = MPI_Isend(matrix + (first + rows) * cols,
+                                bottom * cols, MPI_INT, r,
+                                PROGRESS_HALO_TAG, comm, &request);
+            if (mpi_err == MPI_SUCCESS)
+                progress_add(engine, request, NULL, NULL, NULL);
+        }
+
+        num_bands = plan_bands(rows, depth, top, bottom, firsts, counts,
+                               edges);
+        for (int b = 0; b < num_bands && mpi_err == MPI_SUCCESS; b++) {
+            band = &writes[num_writes++];
+            band->writer = open_writer;
+            band->data = output + (first + firsts[b]) * cols;
+            band->bytes = counts[b] * cols * sizeof(int);
+            band->offset = (first + firsts[b]) * cols * sizeof(int);
+            mpi_err = MPI_Irecv((int *) band->data, counts[b] * cols,
+                                MPI_INT, r, PROGRESS_BAND_TAG, comm,
+                                &request);
+            if (mpi_err == MPI_SUCCESS)
+                progress_add(engine, request, NULL, write_band, band);
+        }
+    }
+    timing_stop(PHASE_DISTRIBUTE);
+
+    // The master's own slab is the top of the matrix, so its bands need no
+    // waiting; each is written as soon as it is computed
+    rows = get_working_rows(MASTER, nproc, matrix_size);
+    bottom = get_padding(MASTER, nproc, matrix_size, depth, DOWN);
+    num_bands = plan_bands(rows, depth, 0, bottom, firsts, counts, edges);
+    for (int b = 0; b < num_bands && mpi_err == MPI_SUCCESS; b++) {
+        band = &writes[num_writes++];
+        band->writer = open_writer;
+        band->data = output + firsts[b] * cols;
+        band->bytes = counts[b] * cols * sizeof(int);
+        band->offset = firsts[b] * cols * sizeof(int);
+        timing_start(PHASE_COMPUTE);
+        result = convolve_rows_with(config, matrix, rows + bottom,
+                                    matrix_size, firsts[b], counts[b], depth,
+                                    (int *) band->data);
+        timing_stop(PHASE_COMPUTE);
+        if (result == -1)
+            break;
+        progress_add(engine, MPI_REQUEST_NULL, NULL, write_band, band);
+    }
+
+    if (mpi_err == MPI_SUCCESS && result == 0) {
+        timing_start(PHASE_COLLECT);
+        mpi_err = progress_wait_all(engine);
+        timing_stop(PHASE_COLLECT);
+        timing_start(PHASE_WRITE);
+        *write_result = open_writer ? async_writer_close(open_writer) : -1;
+        timing_stop(PHASE_WRITE);
+    }
+    free(firsts);
+    free(writes);
+    safe_free(&output);
+    return mpi_err != MPI_SUCCESS ? mpi_err : result;
+}
+
+/**
+ * @brief Receive this process's rows and halos, and compute and send its
+ *        bands, the inner ones while the halos are still arriving.
+ *
+ * @param engine Running progress thread.
+ * @param my_rank Rank of the calling process.
+ * @param nproc Number of processes.
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param config Kernel configuration to compute with.
+ * @param comm Communicator of the processes.
+ * @return MPI_SUCCESS, or an error code (-1 if a band fails to convolve).
+ */
+static int worker_convolve(progress_t *engine, int my_rank, int nproc,
+                           int matrix_size, int depth,
+                           const kernel_config_t *config, MPI_Comm comm)
+{
+    size_t cols = matrix_size;
+    int rows = get_working_rows(my_rank, nproc, matrix_size);
+    int top = get_padding(my_rank, nproc, matrix_size, depth, UP);
+    int bottom = get_padding(my_rank, nproc, matrix_size, depth, DOWN);
+    int padded_rows = top + rows + bottom;
+    int max_bands = rows / PROGRESS_BAND_ROWS + 3;
+    int *firsts = malloc(3 * max_bands * sizeof(int));
+    int *counts = firsts + max_bands, *edges = counts + max_bands;
+    int *padded = allocate_matrix_uninit(padded_rows, matrix_size);
+    int *output = allocate_matrix_uninit(rows, matrix_size);
+    int rows_in = 0, top_in = top == 0, bottom_in = bottom == 0;
+    int halos_in = 0;
+    int num_bands, mpi_err, result = 0;
+    MPI_Request request;
+
+    if (!firsts || !padded || !output) {
+        fprintf(stderr, "P%d failed to allocate its bands\n", my_rank);
+        MPI_Abort(comm, EXIT_FAILURE);
+    }
+
+    timing_start(PHASE_DISTRIBUTE);
+    mpi_err = MPI_Irecv(padded + top * cols, rows * cols, MPI_INT,
+                        MASTER, PROGRESS_ROWS_TAG, comm, &request);
+    if (mpi_err == MPI_SUCCESS) {
+        progress_add(engine, request, &rows_in, NULL, NULL);
+        if (top > 0)
+            mpi_err = MPI_Irecv(padded, top * cols, MPI_INT, MASTER,
+                                PROGRESS_HALO_TAG, comm, &request);
+    }
+    if (mpi_err == MPI_SUCCESS && top > 0)
+        progress_add(engine, request, &top_in, NULL, NULL);
+    if (mpi_err == MPI_SUCCESS && bottom > 0) {
+        mpi_err = MPI_Irecv(padded + (top + rows) * cols,
+                            bottom * cols, MPI_INT, MASTER,
+                            PROGRESS_HALO_TAG, comm, &request);
+        if (mpi_err == MPI_SUCCESS)
+            progress_add(engine, request, &bottom_in, NULL, NULL);
+    }
+    if (mpi_err == MPI_SUCCESS)
+        mpi_err = progress_wait(engine, &rows_in);
+    timing_stop(PHASE_DISTRIBUTE);
+
+    num_bands = plan_bands(rows, depth, top, bottom, firsts, counts,
+                           edges);
+    for (int b = 0; b < num_bands && mpi_err == MPI_SUCCESS; b++) {
+        int *band = output + firsts[b] * cols;
+
+        // Inner bands see only the working rows; their neighbourhoods never
+        // reach the edges, so the halos are not needed yet
+        if (edges[b] && !halos_in) {
+            timing_start(PHASE_DISTRIBUTE);
+            mpi_err = progress_wait(engine, &top_in);
+            if (mpi_err == MPI_SUCCESS)
+                mpi_err = progress_wait(engine, &bottom_in);
+            timing_stop(PHASE_DISTRIBUTE);
+            if (mpi_err != MPI_SUCCESS)
+                break;
+            halos_in = 1;
+        }
+        timing_start(PHASE_COMPUTE);
+        if (edges[b])
+            result = convolve_rows_with(config, padded, padded_rows,
+                                        matrix_size, top + firsts[b],
+                                        counts[b], depth, band);
+        else
+            result = convolve_rows_with(config, padded + top * cols,
+                                        rows, matrix_size,
+                                        firsts[b], counts[b], depth, band);
+        timing_stop(PHASE_COMPUTE);
+        if (result == -1)
+            break;
+
+        mpi_err = MPI_Isend(band, counts[b] * cols, MPI_INT, MASTER,
+                            PROGRESS_BAND_TAG, comm, &request);
+        if (mpi_err == MPI_SUCCESS)
+            progress_add(engine, request, NULL, NULL, NULL);
+    }
+
+    if (mpi_err == MPI_SUCCESS && result == 0) {
+        timing_start(PHASE_COLLECT);
+        mpi_err = progress_wait_all(engine);
+        timing_stop(PHASE_COLLECT);
+    }
+    free(firsts);
+    safe_free(&padded);
+    safe_free(&output);
+    return mpi_err != MPI_SUCCESS ? mpi_err : result;
+}
+
+/**
+ * @brief Convolve the master's matrix with transfers driven by a progress
+ *        thread, writing the result as it arrives.
+ *
+ * @param my_rank Rank of the calling process in comm.
+ * @param matrix Input matrix (master only).
+ * @param matrix_size Size of the (square) matrix.
+ * @param depth Depth of the convolution.
+ * @param config Kernel configuration to compute with.
+ * @param output_filename Output file (master only).
+ * @param comm Communicator of the processes; the master must be rank 0.
+ * @param [out] write_result Result of writing the output, as from
+ *                           write_matrix_to_file (master only).
+ * @return MPI_SUCCESS, or an error code (-1 if a band fails to convolve or
+ *         the progress thread cannot start).
+ */
+int progress_convolve(int my_rank, int *matrix, int matrix_size, int depth,
+                      const kernel_config_t *config,
+                      const char *output_filename, MPI_Comm comm,
+                      int *write_result)
+{
+    progress_t engine;
+    int nproc, result;
+
+    MPI_Comm_size(comm, &nproc);
+    if (progress_start(&engine) == -1) {
+        fprintf(stderr, "P%d failed to start its progress thread\n",
+                my_rank);
+        return -1;
+    }
+    if (my_rank == MASTER)
+        result = master_convolve(&engine, nproc, matrix, matrix_size, depth,
+                                 config, output_filename, comm,
+                                 write_result);
+    else
+        result = worker_convolve(&engine, my_rank, nproc, matrix_size, depth,
+                                 config, comm);
+
+    // After a failure requests may be left outstanding; the caller aborts
+    if (result == MPI_SUCCESS)
+        progress_stop(&engine);
+    return result;
+}
@@ -0,0 +1,143 @@
+/**
+ * @file    progress.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Communication progress thread and the convolution that uses it.
+ *
+ * Non-blocking transfers often only move while the process is inside an
+ * MPI call, so a process deep in the compute loop gets no overlap from
+ * them. Here a helper thread keeps testing the outstanding requests while
+ * the compute threads work, which needs MPI_THREAD_MULTIPLE.
+ *
+ * The convolution built on it splits each process's slab into bands and
+ * orders them so that those away from the slab's edges come first: they
+ * need only the process's own rows, so they are computed while the halo
+ * rows are still arriving. Each band is sent to the master as soon as it
+ * is finished, and the master hands each band it receives to the output
+ * writer, so the gather and the write overlap the compute too.
+ */
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <mpi.h>
+#include <pthread.h>
+#include "convolution.h"
+
+#define PROGRESS_BAND_ROWS  32      /* Rows per band sent to the master */
+#define PROGRESS_POLL_US    50      /* Pause between idle polls */
+#define PROGRESS_ROWS_TAG   33      /* Message tag of a slab's own rows */
+#define PROGRESS_HALO_TAG   34      /* Message tag of a slab's halo rows */
+#define PROGRESS_BAND_TAG   35      /* Message tag of finished bands */
+
+/**
+ * @brief Called on the progress thread when a request completes.
+ */
+typedef void (*progress_callback_t)(void *arg);
+
+/**
+ * @brief A request handed to the progress thread.
+ */
+typedef struct {
+    int                 *flag;      /* Set to 1 on completion (or NULL) */
+    progress_callback_t callback;   /* Called on completion (or NULL) */
+    void                *arg;       /* Argument of the callback */
+} progress_item_t;
+
+/**
+ * @brief A progress thread and its outstanding requests.
+ */
+typedef struct {
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;        /* Signalled on new work or completion */
+    MPI_Request     *requests;      /* Outstanding requests */
+    progress_item_t *items;         /* What to do as each completes */
+    int             num_items;
+    int             capacity;
+    int             stopping;       /* The thread should exit when idle */
+    int             mpi_err;        /* First failed test, or MPI_SUCCESS */
+    double          busy;           /* Seconds spent testing and calling */
+    double          active;         /* Seconds with requests outstanding */
+    double          active_since;   /* When requests became outstanding */
+    double          waited;         /* Seconds callers spent waiting */
+} progress_t;
+
+/**
+ * @brief Start a progress thread.
+ *
+ * @param [out] engine Progress thread to start.
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+int progress_start(progress_t *engine);
+
+/**
+ * @brief Hand a request to the progress thread.
+ *
+ * Once the request completes, the thread sets the flag and calls the
+ * callback. A null request completes at once, which runs the callback on
+ * the progress thread. Aborts if out of memory.
+ *
+ * @param engine Running progress thread.
+ * @param request Request started by the caller, or MPI_REQUEST_NULL.
+ * @param flag Set to 1 on completion (may be NULL).
+ * @param callback Called on completion (may be NULL).
+ * @param arg Argument of the callback.
+ */
+void progress_add(progress_t *engine, MPI_Request request, int *flag,
+                  progress_callback_t callback, void *arg);
+
+/**
+ * @brief Wait for a request's flag to be set.
+ *
+ * @param engine Running progress thread.
+ * @param flag Flag given with the request.
+ * @return MPI_SUCCESS, or the error code of a failed test.
+ */
+int progress_wait(progress_t *engine, const int *flag);
+
+/**
+ * @brief Wait for every outstanding request to complete.
+ *
+ * @param engine Running progress thread.
+ * @return MPI_SUCCESS, or the error code of a failed test.
+ */
+int progress_wait_all(progress_t *engine);
+
+/**
+ * @brief Stop the progress thread and add its costs to the timings.
+ *
+ * The thread's busy time counts as "progress (background)", and the time
+ * requests were outstanding while no caller was waiting for them as
+ * "communication overlapped". Requests still outstanding are completed
+ * first.
+ *
+ * @param engine Running progress thread.
+ */
+void progress_stop(progress_t *engine);
+
+/**
+ * @brief Convolve the master's matrix with transfers driven by a progress
+ *        thread, writing the result as it arrives.
+ *
+ * Collective over comm. Each process convolves matrix_size / nproc rows,
+ * and the last process also the rows left over.
+ *
+ * @param my_rank Rank of the calling process in comm.
+ * @param matrix Input matrix (master only).
+ * @param matrix_size Size of the (square) matrix.
+ * @param depth Depth of the convolution.
+ * @param config Kernel configuration to compute with.
+ * @param output_filename Output file (master only).
+ * @param comm Communicator of the processes; the master must be rank 0.
+ * @param [out] write_result Result of writing the output, as from
+ *                           write_matrix_to_file (master only).
+ * @return MPI_SUCCESS, or an error code (-1 if a band fails to convolve or
+ *         the progress thread cannot start).
+ */
+int progress_convolve(int my_rank, int *matrix, int matrix_size, int depth,
+                      const kernel_config_t *config,
+                      const char *output_filename, MPI_Comm comm,
+                      int *write_result);
+
+#endif /* PROGRESS_H */
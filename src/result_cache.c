@@ -0,0 +1,314 @@
+/**
+ * @file    result_cache.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of the content-addressed result cache.
+ */
+
+#include "result_cache.h"
+#include "headers.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/file.h>
+
+#define HASH_BATCH_BYTES (4 << 20)      /* Rows read per batch when hashing */
+#define RESULT_SUFFIX    ".out"         /* Suffix of cached results */
+#define STATS_FILE       "stats"        /* Hit and miss counts */
+
+/**
+ * @brief A cached result considered for eviction.
+ */
+typedef struct {
+    char    name[NAME_MAX + 1];     /* File name in the cache directory */
+    off_t   size;                   /* Bytes */
+    time_t  used;                   /* Last hit or store */
+} cached_result;
+
+/**
+ * @brief Scramble a 64-bit value (the splitmix64 finaliser).
+ *
+ * @param x Value to scramble.
+ * @return Scrambled value.
+ */
+static uint64_t mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * @brief Add a row's hash to the two 64-bit lanes of a matrix hash.
+ *
+ * The row number seeds the row's hash, so the sum over rows still
+ * depends on where each row is.
+ *
+ * @param row Row to hash.
+ * @param cols Number of columns.
+ * @param index Row number in the matrix.
+ * @param lanes Lanes to add to.
+ */
+static void hash_row(const int *row, int cols, uint64_t index,
+                     uint64_t *lanes)
+{
+    uint64_t a = mix(index), b = mix(~index);
+
+    for (int col = 0; col < cols; col++) {
+        uint64_t value = (uint32_t) row[col];
+        a = (a ^ value) * 0x100000001b3ULL;
+        b = (b + value) * 0x9e3779b97f4a7c15ULL;
+        b ^= b >> 29;
+    }
+    lanes[0] += mix(a);
+    lanes[1] += mix(b);
+}
+
+/**
+ * @brief Hash a band of rows of a matrix file.
+ *
+ * @param input Input matrix file.
+ * @param matrix_size Size of the matrix.
+ * @param first_row First row to hash.
+ * @param num_rows Number of rows to hash.
+ * @param lanes Lanes to add the rows' hashes to.
+ * @return 0 on success, -1 if the rows could not be read.
+ */
+static int hash_rows(const char *input, int matrix_size, int first_row,
+                     int num_rows, uint64_t *lanes)
+{
+    int batch = HASH_BATCH_BYTES / (matrix_size * (int) sizeof(int));
+    if (batch < 1)
+        batch = 1;
+    if (batch > num_rows)
+        batch = num_rows;
+    if (num_rows <= 0)
+        return 0;
+
+    int fd = open(input, O_RDONLY);
+    int *rows = allocate_matrix_uninit(batch, matrix_size);
+    if (fd == -1 || !rows) {
+        if (fd != -1)
+            close(fd);
+        safe_free(&rows);
+        return -1;
+    }
+
+    for (int row = first_row; row < first_row + num_rows; row += batch) {
+        int count = first_row + num_rows - row < batch ?
+                    first_row + num_rows - row : batch;
+        if (read_matrix_rows(fd, matrix_size, row, count, rows) == -1) {
+            safe_free(&rows);
+            close(fd);
+            return -1;
+        }
+        for (int i = 0; i < count; i++)
+            hash_row(rows + (size_t) i * matrix_size, matrix_size,
+                     row + i, lanes);
+    }
+    safe_free(&rows);
+    close(fd);
+    return 0;
+}
+
+/**
+ * @brief Record a hit or a miss in the statistics file.
+ *
+ * @param dir Cache directory.
+ * @param hit Whether to record a hit.
+ * @param [out] hits Hits recorded so far.
+ * @param [out] misses Misses recorded so far.
+ */
+static void record_stats(const char *dir, int hit, long *hits, long *misses)
+{
+    char path[PATH_MAX], counts[64];
+
+    *hits = *misses = 0;
+    snprintf(path, sizeof(path), "%s/%s", dir, STATS_FILE);
+    int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        return;
+
+    // Concurrent jobs may share the cache
+    flock(fd, LOCK_EX);
+    ssize_t got = pread(fd, counts, sizeof(counts) - 1, 0);
+    counts[got > 0 ? got : 0] = '\0';
+    if (sscanf(counts, "%ld %ld", hits, misses) != 2)
+        *hits = *misses = 0;
+    if (hit)
+        (*hits)++;
+    else
+        (*misses)++;
+    int length = snprintf(counts, sizeof(counts), "%ld %ld\n",
+                          *hits, *misses);
+    if (pwrite(fd, counts, length, 0) == length)
+        ftruncate(fd, length);
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+/**
+ * @brief Order cached results from least to most recently used.
+ *
+ * @param a First result.
+ * @param b Second result.
+ * @return Negative, zero or positive as a was used before, with or after b.
+ */
+static int by_use(const void *a, const void *b)
+{
+    time_t used_a = ((const cached_result *) a)->used;
+    time_t used_b = ((const cached_result *) b)->used;
+    return (used_a > used_b) - (used_a < used_b);
+}
+
+/**
+ * @brief Evict the least recently used results until within budget.
+ *
+ * @param dir Cache directory.
+ * @param budget Most bytes of results to keep.
+ */
+static void evict(const char *dir, size_t budget)
+{
+    char path[PATH_MAX];
+    cached_result *results = NULL;
+    size_t count = 0, capacity = 0, total = 0;
+    struct dirent *entry;
+    struct stat st;
+
+    DIR *listing = opendir(dir);
+    if (!listing)
+        return;
+    while ((entry = readdir(listing))) {
+        size_t length = strlen(entry->d_name);
+        if (length <= strlen(RESULT_SUFFIX) ||
+            strcmp(entry->d_name + length - strlen(RESULT_SUFFIX),
+                   RESULT_SUFFIX) != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (stat(path, &st) != 0)
+            continue;
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            cached_result *grown = realloc(results,
+                                           capacity * sizeof(*results));
+            if (!grown)
+                break;
+            results = grown;
+        }
+        strcpy(results[count].name, entry->d_name);
+        results[count].size = st.st_size;
+        results[count].used = st.st_mtime;
+        total += st.st_size;
+        count++;
+    }
+    closedir(listing);
+
+    qsort(results, count, sizeof(*results), by_use);
+    for (size_t i = 0; i < count && total > budget; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, results[i].name);
+        if (unlink(path) == 0) {
+            total -= results[i].size;
+            LOG("Evicted %s from the result cache\n", results[i].name);
+        }
+    }
+    free(results);
+}
+
+/**
+ * @brief Work out a job's cache key from its input file.
+ *
+ * @param input Input matrix file.
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param filter Name of the filter applied.
+ * @param comm Communicator of the processes.
+ * @param [out] key Key of RESULT_CACHE_KEY_LEN characters.
+ * @return MPI_SUCCESS, or an error code (-1 if any process failed to read).
+ */
+int result_cache_key(const char *input, int matrix_size, int depth,
+                     const char *filter, MPI_Comm comm, char *key)
+{
+    uint64_t parts[3] = {0, 0, 0}, sums[3];   // Two lanes and a failure count
+    int rank, nproc;
+
+    // Each process hashes its own rows; the last also takes any remainder
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nproc);
+    int rows_per_node = matrix_size / nproc;
+    int first_row = rank * rows_per_node;
+    int num_rows = rank == nproc - 1 ? matrix_size - first_row : rows_per_node;
+    if (hash_rows(input, matrix_size, first_row, num_rows, parts) == -1)
+        parts[2] = 1;
+
+    int mpi_err = MPI_Allreduce(parts, sums, 3, MPI_UINT64_T, MPI_SUM, comm);
+    if (mpi_err != MPI_SUCCESS)
+        return mpi_err;
+    if (sums[2] != 0)
+        return -1;
+
+    snprintf(key, RESULT_CACHE_KEY_LEN, "v%d-%.32s-%d-%d-%016llx%016llx",
+             RESULT_CACHE_VERSION, filter, matrix_size, depth,
+             (unsigned long long) sums[0], (unsigned long long) sums[1]);
+    return MPI_SUCCESS;
+}
+
+/**
+ * @brief Materialise a cached result and record the hit or miss.
+ *
+ * @param dir Cache directory.
+ * @param key Key of the job.
+ * @param output Output file to create.
+ * @param [out] hits Hits recorded so far, this one included.
+ * @param [out] misses Misses recorded so far, this one included.
+ * @return 0 on a hit, -1 on a miss.
+ */
+int result_cache_fetch(const char *dir, const char *key, const char *output,
+                       long *hits, long *misses)
+{
+    char path[PATH_MAX];
+
+    mkdir(dir, S_IRWXU);
+    snprintf(path, sizeof(path), "%s/%s%s", dir, key, RESULT_SUFFIX);
+    int hit = copy_matrix_file(path, output) == 0;
+
+    // Using a result makes it the last to be evicted
+    if (hit)
+        utimensat(AT_FDCWD, path, NULL, 0);
+    record_stats(dir, hit, hits, misses);
+    return hit ? 0 : -1;
+}
+
+/**
+ * @brief Add a job's output to the cache, evicting old results if needed.
+ *
+ * @param dir Cache directory.
+ * @param key Key of the job.
+ * @param output Output file of the job.
+ * @param budget Most bytes of results to keep.
+ * @return 0 on success, -1 if the result was not stored.
+ */
+int result_cache_store(const char *dir, const char *key, const char *output,
+                       size_t budget)
+{
+    char path[PATH_MAX], temp_path[PATH_MAX];
+    struct stat st;
+
+    if (stat(output, &st) != 0 || (size_t) st.st_size > budget)
+        return -1;
+
+    // Make room first, then publish the result atomically
+    evict(dir, budget - st.st_size);
+    snprintf(path, sizeof(path), "%s/%s%s", dir, key, RESULT_SUFFIX);
+    snprintf(temp_path, sizeof(temp_path), "%s/%s.%ld.tmp", dir, key,
+             (long) getpid());
+    if (copy_matrix_file(output, temp_path) != 0 ||
+        rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
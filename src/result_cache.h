@@ -0,0 +1,74 @@
+/**
+ * @file    result_cache.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Content-addressed on-disk cache of convolution results.
+ *
+ * Jobs are keyed on a 128-bit hash of the input matrix together with its
+ * size, the depth, the filter and the version of the results, so a change
+ * to the results of a key retires the entries made before it. The hash is
+ * a sum of per-row hashes, so every process hashes its own rows straight
+ * from the input file and the parts are combined with one reduction,
+ * whatever the number of processes.
+ * A job seen before is materialised from the cache (by reflink where the
+ * file system supports it, else by copy) without scattering or computing.
+ *
+ * The cache directory holds one KEY.out file per result and a "stats" file
+ * of hit and miss counts. When the results exceed the size budget the
+ * least recently used ones are evicted.
+ */
+
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <stddef.h>
+#include <mpi.h>
+
+#define RESULT_CACHE_MB       1024              /* Default budget in MiB */
+#define RESULT_CACHE_KEY_LEN  96                /* Longest key, with the NUL */
+#define RESULT_CACHE_VERSION  1                 /* Bumped when the results of
+                                                   a key change */
+
+/**
+ * @brief Work out a job's cache key from its input file.
+ *
+ * Collective over comm; every process reads and hashes its share of the
+ * rows and all processes get the key.
+ *
+ * @param input Input matrix file.
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param filter Name of the filter applied.
+ * @param comm Communicator of the processes.
+ * @param [out] key Key of RESULT_CACHE_KEY_LEN characters.
+ * @return MPI_SUCCESS, or an error code (-1 if any process failed to read).
+ */
+int result_cache_key(const char *input, int matrix_size, int depth,
+                     const char *filter, MPI_Comm comm, char *key);
+
+/**
+ * @brief Materialise a cached result and record the hit or miss.
+ *
+ * @param dir Cache directory.
+ * @param key Key of the job.
+ * @param output Output file to create.
+ * @param [out] hits Hits recorded so far, this one included.
+ * @param [out] misses Misses recorded so far, this one included.
+ * @return 0 on a hit, -1 on a miss.
+ */
+int result_cache_fetch(const char *dir, const char *key, const char *output,
+                       long *hits, long *misses);
+
+/**
+ * @brief Add a job's output to the cache, evicting old results if needed.
+ *
+ * @param dir Cache directory.
+ * @param key Key of the job.
+ * @param output Output file of the job.
+ * @param budget Most bytes of results to keep.
+ * @return 0 on success, -1 if the result was not stored.
+ */
+int result_cache_store(const char *dir, const char *key, const char *output,
+                       size_t budget);
+
+#endif /* RESULT_CACHE_H */
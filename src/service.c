@@ -0,0 +1,340 @@
+/**
+ * @file    service.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of the persistent convolution service.
+ */
+
+#include "service.h"
+#include "headers.h"
+#include "input_cache.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_KERNEL 64   /* Longest kernel specification in a request */
+#define MAX_TOKENS 4    /* Most words in a request */
+
+/**
+ * @brief What the workers are told to do next.
+ */
+typedef enum {
+    JOB_RUN,        /* Run the job described */
+    JOB_STOP        /* Shut down */
+} job_command_t;
+
+/**
+ * @brief A job as broadcast from the master to the workers.
+ */
+typedef struct {
+    int     command;                /* job_command_t */
+    int     depth;                  /* Depth of the convolution */
+    char    input[PATH_MAX];        /* Input matrix file */
+    char    output[PATH_MAX];       /* Output matrix file */
+    char    kernel[MAX_KERNEL];     /* Kernel specification, or empty */
+} service_job_t;
+
+/**
+ * @brief Broadcast the next job from the master.
+ *
+ * Idle workers sleep between polls rather than spinning in MPI_Bcast.
+ *
+ * @param job Job to send (master) or receive (workers).
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+static int broadcast_job(service_job_t *job)
+{
+    MPI_Request request;
+    int done = 0;
+
+    int mpi_err = MPI_Ibcast(job, sizeof(*job), MPI_BYTE, MASTER,
+                             MPI_COMM_WORLD, &request);
+    while (mpi_err == MPI_SUCCESS && !done) {
+        mpi_err = MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+        if (!done)
+            usleep(SERVICE_POLL_US);
+    }
+    return mpi_err;
+}
+
+/**
+ * @brief Fill in a job's options from the defaults and the job.
+ *
+ * @param defaults Command line options.
+ * @param job Job to run.
+ * @return Options of the job.
+ */
+static options_t job_options(const options_t *defaults, service_job_t *job)
+{
+    options_t options = *defaults;
+
+    options.input_filename = job->input;
+    options.output_filename = job->output;
+    options.depth = job->depth;
+    if (job->kernel[0])
+        options.kernel = job->kernel;
+    return options;
+}
+
+/**
+ * @brief Send a one line reply to a client.
+ *
+ * @param conn Connection to the client.
+ * @param fmt Formatting string (similar to printf).
+ * @param ... Variadic arguments to fit the formatting string.
+ */
+static void reply(int conn, const char *fmt, ...)
+{
+    char line[SERVICE_MAX_LINE];
+    va_list args;
+
+    va_start(args, fmt);
+    int length = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (length >= (int) sizeof(line))
+        length = sizeof(line) - 1;
+
+    // A client that has gone away must not take the service down with it
+    if (length > 0)
+        send(conn, line, length, MSG_NOSIGNAL);
+}
+
+/**
+ * @brief Create the listening socket.
+ *
+ * @param path Socket path; any stale socket there is replaced.
+ * @return Listening socket, or -1 on failure.
+ */
+static int open_socket(const char *path)
+{
+    struct sockaddr_un address;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == -1) {
+        perror("Failed to create socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(listener, SERVICE_BACKLOG) != 0) {
+        perror("Failed to listen on socket");
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+/**
+ * @brief Check a request and fill in the job it describes.
+ *
+ * @param tokens Words of the request.
+ * @param count Number of words.
+ * @param [out] job Job to run.
+ * @return NULL if the request is valid, else a message saying why not.
+ */
+static const char *parse_request(char **tokens, int count, service_job_t *job)
+{
+    kernel_config_t config;
+    char *end;
+
+    if (count < 3 || count > 4)
+        return "expected INPUT OUTPUT DEPTH [KERNEL]";
+    if (strlen(tokens[0]) >= sizeof(job->input) ||
+        strlen(tokens[1]) >= sizeof(job->output))
+        return "path too long";
+    if (count == 4 && (strlen(tokens[3]) >= sizeof(job->kernel) ||
+                       kernel_config_from_string(tokens[3], &config) == -1))
+        return "invalid kernel";
+
+    long depth = strtol(tokens[2], &end, 10);
+    if (*end || end == tokens[2] || depth < 0 || depth > INT_MAX)
+        return "invalid depth";
+
+    memset(job, 0, sizeof(*job));
+    job->command = JOB_RUN;
+    job->depth = depth;
+    strcpy(job->input, tokens[0]);
+    strcpy(job->output, tokens[1]);
+    if (count == 4)
+        strcpy(job->kernel, tokens[3]);
+    return NULL;
+}
+
+/**
+ * @brief Handle one request on the master.
+ *
+ * @param line Request line.
+ * @param conn Connection to reply on.
+ * @param defaults Command line options.
+ * @param nproc Number of processes.
+ * @param cache Input matrix cache.
+ * @param run_job Function that runs one job.
+ * @return 1 if the service should shut down, else 0.
+ */
+static int handle_request(char *line, int conn, const options_t *defaults,
+                          int nproc, input_cache_t *cache,
+                          service_job_fn run_job)
+{
+    char *tokens[MAX_TOKENS + 1], *saved;
+    service_job_t job;
+    int count = 0, matrix_size = -1, *matrix = NULL;
+    long hits, misses;
+
+    for (char *word = strtok_r(line, " \t\r\n", &saved);
+         word && count <= MAX_TOKENS;
+         word = strtok_r(NULL, " \t\r\n", &saved))
+        tokens[count++] = word;
+    if (count == 0)
+        return 0;
+
+    if (count == 1 && strcmp(tokens[0], "shutdown") == 0) {
+        memset(&job, 0, sizeof(job));
+        job.command = JOB_STOP;
+        broadcast_job(&job);
+        reply(conn, "ok 0\n");
+        return 1;
+    }
+
+    const char *problem = parse_request(tokens, count, &job);
+    if (problem) {
+        reply(conn, "error %s\n", problem);
+        return 0;
+    }
+
+    // Check everything that could fail on the master alone before the
+    // workers are involved, as a failed collective would end the service
+    int fd = open(job.output, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        reply(conn, "error cannot write %s: %s\n", job.output,
+              strerror(errno));
+        return 0;
+    }
+    close(fd);
+    if (defaults->pipelined && job.depth > 0) {
+        if (get_matrix_size_from_file(job.input) <= 0) {
+            reply(conn, "error cannot read %s\n", job.input);
+            return 0;
+        }
+    } else {
+        matrix = input_cache_fetch(cache, job.input, &matrix_size);
+        if (!matrix) {
+            reply(conn, "error cannot read %s\n", job.input);
+            return 0;
+        }
+    }
+
+    // Zero depth is a copy the master makes alone
+    double started = MPI_Wtime();
+    if (job.depth > 0 && broadcast_job(&job) != MPI_SUCCESS) {
+        safe_free(&matrix);
+        reply(conn, "error failed to start job\n");
+        return 1;
+    }
+    int status = run_job(job_options(defaults, &job), MASTER, nproc,
+                         matrix, matrix_size);
+    double elapsed = MPI_Wtime() - started;
+
+    input_cache_stats(cache, &hits, &misses);
+    LOG("Served %s -> %s at depth %d in %.6f s (cache: %ld hits, %ld misses)\n",
+        job.input, job.output, job.depth, elapsed, hits, misses);
+    if (status == EXIT_SUCCESS)
+        reply(conn, "ok %.6f\n", elapsed);
+    else
+        reply(conn, "error failed to write %s\n", job.output);
+    return 0;
+}
+
+/**
+ * @brief Accept connections and serve their requests until shut down.
+ *
+ * @param listener Listening socket.
+ * @param defaults Command line options.
+ * @param nproc Number of processes.
+ * @param cache Input matrix cache.
+ * @param run_job Function that runs one job.
+ */
+static void serve(int listener, const options_t *defaults, int nproc,
+                  input_cache_t *cache, service_job_fn run_job)
+{
+    char line[SERVICE_MAX_LINE];
+    int stop = 0;
+
+    while (!stop) {
+        int conn = accept(listener, NULL, NULL);
+        if (conn == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to accept connection");
+            break;
+        }
+        FILE *requests = fdopen(conn, "r");
+        if (!requests) {
+            close(conn);
+            continue;
+        }
+        while (!stop && fgets(line, sizeof(line), requests))
+            stop = handle_request(line, conn, defaults, nproc, cache,
+                                  run_job);
+        fclose(requests);
+    }
+
+    // Release the workers if the service ended without a shutdown request
+    if (!stop) {
+        service_job_t job;
+        memset(&job, 0, sizeof(job));
+        job.command = JOB_STOP;
+        broadcast_job(&job);
+    }
+}
+
+/**
+ * @brief Serve jobs on the options' socket until asked to shut down.
+ *
+ * @param options Command line options, with the socket path set.
+ * @param my_rank Rank of this process.
+ * @param nproc Number of processes.
+ * @param run_job Function that runs one job.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the service could not start.
+ */
+int service_run(const options_t *options, int my_rank, int nproc,
+                service_job_fn run_job)
+{
+    service_job_t job;
+
+    if (my_rank == MASTER) {
+        input_cache_t *cache = input_cache_create(
+            (size_t) options->cache_mb * 1024 * 1024);
+        int listener = cache ? open_socket(options->socket_path) : -1;
+        if (listener == -1) {
+            input_cache_destroy(cache);
+            memset(&job, 0, sizeof(job));
+            job.command = JOB_STOP;
+            broadcast_job(&job);
+            return EXIT_FAILURE;
+        }
+        fprintf(stderr, "Serving %d processes on %s\n",
+                nproc, options->socket_path);
+
+        serve(listener, options, nproc, cache, run_job);
+        close(listener);
+        unlink(options->socket_path);
+        input_cache_destroy(cache);
+        return EXIT_SUCCESS;
+    }
+
+    // Workers run whatever the master hands them
+    while (broadcast_job(&job) == MPI_SUCCESS && job.command == JOB_RUN)
+        run_job(job_options(options, &job), my_rank, nproc, NULL, -1);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,56 @@
+/**
+ * @file    service.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Persistent convolution service over a UNIX domain socket.
+ *
+ * Instead of running one job and exiting, the MPI job stays up. The master
+ * accepts requests on a UNIX stream socket, one per line:
+ *
+ *     INPUT OUTPUT DEPTH [KERNEL]
+ *     shutdown
+ *
+ * and broadcasts each job to the waiting workers. Once the output has been
+ * written it replies with one line, "ok SECONDS" or "error MESSAGE".
+ * Inputs are served from a bounded in-memory cache, so a request only
+ * costs the convolution itself, not mpirun, MPI_Init and a cold read.
+ */
+
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include "options.h"
+
+#define SERVICE_BACKLOG   16        /* Pending connections on the socket */
+#define SERVICE_POLL_US   1000      /* Idle workers' poll interval */
+#define SERVICE_MAX_LINE  8192      /* Longest request line */
+
+/**
+ * @brief Function that runs one job with all processes.
+ *
+ * @param options Options of the job.
+ * @param my_rank Rank of this process.
+ * @param nproc Number of processes.
+ * @param matrix Input matrix, or NULL to read it (master only).
+ * @param matrix_size Size of the given matrix (master only).
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the job failed.
+ */
+typedef int (*service_job_fn)(options_t options, int my_rank, int nproc,
+                              int *matrix, int matrix_size);
+
+/**
+ * @brief Serve jobs on the options' socket until asked to shut down.
+ *
+ * Collective over MPI_COMM_WORLD. The command line options are the
+ * defaults for every job; a request only sets its files, depth and kernel.
+ *
+ * @param options Command line options, with the socket path set.
+ * @param my_rank Rank of this process.
+ * @param nproc Number of processes.
+ * @param run_job Function that runs one job.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the service could not start.
+ */
+int service_run(const options_t *options, int my_rank, int nproc,
+                service_job_fn run_job);
+
+#endif /* SERVICE_H */
@@ -0,0 +1,374 @@
+/**
+ * @file    sparse.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of the sparse convolution.
+ */
+
+#include "sparse.h"
+#include "headers.h"
+#include <pthread.h>
+#include <string.h>
+
+/**
+ * @brief One thread's share of the rows of a sparse convolution.
+ */
+typedef struct {
+    const sparse_slab_t *slab;      /* Padded slab in sparse form */
+    const double        *weights;   /* Weight of each ring */
+    int                 first_row;  /* First row of the share */
+    int                 num_rows;   /* Rows in the share */
+    int                 depth;
+    int                 *output;    /* Results of the share's first row */
+    output_stats_t      *stats;     /* Statistics of the finished rows (or
+                                       NULL) */
+    int                 output_row; /* Row of the whole output of the
+                                       share's first row */
+} sparse_task_t;
+
+/**
+ * @brief Count the nonzero cells of consecutive rows.
+ *
+ * @param matrix Rows to count.
+ * @param rows Number of rows.
+ * @param cols Number of columns.
+ * @return Number of nonzero cells.
+ */
+long sparse_count(const int *matrix, int rows, int cols)
+{
+    size_t cells = (size_t) rows * cols;
+    long nnz = 0;
+
+    for (size_t i = 0; i < cells; i++)
+        nnz += matrix[i] != 0;
+    return nnz;
+}
+
+/**
+ * @brief Allocate a sparse slab for a number of nonzeros.
+ *
+ * @param [out] slab Slab to allocate.
+ * @param rows Number of rows.
+ * @param cols Number of columns.
+ * @param nnz Number of nonzero cells.
+ * @return 0 on success, -1 if out of memory.
+ */
+int sparse_alloc(sparse_slab_t *slab, int rows, int cols, int nnz)
+{
+    slab->rows = rows;
+    slab->cols = cols;
+    slab->nnz = nnz;
+    slab->data = malloc(((size_t) rows + 1 + 2 * (size_t) nnz) *
+                        sizeof(int));
+    if (!slab->data)
+        return -1;
+    slab->row_starts = slab->data;
+    slab->col_index = slab->row_starts + rows + 1;
+    slab->values = slab->col_index + nnz;
+    return 0;
+}
+
+/**
+ * @brief Build the sparse form of consecutive rows.
+ *
+ * @param matrix Rows to convert.
+ * @param rows Number of rows.
+ * @param cols Number of columns.
+ * @param [out] slab Sparse form, allocated here.
+ * @return 0 on success, -1 if out of memory.
+ */
+int sparse_build(const int *matrix, int rows, int cols, sparse_slab_t *slab)
+{
+    int next = 0;
+
+    if (sparse_alloc(slab, rows, cols,
+                     (int) sparse_count(matrix, rows, cols)) == -1)
+        return -1;
+    for (int row = 0; row < rows; row++) {
+        const int *line = matrix + (size_t) row * cols;
+        slab->row_starts[row] = next;
+        for (int col = 0; col < cols; col++) {
+            if (line[col] == 0)
+                continue;
+            slab->col_index[next] = col;
+            slab->values[next++] = line[col];
+        }
+    }
+    slab->row_starts[rows] = next;
+    return 0;
+}
+
+/**
+ * @brief Release a sparse slab.
+ *
+ * @param slab Slab to release (may be empty).
+ */
+void sparse_free(sparse_slab_t *slab)
+{
+    free(slab->data);
+    slab->data = NULL;
+}
+
+/**
+ * @brief Distribute the padded slabs, sparse ones in sparse form.
+ *
+ * @param my_rank Rank of the calling process in comm.
+ * @param nproc Number of processes.
+ * @param matrix Full matrix (master only).
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param max_density Largest fraction of nonzeros of a sparse slab.
+ * @param my_padded_submatrix Receive buffer of a dense slab.
+ * @param my_padded_rows Rows in the padded slab.
+ * @param [out] my_slab This process's slab in sparse form, if sparse.
+ * @param comm Communicator of the processes; the master must be rank 0.
+ * @return MPI_SUCCESS, or an error code (-1 if allocation fails).
+ */
+int sparse_distribute(int my_rank, int nproc, int *matrix, int matrix_size,
+                      int depth, double max_density,
+                      int *my_padded_submatrix, int my_padded_rows,
+                      sparse_slab_t *my_slab, MPI_Comm comm)
+{
+    int *nnz = malloc(nproc * sizeof(int));     // Per slab; -1 when dense
+    int *counts = malloc(nproc * sizeof(int));
+    int *starts = malloc(nproc * sizeof(int));
+    int mpi_err = MPI_SUCCESS, num_sparse = 0;
+    long total_nnz = 0, total_cells = 0;
+
+    my_slab->data = NULL;
+    if (!nnz || !counts || !starts) {
+        safe_free(&nnz);
+        safe_free(&counts);
+        safe_free(&starts);
+        return -1;
+    }
+
+    // The master decides the form of each slab from its nonzeros
+    if (my_rank == MASTER) {
+        for (int proc = 0; proc < nproc; proc++) {
+            int top = get_padding(proc, nproc, matrix_size, depth, UP);
+            int rows = get_padded_rows(proc, nproc, matrix_size, depth);
+            long cells = (long) rows * matrix_size;
+
+            starts[proc] = (proc * (matrix_size / nproc) - top) *
+                           matrix_size;
+            nnz[proc] = (int) sparse_count(matrix + starts[proc], rows,
+                                           matrix_size);
+            total_nnz += nnz[proc];
+            total_cells += cells;
+            if (nnz[proc] <= max_density * cells) {
+                counts[proc] = 0;
+                num_sparse++;
+            } else {
+                counts[proc] = cells;
+                nnz[proc] = -1;
+            }
+        }
+        fprintf(stderr, "Sparse slabs: %d of %d (%.2f%% nonzero)\n",
+                num_sparse, nproc, 100.0 * total_nnz / total_cells);
+    }
+    mpi_err = MPI_Bcast(nnz, nproc, MPI_INT, MASTER, comm);
+
+    // Dense slabs are scattered as usual, and sparse ones skipped
+    if (mpi_err == MPI_SUCCESS)
+        mpi_err = MPI_Scatterv(matrix, counts, starts, MPI_INT,
+                               my_padded_submatrix,
+                               nnz[my_rank] < 0 ?
+                                   my_padded_rows * matrix_size : 0,
+                               MPI_INT, MASTER, comm);
+
+    // Sparse slabs are sent in one message each: row starts, columns and
+    // values
+    if (mpi_err == MPI_SUCCESS && my_rank == MASTER) {
+        for (int proc = 0; proc < nproc && mpi_err == MPI_SUCCESS; proc++) {
+            sparse_slab_t slab;
+            int rows = get_padded_rows(proc, nproc, matrix_size, depth);
+
+            if (nnz[proc] < 0)
+                continue;
+            if (sparse_build(matrix + starts[proc], rows, matrix_size,
+                             proc == MASTER ? my_slab : &slab) == -1) {
+                mpi_err = -1;
+                break;
+            }
+            if (proc == MASTER)
+                continue;
+            mpi_err = MPI_Send(slab.data, rows + 1 + 2 * slab.nnz, MPI_INT,
+                               proc, SPARSE_TAG, comm);
+            sparse_free(&slab);
+        }
+    } else if (mpi_err == MPI_SUCCESS && nnz[my_rank] >= 0) {
+        if (sparse_alloc(my_slab, my_padded_rows, matrix_size,
+                         nnz[my_rank]) == -1)
+            mpi_err = -1;
+        else
+            mpi_err = MPI_Recv(my_slab->data,
+                               my_padded_rows + 1 + 2 * nnz[my_rank],
+                               MPI_INT, MASTER, SPARSE_TAG, comm,
+                               MPI_STATUS_IGNORE);
+    }
+    LOG("P%d received its slab in %s form\n",
+        my_rank, nnz[my_rank] < 0 ? "dense" : "sparse");
+
+    if (mpi_err != MPI_SUCCESS)
+        sparse_free(my_slab);
+    safe_free(&nnz);
+    safe_free(&counts);
+    safe_free(&starts);
+    return mpi_err;
+}
+
+/**
+ * @brief Add a finished row of a thread's share to its statistics.
+ *
+ * @param task The sparse_task_t of the share.
+ * @param row Row of the slab.
+ */
+static void add_finished_row(const sparse_task_t *task, int row)
+{
+    int cols = task->slab->cols;
+
+    stats_add_row(task->stats,
+                  task->output + (size_t)(row - task->first_row) * cols,
+                  cols, task->output_row + row - task->first_row);
+}
+
+/**
+ * @brief Scatter the nonzeros near one thread's share of rows into it.
+ *
+ * Source rows are visited in order, and each row's nonzeros by column, so
+ * every cell receives its neighbours in the order apply_convolution adds
+ * them. A row is finished once the source depth rows below it has been
+ * visited.
+ *
+ * @param arg The sparse_task_t describing the share.
+ * @return NULL.
+ */
+static void* scatter_nonzeros(void *arg)
+{
+    sparse_task_t *task = arg;
+    const sparse_slab_t *slab = task->slab;
+    int cols = slab->cols, depth = task->depth;
+    int last_row = task->first_row + task->num_rows - 1;
+    int first_source = task->first_row - depth < 0 ?
+                       0 : task->first_row - depth;
+    int last_source = last_row + depth >= slab->rows ?
+                      slab->rows - 1 : last_row + depth;
+    int finished = task->first_row;     // First row not yet in the stats
+
+    memset(task->output, 0, (size_t) task->num_rows * cols * sizeof(int));
+    for (int source = first_source; source <= last_source; source++) {
+        int first_target = source - depth < task->first_row ?
+                           task->first_row : source - depth;
+        int last_target = source + depth > last_row ?
+                          last_row : source + depth;
+
+        for (int i = slab->row_starts[source];
+             i < slab->row_starts[source + 1]; i++) {
+            int col = slab->col_index[i], value = slab->values[i];
+            int first_col = col - depth < 0 ? 0 : col - depth;
+            int last_col = col + depth >= cols ? cols - 1 : col + depth;
+
+            for (int row = first_target; row <= last_target; row++) {
+                int *line = task->output +
+                            (size_t)(row - task->first_row) * cols;
+                int ring = abs(row - source);
+
+                for (int c = first_col; c <= last_col; c++) {
+                    int distance = abs(c - col) > ring ? abs(c - col) : ring;
+                    if (distance == 0)
+                        continue;   // The cell is not its own neighbour
+                    line[c] += value * task->weights[distance];
+                }
+            }
+        }
+        for (; task->stats && finished <= source - depth &&
+               finished <= last_row; finished++)
+            add_finished_row(task, finished);
+    }
+    for (; task->stats && finished <= last_row; finished++)
+        add_finished_row(task, finished);
+    return NULL;
+}
+
+/**
+ * @brief Applies convolution to a band of rows of a sparse slab.
+ *
+ * @param config Kernel configuration (only the thread count is used).
+ * @param slab Padded slab in sparse form.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth for convolution operation.
+ * @param output Buffer of num_rows * slab->cols cells for the results.
+ * @param output_row Row of the whole output that the band's first row is.
+ * @param stats Statistics to add the results to (may be NULL).
+ * @return 0 on success, -1 on failure.
+ */
+int sparse_convolve_rows(const kernel_config_t *config,
+                         const sparse_slab_t *slab, int first_row,
+                         int num_rows, int depth, int *output,
+                         int output_row, output_stats_t *stats)
+{
+    sparse_task_t tasks[MAX_KERNEL_THREADS];
+    pthread_t threads[MAX_KERNEL_THREADS];
+    output_stats_t *thread_stats = NULL;
+    int num_threads = config->threads, started;
+
+    if (!slab->data || !output || depth < 0 || first_row < 0 ||
+        num_rows < 0 || first_row + num_rows > slab->rows) {
+        fprintf(stderr, "Invalid input parameters for "
+                "sparse_convolve_rows\n");
+        return -1;
+    }
+
+    if (num_threads > num_rows)
+        num_threads = num_rows;
+    if (num_threads > MAX_KERNEL_THREADS)
+        num_threads = MAX_KERNEL_THREADS;
+    if (num_threads < 1)
+        num_threads = 1;
+
+    double *weights = malloc((depth + 1) * sizeof(double));
+    if (stats)
+        thread_stats = malloc(num_threads * sizeof(output_stats_t));
+    if (!weights || (stats && !thread_stats)) {
+        fprintf(stderr, "Failed to allocate convolution weights\n");
+        free(weights);
+        free(thread_stats);
+        return -1;
+    }
+    for (int ring = 0; ring <= depth; ring++)
+        weights[ring] = 1 / (double)(ring + 1);
+
+    // Each thread owns a share of the output rows, so none write the same
+    // cell, and gathers its own statistics
+    for (int t = 0; t < num_threads; t++) {
+        int start = num_rows * t / num_threads;
+        int end = num_rows * (t + 1) / num_threads;
+        tasks[t] = (sparse_task_t) {
+            slab, weights, first_row + start, end - start, depth,
+            output + (size_t) start * slab->cols,
+            stats ? &thread_stats[t] : NULL, output_row + start
+        };
+        if (stats)
+            stats_init(&thread_stats[t]);
+    }
+    for (started = 1; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, scatter_nonzeros,
+                           &tasks[started]) != 0) {
+            // The calling thread takes over the shares not started
+            for (int t = started; t < num_threads; t++)
+                scatter_nonzeros(&tasks[t]);
+            break;
+        }
+    }
+    scatter_nonzeros(&tasks[0]);
+    for (int t = 1; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    for (int t = 0; stats && t < num_threads; t++)
+        stats_merge(stats, &thread_stats[t]);
+    free(thread_stats);
+    free(weights);
+    return 0;
+}
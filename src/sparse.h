@@ -0,0 +1,130 @@
+/**
+ * @file    sparse.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Convolution of mostly-zero matrices from their nonzero cells.
+ *
+ * A zero neighbour adds nothing to a cell, so for matrices that are mostly
+ * zeros it is cheaper to go the other way round: each nonzero cell adds
+ * its weighted value to every cell within depth of it, at a cost of
+ * nnz * (2 * depth + 1)^2 rather than one per neighbour of every cell.
+ *
+ * The nonzeros are kept in compressed sparse rows and visited in row-major
+ * order, so that each cell receives its neighbours' contributions in the
+ * same order, with the same truncation, as apply_convolution adds them;
+ * the results are identical.
+ *
+ * The master counts the nonzeros of each process's padded slab. Slabs with
+ * at most the given fraction of nonzeros are sent in sparse form and
+ * convolved as above; denser ones are scattered and convolved as usual.
+ */
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <mpi.h>
+#include "convolution.h"
+
+#define SPARSE_MAX_DENSITY  0.05    /* Default densest slab sent sparse */
+#define SPARSE_TAG          36      /* Message tag of sparse slabs */
+
+/**
+ * @brief Rows of a matrix in compressed sparse row form.
+ */
+typedef struct {
+    int     rows;           /* Rows of the matrix */
+    int     cols;           /* Columns of the matrix */
+    int     nnz;            /* Nonzero cells */
+    int     *data;          /* The three arrays below, in one buffer */
+    int     *row_starts;    /* First nonzero of each row, then nnz */
+    int     *col_index;     /* Column of each nonzero */
+    int     *values;        /* Value of each nonzero */
+} sparse_slab_t;
+
+/**
+ * @brief Count the nonzero cells of consecutive rows.
+ *
+ * @param matrix Rows to count.
+ * @param rows Number of rows.
+ * @param cols Number of columns.
+ * @return Number of nonzero cells.
+ */
+long sparse_count(const int *matrix, int rows, int cols);
+
+/**
+ * @brief Allocate a sparse slab for a number of nonzeros.
+ *
+ * @param [out] slab Slab to allocate.
+ * @param rows Number of rows.
+ * @param cols Number of columns.
+ * @param nnz Number of nonzero cells.
+ * @return 0 on success, -1 if out of memory.
+ */
+int sparse_alloc(sparse_slab_t *slab, int rows, int cols, int nnz);
+
+/**
+ * @brief Build the sparse form of consecutive rows.
+ *
+ * @param matrix Rows to convert.
+ * @param rows Number of rows.
+ * @param cols Number of columns.
+ * @param [out] slab Sparse form, allocated here.
+ * @return 0 on success, -1 if out of memory.
+ */
+int sparse_build(const int *matrix, int rows, int cols, sparse_slab_t *slab);
+
+/**
+ * @brief Release a sparse slab.
+ *
+ * @param slab Slab to release (may be empty).
+ */
+void sparse_free(sparse_slab_t *slab);
+
+/**
+ * @brief Distribute the padded slabs, sparse ones in sparse form.
+ *
+ * Collective over comm; replaces the master's scatter. A process whose
+ * slab has at most max_density nonzeros receives it in my_slab; otherwise
+ * my_slab is left empty (data NULL) and the slab is scattered into
+ * my_padded_submatrix.
+ *
+ * @param my_rank Rank of the calling process in comm.
+ * @param nproc Number of processes.
+ * @param matrix Full matrix (master only).
+ * @param matrix_size Size of the matrix.
+ * @param depth Depth of the convolution.
+ * @param max_density Largest fraction of nonzeros of a sparse slab.
+ * @param my_padded_submatrix Receive buffer of a dense slab.
+ * @param my_padded_rows Rows in the padded slab.
+ * @param [out] my_slab This process's slab in sparse form, if sparse.
+ * @param comm Communicator of the processes; the master must be rank 0.
+ * @return MPI_SUCCESS, or an error code (-1 if allocation fails).
+ */
+int sparse_distribute(int my_rank, int nproc, int *matrix, int matrix_size,
+                      int depth, double max_density,
+                      int *my_padded_submatrix, int my_padded_rows,
+                      sparse_slab_t *my_slab, MPI_Comm comm);
+
+/**
+ * @brief Applies convolution to a band of rows of a sparse slab.
+ *
+ * Same results as convolve_rows_stats on the dense slab. The band's rows
+ * are split across config->threads threads, and each row is added to the
+ * statistics once the last nonzero within depth of it has been scattered.
+ *
+ * @param config Kernel configuration (only the thread count is used).
+ * @param slab Padded slab in sparse form.
+ * @param first_row First row of the band to process.
+ * @param num_rows Number of rows in the band.
+ * @param depth Depth for convolution operation.
+ * @param output Buffer of num_rows * slab->cols cells for the results.
+ * @param output_row Row of the whole output that the band's first row is.
+ * @param stats Statistics to add the results to (may be NULL).
+ * @return 0 on success, -1 on failure.
+ */
+int sparse_convolve_rows(const kernel_config_t *config,
+                         const sparse_slab_t *slab, int first_row,
+                         int num_rows, int depth, int *output,
+                         int output_row, output_stats_t *stats);
+
+#endif /* SPARSE_H */
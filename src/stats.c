@@ -0,0 +1,214 @@
+/**
+ * @file    stats.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of the output statistics.
+ */
+
+#include "stats.h"
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HASH_BASIS  0xcbf29ce484222325ULL   /* FNV-1a offset basis */
+#define HASH_PRIME  0x100000001b3ULL        /* FNV-1a prime */
+#define ROW_MIX     0x9e3779b97f4a7c15ULL   /* Spreads row indices apart */
+
+/**
+ * @brief Find the histogram bin of a value.
+ *
+ * @param value Value to bin.
+ * @return Bin of the value's sign and power of two.
+ */
+static inline int histogram_bin(int value)
+{
+    unsigned magnitude = value < 0 ? 0u - (unsigned) value : (unsigned) value;
+    int bits = magnitude ? 32 - __builtin_clz(magnitude) : 0;
+
+    return value < 0 ? STATS_ZERO_BIN - bits : STATS_ZERO_BIN + bits;
+}
+
+/**
+ * @brief Empty a set of statistics.
+ *
+ * @param [out] stats Statistics to empty.
+ */
+void stats_init(output_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->min = INT_MAX;
+    stats->max = INT_MIN;
+}
+
+/**
+ * @brief Add an output row to a set of statistics.
+ *
+ * @param stats Statistics to add to.
+ * @param row Values of the row.
+ * @param cols Number of values in the row.
+ * @param row_index Index of the row in the whole output.
+ */
+void stats_add_row(output_stats_t *stats, const int *row, int cols,
+                   int row_index)
+{
+    uint64_t hash = HASH_BASIS ^ ((uint64_t) row_index * ROW_MIX);
+    int64_t sum = 0;
+    double sum_squares = 0;
+
+    for (int col = 0; col < cols; col++) {
+        int value = row[col];
+        if (value < stats->min)
+            stats->min = value;
+        if (value > stats->max)
+            stats->max = value;
+        sum += value;
+        sum_squares += (double) value * value;
+        stats->histogram[histogram_bin(value)]++;
+        hash = (hash ^ (uint32_t) value) * HASH_PRIME;
+    }
+    stats->count += cols;
+    stats->sum += sum;
+    stats->sum_squares += sum_squares;
+    stats->checksum += hash;
+}
+
+/**
+ * @brief Add consecutive output rows to a set of statistics.
+ *
+ * @param stats Statistics to add to.
+ * @param rows Values of the rows.
+ * @param num_rows Number of rows.
+ * @param cols Number of values in each row.
+ * @param first_index Index of the first row in the whole output.
+ */
+void stats_add_rows(output_stats_t *stats, const int *rows, int num_rows,
+                    int cols, int first_index)
+{
+    for (int row = 0; row < num_rows; row++)
+        stats_add_row(stats, rows + (size_t) row * cols, cols,
+                      first_index + row);
+}
+
+/**
+ * @brief Add one set of statistics to another.
+ *
+ * @param stats Statistics to add to.
+ * @param other Statistics to add.
+ */
+void stats_merge(output_stats_t *stats, const output_stats_t *other)
+{
+    if (other->min < stats->min)
+        stats->min = other->min;
+    if (other->max > stats->max)
+        stats->max = other->max;
+    stats->count += other->count;
+    stats->sum += other->sum;
+    stats->sum_squares += other->sum_squares;
+    for (int bin = 0; bin < STATS_BINS; bin++)
+        stats->histogram[bin] += other->histogram[bin];
+    stats->checksum += other->checksum;
+}
+
+/**
+ * @brief Reduction operation merging arrays of statistics.
+ *
+ * @param in Statistics to add.
+ * @param inout Statistics added to.
+ * @param len Number of statistics in each array.
+ * @param datatype Datatype of one set of statistics.
+ */
+static void merge_op(void *in, void *inout, int *len, MPI_Datatype *datatype)
+{
+    const output_stats_t *from = in;
+    output_stats_t *to = inout;
+
+    (void) datatype;
+    for (int i = 0; i < *len; i++)
+        stats_merge(&to[i], &from[i]);
+}
+
+/**
+ * @brief Combine every process's statistics on the root.
+ *
+ * @param stats This process's statistics.
+ * @param [out] total Statistics of all the processes (root only).
+ * @param root Rank that receives the total.
+ * @param comm Communicator of the processes.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int stats_reduce(const output_stats_t *stats, output_stats_t *total,
+                 int root, MPI_Comm comm)
+{
+    MPI_Datatype type;
+    MPI_Op op;
+    int mpi_err;
+
+    mpi_err = MPI_Type_contiguous(sizeof(*stats), MPI_BYTE, &type);
+    if (mpi_err != MPI_SUCCESS)
+        return mpi_err;
+    mpi_err = MPI_Type_commit(&type);
+    if (mpi_err == MPI_SUCCESS) {
+        mpi_err = MPI_Op_create(merge_op, 1, &op);
+        if (mpi_err == MPI_SUCCESS) {
+            mpi_err = MPI_Reduce(stats, total, 1, type, op, root, comm);
+            MPI_Op_free(&op);
+        }
+    }
+    MPI_Type_free(&type);
+    return mpi_err;
+}
+
+/**
+ * @brief Write statistics beside an output file.
+ *
+ * @param output_filename Name of the output file.
+ * @param stats Statistics of the output.
+ * @return 0 on success, -1 if the file could not be written.
+ */
+int stats_write(const char *output_filename, const output_stats_t *stats)
+{
+    char filename[PATH_MAX];
+    double mean = 0, variance = 0;
+    FILE *file;
+
+    if (snprintf(filename, sizeof(filename), "%s%s", output_filename,
+                 STATS_SUFFIX) >= (int) sizeof(filename))
+        return -1;
+    file = fopen(filename, "w");
+    if (!file)
+        return -1;
+
+    if (stats->count > 0) {
+        mean = (double) stats->sum / stats->count;
+        variance = stats->sum_squares / stats->count - mean * mean;
+    }
+    fprintf(file, "cells %" PRId64 "\n", stats->count);
+    if (stats->count > 0)
+        fprintf(file, "min %d\nmax %d\n", stats->min, stats->max);
+    fprintf(file, "sum %" PRId64 "\nmean %.6f\nstddev %.6f\n"
+            "checksum %016" PRIx64 "\nhistogram\n",
+            stats->sum, mean, variance > 0 ? sqrt(variance) : 0,
+            stats->checksum);
+    // Each bin is listed as its lowest and highest value, in order
+    for (int bin = 0; bin < STATS_BINS; bin++) {
+        int bits = bin - STATS_ZERO_BIN;
+        long long low = 0, high = 0;
+
+        if (stats->histogram[bin] == 0)
+            continue;
+        if (bits > 0) {
+            low = 1LL << (bits - 1);
+            high = (1LL << bits) - 1;
+        } else if (bits < 0) {
+            low = 1 - (1LL << -bits);
+            high = -(1LL << (-bits - 1));
+            if (low < INT_MIN)
+                low = INT_MIN;
+        }
+        fprintf(file, "  %lld to %lld %" PRId64 "\n", low, high,
+                stats->histogram[bin]);
+    }
+    return fclose(file) == 0 ? 0 : -1;
+}
@@ -0,0 +1,106 @@
+/**
+ * @file    stats.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Summary statistics of the output, gathered as it is computed.
+ *
+ * The kernels add each output row to the statistics as soon as it is
+ * finished, while it is still in cache, so no second pass over the output
+ * is needed. Each process's statistics are combined on the master with a
+ * reduction under a custom operation and written beside the output.
+ *
+ * The histogram has a bin per sign and power of two, mirrored about a bin
+ * of zeros, so it needs no range chosen in advance: bin STATS_ZERO_BIN + b
+ * counts values in [2^(b-1), 2^b) and bin STATS_ZERO_BIN - b values in
+ * (-2^b, -2^(b-1)]. The checksum is the sum of a hash of each row and its
+ * index, so it does not depend on how the rows were split between
+ * processes or threads.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <mpi.h>
+#include <stdint.h>
+
+#define STATS_ZERO_BIN  32          /* Bin of zeros, between the signs */
+#define STATS_BINS      64          /* Bins of the histogram */
+#define STATS_SUFFIX    ".stats"    /* Appended to the output's name */
+
+/**
+ * @brief Statistics of a set of output rows.
+ */
+typedef struct {
+    int64_t     count;                  /* Cells */
+    int         min;                    /* Smallest value */
+    int         max;                    /* Largest value */
+    int64_t     sum;                    /* Sum of the values */
+    double      sum_squares;            /* Sum of the squared values */
+    int64_t     histogram[STATS_BINS];  /* Cells in each bin */
+    uint64_t    checksum;               /* Sum of the rows' hashes */
+} output_stats_t;
+
+/**
+ * @brief Empty a set of statistics.
+ *
+ * @param [out] stats Statistics to empty.
+ */
+void stats_init(output_stats_t *stats);
+
+/**
+ * @brief Add an output row to a set of statistics.
+ *
+ * @param stats Statistics to add to.
+ * @param row Values of the row.
+ * @param cols Number of values in the row.
+ * @param row_index Index of the row in the whole output.
+ */
+void stats_add_row(output_stats_t *stats, const int *row, int cols,
+                   int row_index);
+
+/**
+ * @brief Add consecutive output rows to a set of statistics.
+ *
+ * @param stats Statistics to add to.
+ * @param rows Values of the rows.
+ * @param num_rows Number of rows.
+ * @param cols Number of values in each row.
+ * @param first_index Index of the first row in the whole output.
+ */
+void stats_add_rows(output_stats_t *stats, const int *rows, int num_rows,
+                    int cols, int first_index);
+
+/**
+ * @brief Add one set of statistics to another.
+ *
+ * @param stats Statistics to add to.
+ * @param other Statistics to add.
+ */
+void stats_merge(output_stats_t *stats, const output_stats_t *other);
+
+/**
+ * @brief Combine every process's statistics on the root.
+ *
+ * Collective over comm.
+ *
+ * @param stats This process's statistics.
+ * @param [out] total Statistics of all the processes (root only).
+ * @param root Rank that receives the total.
+ * @param comm Communicator of the processes.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int stats_reduce(const output_stats_t *stats, output_stats_t *total,
+                 int root, MPI_Comm comm);
+
+/**
+ * @brief Write statistics beside an output file.
+ *
+ * The sidecar file is named after the output with STATS_SUFFIX appended.
+ *
+ * @param output_filename Name of the output file.
+ * @param stats Statistics of the output.
+ * @return 0 on success, -1 if the file could not be written.
+ */
+int stats_write(const char *output_filename, const output_stats_t *stats);
+
+#endif /* STATS_H */
@@ -0,0 +1,140 @@
+/**
+ * @file    timing.c
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Implementation of per-phase wall clock instrumentation.
+ */
+
+#include "timing.h"
+#include <stdio.h>
+#include <time.h>
+
+#define REPORT_ROOT 0   /* Rank that prints the timing report */
+
+static const char *phase_names[NUM_PHASES] = {
+    "read",
+    "distribute",
+    "compute",
+    "checkpoint",
+    "checkpoint (background)",
+    "collect",
+    "write",
+    "progress (background)",
+    "communication overlapped",
+    "error check"
+};
+
+static double phase_totals[NUM_PHASES];     /* Accumulated seconds */
+static double phase_started[NUM_PHASES];    /* Start time of open phases */
+
+/**
+ * @brief Get a monotonic timestamp in seconds.
+ *
+ * Read without MPI, so that programs which never initialise it can time
+ * their phases too.
+ *
+ * @return Current time in seconds.
+ */
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Print a table of the phases that took any time.
+ *
+ * @param means Mean seconds of each phase.
+ * @param maxima Largest seconds of each phase.
+ */
+static void print_phases(const double *means, const double *maxima)
+{
+    fprintf(stderr, "%-24s %12s %12s\n", "phase", "mean (s)", "max (s)");
+    for (int phase = 0; phase < NUM_PHASES; phase++) {
+        if (maxima[phase] <= 0)
+            continue;
+        fprintf(stderr, "%-24s %12.6f %12.6f\n", phase_names[phase],
+                means[phase], maxima[phase]);
+    }
+}
+
+/**
+ * @brief Start timing a phase.
+ *
+ * @param phase Phase to start.
+ */
+void timing_start(phase_t phase)
+{
+    phase_started[phase] = now_seconds();
+}
+
+/**
+ * @brief Stop timing a phase and add the elapsed time to its total.
+ *
+ * @param phase Phase to stop.
+ */
+void timing_stop(phase_t phase)
+{
+    phase_totals[phase] += now_seconds() - phase_started[phase];
+}
+
+/**
+ * @brief Add a measured duration to a phase's total.
+ *
+ * @param phase Phase to add to.
+ * @param seconds Duration in seconds.
+ */
+void timing_add(phase_t phase, double seconds)
+{
+    phase_totals[phase] += seconds;
+}
+
+/**
+ * @brief Clear the phase totals.
+ */
+void timing_reset(void)
+{
+    for (int phase = 0; phase < NUM_PHASES; phase++)
+        phase_totals[phase] = 0;
+}
+
+/**
+ * @brief Reduce the phase totals across processes and report them.
+ *
+ * @param rank Rank of the calling process in comm.
+ * @param comm Communicator of the processes to report on.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int timing_report(int rank, MPI_Comm comm)
+{
+    double sums[NUM_PHASES], maxima[NUM_PHASES];
+    int nproc, mpi_err;
+
+    mpi_err = MPI_Comm_size(comm, &nproc);
+    if (mpi_err != MPI_SUCCESS)
+        return mpi_err;
+    mpi_err = MPI_Reduce(phase_totals, sums, NUM_PHASES, MPI_DOUBLE,
+                         MPI_SUM, REPORT_ROOT, comm);
+    if (mpi_err != MPI_SUCCESS)
+        return mpi_err;
+    mpi_err = MPI_Reduce(phase_totals, maxima, NUM_PHASES, MPI_DOUBLE,
+                         MPI_MAX, REPORT_ROOT, comm);
+    if (mpi_err != MPI_SUCCESS)
+        return mpi_err;
+
+    if (rank == REPORT_ROOT) {
+        for (int phase = 0; phase < NUM_PHASES; phase++)
+            sums[phase] /= nproc;
+        print_phases(sums, maxima);
+    }
+    return MPI_SUCCESS;
+}
+
+/**
+ * @brief Report this process's phase totals alone.
+ */
+void timing_print(void)
+{
+    print_phases(phase_totals, phase_totals);
+}
@@ -0,0 +1,84 @@
+/**
+ * @file    timing.h
+ * @author  Kieran Hillier
+ * @date    4th October 2023
+ * @brief   Per-phase wall clock instrumentation for the convolution program.
+ *
+ * Each process accumulates the time it spends in each phase of a run. The
+ * totals are reduced across processes and reported by the master.
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <mpi.h>
+
+/**
+ * @brief Phases of a run that are timed separately.
+ */
+typedef enum {
+    PHASE_READ,             /* Reading the input matrix */
+    PHASE_DISTRIBUTE,       /* Broadcasts and scattering of slabs */
+    PHASE_COMPUTE,          /* Applying the convolution */
+    PHASE_CHECKPOINT,       /* Compute time lost to checkpointing */
+    PHASE_CHECKPOINT_BG,    /* Background checkpoint writing */
+    PHASE_COLLECT,          /* Gathering or collectively writing results */
+    PHASE_WRITE,            /* Writing the output matrix */
+    PHASE_PROGRESS_BG,      /* Progress thread driving transfers */
+    PHASE_OVERLAP,          /* Transfers in flight while computing */
+    PHASE_ERROR_CHECK,      /* Checking approximate results exactly */
+    NUM_PHASES
+} phase_t;
+
+/**
+ * @brief Start timing a phase.
+ *
+ * @param phase Phase to start.
+ */
+void timing_start(phase_t phase);
+
+/**
+ * @brief Stop timing a phase and add the elapsed time to its total.
+ *
+ * @param phase Phase to stop.
+ */
+void timing_stop(phase_t phase);
+
+/**
+ * @brief Add a measured duration to a phase's total.
+ *
+ * Used for time measured elsewhere, e.g. by a helper thread.
+ *
+ * @param phase Phase to add to.
+ * @param seconds Duration in seconds.
+ */
+void timing_add(phase_t phase, double seconds);
+
+/**
+ * @brief Clear the phase totals.
+ *
+ * Called at the start of each job, so that a process running many jobs
+ * reports each job's phases alone.
+ */
+void timing_reset(void);
+
+/**
+ * @brief Reduce the phase totals across processes and report them.
+ *
+ * Collective over comm. The master prints the mean and maximum time of
+ * each phase that any process spent time in to stderr.
+ *
+ * @param rank Rank of the calling process in comm.
+ * @param comm Communicator of the processes to report on.
+ * @return MPI_SUCCESS, or the error code of the failing MPI call.
+ */
+int timing_report(int rank, MPI_Comm comm);
+
+/**
+ * @brief Report this process's phase totals alone.
+ *
+ * Needs no MPI, for programs that run without it.
+ */
+void timing_print(void);
+
+#endif /* TIMING_H */